@@ -0,0 +1,313 @@
+/*
+	Copyright (C) 2013 Edwin Velds
+
+    This file is part of Polka 2.
+
+    Polka 2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Polka 2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Polka 2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Base64.h"
+#include "Simd.h"
+#include <algorithm>
+#include <cstring>
+
+namespace Polka {
+
+// groups of 3 bytes per 100 character line
+static const size_t LINE_GROUPS = 25;
+
+static const char EncodeChars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// reverse lookup, -1 outside the alphabet
+struct DecodeTable
+{
+	signed char value[256];
+	DecodeTable()
+	{
+		memset( value, -1, sizeof(value) );
+		for( int i = 0; i < 64; i++ )
+			value[(unsigned char)EncodeChars[i]] = i;
+	}
+};
+static const DecodeTable Decode;
+
+int base64Value( char c )
+{
+	return Decode.value[(unsigned char)c];
+}
+
+
+/*
+ * scalar
+ */
+
+// avail is the number of readable bytes from src, which allows the vector
+// versions to load more than they use
+static void encodeGroupsScalar( const unsigned char *src, size_t groups, char *dest, size_t )
+{
+	for( size_t i = 0; i < groups; i++, src += 3, dest += 4 ) {
+		unsigned int n = (src[0] << 16) | (src[1] << 8) | src[2];
+		dest[0] = EncodeChars[n >> 18];
+		dest[1] = EncodeChars[(n >> 12) & 63];
+		dest[2] = EncodeChars[(n >> 6) & 63];
+		dest[3] = EncodeChars[n & 63];
+	}
+}
+
+static size_t decodeQuadsScalar( const unsigned char *src, size_t size, char *dest )
+{
+	size_t p = 0;
+	for( ; p+4 <= size; p += 4 ) {
+		int a = Decode.value[src[p]], b = Decode.value[src[p+1]],
+		    c = Decode.value[src[p+2]], d = Decode.value[src[p+3]];
+		if( (a | b | c | d) < 0 ) break;
+		int n = (a << 18) | (b << 12) | (c << 6) | d;
+		*dest++ = char(n >> 16);
+		*dest++ = char(n >> 8);
+		*dest++ = char(n);
+	}
+	return p;
+}
+
+
+#ifdef POLKA_X86_SIMD
+
+/*
+ * ssse3
+ */
+
+// spread 12 bytes to 16 values of 6 bits, one per byte
+__attribute__((target("ssse3")))
+static inline __m128i splitGroups( __m128i in )
+{
+	in = _mm_shuffle_epi8( in, _mm_setr_epi8( 1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10 ) );
+	// shift the values of each 32 bit word in place with multiplies
+	__m128i ac = _mm_mulhi_epu16( _mm_and_si128( in, _mm_set1_epi32( 0x0fc0fc00 ) ),
+	                              _mm_set1_epi32( 0x04000040 ) );
+	__m128i bd = _mm_mullo_epi16( _mm_and_si128( in, _mm_set1_epi32( 0x003f03f0 ) ),
+	                              _mm_set1_epi32( 0x01000010 ) );
+	return _mm_or_si128( ac, bd );
+}
+
+// map values to characters by adding an offset per range
+__attribute__((target("ssse3")))
+static inline __m128i encodeValues( __m128i v )
+{
+	// 0..51 to 0, 52..61 to 1..10, 62 to 11 and 63 to 12, then 0..25 to 13
+	__m128i range = _mm_subs_epu8( v, _mm_set1_epi8( 51 ) );
+	range = _mm_or_si128( range, _mm_and_si128( _mm_cmpgt_epi8( _mm_set1_epi8( 26 ), v ), _mm_set1_epi8( 13 ) ) );
+	const __m128i offsets = _mm_setr_epi8( 'a'-26, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52,
+	                                       '0'-52, '0'-52, '0'-52, '+'-62, '/'-63, 'A', 0, 0 );
+	return _mm_add_epi8( v, _mm_shuffle_epi8( offsets, range ) );
+}
+
+__attribute__((target("ssse3")))
+static void encodeGroupsSSSE3( const unsigned char *src, size_t groups, char *dest, size_t avail )
+{
+	// 4 groups per step from a 16 byte load
+	for( ; groups >= 4 && avail >= 16; groups -= 4, avail -= 12, src += 12, dest += 16 ) {
+		__m128i in = _mm_loadu_si128( reinterpret_cast<const __m128i*>(src) );
+		_mm_storeu_si128( reinterpret_cast<__m128i*>(dest), encodeValues( splitGroups( in ) ) );
+	}
+	encodeGroupsScalar( src, groups, dest, avail );
+}
+
+// convert 16 characters to 12 bytes, fails if any is outside the alphabet
+__attribute__((target("ssse3")))
+static inline bool decodeBlock( __m128i in, __m128i& out )
+{
+	const __m128i nibble = _mm_set1_epi8( 15 );
+	__m128i hi = _mm_and_si128( _mm_srli_epi32( in, 4 ), nibble );
+	__m128i lo = _mm_and_si128( in, nibble );
+
+	// a character is valid if the mask of its low nibble has the bit of its high nibble
+	const __m128i masks = _mm_setr_epi8( char(0xa8), char(0xf8), char(0xf8), char(0xf8), char(0xf8),
+	                                     char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8),
+	                                     char(0xf0), 0x54, 0x50, 0x50, 0x50, 0x54 );
+	const __m128i bits = _mm_setr_epi8( 1, 2, 4, 8, 16, 32, 64, char(128), 0, 0, 0, 0, 0, 0, 0, 0 );
+	__m128i valid = _mm_and_si128( _mm_shuffle_epi8( masks, lo ), _mm_shuffle_epi8( bits, hi ) );
+	if( _mm_movemask_epi8( _mm_cmpeq_epi8( valid, _mm_setzero_si128() ) ) ) return false;
+
+	// offsets by high nibble, '/' shares its nibble with '+'
+	const __m128i offsets = _mm_setr_epi8( 0, 0, 62-'+', 52-'0', -'A', -'A', 26-'a', 26-'a',
+	                                       0, 0, 0, 0, 0, 0, 0, 0 );
+	__m128i slash = _mm_and_si128( _mm_cmpeq_epi8( in, _mm_set1_epi8( '/' ) ), _mm_set1_epi8( '+'-'/'+1 ) );
+	__m128i v = _mm_add_epi8( in, _mm_add_epi8( _mm_shuffle_epi8( offsets, hi ), slash ) );
+
+	// join to 24 bits per quad and put the bytes in order
+	v = _mm_maddubs_epi16( v, _mm_set1_epi32( 0x01400140 ) );
+	v = _mm_madd_epi16( v, _mm_set1_epi32( 0x00011000 ) );
+	out = _mm_shuffle_epi8( v, _mm_setr_epi8( 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1 ) );
+	return true;
+}
+
+__attribute__((target("ssse3")))
+static inline void store12( char *dest, __m128i v )
+{
+	_mm_storel_epi64( reinterpret_cast<__m128i*>(dest), v );
+	int last = _mm_cvtsi128_si32( _mm_srli_si128( v, 8 ) );
+	memcpy( dest+8, &last, 4 );
+}
+
+__attribute__((target("ssse3")))
+static size_t decodeQuadsSSSE3( const unsigned char *src, size_t size, char *dest )
+{
+	size_t p = 0;
+	__m128i out;
+	for( ; p+16 <= size; p += 16, dest += 12 ) {
+		if( !decodeBlock( _mm_loadu_si128( reinterpret_cast<const __m128i*>(src+p) ), out ) ) break;
+		store12( dest, out );
+	}
+	return p + decodeQuadsScalar( src+p, size-p, dest );
+}
+
+
+/*
+ * avx2
+ */
+
+__attribute__((target("avx2")))
+static void encodeGroupsAVX2( const unsigned char *src, size_t groups, char *dest, size_t avail )
+{
+	const __m256i order = _mm256_setr_epi8( 1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+	                                        1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10 );
+	const __m256i offsets = _mm256_setr_epi8( 'a'-26, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52,
+	                                          '0'-52, '0'-52, '0'-52, '+'-62, '/'-63, 'A', 0, 0,
+	                                          'a'-26, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52,
+	                                          '0'-52, '0'-52, '0'-52, '+'-62, '/'-63, 'A', 0, 0 );
+	// 8 groups per step, 12 bytes in each lane
+	for( ; groups >= 8 && avail >= 28; groups -= 8, avail -= 24, src += 24, dest += 32 ) {
+		__m256i in = _mm256_inserti128_si256(
+			_mm256_castsi128_si256( _mm_loadu_si128( reinterpret_cast<const __m128i*>(src) ) ),
+			_mm_loadu_si128( reinterpret_cast<const __m128i*>(src+12) ), 1 );
+		in = _mm256_shuffle_epi8( in, order );
+		__m256i ac = _mm256_mulhi_epu16( _mm256_and_si256( in, _mm256_set1_epi32( 0x0fc0fc00 ) ),
+		                                 _mm256_set1_epi32( 0x04000040 ) );
+		__m256i bd = _mm256_mullo_epi16( _mm256_and_si256( in, _mm256_set1_epi32( 0x003f03f0 ) ),
+		                                 _mm256_set1_epi32( 0x01000010 ) );
+		__m256i v = _mm256_or_si256( ac, bd );
+		__m256i range = _mm256_subs_epu8( v, _mm256_set1_epi8( 51 ) );
+		range = _mm256_or_si256( range, _mm256_and_si256( _mm256_cmpgt_epi8( _mm256_set1_epi8( 26 ), v ),
+		                                                  _mm256_set1_epi8( 13 ) ) );
+		v = _mm256_add_epi8( v, _mm256_shuffle_epi8( offsets, range ) );
+		_mm256_storeu_si256( reinterpret_cast<__m256i*>(dest), v );
+	}
+	encodeGroupsSSSE3( src, groups, dest, avail );
+}
+
+__attribute__((target("avx2")))
+static size_t decodeQuadsAVX2( const unsigned char *src, size_t size, char *dest )
+{
+	const __m256i nibble = _mm256_set1_epi8( 15 );
+	const __m256i masks = _mm256_setr_epi8( char(0xa8), char(0xf8), char(0xf8), char(0xf8), char(0xf8),
+	                                        char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8),
+	                                        char(0xf0), 0x54, 0x50, 0x50, 0x50, 0x54,
+	                                        char(0xa8), char(0xf8), char(0xf8), char(0xf8), char(0xf8),
+	                                        char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8),
+	                                        char(0xf0), 0x54, 0x50, 0x50, 0x50, 0x54 );
+	const __m256i bits = _mm256_setr_epi8( 1, 2, 4, 8, 16, 32, 64, char(128), 0, 0, 0, 0, 0, 0, 0, 0,
+	                                       1, 2, 4, 8, 16, 32, 64, char(128), 0, 0, 0, 0, 0, 0, 0, 0 );
+	const __m256i offsets = _mm256_setr_epi8( 0, 0, 62-'+', 52-'0', -'A', -'A', 26-'a', 26-'a',
+	                                          0, 0, 0, 0, 0, 0, 0, 0,
+	                                          0, 0, 62-'+', 52-'0', -'A', -'A', 26-'a', 26-'a',
+	                                          0, 0, 0, 0, 0, 0, 0, 0 );
+	const __m256i order = _mm256_setr_epi8( 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+	                                        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1 );
+
+	size_t p = 0;
+	for( ; p+32 <= size; p += 32, dest += 24 ) {
+		__m256i in = _mm256_loadu_si256( reinterpret_cast<const __m256i*>(src+p) );
+		__m256i hi = _mm256_and_si256( _mm256_srli_epi32( in, 4 ), nibble );
+		__m256i lo = _mm256_and_si256( in, nibble );
+		__m256i valid = _mm256_and_si256( _mm256_shuffle_epi8( masks, lo ), _mm256_shuffle_epi8( bits, hi ) );
+		if( _mm256_movemask_epi8( _mm256_cmpeq_epi8( valid, _mm256_setzero_si256() ) ) ) break;
+
+		__m256i slash = _mm256_and_si256( _mm256_cmpeq_epi8( in, _mm256_set1_epi8( '/' ) ),
+		                                  _mm256_set1_epi8( '+'-'/'+1 ) );
+		__m256i v = _mm256_add_epi8( in, _mm256_add_epi8( _mm256_shuffle_epi8( offsets, hi ), slash ) );
+		v = _mm256_maddubs_epi16( v, _mm256_set1_epi32( 0x01400140 ) );
+		v = _mm256_madd_epi16( v, _mm256_set1_epi32( 0x00011000 ) );
+		// 12 bytes at the start of each lane, move them together
+		v = _mm256_shuffle_epi8( v, order );
+		v = _mm256_permutevar8x32_epi32( v, _mm256_setr_epi32( 0, 1, 2, 4, 5, 6, 3, 7 ) );
+		_mm_storeu_si128( reinterpret_cast<__m128i*>(dest), _mm256_castsi256_si128( v ) );
+		_mm_storel_epi64( reinterpret_cast<__m128i*>(dest+16), _mm256_extracti128_si256( v, 1 ) );
+	}
+	return p + decodeQuadsSSSE3( src+p, size-p, dest );
+}
+
+#endif // POLKA_X86_SIMD
+
+
+/*
+ * entries
+ */
+
+void base64Encode( const char *src, size_t size, std::string& dest )
+{
+	typedef void (*EncodeGroups)( const unsigned char *, size_t, char *, size_t );
+	EncodeGroups encode = encodeGroupsScalar;
+#ifdef POLKA_X86_SIMD
+	if( hasAVX2() )
+		encode = encodeGroupsAVX2;
+	else if( hasSSSE3() )
+		encode = encodeGroupsSSSE3;
+#endif
+
+	// room for all lines, the tail and the end marker
+	size_t chars = size/3*4;
+	size_t start = dest.size();
+	dest.resize( start + chars + chars/100 + 4 );
+	char *out = &dest[start];
+
+	const unsigned char *s = reinterpret_cast<const unsigned char*>(src);
+	const unsigned char *end = s + size;
+	for( size_t groups = size/3; groups; ) {
+		size_t n = std::min( groups, LINE_GROUPS );
+		encode( s, n, out, end - s );
+		s += 3*n;
+		out += 4*n;
+		groups -= n;
+		if( n == LINE_GROUPS ) *out++ = '\n';
+	}
+
+	// last bytes with padding
+	size_t rest = size % 3;
+	if( rest == 0 ) {
+		// add an extra = if everything is done
+		*out++ = '=';
+	} else {
+		unsigned int n = s[0] << 16;
+		if( rest == 2 ) n |= s[1] << 8;
+		*out++ = EncodeChars[n >> 18];
+		*out++ = EncodeChars[(n >> 12) & 63];
+		*out++ = rest == 2 ? EncodeChars[(n >> 6) & 63] : '=';
+		*out++ = '=';
+	}
+	dest.resize( out - dest.data() );
+}
+
+size_t base64DecodeQuads( const char *src, size_t size, char *dest )
+{
+	const unsigned char *s = reinterpret_cast<const unsigned char*>(src);
+#ifdef POLKA_X86_SIMD
+	if( hasAVX2() )
+		return decodeQuadsAVX2( s, size, dest );
+	if( hasSSSE3() )
+		return decodeQuadsSSSE3( s, size, dest );
+#endif
+	return decodeQuadsScalar( s, size, dest );
+}
+
+} // namespace Polka
@@ -0,0 +1,42 @@
+/*
+	Copyright (C) 2013 Edwin Velds
+
+    This file is part of Polka 2.
+
+    Polka 2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Polka 2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Polka 2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _POLKA_BASE64_H_
+#define _POLKA_BASE64_H_
+
+#include <string>
+
+namespace Polka {
+
+// base64 for storage data fields. The encoded text is appended to dest
+// with a line break after every 100 characters and ends with the usual
+// padding, or a single '=' if no padding is needed.
+void base64Encode( const char *src, size_t size, std::string& dest );
+
+// decode complete quads from src up to the first character outside the
+// alphabet. dest receives 3 bytes per quad, the number of characters
+// used is returned.
+size_t base64DecodeQuads( const char *src, size_t size, char *dest );
+
+// 6 bit value of a character or -1 if it is not part of the alphabet
+int base64Value( char c );
+
+} // namespace Polka
+
+#endif // _POLKA_BASE64_H_
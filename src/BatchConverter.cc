@@ -0,0 +1,386 @@
+/*
+	Copyright (C) 2013 Edwin Velds
+
+    This file is part of Polka 2.
+
+    Polka 2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Polka 2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Polka 2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "BatchConverter.h"
+#include "MSXBitmapExport.h"
+#include "MSX1Palette.h"
+#include "PixelKernels.h"
+#include "Parallel.h"
+#include "Functions.h"
+#include <cairomm/surface.h>
+#include <glibmm/miscutils.h>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <fstream>
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+
+namespace Polka {
+
+typedef std::chrono::steady_clock Clock;
+
+static double milliseconds( Clock::time_point start, Clock::time_point end )
+{
+	return std::chrono::duration<double, std::milli>( end - start ).count();
+}
+
+// reports of finished jobs are not interleaved
+static std::mutex ReportMutex;
+
+// option names
+struct OptionName
+{
+	const char *Name;
+	int Value;
+};
+
+static const OptionName QuantNames[] = {
+	{ "popularity", ColorReducer::QUANT_POPULARITY },
+	{ "elimination", ColorReducer::QUANT_ELIMINATION },
+	{ "errorelimination", ColorReducer::QUANT_ERRORELIMINATION },
+	{ "octree", ColorReducer::QUANT_OCTREE },
+	{ 0, 0 }
+};
+
+static const OptionName DitherNames[] = {
+	{ "none", ColorReducer::DITHER_NONE },
+	{ "ordered", ColorReducer::DITHER_ORDERED },
+	{ "floyd-steinberg", ColorReducer::DITHER_FLOYDSTEINBERG },
+	{ "jarvis", ColorReducer::DITHER_JARVISJUDICENINKE },
+	{ "stucki", ColorReducer::DITHER_STUCKI },
+	{ "burkes", ColorReducer::DITHER_BURKES },
+	{ "sierra3", ColorReducer::DITHER_SIERRA3 },
+	{ "sierra2", ColorReducer::DITHER_SIERRA2 },
+	{ "sierra2-4a", ColorReducer::DITHER_SIERRA2_4A },
+	{ "stevenson-arce", ColorReducer::DITHER_STEVENSONARCE },
+	{ "atkinson", ColorReducer::DITHER_ATKINSON },
+	{ 0, 0 }
+};
+
+static bool findOption( const OptionName *names, const std::string& name, int& value )
+{
+	for( ; names->Name; names++ )
+		if( name == names->Name ) {
+			value = names->Value;
+			return true;
+		}
+	return false;
+}
+
+
+BatchConverter::BatchConverter()
+	: m_Palette("PAL/16/MSX2"),
+	  m_QuantMethod(ColorReducer::QUANT_OCTREE),
+	  m_ErrorMethod(ColorReducer::COLORERROR_RGB),
+	  m_DitherType(ColorReducer::DITHER_NONE),
+	  m_OrderX(2), m_OrderY(2),
+	  m_Serpentine(false),
+	  m_Screen(0),
+	  m_IncludePalette(true),
+	  m_Threads(hardwareThreads())
+{
+}
+
+BatchConverter::~BatchConverter()
+{
+}
+
+void BatchConverter::printUsage()
+{
+	std::cerr << "Usage: polka2 --convert [options] <file.png>...\n"
+	             "Converts PNG images to MSX screen 5 (up to 256 pixels wide) or\n"
+	             "screen 7 (up to 512 pixels wide) bitmap files, or to screen 2 or 4\n"
+	             "files of up to 256 by 192 pixels with two colours per 8x1 block.\n\n"
+	             "Options:\n"
+	             "  --manifest <file>   read input files from file, one per line\n"
+	             "  --output <dir>      write results to dir instead of next to the input\n"
+	             "  --palette <type>    target palette, PAL/16/MSX2 (default) or PAL/16/G9K\n"
+	             "  --screen <n>        2 for the msx1 colours or 4 for a palette\n"
+	             "  --quant <method>    popularity, elimination, errorelimination or octree\n"
+	             "  --perceptual        use perceptual colour errors\n"
+	             "  --dither <type>     none, ordered, floyd-steinberg, jarvis, stucki, burkes,\n"
+	             "                      sierra3, sierra2, sierra2-4a, stevenson-arce, atkinson\n"
+	             "  --order <x>x<y>     ordered dither matrix of 2^x by 2^y pixels\n"
+	             "  --serpentine        alternate the error diffusion direction per row\n"
+	             "  --no-palette        do not store the palette in the file\n"
+	             "  --jobs <n>          number of files converted at the same time\n";
+}
+
+bool BatchConverter::parseArguments( int argc, char *argv[] )
+{
+	for( int i = 0; i < argc; i++ ) {
+		std::string arg = argv[i];
+		// options with a value
+		if( arg == "--manifest" || arg == "--output" || arg == "--palette" ||
+		    arg == "--quant" || arg == "--dither" || arg == "--order" || arg == "--screen" ||
+		    arg == "--jobs" ) {
+			if( ++i == argc ) {
+				std::cerr << "Missing value for " << arg << std::endl;
+				return false;
+			}
+			std::string value = argv[i];
+			int v;
+			if( arg == "--manifest" ) {
+				if( !readManifest( value ) ) return false;
+			} else if( arg == "--output" ) {
+				m_OutputDir = value;
+			} else if( arg == "--palette" ) {
+				std::vector<std::string> pals;
+				ColorReducer::getTargetPalettes( pals );
+				if( std::find( pals.begin(), pals.end(), value ) == pals.end() ) {
+					std::cerr << "Unknown palette " << value << std::endl;
+					return false;
+				}
+				m_Palette = value;
+			} else if( arg == "--quant" ) {
+				if( !findOption( QuantNames, value, v ) ) {
+					std::cerr << "Unknown quantization method " << value << std::endl;
+					return false;
+				}
+				m_QuantMethod = ColorReducer::QuantizationMethod(v);
+			} else if( arg == "--dither" ) {
+				if( !findOption( DitherNames, value, v ) ) {
+					std::cerr << "Unknown dither type " << value << std::endl;
+					return false;
+				}
+				m_DitherType = ColorReducer::DitherType(v);
+			} else if( arg == "--order" ) {
+				std::vector<std::string> wh = split( value, 'x' );
+				if( wh.size() != 2 || to_int(wh[0]) < 1 || to_int(wh[1]) < 1 ) {
+					std::cerr << "Invalid dither order " << value << std::endl;
+					return false;
+				}
+				m_OrderX = to_int(wh[0]);
+				m_OrderY = to_int(wh[1]);
+			} else if( arg == "--screen" ) {
+				m_Screen = to_int( value );
+				if( m_Screen != 2 && m_Screen != 4 ) {
+					std::cerr << "Unsupported screen " << value << std::endl;
+					return false;
+				}
+			} else {
+				m_Threads = to_int( value );
+				if( m_Threads < 1 ) {
+					std::cerr << "Invalid number of jobs " << value << std::endl;
+					return false;
+				}
+			}
+		} else if( arg == "--perceptual" ) {
+			m_ErrorMethod = ColorReducer::COLORERROR_PERCEPTUAL;
+		} else if( arg == "--serpentine" ) {
+			m_Serpentine = true;
+		} else if( arg == "--no-palette" ) {
+			m_IncludePalette = false;
+		} else if( arg.size() > 1 && arg[0] == '-' ) {
+			std::cerr << "Unknown option " << arg << std::endl;
+			return false;
+		} else {
+			addFile( arg );
+		}
+	}
+	if( m_Jobs.empty() ) {
+		std::cerr << "No input files" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+void BatchConverter::addFile( const std::string& filename )
+{
+	Job job;
+	job.Input = filename;
+	job.LoadTime = job.QuantizeTime = job.DitherTime = job.WriteTime = 0.0;
+	m_Jobs.push_back( job );
+}
+
+bool BatchConverter::readManifest( const std::string& filename )
+{
+	std::ifstream file( filename.c_str() );
+	if( !file.is_open() ) {
+		std::cerr << "Unable to open manifest " << filename << std::endl;
+		return false;
+	}
+	// relative names are relative to the manifest
+	std::string dir = Glib::path_get_dirname( filename );
+	std::string line;
+	while( std::getline( file, line ) ) {
+		line = trim( line );
+		if( line.empty() || line[0] == '#' ) continue;
+		if( Glib::path_is_absolute( line ) )
+			addFile( line );
+		else
+			addFile( Glib::build_filename( dir, line ) );
+	}
+	return true;
+}
+
+int BatchConverter::run()
+{
+	Clock::time_point start = Clock::now();
+	parallelFor( m_Jobs.size(), m_Threads, [this]( int i ) {
+		convert( m_Jobs[i] );
+		report( m_Jobs[i] );
+	} );
+
+	int failed = 0;
+	for( unsigned int i = 0; i < m_Jobs.size(); i++ )
+		if( !m_Jobs[i].Error.empty() ) failed++;
+	printf( "Converted %d of %d files in %.1f ms\n", int(m_Jobs.size()) - failed,
+	        int(m_Jobs.size()), milliseconds( start, Clock::now() ) );
+	return failed ? 1 : 0;
+}
+
+void BatchConverter::convert( Job& job )
+{
+	Clock::time_point t0 = Clock::now();
+
+	// load image, cairo reports errors with exceptions
+	Cairo::RefPtr<Cairo::ImageSurface> image;
+	try {
+		image = Cairo::ImageSurface::create_from_png( job.Input );
+	} catch( const std::exception& e ) {
+		job.Error = e.what();
+		return;
+	}
+	if( image->get_format() != Cairo::FORMAT_ARGB32 && image->get_format() != Cairo::FORMAT_RGB24 ) {
+		job.Error = "unsupported pixel format";
+		return;
+	}
+	int w = image->get_width(), h = image->get_height();
+	if( w <= 0 || h <= 0 || w > 512 || h > 256 || (m_Screen && (w > 256 || h > 192)) ) {
+		job.Error = "image size not supported";
+		return;
+	}
+	// screen 5 or 7 with 192, 212 or 256 lines
+	int sw = w <= 256 ? 256 : 512;
+	int lines = h <= 192 ? 192 : (h <= 212 ? 212 : 256);
+
+	Clock::time_point t1 = Clock::now();
+	job.LoadTime = milliseconds( t0, t1 );
+
+	// reduce colours
+	std::vector<unsigned char> index( w*h );
+	ColorReducer cr;
+	// share the cores with the other conversions
+	int jobs = std::min( m_Threads, int(m_Jobs.size()) );
+	cr.setThreads( hardwareThreads() / std::max( 1, jobs ) );
+	cr.setRGBSource( image->get_data(), w, h, 4, image->get_stride() );
+	cr.setTarget( m_Palette, &index[0] );
+	if( cr.needQuantization( m_Palette ) )
+		cr.setQuantizationMethod( m_QuantMethod, m_ErrorMethod );
+	cr.setDitherType( m_DitherType, m_OrderX, m_OrderY );
+	cr.setSerpentine( m_Serpentine );
+	if( m_Screen == 2 ) {
+		// fixed colours without the transparent one
+		cr.setPalette( TMS99X8A_PALETTE[1], 15 );
+	} else if( !cr.quantizeColors() ) {
+		job.Error = "quantization failed";
+		return;
+	}
+	Clock::time_point t2 = Clock::now();
+	job.QuantizeTime = milliseconds( t1, t2 );
+
+	if( m_Screen ) {
+		// tables for the whole screen, 32 characters wide
+		std::vector<unsigned char> patterns( 0x1800, 0 ), colors( 0x1800, 0 );
+		if( !cr.generatePatterns( &patterns[0], &colors[0], 32 ) ) {
+			job.Error = "pattern generation failed";
+			return;
+		}
+		// palette index 0 is colour 1
+		if( m_Screen == 2 )
+			for( unsigned int i = 0; i < colors.size(); i++ )
+				colors[i] += 0x11;
+		Clock::time_point t3 = Clock::now();
+		job.DitherTime = milliseconds( t2, t3 );
+
+		double pal[48];
+		getPalette( cr, pal );
+		job.Output = outputName( job.Input, m_Screen == 2 ? ".SC2" : ".SC4" );
+		if( !MSXBitmapExporter::writePatterns( job.Output, &patterns[0], &colors[0],
+		                                       m_IncludePalette && m_Screen == 4 ? pal : 0 ) ) {
+			job.Error = "unable to write " + job.Output;
+			return;
+		}
+		job.WriteTime = milliseconds( t3, Clock::now() );
+		return;
+	}
+
+	if( !cr.generateImage() ) {
+		job.Error = "image generation failed";
+		return;
+	}
+	Clock::time_point t3 = Clock::now();
+	job.DitherTime = milliseconds( t2, t3 );
+
+	// pack into vram layout
+	std::vector<char> data( sw/2*lines, 0 );
+	for( int y = 0; y < h; y++ )
+		packPixels( &index[w*y], reinterpret_cast<unsigned char*>(&data[sw/2*y]), 0, w, 4 );
+	double pal[48];
+	getPalette( cr, pal );
+	job.Output = outputName( job.Input, sw == 256 ? ".SC5" : ".SC7" );
+
+	// the palette only fits files below 256 lines
+	if( !MSXBitmapExporter::writeBitmap( job.Output, &data[0], sw, lines,
+	                                     m_IncludePalette && lines < 256 ? pal : 0 ) ) {
+		job.Error = "unable to write " + job.Output;
+		return;
+	}
+	job.WriteTime = milliseconds( t3, Clock::now() );
+}
+
+void BatchConverter::getPalette( const ColorReducer& cr, double *pal )
+{
+	memset( pal, 0, 48*sizeof(double) );
+	for( int c = 0; c < cr.palSize() && c < 16; c++ ) {
+		pal[3*c]   = cr.palRed(c);
+		pal[3*c+1] = cr.palGreen(c);
+		pal[3*c+2] = cr.palBlue(c);
+	}
+}
+
+std::string BatchConverter::outputName( const std::string& input, const char *ext ) const
+{
+	std::string name = Glib::path_get_basename( input );
+	size_t dot = name.rfind('.');
+	if( dot != std::string::npos ) name.erase( dot );
+	name += ext;
+	return Glib::build_filename( m_OutputDir.empty() ? Glib::path_get_dirname( input ) : m_OutputDir, name );
+}
+
+void BatchConverter::report( const Job& job )
+{
+	std::lock_guard<std::mutex> lock( ReportMutex );
+	if( !job.Error.empty() ) {
+		fprintf( stderr, "%s: %s\n", job.Input.c_str(), job.Error.c_str() );
+		return;
+	}
+	printf( "%s -> %s: %.1f ms (load %.1f, quantize %.1f, dither %.1f, write %.1f)\n",
+	        job.Input.c_str(), job.Output.c_str(),
+	        job.LoadTime + job.QuantizeTime + job.DitherTime + job.WriteTime,
+	        job.LoadTime, job.QuantizeTime, job.DitherTime, job.WriteTime );
+	fflush( stdout );
+}
+
+} // namespace Polka
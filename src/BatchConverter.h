@@ -0,0 +1,78 @@
+/*
+	Copyright (C) 2013 Edwin Velds
+
+    This file is part of Polka 2.
+
+    Polka 2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Polka 2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Polka 2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _POLKA_BATCHCONVERTER_H_
+#define _POLKA_BATCHCONVERTER_H_
+
+#include "ColorReducer.h"
+#include <string>
+#include <vector>
+
+namespace Polka {
+
+// command line conversion of images to MSX bitmap files, no windows
+// are created
+class BatchConverter
+{
+public:
+	BatchConverter();
+	~BatchConverter();
+
+	// parse the arguments following --convert
+	bool parseArguments( int argc, char *argv[] );
+	static void printUsage();
+
+	// convert all files, returns the process exit code
+	int run();
+
+private:
+	struct Job
+	{
+		std::string Input, Output;
+		std::string Error;
+		// timings in milliseconds
+		double LoadTime, QuantizeTime, DitherTime, WriteTime;
+	};
+	std::vector<Job> m_Jobs;
+
+	std::string m_OutputDir;
+	std::string m_Palette;
+	ColorReducer::QuantizationMethod m_QuantMethod;
+	ColorReducer::ColorErrorMethod m_ErrorMethod;
+	ColorReducer::DitherType m_DitherType;
+	int m_OrderX, m_OrderY;
+	bool m_Serpentine;
+	// screen 2 or 4 patterns, bitmaps when 0
+	int m_Screen;
+	bool m_IncludePalette;
+	int m_Threads;
+
+	void addFile( const std::string& filename );
+	bool readManifest( const std::string& filename );
+	void convert( Job& job );
+	// 16 rgb triplets, unused ones black
+	static void getPalette( const ColorReducer& cr, double *pal );
+	std::string outputName( const std::string& input, const char *ext ) const;
+	void report( const Job& job );
+};
+
+} // namespace Polka
+
+#endif // _POLKA_BATCHCONVERTER_H_
@@ -0,0 +1,159 @@
+/*
+	Copyright (C) 2013 Edwin Velds
+
+    This file is part of Polka 2.
+
+    Polka 2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Polka 2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Polka 2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Compression.h"
+#include <cstring>
+#include <cstdint>
+
+namespace Polka {
+
+static const int HASH_BITS = 12;
+static const unsigned int MIN_MATCH = 4;
+static const size_t MAX_OFFSET = 65535;
+
+static inline uint32_t read32( const char *p )
+{
+	uint32_t v;
+	memcpy( &v, p, 4 );
+	return v;
+}
+
+static inline unsigned int hash32( uint32_t v )
+{
+	return (v * 2654435761u) >> (32-HASH_BITS);
+}
+
+// lengths of 15 and up continue in extra bytes
+static void putLength( std::string& dest, size_t len )
+{
+	while( len >= 255 ) {
+		dest += char(255);
+		len -= 255;
+	}
+	dest += char(len);
+}
+
+static void putSequence( std::string& dest, const char *lit, size_t nlit, size_t offset, size_t len )
+{
+	size_t mlen = len ? len - MIN_MATCH : 0;
+	dest += char( ((nlit < 15 ? nlit : 15) << 4) | (mlen < 15 ? mlen : 15) );
+	if( nlit >= 15 ) putLength( dest, nlit-15 );
+	dest.append( lit, nlit );
+	if( !len ) return;
+	dest += char(offset & 255);
+	dest += char(offset >> 8);
+	if( mlen >= 15 ) putLength( dest, mlen-15 );
+}
+
+void compressData( const char *src, size_t size, std::string& dest )
+{
+	dest.clear();
+	dest.reserve( size/2 + 16 );
+	for( int i = 0; i < 4; i++ )
+		dest += char( (size >> (8*i)) & 255 );
+
+	// last position seen for each hash, offset by one
+	std::string::size_type table[1 << HASH_BITS];
+	memset( table, 0, sizeof(table) );
+
+	size_t anchor = 0, i = 0;
+	while( i + MIN_MATCH <= size ) {
+		uint32_t seq = read32( src+i );
+		unsigned int h = hash32( seq );
+		size_t ref = table[h];
+		table[h] = i+1;
+		if( ref && i-(ref-1) <= MAX_OFFSET && read32( src+ref-1 ) == seq ) {
+			ref--;
+			// extend match
+			size_t len = MIN_MATCH;
+			while( i+len < size && src[ref+len] == src[i+len] ) len++;
+			putSequence( dest, src+anchor, i-anchor, i-ref, len );
+			i += len;
+			anchor = i;
+		} else {
+			i++;
+		}
+	}
+	// trailing literals
+	if( anchor < size || size == 0 )
+		putSequence( dest, src+anchor, size-anchor, 0, 0 );
+}
+
+// read continued length, false if out of data
+static bool getLength( const unsigned char *& p, const unsigned char *end, size_t& len )
+{
+	unsigned char b;
+	do {
+		if( p >= end ) return false;
+		b = *p++;
+		len += b;
+	} while( b == 255 );
+	return true;
+}
+
+bool decompressData( const std::string& src, std::string& dest )
+{
+	return decompressData( src.data(), src.size(), dest );
+}
+
+bool decompressData( const char *src, size_t srcSize, std::string& dest, size_t expected )
+{
+	dest.clear();
+	if( srcSize < 4 ) return false;
+	const unsigned char *p = reinterpret_cast<const unsigned char*>(src);
+	const unsigned char *end = p + srcSize;
+	size_t size = p[0] | (p[1] << 8) | (p[2] << 16) | (size_t(p[3]) << 24);
+	p += 4;
+	if( expected != size_t(-1) && size != expected ) return false;
+	dest.resize( size );
+	char *out = &dest[0];
+	size_t pos = 0;
+
+	while( p < end ) {
+		unsigned char token = *p++;
+		// literals
+		size_t nlit = token >> 4;
+		if( nlit == 15 && !getLength( p, end, nlit ) ) return false;
+		if( nlit > size_t(end-p) || nlit > size-pos ) return false;
+		memcpy( out+pos, p, nlit );
+		p += nlit;
+		pos += nlit;
+		if( p == end ) break;
+
+		// match, may overlap its own output
+		if( end-p < 2 ) return false;
+		size_t offset = p[0] | (p[1] << 8);
+		p += 2;
+		size_t len = token & 15;
+		if( len == 15 && !getLength( p, end, len ) ) return false;
+		len += MIN_MATCH;
+		if( offset == 0 || offset > pos || len > size-pos ) return false;
+		const char *from = out + pos - offset;
+		if( offset >= len ) {
+			memcpy( out+pos, from, len );
+		} else {
+			for( size_t j = 0; j < len; j++ )
+				out[pos+j] = from[j];
+		}
+		pos += len;
+	}
+	return pos == size;
+}
+
+} // namespace Polka
@@ -0,0 +1,38 @@
+/*
+	Copyright (C) 2013 Edwin Velds
+
+    This file is part of Polka 2.
+
+    Polka 2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Polka 2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Polka 2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _POLKA_COMPRESSION_H_
+#define _POLKA_COMPRESSION_H_
+
+#include <string>
+
+namespace Polka {
+
+// fast lz77 style compression for in memory data such as undo buffers.
+// The output starts with the uncompressed size, followed by sequences of
+// literals and back references.
+void compressData( const char *src, size_t size, std::string& dest );
+bool decompressData( const std::string& src, std::string& dest );
+// a known size rejects data claiming a different one before allocating
+bool decompressData( const char *src, size_t size, std::string& dest,
+                     size_t expected = size_t(-1) );
+
+} // namespace Polka
+
+#endif // _POLKA_COMPRESSION_H_
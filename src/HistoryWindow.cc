@@ -23,6 +23,7 @@
 #include <gtkmm/stock.h>
 #include <glibmm/i18n.h>
 #include <gtkmm/activatable.h>
+#include <cstdio>
 
 #include <iostream>
 using namespace std;
@@ -48,6 +49,7 @@ HistoryWindow::HistoryWindow()
 	m_MainBox.pack_start( m_ButtonBox, Gtk::PACK_SHRINK );
 	m_ButtonBox.pack_start( m_UndoButton, Gtk::PACK_SHRINK );
 	m_ButtonBox.pack_start( m_RedoButton, Gtk::PACK_SHRINK );
+	m_ButtonBox.pack_end( m_MemoryLabel, Gtk::PACK_SHRINK );
 	//m_UndoButton.set_relief( Gtk::RELIEF_NONE );
 	//m_RedoButton.set_relief( Gtk::RELIEF_NONE );
 
@@ -56,6 +58,7 @@ HistoryWindow::HistoryWindow()
 	m_ListView.append_column( "I", m_Columns.m_ColType );
 	m_ListView.append_column( "I", m_Columns.m_ColIcon );
 	m_ListView.append_column( "T", m_Columns.m_ColName );
+	m_ListView.append_column( "M", m_Columns.m_ColSize );
 	m_ListView.set_sensitive(false);
 
 	m_ListView.set_headers_visible(false);
@@ -108,6 +111,7 @@ void HistoryWindow::setUndoHistory( UndoHistory *hist )
 		clearUndoRows();
 		clearRedoRows();
 		m_ListView.set_sensitive(false);
+		m_MemoryLabel.set_text("");
 	}
 	m_pHistory = hist;
 
@@ -170,6 +174,12 @@ void HistoryWindow::historyChanged( UndoHistory::ChangeType type )
 		case UndoHistory::CHANGE_REDOACTION:
 			redoAction();
 			break;
+		case UndoHistory::CHANGE_DROPUNDO:
+			dropFirstUndoRow();
+			break;
+		case UndoHistory::CHANGE_MEMORY:
+			updateMemory();
+			break;
 		default:
 			break;
 	}
@@ -221,6 +231,39 @@ void HistoryWindow::addLastUndoRow()
 	m_UndoButton.set_sensitive();
 }
 
+void HistoryWindow::dropFirstUndoRow()
+{
+	// oldest action follows the start row
+	Gtk::TreeModel::iterator del = m_refListModel->children().begin();
+	++del;
+	if( del != m_itLastUndo && del != m_refListModel->children().end() )
+		m_refListModel->erase(del);
+}
+
+static Glib::ustring memoryText( size_t size )
+{
+	char buf[32];
+	if( size < 1024*1024 )
+		snprintf( buf, sizeof(buf), "%.1f kB", size/1024.0 );
+	else
+		snprintf( buf, sizeof(buf), "%.1f MB", size/(1024.0*1024.0) );
+	return buf;
+}
+
+void HistoryWindow::updateMemory()
+{
+	for( Gtk::TreeModel::iterator it = m_refListModel->children().begin();
+	     it != m_refListModel->children().end(); ++it ) {
+		const UndoAction *action = (*it)[m_Columns.m_pAction];
+		if( action )
+			(*it)[m_Columns.m_ColSize] = memoryText( action->userActionMemorySize() );
+	}
+	Glib::ustring text = memoryText( m_pHistory->memoryUsage() );
+	if( m_pHistory->memoryBudget() )
+		text += " / " + memoryText( m_pHistory->memoryBudget() );
+	m_MemoryLabel.set_text( text );
+}
+
 void HistoryWindow::undoAction()
 {
 	m_itFirstRedo = m_itLastUndo;
@@ -25,6 +25,7 @@
 #include <gtkmm/liststore.h>
 #include <gtkmm/box.h>
 #include <gtkmm/toolbar.h>
+#include <gtkmm/label.h>
 //#include <gtkmm/action.h>
 
 #include "UndoHistory.h"
@@ -54,11 +55,12 @@ private:
 	{
 	public:
 
-		ModelColumns(){ add(m_ColType); add(m_ColIcon); add(m_ColName); add(m_pAction); }
+		ModelColumns(){ add(m_ColType); add(m_ColIcon); add(m_ColName); add(m_ColSize); add(m_pAction); }
 
 		Gtk::TreeModelColumn< Glib::RefPtr<Gdk::Pixbuf> > m_ColType;
 		Gtk::TreeModelColumn< Glib::RefPtr<Gdk::Pixbuf> > m_ColIcon;
 		Gtk::TreeModelColumn< Glib::ustring > m_ColName;
+		Gtk::TreeModelColumn< Glib::ustring > m_ColSize;
 		Gtk::TreeModelColumn< const UndoAction* > m_pAction;
 	};
 
@@ -66,6 +68,7 @@ private:
 	Gtk::HBox m_ButtonBox;
 	Gtk::ToolButton m_UndoButton;
 	Gtk::ToolButton m_RedoButton;
+	Gtk::Label m_MemoryLabel;
 	Gtk::VBox m_MainBox;
 	Glib::RefPtr<Gtk::ListStore> m_refListModel;
 	ModelColumns m_Columns;
@@ -85,6 +88,8 @@ private:
 	void clearUndoRows();
 	void clearRedoRows();
 	void addLastUndoRow();
+	void dropFirstUndoRow();
+	void updateMemory();
 	void undoAction();
 	void redoAction();
 	void updateButtonSensitivity();
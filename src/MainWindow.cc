@@ -123,6 +123,7 @@ void MainWindow::buildActions()
 	m_refRecent->signal_item_activated().connect( sigc::mem_fun(*this, &MainWindow::onFileRecent) );
 	Glib::RefPtr<Gtk::RecentFilter> recentFilter = Gtk::RecentFilter::create();
 	recentFilter->add_pattern("*.ppp");
+	recentFilter->add_pattern("*.ppb");
 	m_refRecent->add_filter(recentFilter);
 	m_refRecent->set_sort_type(Gtk::RECENT_SORT_MRU);
 	m_refActionGroup->add(m_refRecent);
@@ -313,6 +314,7 @@ void MainWindow::onFileNew()
 	m_ModifiedCounter = 0;
 	m_pProject->undoHistory().signalHistoryChanged().connect( sigc::mem_fun(*this, &MainWindow::changeModifiedStatus ) );
 	m_HistoryWindow.setUndoHistory( &m_pProject->undoHistory() );
+	m_pProject->undoHistory().setMemoryBudget( size_t(Settings::get().getInteger( "", "UndoMemoryBudget", 256 )) << 20 );
 	m_refActionGroup->get_action("FileClose")->set_sensitive(true);
 	m_refActionGroup->get_action("FileSaveAs")->set_sensitive(true);
 	m_refActionGroup->get_action("FileImport")->set_sensitive(true);
@@ -336,6 +338,7 @@ void MainWindow::onFileOpen()
 	filter->set_name("Polka 2 project files");
 	filter->add_mime_type("application/x-polka2-project");
 	filter->add_pattern("*.ppp");
+	filter->add_pattern("*.ppb");
 	dialog.add_filter(filter);
 
 	// Show the dialog and wait for a user response:
@@ -395,6 +398,11 @@ void MainWindow::onFileSaveAs()
 	filter->add_mime_type("application/x-polka2-project");
 	filter->add_pattern("*.ppp");
 	dialog.add_filter(filter);
+	// binary projects load faster but can't be compared as text
+	Glib::RefPtr<Gtk::FileFilter> binFilter = Gtk::FileFilter::create();
+	binFilter->set_name("Polka 2 binary project files");
+	binFilter->add_pattern("*.ppb");
+	dialog.add_filter(binFilter);
 
 	// Show the dialog and wait for a user response:
 	int result = dialog.run();
@@ -405,7 +413,8 @@ void MainWindow::onFileSaveAs()
 		std::string ext = "    ";
 		std::transform(fname.end()-4, fname.end(), ext.begin(), tolower);
 		// add extension if not there
-		if( ext != ".ppp" ) fname += ".ppp";
+		if( ext != ".ppp" && ext != ".ppb" )
+			fname += dialog.get_filter() == binFilter ? ".ppb" : ".ppp";
 		// save to selected file
 		if( m_pProject->saveToFile( fname ) == 0 ) {
 			m_ModifiedCounter = 0;
@@ -519,6 +528,10 @@ void MainWindow::changeModifiedStatus( UndoHistory::ChangeType type )
 		case UndoHistory::CHANGE_REDOACTION:
 			m_ModifiedCounter++;
 			break;
+		case UndoHistory::CHANGE_DROPUNDO:
+		case UndoHistory::CHANGE_MEMORY:
+			// no change to the data
+			break;
 		default:
 			if( m_ModifiedCounter != 0 )
 				m_ModifiedCounter = std::numeric_limits<int>::max()/2;
@@ -0,0 +1,99 @@
+/*
+	Copyright (C) 2013 Edwin Velds
+
+    This file is part of Polka 2.
+
+    Polka 2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Polka 2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Polka 2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "MappedFile.h"
+#include <fstream>
+#include <cstdlib>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace Polka {
+
+MappedFile::MappedFile()
+	: m_pData(0), m_Size(0), m_Mapped(false)
+{
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+bool MappedFile::open( const std::string& filename )
+{
+	close();
+#ifndef _WIN32
+	int fd = ::open( filename.c_str(), O_RDONLY );
+	if( fd < 0 ) return false;
+	struct stat st;
+	if( fstat( fd, &st ) == 0 && st.st_size > 0 ) {
+		void *p = mmap( 0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+		if( p != MAP_FAILED ) {
+			m_pData = static_cast<char*>(p);
+			m_Size = st.st_size;
+			m_Mapped = true;
+		}
+	}
+	::close( fd );
+	if( m_Mapped ) return true;
+#endif
+	// read the file instead
+	std::ifstream f( filename.c_str(), std::ios::in | std::ios::binary );
+	if( !f.is_open() ) return false;
+	f.seekg( 0, std::ios::end );
+	size_t size = f.tellg();
+	f.seekg( 0 );
+	m_pData = static_cast<char*>( malloc( size ? size : 1 ) );
+	f.read( m_pData, size );
+	if( !f ) {
+		close();
+		return false;
+	}
+	m_Size = size;
+	return true;
+}
+
+void MappedFile::close()
+{
+#ifndef _WIN32
+	if( m_Mapped )
+		munmap( m_pData, m_Size );
+	else
+#endif
+		free( m_pData );
+	m_pData = 0;
+	m_Size = 0;
+	m_Mapped = false;
+}
+
+const char *MappedFile::data() const
+{
+	return m_pData;
+}
+
+size_t MappedFile::size() const
+{
+	return m_Size;
+}
+
+} // namespace Polka
@@ -0,0 +1,52 @@
+/*
+	Copyright (C) 2013 Edwin Velds
+
+    This file is part of Polka 2.
+
+    Polka 2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Polka 2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Polka 2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _POLKA_MAPPEDFILE_H_
+#define _POLKA_MAPPEDFILE_H_
+
+#include <string>
+
+namespace Polka {
+
+// read only view of a whole file, memory mapped where the platform
+// allows it and read into memory otherwise
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+
+	bool open( const std::string& filename );
+	void close();
+
+	const char *data() const;
+	size_t size() const;
+
+private:
+	// don't allow copies
+	MappedFile( const MappedFile& );
+
+	char *m_pData;
+	size_t m_Size;
+	bool m_Mapped;
+};
+
+} // namespace Polka
+
+#endif // _POLKA_MAPPEDFILE_H_
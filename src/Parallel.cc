@@ -0,0 +1,58 @@
+/*
+	Copyright (C) 2013 Edwin Velds
+
+    This file is part of Polka 2.
+
+    Polka 2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Polka 2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Polka 2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "Parallel.h"
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace Polka {
+
+int hardwareThreads()
+{
+	// may be unknown
+	return std::max( 1u, std::thread::hardware_concurrency() );
+}
+
+void parallelFor( int count, int threads, const std::function<void(int)>& func )
+{
+	threads = std::min( threads, count );
+	if( threads <= 1 ) {
+		for( int i = 0; i < count; i++ )
+			func(i);
+		return;
+	}
+
+	// indices are handed out one at a time
+	std::atomic<int> next( 0 );
+	auto worker = [&]() {
+		for( int i = next++; i < count; i = next++ )
+			func(i);
+	};
+	std::vector<std::thread> pool;
+	for( int t = 1; t < threads; t++ )
+		pool.push_back( std::thread( worker ) );
+	worker();
+	for( unsigned int t = 0; t < pool.size(); t++ )
+		pool[t].join();
+}
+
+} // namespace Polka
@@ -0,0 +1,37 @@
+/*
+	Copyright (C) 2013 Edwin Velds
+
+    This file is part of Polka 2.
+
+    Polka 2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Polka 2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Polka 2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _POLKA_PARALLEL_H_
+#define _POLKA_PARALLEL_H_
+
+#include <functional>
+
+namespace Polka {
+
+// number of threads to use if none is given
+int hardwareThreads();
+
+// call func for every index in [0, count) on up to threads threads,
+// the calling thread takes part and returns when all calls are done
+void parallelFor( int count, int threads, const std::function<void(int)>& func );
+
+} // namespace Polka
+
+#endif // _POLKA_PARALLEL_H_
@@ -518,9 +518,15 @@ int Project::save()
  	s.createItem("PROJECT_NAME", "S");
  	s.setField(0, m_ProjectName.raw() );
  	// store objects
-	saveTreeRow( s, m_rpTreeModel->children()[0].children() );
+	int r = saveTreeRow( s, m_rpTreeModel->children()[0].children() );
+	// keep the existing file if an object can't be stored
+	if( r ) return r;
+	// binary container for .ppb files
+	std::string ext = m_Filename.size() > 4 ? m_Filename.substr( m_Filename.size()-4 ) : "";
+	std::transform( ext.begin(), ext.end(), ext.begin(), tolower );
+	if( ext == ".ppb" ) s.setFileFormat( Storage::FORMAT_BINARY );
 	// save to file
-	int r = s.save();
+	r = s.save();
 	return r;
 }
 
@@ -545,7 +551,8 @@ int Project::saveTreeRow( Storage& s, const Gtk::TreeModel::Children& c )
 		bool hasChildren = row.children().size();
 		if( !obj && hasChildren  ) {
 			// container has childern, store them
-			saveTreeRow( s, row.children() );
+			int err = saveTreeRow( s, row.children() );
+			if( err ) return err;
 		} else if( obj || (!hasChildren && path.size() > 1 ) ) {
 			// row is object or empty location create object
 			Storage& subS = s.createObject( obj?obj->id():"EMPTY_LOCATION" );
@@ -561,7 +568,7 @@ int Project::saveTreeRow( Storage& s, const Gtk::TreeModel::Children& c )
 					subS.setField(0, 1);
 				}
 				// write object
-				obj->save( subS );
+				if( obj->save( subS ) ) return Storage::EFAILSTOREOBJECT;
 			} else {
 				// location name added to location
 				Glib::ustring locName( row[m_Cols.m_Name] );
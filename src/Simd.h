@@ -0,0 +1,54 @@
+/*
+	Copyright (C) 2013 Edwin Velds
+
+    This file is part of Polka 2.
+
+    Polka 2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Polka 2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Polka 2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _POLKA_SIMD_H_
+#define _POLKA_SIMD_H_
+
+// vector versions are compiled for their own target and selected at runtime,
+// sse2 is part of the x86-64 baseline and needs no runtime check
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define POLKA_X86_SIMD
+#include <immintrin.h>
+#ifdef __SSE2__
+#define POLKA_SSE2
+#endif
+#endif
+
+namespace Polka {
+
+#ifdef POLKA_X86_SIMD
+
+// cpu features, probed once
+inline bool hasSSSE3()
+{
+	static const bool result = __builtin_cpu_supports("ssse3");
+	return result;
+}
+
+inline bool hasAVX2()
+{
+	static const bool result = __builtin_cpu_supports("avx2");
+	return result;
+}
+
+#endif // POLKA_X86_SIMD
+
+} // namespace Polka
+
+#endif // _POLKA_SIMD_H_
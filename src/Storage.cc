@@ -19,13 +19,14 @@
 
 #include "Storage.h"
 #include "Functions.h"
+#include "Base64.h"
 #include <cassert>
 #include <fstream>
-#include <sstream>
 #include <iomanip>
 #include <iostream>
 #include <cstdlib>
 #include <cstring>
+#include <algorithm>
 
 namespace Polka {
 
@@ -36,9 +37,9 @@ static const std::string EMPTY;
  */
 
 Storage::Storage( const std::string filename )
-	: m_FileName( filename ), m_CurItem(0), m_VersionMajor(-1), m_VersionMinor(-1), m_pParent(0)
+	: m_FileName( filename ), m_CurItem(0), m_VersionMajor(-1), m_VersionMinor(-1), m_pParent(0),
+	  m_FileFormat(FORMAT_TEXT), m_Compress(true)
 {
- std::cout << "storage for " << m_FileName << std::endl;
 }
 
 Storage::~Storage()
@@ -101,18 +102,37 @@ int Storage::load()
 {
 	std::cout << "obj: " << this << std::endl;
 	std::ifstream file;
-	file.open( m_FileName.c_str() ); std::cout << "loading " << m_FileName << std::endl;
+	file.open( m_FileName.c_str(), std::ios::in | std::ios::binary ); std::cout << "loading " << m_FileName << std::endl;
 	if( !file.is_open() ) return EFAILEDOPENREAD;
-	return load(file);
+	// binary containers start with a magic header
+	if( isBinaryFile(file) ) {
+		file.close();
+		m_FileFormat = FORMAT_BINARY;
+		return loadBinary();
+	}
+	// reopen as text
+	file.close();
+	file.open( m_FileName.c_str() );
+	if( !file.is_open() ) return EFAILEDOPENREAD;
+	m_FileFormat = FORMAT_TEXT;
+	return loadText(file);
 }
 
 int Storage::save()
 {
 	std::cout << "obj: " << this << std::endl;
 	if( m_FileName.empty() ) m_FileName = "ALARM";
+	// the file may be the one still mapped
+	loadMappedData();
 	std::ofstream file;
-	file.open( m_FileName.c_str() ); std::cout << "saving " << m_FileName << std::endl;
+	if( m_FileFormat == FORMAT_BINARY )
+		file.open( m_FileName.c_str(), std::ios::out | std::ios::trunc | std::ios::binary );
+	else
+		file.open( m_FileName.c_str() );
+	std::cout << "saving " << m_FileName << std::endl;
 	if( !file.is_open() ) return EFAILEDOPENWRITE;
+	if( m_FileFormat == FORMAT_BINARY )
+		return saveBinary(file);
 	return save(file);
 }
 
@@ -121,50 +141,15 @@ void Storage::setFilename( const std::string& filename )
 	m_FileName = filename;
 }
 
-int Storage::load( std::ifstream& f )
-{
-	std::string buf;
-	while( !f.eof() ) {
-		// get a full line
-		std::getline(f, buf);
- 		buf = trim(buf);
-		// check possibilites
-		if( buf.empty() ) {
-			// empty line, skip
-			continue;
-		} else if( buf[0] == '*' ) {
-			// found name record
-			size_t n = buf.find_first_of(':');
-			if( n == std::string::npos ) {
-				// no format separator
-				return EITEMWITHOUTSEPARATOR;
-			}
-			std::string name = buf.substr( 1, n-1 );
-			std::string format = buf.substr( n+1 );
-			// check string sizes
-			if( !name.size() || !format.size() ) return EBADITEMLINE;
-			// create item first and check format result
-			createItem( name, format );
-			if( !m_CurItem->format().size() ) return EBADITEMFORMAT;
-			// read item
-			int err = m_CurItem->load(f);
-			if( err ) return err;
-			
-		} else if( buf[0] == '+' ) {
-			// found object
-			Storage& subS = createObject( trim(buf.substr(1)) );
-			int err = subS.load( f );
-if( err ) std::cout << "Error " << err << " in loading of object " << buf << std:: endl;
-		} else if( buf[0] == '-' ) {
-			// found object end marker
-			return 0;
-		} else {
-			// found garbage => error
-			return EINVALIDDATA;
-		}
-	}
-	
-	return 0;
+void Storage::setFileFormat( FileFormat format, bool compress )
+{
+	m_FileFormat = format;
+	m_Compress = compress;
+}
+
+Storage::FileFormat Storage::fileFormat() const
+{
+	return m_FileFormat;
 }
 
 int Storage::save( std::ofstream& f )
@@ -196,48 +181,70 @@ int Storage::save( std::ofstream& f )
 
 bool Storage::findItem( const std::string& name )
 {
-	m_itCurItem = m_Items.begin();
-	while( m_itCurItem != m_Items.end() ) {
-		if( (*m_itCurItem)->name() == name ) {
-			m_CurItem = *m_itCurItem;
-			return true;
-		}
-		++m_itCurItem;
+	std::unordered_map<std::string, unsigned int>::const_iterator it = m_ItemIndex.find( name );
+	if( it == m_ItemIndex.end() ) {
+		m_itCurItem = m_Items.end();
+		m_CurItem = 0;
+		return false;
 	}
-	m_CurItem = 0;
-	return false;	
+	m_itCurItem = m_Items.begin() + it->second;
+	m_CurItem = *m_itCurItem;
+	return true;
 }
 
 bool Storage::findObject( const std::string& type )
 {
-	m_itCurItem = m_Items.begin();
-	while( m_itCurItem != m_Items.end() ) {
-		if( (*m_itCurItem)->isObject() && (type.empty() || (*m_itCurItem)->name() == type) ) {
-			m_CurItem = *m_itCurItem;
-			return true;
-		}
-		++m_itCurItem;
-	}
-	m_CurItem = 0;
-	return false;
+	return findObjectFrom( 0, type );
 }
 
 bool Storage::findNextObject( const std::string& type )
 {
-	++m_itCurItem;
-	while( m_itCurItem != m_Items.end() ) {
-		if( (*m_itCurItem)->isObject() && (type.empty() || (*m_itCurItem)->name() == type) ) {
+	return findObjectFrom( m_itCurItem - m_Items.begin() + 1, type );
+}
+
+bool Storage::findObjectFrom( unsigned int pos, const std::string& type )
+{
+	// positions of all objects or those of the type
+	const std::vector<unsigned int> *objs = &m_Objects;
+	if( !type.empty() ) {
+		std::unordered_map<std::string, std::vector<unsigned int> >::const_iterator it = m_ObjectIndex.find( type );
+		objs = it == m_ObjectIndex.end() ? 0 : &it->second;
+	}
+	if( objs ) {
+		std::vector<unsigned int>::const_iterator it = std::lower_bound( objs->begin(), objs->end(), pos );
+		if( it != objs->end() ) {
+			m_itCurItem = m_Items.begin() + *it;
 			m_CurItem = *m_itCurItem;
 			return true;
 		}
-		++m_itCurItem;
 	}
+	m_itCurItem = m_Items.end();
 	m_CurItem = 0;
 	return false;
 }
 
+void Storage::indexItem( unsigned int pos )
+{
+	Item *item = m_Items[pos];
+	// only the first of a name is found
+	m_ItemIndex.insert( std::make_pair( item->name(), pos ) );
+	if( item->isObject() ) {
+		m_ObjectIndex[item->name()].push_back( pos );
+		m_Objects.push_back( pos );
+	}
+}
+
+void Storage::rebuildIndex()
+{
+	m_ItemIndex.clear();
+	m_ObjectIndex.clear();
+	m_Objects.clear();
+	for( unsigned int i = 0; i < m_Items.size(); i++ )
+		indexItem( i );
+}
+
 void Storage::createItem( const std::string& name, const std::string& format, int size )
-{ std::cout << "CREATE: " << name << ", " << format << std::endl;
+{
 	if( findItem( name ) ) {
 		m_CurItem->resetFormat( format );
 	} else {
@@ -245,6 +252,7 @@ void Storage::createItem( const std::string& name, const std::string& format, in
 		m_Items.push_back( m_CurItem );
 		m_itCurItem = m_Items.end();
 		--m_itCurItem;
+		indexItem( m_Items.size()-1 );
 	}
 	if( size > 0 )
 		if( m_CurItem->isArray() ) 
@@ -252,13 +260,14 @@ void Storage::createItem( const std::string& name, const std::string& format, in
 }
 
 Storage& Storage::createObject( const std::string& type )
-{ std::cout << "create object: " << type << std::endl;
+{
 	// create new object item
 	m_CurItem = new Item( type, "O" );
 	m_Items.push_back( m_CurItem );
 	m_CurItem->object().setParent(this);
 	m_itCurItem = m_Items.end();
 	--m_itCurItem;
+	indexItem( m_Items.size()-1 );
 	return m_CurItem->object();
 }
 
@@ -268,6 +277,23 @@ Storage& Storage::object()
 	return m_CurItem->object();
 }
 
+Storage *Storage::detachObject()
+{
+	if( !isObject() ) return 0;
+	Storage *obj = m_CurItem->releaseObject();
+	// keep the version of the tree
+	obj->m_VersionMajor = versionMajor();
+	obj->m_VersionMinor = versionMinor();
+	obj->setParent(0);
+	delete m_CurItem;
+	m_CurItem = 0;
+	m_Items.erase(m_itCurItem);
+	// positions after it have moved
+	rebuildIndex();
+	m_itCurItem = m_Items.end();
+	return obj;
+}
+
 bool Storage::deleteObject( const std::string& type )
 {
 	if( !type.empty() ) findObject(type);
@@ -276,6 +302,7 @@ bool Storage::deleteObject( const std::string& type )
 	delete m_CurItem;
 	m_CurItem = 0;
 	m_Items.erase(m_itCurItem);
+	rebuildIndex();
 	m_itCurItem = m_Items.end();
 	return true;
 }
@@ -294,6 +321,19 @@ int Storage::arraySize() const
 	return m_CurItem->arraySize();
 }
 
+size_t Storage::memorySize() const
+{
+	size_t size = sizeof(Storage) + m_FileName.capacity() + m_Name.capacity()
+	            + m_Items.capacity() * sizeof(Item*);
+	// index nodes and positions
+	size += m_ItemIndex.size() * (sizeof(std::string) + 4*sizeof(void*))
+	      + m_ObjectIndex.size() * (sizeof(std::string) + sizeof(std::vector<unsigned int>) + 2*sizeof(void*))
+	      + 2 * m_Objects.capacity() * sizeof(unsigned int);
+	for( unsigned int i = 0; i < m_Items.size(); i++ )
+		size += m_Items[i]->memorySize();
+	return size;
+}
+
 bool Storage::isObject() const
 {
 	if( !m_CurItem ) return false;
@@ -307,6 +347,18 @@ const std::string& Storage::objectType() const
 	return m_CurItem->name();
 }
 
+bool Storage::hasMappedData() const
+{
+	if( !m_CurItem ) return false;
+	return m_CurItem->hasMappedData();
+}
+
+size_t Storage::dataSize( int id ) const
+{
+	assert( m_CurItem );
+	return m_CurItem->dataSize(id);
+}
+
 
 // access functions
 const std::string& Storage::stringField( int id )
@@ -439,7 +491,7 @@ Storage::Item::Item( const Item& _item )
 }
 
 Storage::Item::~Item()
-{ std::cout << "~Item: " << m_Name << std::endl;
+{
 	if( m_pData ) free(m_pData);
 	if( m_pObject ) delete m_pObject;
 }
@@ -500,6 +552,17 @@ int Storage::Item::arraySize() const
 	return m_ArraySize;
 }
 
+size_t Storage::Item::memorySize() const
+{
+	size_t size = sizeof(Item) + m_Name.capacity() + m_Format.capacity() + m_ArrayFormat.capacity()
+	            + m_FieldLocs.capacity() * sizeof(int) + m_Data.capacity() * sizeof(std::string);
+	if( m_pData ) size += m_RowSize * std::max( m_ArraySize, 1 );
+	for( unsigned int i = 0; i < m_Data.size(); i++ )
+		size += m_Data[i].capacity();
+	if( m_pObject ) size += m_pObject->memorySize();
+	return size;
+}
+
 bool Storage::Item::isObject() const
 {
 	return m_pObject != 0;
@@ -511,6 +574,13 @@ Storage& Storage::Item::object()
 	return *m_pObject;
 }
 
+Storage *Storage::Item::releaseObject()
+{
+	Storage *obj = m_pObject;
+	m_pObject = 0;
+	return obj;
+}
+
 void Storage::Item::forceArraySize( int rows )
 {
 	assert( m_ArraySize >= 0 );
@@ -533,8 +603,8 @@ const std::string& Storage::Item::stringField( int id )
 	// return data
 	if( sid == -1 )
 		return EMPTY;
-	else
-		return m_Data[sid];
+	resolve( sid );
+	return m_Data[sid];
 }
 
 const std::string& Storage::Item::stringField( int row, int id )
@@ -548,8 +618,8 @@ const std::string& Storage::Item::stringField( int row, int id )
 	// return data
 	if( sid == -1 )
 		return EMPTY;
-	else
-		return m_Data[sid];
+	resolve( sid );
+	return m_Data[sid];
 }
 
 const std::string& Storage::Item::dataField( int id )
@@ -610,6 +680,7 @@ void Storage::Item::setField( int id, const std::string& str )
 	int *dat = (int *)(m_pData + m_FieldLocs[id]);
 	// create data field if not available
 	if( *dat == -1 ) { *dat = m_Data.size(); m_Data.push_back( std::string() ); }
+	if( *dat < int(m_Mapped.size()) ) m_Mapped[*dat].offset = 0;
 	m_Data[*dat] = str;
 }
 
@@ -624,6 +695,7 @@ void Storage::Item::setField( int row, int id, const std::string& str )
 	int *dat = (int *)(m_pData + m_RowSize*row + m_FieldLocs[id]);
 	// create data field if not available
 	if( *dat == -1 ) { *dat = m_Data.size(); m_Data.push_back( std::string() ); }
+	if( *dat < int(m_Mapped.size()) ) m_Mapped[*dat].offset = 0;
 	m_Data[*dat] = str;
 }
 
@@ -676,6 +748,7 @@ std::string& Storage::Item::setDataField( int id )
 	int *dat = (int *)(m_pData + m_FieldLocs[id]);
 	// create data field if not available
 	if( *dat == -1 ) { *dat = m_Data.size(); m_Data.push_back( std::string() ); }
+	resolve( *dat );
 	return m_Data[*dat];
 }
 
@@ -690,122 +763,11 @@ std::string& Storage::Item::setDataField( int row, int id )
 	int *dat = (int *)(m_pData + m_RowSize*row + m_FieldLocs[id]);
 	// create data field if not available
 	if( *dat == -1 ) { *dat = m_Data.size(); m_Data.push_back( std::string() ); }
+	resolve( *dat );
 	return m_Data[*dat];
 }
 
 
-/*
- * base64
- * 
- *   Encode string to base64 (6 bit to "A-Za-z0-9+/")
- */
-void Storage::Item::base64encode( const std::string& str, std::ostream& f )
-{
-	int count = 0;
-	for( int i = 0; i+2 < int(str.size()); i += 3 ) {
-		// create 3 char value
-		int n = ((unsigned char)(str[i])  << 16) |
-		        ((unsigned char)(str[i+1]) << 8) | 
-		         (unsigned char)(str[i+2]);
-
-		// convert to 4 base64 chars
-		for( int c = 18; c >= 0; c-=6 ) {
-			char b = (n >> c) & 63;
-			if( b < 26 )
-				b += 'A';
-			else if( b < 52 )
-				b += 'a'-26;
-			else if( b < 62 )
-				b += '0'-52;
-			else if( b == 62 )
-				b = '+';
-			else
-				b = '/';
-			f << b;
-			count++;
-		}
-		// lines of 64
-		if( count == 100 ) { f << std::endl; count = 0; }
-	}
-	// last bytes
-	unsigned int N = str.size();
-	if( N % 3 == 0 ) {
-		// add an extra = if everything is done
-		f << '=';
-	} else {
-		// 
-		int n;
-		if( N % 3 == 1 )
-			n = (str[N-1] << 16) | 1;
-		else 
-			n = (str[N-2] << 16) | (str[N-1] << 8);
-
-		for( int c = 3; c > (n&3); c-- ) {
-			char b = (n >> (6*c)) & 63;
-			if( b < 26 )
-				b += 'A';
-			else if( b < 52 )
-				b += 'a'-26;
-			else if( b < 62 )
-				b += '0'-52;
-			else if( b == 63 )
-				b = '+';
-			else
-				b = '/';
-			f << b;
-		}
-		// add end marker
-		f << '=';
-		if( N%3 == 1 ) f << '=';
-	}
-}
-
-bool Storage::Item::base64decode( const std::string& str, unsigned int p, std::string& result )
-{
-	while( p < str.size() ) {
-		// skip whitespace
-		if( str[p] < '0' )
-			p++;
-		else if( str[p] == '=' )
-			// no more quads
-			p = str.size();
-		else if( str.size() - p < 4 )
-			// not enough chars till end
-			p = str.size();
-		else {
-			// calc binary value
-			int val = 0;
-			for( int i = 0; i < 4; i++ ) {
-				val <<= 6;
-				int b = str[p + i];
-				if( b >= 'A' && b <= 'Z' )
-					val += b - 'A';
-				else if( b >= 'a' && b <= 'z' )
-					val += b - 'a' + 26;
-				else if( b >= '0' && b <= '9' )
-					val += b - '0' + 52;
-				else if( b == '+' )
-					val += 62;
-				else
-					val += 63;
-			}
-			// output char to string
-			result += char(val >> 16);
-			if( str[ p+2 ] == '=' )
-				p = str.size();
-			else {
-				result += char( (val >> 8) & 255 );
-				if( str[ p+3 ] == '=' )
-					p = str.size();
-				else 
-					result += char( val & 255 );
-			}
-			p += 4;
-		}
-	}
-	return true;
-}
-
 bool Storage::Item::mustEncode( const std::string& str )
 {
 	if( str.size() > 1024 ) return true;
@@ -813,137 +775,6 @@ bool Storage::Item::mustEncode( const std::string& str )
 	return str.find_first_of("\000\007\008\027") != std::string::npos;
 }
 
-int Storage::Item::load( std::istream& f )
-{
-	// read items according to format
-	int fld = 0, numFields = m_Format.size();
-	// array can be empty
-	if( m_ArraySize >= 0 ) {
-		// peek next line for non data character
-		char c = f.peek();
-		if( c == '+' || c == '*' || c == '-')
-			numFields = 0;
-	}
-
-	std::string line;
-	size_t ptr = 0;
-	while( fld < numFields ) {
-		// skip white space
-		if( ptr >= line.size() || (ptr = line.find_first_not_of(" \t\r\n", ptr)) == std::string::npos ) {
-			// load next line from file
-			if( f.eof() ) return EPREMATUREENDARRAY;
-			std::getline(f, line);
-			// check if field is not name/object
-			if( line[0] == '*' || line[0] == '+' )
-				return EPREMATUREENDARRAY;
-			// start 
-			ptr = line.find_first_not_of(" \t\r\n");
-			// error if no data found
-			if( ptr == std::string::npos )
-				return EPREMATUREENDARRAY;
-		}
-		// store field
-		int id = fld%m_Format.size(), row = fld/m_Format.size();
-		switch( m_Format[id] ) {
-			case 'I':
-			{
-				int pos = line.find(',', ptr);
-				std::string field = line.substr(ptr, pos-ptr);
-				int r;
-				std::istringstream ss( field );
-				ss >> r;
-				if( m_ArraySize == -1 )
-					setField( id, r );
-				else
-					setField( row, id, r );
-				ptr = pos;
-				break;
-			}
-			case 'F':
-			{
-				int pos = line.find(',', ptr);
-				std::string field = line.substr(ptr, pos-ptr);
-				double r;
-				std::istringstream ss( field );
-				ss >> r;
-				if( m_ArraySize == -1 )
-					setField( id, r );
-				else
-					setField( row, id, r );
-				ptr = pos;
-				break;
-			}
-			default:
-				// string/data
-				std::string& str = m_ArraySize==-1?setDataField(id):setDataField(row, id);
-				if( line[ptr] == '"' ) {
-					// create string
-					ptr++;
-					while(true) {
-						// find quotes or end of line
-						size_t end = line.find('"', ptr);
-					
-						if( end == std::string::npos ) {
-							// end of line, copy everything
-							str += line.substr(ptr);
-							str += "\n";
-							// and continue on next line
-							if( f.eof() ) return EPREMATUREENDDATA;
-							std::getline(f, line);
-							ptr = 0;
-						} else if( int(end) == int(line.size())-1 || line[end+1] != '"') {
-							// end of string found
-							str += line.substr(ptr, end-ptr);
-							ptr = end+1;
-							break;
-						} else {
-							// double quote
-							str += line.substr(ptr, 1+end-ptr);
-							ptr = end+2;
-						}
-						
-					}
-				} else {
-					// create data
-					size_t end;
-					while(true) {
-						if( !base64decode( line, ptr, str ) )
-							return EINVALIDDATA;
-						end = line.find('=', ptr);
-						if( end != std::string::npos ) {
-							ptr = end+1;
-							while( line[ptr] == '=' ) ptr++;
-							break;
-						}
-						// get next line
-						if( f.eof() ) return EPREMATUREENDDATA;
-						std::getline(f, line);
-					}
-				}
-		}
-
-		// field done
-		fld++;
-		// ptr after field, more data?
-		ptr = line.find_first_not_of(" \t\n\r", ptr);
-		if( ptr == std::string::npos ) 
-			break;
-
-		// more data
-		ptr++;
-		
-		// extend field count for arrays
-		if( fld == numFields )
-			if( m_ArraySize >= 0 )
-				numFields += m_Format.size();
-	}
-	
-	if( fld != numFields )
-		return EPREMATUREENDDATA;
-	
-	return 0;
-}
-
 int Storage::Item::save( std::ostream& f )
 {
 	if( m_ArraySize == 0 ) return 0;
@@ -987,8 +818,11 @@ int Storage::Item::save( std::ostream& f )
 					f << "\"\"";
 					p += 2;
 				} else if( mustEncode( m_Data[datId] ) ) {
-					// base 64 encode output
-					base64encode( m_Data[datId], f );
+					// base 64 encode output, a leading + would start an object
+					if( p == 0 ) f << ' ';
+					std::string text;
+					base64Encode( m_Data[datId].data(), m_Data[datId].size(), text );
+					f.write( text.data(), text.size() );
 					p = 100;
 				} else {
 					p += 2 + m_Data[datId].size();
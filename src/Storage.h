@@ -22,9 +22,13 @@
 
 #include <string>
 #include <vector>
+#include <memory>
+#include <unordered_map>
 
 namespace Polka {
 
+class MappedFile;
+
 class Storage
 {
 public:
@@ -43,6 +47,11 @@ public:
 	int save();
 	void setFilename( const std::string& filename );
 
+	// file format used by save, load detects it
+	enum FileFormat { FORMAT_TEXT, FORMAT_BINARY };
+	void setFileFormat( FileFormat format, bool compress = true );
+	FileFormat fileFormat() const;
+
 	// item/object
 	bool findItem( const std::string& name );
 	bool findObject( const std::string& type = "" );
@@ -50,12 +59,18 @@ public:
 	void createItem( const std::string& name, const std::string& format, int size = -1 );
 	Storage& createObject( const std::string& type );
 	Storage& object();
+	// remove the current object from the tree, the caller owns it
+	Storage *detachObject();
 
 	// validate
 	bool checkFormat( const std::string& format ) const;
 	int arraySize() const;
 	bool isObject() const;
 	const std::string& objectType() const;
+	// data of binary files is decoded from the file on first access
+	bool hasMappedData() const;
+	// size of a data field, without decoding it
+	size_t dataSize( int id ) const;
 
 	// access fields
 	const std::string& stringField( int id );
@@ -79,17 +94,31 @@ public:
 	
 	// deletion
 	bool deleteObject( const std::string& type = "" );
+
+	// approximate heap usage in bytes
+	size_t memorySize() const;
 	
 	// error codes
 	enum ErrorCodes { EFAILEDOPENWRITE = 1, EFAILEDOPENREAD, EFAILSTOREOBJECT,
 	                  EITEMWITHOUTSEPARATOR, EBADITEMLINE, EBADITEMFORMAT,
 	                  EDATAFIELDEMPTY, EPREMATUREENDDATA, EINVALIDDATA,
 	                  EMISSINGDATAFATAL, EMISSINGDATANONFATAL, EINCORRECTDATATYPE,
-	                  EINCORRECTDATALENGTH, EPREMATUREENDARRAY };
+	                  EINCORRECTDATALENGTH, EPREMATUREENDARRAY,
+	                  EBADCONTAINER, EUNSUPPORTEDCONTAINER };
 	
 	
 private:
 	
+	// binary container helpers
+	class BinaryWriter;
+	class BinaryReader;
+	class TextReader;
+	// block of a mapped binary file
+	struct MappedData {
+		size_t offset, size, rawSize;
+		bool compressed;
+	};
+
 	class Item
 	{
 	public:
@@ -118,6 +147,10 @@ private:
 		int arraySize() const;
 		bool isObject() const;
 		Storage& object();
+		Storage *releaseObject();
+		bool hasMappedData() const;
+		size_t dataSize( int id ) const;
+		void loadMappedData();
 
 		// store fields
 		void setField( int id, const std::string& str );
@@ -130,8 +163,12 @@ private:
 		std::string& setDataField( int row, int id );
 		
 		// storage
-		int load( std::istream& f );
+		int load( TextReader& f );
 		int save( std::ostream& f );
+		int read( BinaryReader& r );
+		void write( BinaryWriter& w );
+
+		size_t memorySize() const;
 		
 	private:
 		// don't allow copy construction
@@ -147,9 +184,12 @@ private:
 
 		Storage *m_pObject;
 
+		// data fields still in a binary file
+		std::shared_ptr<MappedFile> m_pMap;
+		std::vector<MappedData> m_Mapped;
+		void resolve( int sid );
+
 		bool mustEncode( const std::string& str );
-		void base64encode( const std::string& str, std::ostream& f );
-		bool base64decode( const std::string& str, unsigned int p, std::string& result );
 
 
 	};
@@ -159,13 +199,29 @@ private:
 	std::vector<Item*> m_Items;
 	std::vector<Item*>::iterator m_itCurItem;
 	Item *m_CurItem;
+	// lookup of the first item by name and of object positions by type
+	std::unordered_map<std::string, unsigned int> m_ItemIndex;
+	std::unordered_map<std::string, std::vector<unsigned int> > m_ObjectIndex;
+	std::vector<unsigned int> m_Objects;
 	int m_VersionMajor, m_VersionMinor;
 	const Storage *m_pParent;
+	FileFormat m_FileFormat;
+	bool m_Compress;
 
-	int load( std::ifstream& f );
+	int loadText( std::istream& f );
+	int load( TextReader& f );
 	int save( std::ofstream& f );
+	static bool isBinaryFile( std::ifstream& f );
+	int loadBinary();
+	int saveBinary( std::ofstream& f );
+	int readDirectory( BinaryReader& r );
+	void writeDirectory( BinaryWriter& w );
+	void loadMappedData();
 	
 	void setParent( const Storage* s );
+	bool findObjectFrom( unsigned int pos, const std::string& type );
+	void indexItem( unsigned int pos );
+	void rebuildIndex();
 };
 
 } // namespace Polka
@@ -184,6 +240,10 @@ data
 data
 ....
 
+Strings are quoted with double quotes for quotes inside. Long strings
+and strings with control characters are written as base64 data, wrapped
+after 100 characters and ended by the padding or a single '='.
+
 
 Objects:
 
@@ -207,4 +267,33 @@ Level palettes/Level 1
 -PAL2
 
 
+Binary container:
+
+The same tree can be saved as a binary file for faster loading. All
+numbers are little endian.
+
+Header (32 bytes):
+  "POLKA2\x1aB"   magic
+  u32             container version (1)
+  u32             flags (0)
+  u64             directory offset
+  u64             directory size
+
+Data blocks follow the header, the directory comes last. A directory
+level starts with a u32 entry count. Each entry is:
+
+  u8 'O', u16 name length, name, directory level of the object
+  u8 'I', u16 name length, name, u16 format length, format,
+     i32 array size (-1 for no array),
+     fields per row: I = i32, F = f64, S = data reference
+
+Data references start with a u8 type:
+  0  empty field
+  1  inline: u32 size, bytes
+  2  block: u64 offset, u64 size
+  3  compressed block: u64 offset, u64 stored size, u64 size
+
+Loading maps the file into memory and leaves the blocks there until a
+field is accessed.
+
 */
@@ -0,0 +1,481 @@
+/*
+	Copyright (C) 2013 Edwin Velds
+
+    This file is part of Polka 2.
+
+    Polka 2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Polka 2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Polka 2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Storage.h"
+#include "Compression.h"
+#include "MappedFile.h"
+#include <cassert>
+#include <fstream>
+#include <cstring>
+#include <cstdint>
+
+namespace Polka {
+
+/*
+ * Binary container, see the format description in Storage.h
+ */
+
+static const char MAGIC[8] = { 'P', 'O', 'L', 'K', 'A', '2', '\x1a', 'B' };
+static const uint32_t CONTAINER_VERSION = 1;
+static const uint64_t HEADER_SIZE = 32;
+
+// data reference types
+enum { DATA_EMPTY = 0, DATA_INLINE, DATA_BLOCK, DATA_COMPRESSED };
+
+// fields up to this size stay in the directory
+static const size_t INLINE_DATA_SIZE = 256;
+
+static void putLE( std::string& dest, uint64_t v, int bytes )
+{
+	for( int i = 0; i < bytes; i++ ) {
+		dest += char(v & 255);
+		v >>= 8;
+	}
+}
+
+static uint64_t getLE( const unsigned char *p, int bytes )
+{
+	uint64_t v = 0;
+	for( int i = bytes-1; i >= 0; i-- )
+		v = (v << 8) | p[i];
+	return v;
+}
+
+
+/*
+ * Writer: the directory is built in memory while blocks go to the file
+ */
+
+class Storage::BinaryWriter
+{
+public:
+	BinaryWriter( std::ofstream& f, bool compress )
+		: m_File(f), m_Offset(HEADER_SIZE), m_Compress(compress) {}
+
+	void put8( unsigned int v ) { m_Dir += char(v); }
+	void put16( unsigned int v ) { putLE( m_Dir, v, 2 ); }
+	void put32( uint32_t v ) { putLE( m_Dir, v, 4 ); }
+	void put64( uint64_t v ) { putLE( m_Dir, v, 8 ); }
+
+	void putDouble( double v )
+	{
+		uint64_t bits;
+		memcpy( &bits, &v, 8 );
+		put64( bits );
+	}
+
+	void putString( const std::string& str )
+	{
+		put16( str.size() );
+		m_Dir += str;
+	}
+
+	void putData( const std::string& data )
+	{
+		if( data.size() <= INLINE_DATA_SIZE ) {
+			put8( DATA_INLINE );
+			put32( data.size() );
+			m_Dir += data;
+			return;
+		}
+		// compress into a block if it pays off
+		if( m_Compress && data.size() < 0xffffffffu ) {
+			compressData( data.data(), data.size(), m_Buffer );
+			if( m_Buffer.size() < data.size() ) {
+				put8( DATA_COMPRESSED );
+				put64( m_Offset );
+				put64( m_Buffer.size() );
+				put64( data.size() );
+				writeBlock( m_Buffer );
+				return;
+			}
+		}
+		put8( DATA_BLOCK );
+		put64( m_Offset );
+		put64( data.size() );
+		writeBlock( data );
+	}
+
+	uint64_t offset() const { return m_Offset; }
+	const std::string& directory() const { return m_Dir; }
+
+private:
+	std::ofstream& m_File;
+	std::string m_Dir, m_Buffer;
+	uint64_t m_Offset;
+	bool m_Compress;
+
+	void writeBlock( const std::string& data )
+	{
+		m_File.write( data.data(), data.size() );
+		m_Offset += data.size();
+	}
+};
+
+
+/*
+ * Reader: parses the directory of a mapped file, data blocks are
+ * referenced and decoded on first access
+ */
+
+class Storage::BinaryReader
+{
+public:
+	BinaryReader( const std::shared_ptr<MappedFile>& map, uint64_t dir_offset, uint64_t dir_size )
+		: m_pMap(map),
+		  m_pPos( reinterpret_cast<const unsigned char*>(map->data()) + dir_offset ),
+		  m_pEnd( m_pPos + dir_size ), m_BlocksEnd(dir_offset), m_Failed(false) {}
+
+	// reading past the end returns zeros and marks failure
+	uint64_t get( int bytes )
+	{
+		if( m_pEnd - m_pPos < bytes ) {
+			m_Failed = true;
+			m_pPos = m_pEnd;
+			return 0;
+		}
+		uint64_t v = getLE( m_pPos, bytes );
+		m_pPos += bytes;
+		return v;
+	}
+	unsigned int get8() { return get(1); }
+	unsigned int get16() { return get(2); }
+	uint32_t get32() { return get(4); }
+	uint64_t get64() { return get(8); }
+
+	double getDouble()
+	{
+		uint64_t bits = get64();
+		double v;
+		memcpy( &v, &bits, 8 );
+		return v;
+	}
+
+	void getString( std::string& str )
+	{
+		size_t len = get16();
+		if( size_t(m_pEnd - m_pPos) < len ) {
+			m_Failed = true;
+			len = m_pEnd - m_pPos;
+		}
+		str.assign( reinterpret_cast<const char*>(m_pPos), len );
+		m_pPos += len;
+	}
+
+	// inline data is copied, blocks only referenced
+	int getData( unsigned int type, std::string& data, MappedData& ref )
+	{
+		ref.offset = 0;
+		switch( type ) {
+			case DATA_INLINE:
+			{
+				size_t len = get32();
+				if( size_t(m_pEnd - m_pPos) < len ) return EPREMATUREENDDATA;
+				data.assign( reinterpret_cast<const char*>(m_pPos), len );
+				m_pPos += len;
+				return 0;
+			}
+			case DATA_BLOCK:
+			case DATA_COMPRESSED:
+			{
+				uint64_t offset = get64();
+				uint64_t size = get64();
+				uint64_t rawSize = type == DATA_COMPRESSED ? get64() : size;
+				if( m_Failed ) return EPREMATUREENDDATA;
+				if( offset < HEADER_SIZE || offset > m_BlocksEnd || size > m_BlocksEnd - offset )
+					return EBADCONTAINER;
+				// no block expands beyond 256 times its stored size
+				if( rawSize / 256 > size ) return EBADCONTAINER;
+				if( size == 0 ) return 0;
+				ref.offset = offset;
+				ref.size = size;
+				ref.rawSize = rawSize;
+				ref.compressed = type == DATA_COMPRESSED;
+				return 0;
+			}
+			default:
+				return EINVALIDDATA;
+		}
+	}
+
+	const std::shared_ptr<MappedFile>& map() const { return m_pMap; }
+	size_t remaining() const { return m_pEnd - m_pPos; }
+	bool failed() const { return m_Failed; }
+
+private:
+	std::shared_ptr<MappedFile> m_pMap;
+	const unsigned char *m_pPos, *m_pEnd;
+	uint64_t m_BlocksEnd;
+	bool m_Failed;
+};
+
+
+/*
+ * Storage
+ */
+
+bool Storage::isBinaryFile( std::ifstream& f )
+{
+	char magic[sizeof(MAGIC)];
+	f.read( magic, sizeof(MAGIC) );
+	bool binary = f && memcmp( magic, MAGIC, sizeof(MAGIC) ) == 0;
+	f.clear();
+	f.seekg( 0 );
+	return binary;
+}
+
+int Storage::loadBinary()
+{
+	std::shared_ptr<MappedFile> map = std::make_shared<MappedFile>();
+	if( !map->open( m_FileName ) ) return EFAILEDOPENREAD;
+	if( map->size() < HEADER_SIZE ) return EBADCONTAINER;
+
+	// header
+	const unsigned char *header = reinterpret_cast<const unsigned char*>(map->data());
+	if( getLE( header+8, 4 ) > CONTAINER_VERSION ) return EUNSUPPORTEDCONTAINER;
+	uint64_t dirOffset = getLE( header+16, 8 );
+	uint64_t dirSize = getLE( header+24, 8 );
+
+	// directory must fit in the file
+	if( dirOffset < HEADER_SIZE || dirOffset > map->size() || dirSize > map->size() - dirOffset )
+		return EBADCONTAINER;
+
+	BinaryReader r( map, dirOffset, dirSize );
+	return readDirectory( r );
+}
+
+int Storage::saveBinary( std::ofstream& f )
+{
+	// header is completed after the blocks are written
+	char header[HEADER_SIZE];
+	memset( header, 0, HEADER_SIZE );
+	f.write( header, HEADER_SIZE );
+
+	BinaryWriter w( f, m_Compress );
+	writeDirectory( w );
+	f.write( w.directory().data(), w.directory().size() );
+
+	std::string head( MAGIC, sizeof(MAGIC) );
+	putLE( head, CONTAINER_VERSION, 4 );
+	putLE( head, 0, 4 );
+	putLE( head, w.offset(), 8 );
+	putLE( head, w.directory().size(), 8 );
+	f.seekp( 0 );
+	f.write( head.data(), head.size() );
+	return f ? 0 : EFAILEDOPENWRITE;
+}
+
+int Storage::readDirectory( BinaryReader& r )
+{
+	uint32_t count = r.get32();
+	// every entry takes at least three bytes
+	if( count > r.remaining()/3 ) return EPREMATUREENDDATA;
+
+	std::string name, format;
+	for( uint32_t i = 0; i < count; i++ ) {
+		unsigned int type = r.get8();
+		r.getString( name );
+		if( r.failed() ) return EPREMATUREENDDATA;
+		if( name.empty() ) return EBADITEMLINE;
+
+		if( type == 'O' ) {
+			Storage& subS = createObject( name );
+			int err = subS.readDirectory( r );
+			if( err ) return err;
+		} else if( type == 'I' ) {
+			r.getString( format );
+			if( r.failed() ) return EPREMATUREENDDATA;
+			// validate before the item asserts on it
+			std::string fields = format;
+			if( !fields.empty() && fields[0] == '[' ) {
+				if( fields.size() < 3 || fields[fields.size()-1] != ']' ) return EBADITEMFORMAT;
+				fields = fields.substr( 1, fields.size()-2 );
+			}
+			if( fields.empty() || fields.find_first_not_of("IFS") != std::string::npos )
+				return EBADITEMFORMAT;
+			createItem( name, format );
+			int err = m_CurItem->read( r );
+			if( err ) return err;
+		} else
+			return EINVALIDDATA;
+	}
+	return 0;
+}
+
+void Storage::loadMappedData()
+{
+	for( unsigned int i = 0; i < m_Items.size(); i++ )
+		m_Items[i]->loadMappedData();
+}
+
+void Storage::writeDirectory( BinaryWriter& w )
+{
+	w.put32( m_Items.size() );
+	for( unsigned int i = 0; i < m_Items.size(); i++ ) {
+		Item *item = m_Items[i];
+		if( item->isObject() ) {
+			w.put8( 'O' );
+			w.putString( item->name() );
+			item->object().writeDirectory( w );
+		} else {
+			w.put8( 'I' );
+			w.putString( item->name() );
+			w.putString( item->format() );
+			item->write( w );
+		}
+	}
+}
+
+
+/*
+ * Item
+ */
+
+int Storage::Item::read( BinaryReader& r )
+{
+	int rows = int32_t( r.get32() );
+	if( r.failed() ) return EPREMATUREENDDATA;
+	if( (rows < 0) != (m_ArraySize < 0) ) return EINCORRECTDATATYPE;
+	if( rows < -1 ) return EINVALIDDATA;
+	if( rows > 0 ) {
+		// every field takes at least one byte
+		if( size_t(rows) > r.remaining()/m_Format.size() ) return EPREMATUREENDARRAY;
+		forceArraySize( rows );
+	}
+
+	int num = m_Format.size() * (rows < 0 ? 1 : rows);
+	for( int i = 0; i < num; i++ ) {
+		int id = i%m_Format.size(), row = i/m_Format.size();
+		char *field = m_pData + row*m_RowSize + m_FieldLocs[id];
+		switch( m_Format[id] ) {
+			case 'I':
+			{
+				int v = int32_t( r.get32() );
+				memcpy( field, &v, sizeof(int) );
+				break;
+			}
+			case 'F':
+			{
+				double v = r.getDouble();
+				memcpy( field, &v, sizeof(double) );
+				break;
+			}
+			default:
+			{
+				unsigned int type = r.get8();
+				if( type == DATA_EMPTY ) break;
+				int sid = m_Data.size();
+				memcpy( field, &sid, sizeof(int) );
+				m_Data.push_back( std::string() );
+				MappedData ref;
+				int err = r.getData( type, m_Data.back(), ref );
+				if( err ) return err;
+				if( ref.offset ) {
+					m_Mapped.resize( sid+1 );
+					m_Mapped[sid] = ref;
+					m_pMap = r.map();
+				}
+			}
+		}
+	}
+	return r.failed() ? EPREMATUREENDDATA : 0;
+}
+
+bool Storage::Item::hasMappedData() const
+{
+	for( unsigned int i = 0; i < m_Mapped.size(); i++ )
+		if( m_Mapped[i].offset ) return true;
+	return false;
+}
+
+size_t Storage::Item::dataSize( int id ) const
+{
+	assert( id < int(m_Format.size()) );
+	assert( m_Format[id] == 'S' );
+	int sid = *(int *)(m_pData + m_FieldLocs[id]);
+	if( sid == -1 ) return 0;
+	// mapped blocks know their decoded size from the directory
+	if( sid < int(m_Mapped.size()) && m_Mapped[sid].offset )
+		return m_Mapped[sid].rawSize;
+	return m_Data[sid].size();
+}
+
+void Storage::Item::loadMappedData()
+{
+	for( unsigned int i = 0; i < m_Mapped.size(); i++ )
+		resolve( i );
+	if( m_pObject ) m_pObject->loadMappedData();
+}
+
+void Storage::Item::resolve( int sid )
+{
+	if( sid >= int(m_Mapped.size()) || !m_Mapped[sid].offset ) return;
+	MappedData& ref = m_Mapped[sid];
+	const char *block = m_pMap->data() + ref.offset;
+	if( ref.compressed ) {
+		// invalid data or a size not matching the directory leaves the field empty
+		if( !decompressData( block, ref.size, m_Data[sid], ref.rawSize ) )
+			m_Data[sid].clear();
+	} else
+		m_Data[sid].assign( block, ref.size );
+	ref.offset = 0;
+	// release the file with the last field
+	if( !hasMappedData() ) {
+		m_Mapped.clear();
+		m_pMap.reset();
+	}
+}
+
+void Storage::Item::write( BinaryWriter& w )
+{
+	w.put32( m_ArraySize );
+
+	int num = m_Format.size() * (m_ArraySize < 0 ? 1 : m_ArraySize);
+	for( int i = 0; i < num; i++ ) {
+		int id = i%m_Format.size(), row = i/m_Format.size();
+		const char *field = m_pData + row*m_RowSize + m_FieldLocs[id];
+		switch( m_Format[id] ) {
+			case 'I':
+			{
+				int v;
+				memcpy( &v, field, sizeof(int) );
+				w.put32( v );
+				break;
+			}
+			case 'F':
+			{
+				double v;
+				memcpy( &v, field, sizeof(double) );
+				w.putDouble( v );
+				break;
+			}
+			default:
+			{
+				int sid;
+				memcpy( &sid, field, sizeof(int) );
+				if( sid == -1 )
+					w.put8( DATA_EMPTY );
+				else
+					w.putData( m_Data[sid] );
+			}
+		}
+	}
+}
+
+} // namespace Polka
@@ -19,6 +19,7 @@
 
 #include "StorageHelpers.h"
 #include "Storage.h"
+#include "Compression.h"
 
 namespace Polka {
 	
@@ -82,5 +83,22 @@ void storageSetObjectName( Storage& s, const std::string& name )
 	s.setField( 0, name );
 }
 
+void storageSetPackedData( Storage& s, const std::string& name, const char *data, size_t size )
+{
+	s.createItem( name, "S" );
+	std::string& dat = s.setDataField(0);
+	compressData( data, size, dat );
+	// data is kept for a long time, drop spare capacity
+	dat.shrink_to_fit();
+}
+
+bool storageGetPackedData( Storage& s, const std::string& name, std::string& data )
+{
+	if( s.findItem( name ) )
+		if( s.checkFormat("S") )
+			return decompressData( s.dataField(0), data );
+	return false;
+}
+
 
 }
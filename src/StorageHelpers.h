@@ -44,6 +44,10 @@ void storageSetRect( Storage& s, const std::string& name, const Gdk::Rectangle&
 bool storageGetRect( Storage& s, const std::string& name, Gdk::Rectangle& rect );
 void storageSetObjectName( Storage& s, const std::string& name );
 
+// binary data kept compressed in memory
+void storageSetPackedData( Storage& s, const std::string& name, const char *data, size_t size );
+bool storageGetPackedData( Storage& s, const std::string& name, std::string& data );
+
 } // namespace Polka
 
 #endif // _POLKA_STORAGEHELPERS_H_
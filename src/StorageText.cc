@@ -0,0 +1,517 @@
+/*
+	Copyright (C) 2013 Edwin Velds
+
+    This file is part of Polka 2.
+
+    Polka 2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Polka 2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Polka 2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Storage.h"
+#include "Base64.h"
+#include <istream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <climits>
+#include <cfloat>
+
+namespace Polka {
+
+/*
+ * Text format parser
+ *
+ *   The file is read in large blocks and lines are handled as slices
+ *   of the block buffer. The results are the same as reading each line
+ *   with getline and converting fields with string streams.
+ */
+
+static const size_t npos = std::string::npos;
+static const size_t TEXT_BLOCK_SIZE = 1 << 20;
+
+// part of a line in the read buffer
+struct TextSlice
+{
+	const char *p;
+	size_t size;
+
+	TextSlice() : p(0), size(0) {}
+	TextSlice( const char *_p, size_t _size ) : p(_p), size(_size) {}
+
+	// zero past the end like std::string
+	char operator[]( size_t i ) const { return i < size ? p[i] : '\0'; }
+	bool empty() const { return size == 0; }
+
+	size_t find( char c, size_t from ) const
+	{
+		if( from >= size ) return npos;
+		const char *r = static_cast<const char*>( memchr( p+from, c, size-from ) );
+		return r ? r-p : npos;
+	}
+
+	// skip " \t\r\n"
+	size_t skipSpaces( size_t from ) const
+	{
+		for( size_t i = from; i < size; i++ )
+			if( p[i] != ' ' && p[i] != '\t' && p[i] != '\r' && p[i] != '\n' )
+				return i;
+		return npos;
+	}
+
+	TextSlice trim() const
+	{
+		size_t b = skipSpaces(0);
+		if( b == npos ) return TextSlice( p, 0 );
+		size_t e = size;
+		while( p[e-1] == ' ' || p[e-1] == '\t' || p[e-1] == '\r' || p[e-1] == '\n' ) e--;
+		return TextSlice( p+b, e-b );
+	}
+
+	std::string str( size_t from, size_t len = npos ) const
+	{
+		if( from > size ) from = size;
+		return std::string( p+from, std::min( len, size-from ) );
+	}
+};
+
+
+/*
+ * Reader with getline, peek and eof like an istream
+ */
+
+class Storage::TextReader
+{
+public:
+	TextReader( std::istream& f )
+		: m_File(f), m_Buffer(TEXT_BLOCK_SIZE), m_Pos(0), m_End(0),
+		  m_Eof(false), m_FileDone(false) {}
+
+	bool eof() const { return m_Eof; }
+
+	int peek()
+	{
+		if( m_Pos == m_End && !fill() ) {
+			m_Eof = true;
+			return EOF;
+		}
+		return (unsigned char)m_Buffer[m_Pos];
+	}
+
+	// the line stays valid until the next read
+	void getLine( TextSlice& line )
+	{
+		size_t scan = m_Pos;
+		while( true ) {
+			const char *base = &m_Buffer[0];
+			const char *nl = static_cast<const char*>( memchr( base+scan, '\n', m_End-scan ) );
+			if( nl ) {
+				line = TextSlice( base+m_Pos, nl-base-m_Pos );
+				m_Pos = nl-base+1;
+				return;
+			}
+			// line continues in the next block
+			scan = m_End - m_Pos;
+			if( !fill() ) {
+				line = TextSlice( &m_Buffer[0]+m_Pos, m_End-m_Pos );
+				m_Pos = m_End;
+				m_Eof = true;
+				return;
+			}
+			scan += m_Pos;
+		}
+	}
+
+	// distance to the next c in the buffer or npos
+	size_t distanceTo( char c, const char *from ) const
+	{
+		const char *end = &m_Buffer[0] + m_End;
+		if( from < &m_Buffer[0] || from >= end ) return npos;
+		const char *r = static_cast<const char*>( memchr( from, c, end-from ) );
+		return r ? r-from : npos;
+	}
+
+private:
+	std::istream& m_File;
+	std::vector<char> m_Buffer;
+	size_t m_Pos, m_End;
+	bool m_Eof, m_FileDone;
+
+	bool fill()
+	{
+		if( m_FileDone ) return false;
+		// keep the unread part
+		if( m_Pos > 0 ) {
+			memmove( &m_Buffer[0], &m_Buffer[m_Pos], m_End-m_Pos );
+			m_End -= m_Pos;
+			m_Pos = 0;
+		}
+		// grow for very long lines
+		if( m_End == m_Buffer.size() )
+			m_Buffer.resize( 2*m_Buffer.size() );
+		m_File.read( &m_Buffer[m_End], m_Buffer.size()-m_End );
+		size_t n = m_File.gcount();
+		if( n == 0 ) {
+			m_FileDone = true;
+			return false;
+		}
+		m_End += n;
+		return true;
+	}
+};
+
+
+/*
+ * Number conversion without allocation
+ */
+
+static inline bool isStreamSpace( char c )
+{
+	return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// same result as extracting an int from a string stream
+static int parseInt( const char *p, const char *end )
+{
+	while( p < end && isStreamSpace(*p) ) p++;
+	bool neg = false;
+	if( p < end && (*p == '+' || *p == '-') ) {
+		neg = *p == '-';
+		p++;
+	}
+	long long v = 0;
+	bool digits = false;
+	while( p < end && *p >= '0' && *p <= '9' ) {
+		// saturate, out of range values are clamped
+		if( v <= INT_MAX ) v = 10*v + (*p - '0');
+		digits = true;
+		p++;
+	}
+	if( !digits ) return 0;
+	if( neg ) v = -v;
+	if( v < INT_MIN ) return INT_MIN;
+	if( v > INT_MAX ) return INT_MAX;
+	return int(v);
+}
+
+// same result as extracting a double from a string stream, values
+// that can't be converted exactly here go through the stream
+static double parseDouble( const char *start, const char *end )
+{
+	static const double POW10[23] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+	const char *p = start;
+	while( p < end && isStreamSpace(*p) ) p++;
+	bool neg = false;
+	if( p < end && (*p == '+' || *p == '-') ) {
+		neg = *p == '-';
+		p++;
+	}
+	// accept the characters the stream would
+	uint64_t mant = 0;
+	int digits = 0, exp10 = 0, expVal = 0;
+	bool mantissa = false, dec = false, sci = false, expNeg = false, expDigits = false;
+	bool exact = true;
+	while( p < end ) {
+		char c = *p;
+		if( c >= '0' && c <= '9' ) {
+			if( sci ) {
+				if( expVal < 10000 ) expVal = 10*expVal + (c-'0');
+				expDigits = true;
+			} else {
+				mantissa = true;
+				if( mant == 0 && c == '0' ) {
+					if( dec ) exp10--;
+				} else if( digits < 19 ) {
+					mant = 10*mant + (c-'0');
+					digits++;
+					if( dec ) exp10--;
+				} else
+					exact = false;
+			}
+		} else if( c == '.' && !dec && !sci ) {
+			dec = true;
+		} else if( (c == 'e' || c == 'E') && !sci && mantissa ) {
+			sci = true;
+			if( p+1 < end && (p[1] == '+' || p[1] == '-') ) {
+				expNeg = p[1] == '-';
+				p++;
+			}
+		} else
+			break;
+		p++;
+	}
+	// incomplete numbers fail
+	if( !mantissa || (sci && !expDigits) ) return 0.0;
+	if( mant == 0 ) return neg ? -0.0 : 0.0;
+
+	int e = exp10 + (expNeg ? -expVal : expVal);
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+	if( exact && mant <= (uint64_t(1) << 53) && e >= -22 && e <= 22 ) {
+		// single rounding, same as strtod
+		double v = double(mant);
+		v = e < 0 ? v / POW10[-e] : v * POW10[e];
+		return neg ? -v : v;
+	}
+#endif
+	std::istringstream ss( std::string( start, end ) );
+	double r;
+	ss >> r;
+	return r;
+}
+
+
+/*
+ * base64
+ *
+ *   Decode from p to the end marker into the end of result. Quads don't
+ *   span lines, only whitespace may separate them.
+ */
+
+static bool base64decode( const TextSlice& str, size_t p, std::string& result )
+{
+	if( p >= str.size ) return true;
+	// room for all quads
+	size_t start = result.size();
+	result.resize( start + (str.size-p)/4*3 );
+	char *out = &result[0] + start;
+	const char *s = str.p;
+	bool ok = true;
+
+	while( p < str.size ) {
+		// runs of full quads
+		size_t n = base64DecodeQuads( s+p, str.size-p, out );
+		p += n;
+		out += n/4*3;
+		if( p == str.size || s[p] == '=' ) break;
+		if( s[p] == ' ' || s[p] == '\t' || s[p] == '\r' ) {
+			// skip whitespace
+			p++;
+			continue;
+		}
+		// only a padded quad may remain
+		if( str.size - p < 4 || base64Value( s[p] ) < 0 || base64Value( s[p+1] ) < 0 ) {
+			ok = false;
+			break;
+		}
+		int val = (base64Value( s[p] ) << 18) | (base64Value( s[p+1] ) << 12);
+		if( s[p+2] == '=' ) {
+			*out++ = char(val >> 16);
+		} else if( base64Value( s[p+2] ) >= 0 && s[p+3] == '=' ) {
+			val |= base64Value( s[p+2] ) << 6;
+			*out++ = char(val >> 16);
+			*out++ = char(val >> 8);
+		} else
+			ok = false;
+		break;
+	}
+	result.resize( out - result.data() );
+	return ok;
+}
+
+
+/*
+ * Storage
+ */
+
+int Storage::loadText( std::istream& f )
+{
+	TextReader reader( f );
+	return load( reader );
+}
+
+int Storage::load( TextReader& f )
+{
+	TextSlice buf;
+	while( !f.eof() ) {
+		// get a full line
+		f.getLine( buf );
+		buf = buf.trim();
+		// check possibilites
+		if( buf.empty() ) {
+			// empty line, skip
+			continue;
+		} else if( buf[0] == '*' ) {
+			// found name record
+			size_t n = buf.find( ':', 0 );
+			if( n == npos ) {
+				// no format separator
+				return EITEMWITHOUTSEPARATOR;
+			}
+			std::string name = buf.str( 1, n-1 );
+			std::string format = buf.str( n+1 );
+			// check string sizes
+			if( !name.size() || !format.size() ) return EBADITEMLINE;
+			// create item first and check format result
+			createItem( name, format );
+			if( !m_CurItem->format().size() ) return EBADITEMFORMAT;
+			// read item
+			int err = m_CurItem->load(f);
+			if( err ) return err;
+			
+		} else if( buf[0] == '+' ) {
+			// found object
+			std::string type = TextSlice( buf.p+1, buf.size-1 ).trim().str(0);
+			Storage& subS = createObject( type );
+			int err = subS.load( f );
+			if( err ) return err;
+		} else if( buf[0] == '-' ) {
+			// found object end marker
+			return 0;
+		} else {
+			// found garbage => error
+			return EINVALIDDATA;
+		}
+	}
+	
+	return 0;
+}
+
+
+/*
+ * Item
+ */
+
+int Storage::Item::load( TextReader& f )
+{
+	// read items according to format
+	int fld = 0, numFields = m_Format.size();
+	// array can be empty
+	if( m_ArraySize >= 0 ) {
+		// peek next line for non data character
+		int c = f.peek();
+		if( c == '+' || c == '*' || c == '-')
+			numFields = 0;
+	}
+
+	TextSlice line;
+	size_t ptr = 0;
+	while( fld < numFields ) {
+		// skip white space
+		if( ptr >= line.size || (ptr = line.skipSpaces(ptr)) == npos ) {
+			// load next line from file
+			if( f.eof() ) return EPREMATUREENDARRAY;
+			f.getLine( line );
+			// check if field is not name/object
+			if( line[0] == '*' || line[0] == '+' )
+				return EPREMATUREENDARRAY;
+			// start 
+			ptr = line.skipSpaces(0);
+			// error if no data found
+			if( ptr == npos )
+				return EPREMATUREENDARRAY;
+		}
+		// store field
+		int id = fld%m_Format.size(), row = fld/m_Format.size();
+		switch( m_Format[id] ) {
+			case 'I':
+			{
+				size_t pos = line.find( ',', ptr );
+				int r = parseInt( line.p + ptr, line.p + (pos == npos ? line.size : pos) );
+				if( m_ArraySize == -1 )
+					setField( id, r );
+				else
+					setField( row, id, r );
+				ptr = pos;
+				break;
+			}
+			case 'F':
+			{
+				size_t pos = line.find( ',', ptr );
+				double r = parseDouble( line.p + ptr, line.p + (pos == npos ? line.size : pos) );
+				if( m_ArraySize == -1 )
+					setField( id, r );
+				else
+					setField( row, id, r );
+				ptr = pos;
+				break;
+			}
+			default:
+				// string/data
+				std::string& str = m_ArraySize==-1?setDataField(id):setDataField(row, id);
+				if( line[ptr] == '"' ) {
+					// create string
+					ptr++;
+					while(true) {
+						// find quotes or end of line
+						size_t end = line.find( '"', ptr );
+					
+						if( end == npos ) {
+							// end of line, copy everything
+							if( ptr < line.size ) str.append( line.p+ptr, line.size-ptr );
+							str += '\n';
+							// and continue on next line
+							if( f.eof() ) return EPREMATUREENDDATA;
+							f.getLine( line );
+							ptr = 0;
+						} else if( end == line.size-1 || line[end+1] != '"' ) {
+							// end of string found
+							str.append( line.p+ptr, end-ptr );
+							ptr = end+1;
+							break;
+						} else {
+							// double quote
+							str.append( line.p+ptr, 1+end-ptr );
+							ptr = end+2;
+						}
+						
+					}
+				} else {
+					// create data, reserve up to the end marker
+					size_t dist = f.distanceTo( '=', line.p+ptr );
+					if( dist != npos ) str.reserve( str.size() + dist/4*3 + 3 );
+					size_t end;
+					while(true) {
+						if( !base64decode( line, ptr, str ) )
+							return EINVALIDDATA;
+						end = line.find( '=', ptr );
+						if( end != npos ) {
+							ptr = end+1;
+							while( line[ptr] == '=' ) ptr++;
+							break;
+						}
+						// get next line
+						if( f.eof() ) return EPREMATUREENDDATA;
+						f.getLine( line );
+						ptr = 0;
+					}
+				}
+		}
+
+		// field done
+		fld++;
+		// ptr after field, more data?
+		ptr = line.skipSpaces( ptr );
+		if( ptr == npos ) 
+			break;
+
+		// more data
+		ptr++;
+		
+		// extend field count for arrays
+		if( fld == numFields )
+			if( m_ArraySize >= 0 )
+				numFields += m_Format.size();
+	}
+	
+	if( fld != numFields )
+		return EPREMATUREENDDATA;
+	
+	return 0;
+}
+
+} // namespace Polka
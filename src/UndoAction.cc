@@ -27,7 +27,7 @@
 namespace Polka {
 
 UndoAction::UndoAction( UndoHistory& hist, guint32 suid )
-	: m_History( hist )
+	: m_History( hist ), m_MemorySize(0), m_Complete(false), m_UserActionMemorySize(0)
 {
 	m_SourceId = suid;
 	m_UndoStorage.setFileIdentification("", m_History.m_VersionMajor, m_History.m_VersionMinor);
@@ -36,7 +36,7 @@ UndoAction::UndoAction( UndoHistory& hist, guint32 suid )
 }
 
 UndoAction::UndoAction( UndoHistory& hist )
-	: m_History( hist )
+	: m_History( hist ), m_MemorySize(0), m_Complete(false), m_UserActionMemorySize(0)
 {
 	m_History.registerAction(this);
 }
@@ -117,6 +117,20 @@ Storage& UndoAction::redoData()
 	return m_RedoStorage;
 }
 
+size_t UndoAction::memorySize() const
+{
+	if( m_Complete && m_MemorySize ) return m_MemorySize;
+	m_MemorySize = sizeof(UndoAction) + m_Name.bytes() + m_UserActionName.bytes()
+	             + m_UndoId.capacity() + m_RedoId.capacity()
+	             + m_UndoStorage.memorySize() + m_RedoStorage.memorySize();
+	return m_MemorySize;
+}
+
+size_t UndoAction::userActionMemorySize() const
+{
+	return m_UserActionMemorySize;
+}
+
 void UndoAction::undo( Project& project )
 {
 	if( m_SourceId ) {
@@ -57,6 +57,10 @@ public:
 	Storage& undoData();
 	Storage& redoData();
 
+	// memory used by the action, and by the whole user action it starts
+	size_t memorySize() const;
+	size_t userActionMemorySize() const;
+
 protected:	
 	UndoAction( UndoHistory& hist, guint32 source );
 	UndoAction( UndoHistory& hist );
@@ -75,6 +79,10 @@ private:
 
 	std::string m_UndoId, m_RedoId;
 	Storage m_UndoStorage, m_RedoStorage;
+	// size is cached once no more data can be added
+	mutable size_t m_MemorySize;
+	bool m_Complete;
+	size_t m_UserActionMemorySize;
 };
 
 } // namespace Polka
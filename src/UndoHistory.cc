@@ -32,7 +32,8 @@ namespace Polka {
 
 
 UndoHistory::UndoHistory( Project& project, int major, int minor )
-	: m_Project(project), m_VersionMajor(major), m_VersionMinor(minor)
+	: m_Project(project), m_VersionMajor(major), m_VersionMinor(minor),
+	  m_MemoryBudget(0), m_MemoryUsage(0)
 {
 	m_UndoPointName = "ERROR";
 }
@@ -102,6 +103,13 @@ void UndoHistory::registerAction( UndoAction* action )
 	if( m_RedoActions.size() )
 		clearRedoHistory();
 
+	// previous action can't receive data anymore
+	if( m_UndoActions.size() )
+		m_UndoActions.back()->m_Complete = true;
+	// check budget before a new user action starts
+	if( !m_UndoPointName.empty() )
+		updateMemoryUsage();
+
 	// add to undo history
 	m_UndoActions.push_back( action );
 	if( !m_UndoPointName.empty() ) {
@@ -153,6 +161,66 @@ void UndoHistory::redo()
 
 
 
+void UndoHistory::setMemoryBudget( size_t bytes )
+{
+	m_MemoryBudget = bytes;
+	updateMemoryUsage();
+}
+
+size_t UndoHistory::memoryBudget() const
+{
+	return m_MemoryBudget;
+}
+
+size_t UndoHistory::memoryUsage() const
+{
+	return m_MemoryUsage;
+}
+
+void UndoHistory::updateMemoryUsage()
+{
+	// sum actions per user action in history order, redo actions
+	// are stored last first
+	std::vector<UndoAction*> actions( m_UndoActions );
+	actions.insert( actions.end(), m_RedoActions.rbegin(), m_RedoActions.rend() );
+	UndoAction *user = 0;
+	m_MemoryUsage = 0;
+	for( unsigned int i = 0; i < actions.size(); i++ ) {
+		size_t size = actions[i]->memorySize();
+		if( actions[i]->isUserAction() ) {
+			user = actions[i];
+			user->m_UserActionMemorySize = 0;
+		}
+		if( user ) user->m_UserActionMemorySize += size;
+		m_MemoryUsage += size;
+	}
+
+	// drop the oldest user actions until within budget, the last one
+	// always remains
+	if( m_MemoryBudget ) {
+		while( m_MemoryUsage > m_MemoryBudget ) {
+			unsigned int users = 0;
+			for( unsigned int i = 0; i < m_UndoActions.size() && users < 2; i++ )
+				if( m_UndoActions[i]->isUserAction() ) users++;
+			if( users < 2 ) break;
+			dropOldestUndo();
+		}
+	}
+	m_SignalHistoryChanged.emit( CHANGE_MEMORY );
+}
+
+void UndoHistory::dropOldestUndo()
+{
+	// remove the first user action with its sub actions
+	unsigned int n = 1;
+	while( n < m_UndoActions.size() && !m_UndoActions[n]->isUserAction() ) n++;
+	for( unsigned int i = 0; i < n; i++ ) {
+		m_MemoryUsage -= m_UndoActions[i]->memorySize();
+		delete m_UndoActions[i];
+	}
+	m_UndoActions.erase( m_UndoActions.begin(), m_UndoActions.begin() + n );
+	m_SignalHistoryChanged.emit( CHANGE_DROPUNDO );
+}
 
 } // namespace ...
 
@@ -48,8 +48,14 @@ public:
 	void undo();
 	void redo();
 
+	// memory limit in bytes, 0 for no limit
+	void setMemoryBudget( size_t bytes );
+	size_t memoryBudget() const;
+	size_t memoryUsage() const;
+	void updateMemoryUsage();
+
 	enum ChangeType { CHANGE_UNDOACTION, CHANGE_REDOACTION, CHANGE_ADDUNDO,
-	                  CHANGE_ALLUNDO, CHANGE_ALLREDO };
+	                  CHANGE_ALLUNDO, CHANGE_ALLREDO, CHANGE_DROPUNDO, CHANGE_MEMORY };
 
 	typedef sigc::signal<void, ChangeType> SignalHistoryChanged;
 	SignalHistoryChanged signalHistoryChanged();
@@ -62,10 +68,12 @@ private:
 	int m_VersionMajor, m_VersionMinor;
 	Glib::ustring m_UndoPointName;
 	Glib::RefPtr<Gdk::Pixbuf> m_refUndoPointIcon;
+	size_t m_MemoryBudget, m_MemoryUsage;
 
 	friend class UndoAction;
 	
 	void registerAction( UndoAction* action );
+	void dropOldestUndo();
 };
 
 } // namespace Polka
@@ -0,0 +1,181 @@
+/*
+	Copyright (C) 2013 Edwin Velds
+
+    This file is part of Polka 2.
+
+    Polka 2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Polka 2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Polka 2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "AccuracyChecks.h"
+#include "ColorDistance.h"
+#include <algorithm>
+#include <vector>
+#include <cmath>
+#include <climits>
+
+namespace Polka {
+
+// fixed seeds so every run checks the same colours
+static const int ERROR_PAIRS = 500000;
+static const int NEAREST_COLORS = 50000;
+static const int PALETTES = 50;
+
+class CheckRandom
+{
+public:
+	CheckRandom( unsigned int seed ) : m_Seed(seed) {}
+	int operator()( int n )
+	{
+		m_Seed = m_Seed * 1103515245u + 12345u;
+		return int( (m_Seed >> 16) % n );
+	}
+private:
+	unsigned int m_Seed;
+};
+
+/*
+ * ColorDistance reference, the double precision code it replaced
+ */
+
+static void refRgbToLab( int ri, int gi, int bi, int cd, int cr, double& L, double& a, double& b )
+{
+	// convert rgb range to 0.0 - 1.0
+	double R = double(ri-cd)/cr;
+	double G = double(gi-cd)/cr;
+	double B = double(bi-cd)/cr;
+	// first convert to XYZ
+	R = R>0.04045 ? pow((R+0.055)/1.055,2.4) : R/12.92;
+	G = G>0.04045 ? pow((G+0.055)/1.055,2.4) : G/12.92;
+	B = B>0.04045 ? pow((B+0.055)/1.055,2.4) : B/12.92;
+	double x = (R*41.24 + G*35.75 + B*18.05) / 95.047;
+	double y = (R*21.26 + G*71.52 + B* 7.22) / 100.0;
+	double z = (R* 1.93 + G*11.92 + B*95.05) / 108.883;
+	// now convert to Lab
+	x = x > 0.008856 ? pow(x, 1.0/3.0) : 7.787*x+16.0/116.0;
+	y = y > 0.008856 ? pow(y, 1.0/3.0) : 7.787*y+16.0/116.0;
+	z = z > 0.008856 ? pow(z, 1.0/3.0) : 7.787*z+16.0/116.0;
+	L = 116.0*y-16.0;
+	a = 500.0*(x-y);
+	b = 200.0*(y-z);
+}
+
+static int refLabError( double L1, double a1, double b1, double L2, double a2, double b2 )
+{
+	double C1 = sqrt(a1*a1+b1*b1), C2 = sqrt(a2*a2+b2*b2);
+	double deltaC = C1-C2;
+	double deltaL = L1-L2, deltaa = a1-a2, deltab = b1-b2;
+	double deltaH2 = deltaa*deltaa+deltab*deltab-deltaC*deltaC;
+	double deltaH = deltaH2>0.0 ? sqrt(deltaH2) : 0.0;
+	double deltaCK = deltaC/(1+0.045*C1), deltaHK = deltaH/(1+0.015*C1);
+	double deltaE2 = deltaL*deltaL + deltaCK*deltaCK + deltaHK*deltaHK;
+	return round(deltaE2*75);
+}
+
+static int refError( bool perceptual, int cd, int cr, const int *c1, const int *c2 )
+{
+	if( !perceptual )
+		return (c2[0]-c1[0])*(c2[0]-c1[0]) + (c2[1]-c1[1])*(c2[1]-c1[1]) + (c2[2]-c1[2])*(c2[2]-c1[2]);
+	double L1, a1, b1, L2, a2, b2;
+	refRgbToLab( c1[0], c1[1], c1[2], cd, cr, L1, a1, b1 );
+	refRgbToLab( c2[0], c2[1], c2[2], cd, cr, L2, a2, b2 );
+	return refLabError( L1, a1, b1, L2, a2, b2 );
+}
+
+// allowed difference: 1 for small errors and 0.02% for large ones,
+// rgb errors must be exact
+static int tolerance( bool perceptual, int err )
+{
+	if( !perceptual ) return 0;
+	return std::max( 1, int(err * 0.0002) );
+}
+
+static int checkColorDistance( std::ostream& out, bool perceptual, int cd, int cr )
+{
+	ColorDistance dist;
+	dist.setMethod( perceptual ? ColorDistance::METHOD_PERCEPTUAL : ColorDistance::METHOD_RGB, cd, cr );
+	CheckRandom rnd( 17 + cd );
+	int fails = 0, worst = 0;
+
+	// errors between colour pairs
+	for( int i = 0; i < ERROR_PAIRS; i++ ) {
+		int c1[3], c2[3];
+		for( int j = 0; j < 3; j++ ) {
+			c1[j] = cd + rnd(cr+1);
+			// also close colours, where small errors matter most
+			c2[j] = i & 1 ? std::min( cd+cr, std::max( cd, c1[j] + rnd(9) - 4 ) ) : cd + rnd(cr+1);
+		}
+		int ref = refError( perceptual, cd, cr, c1, c2 );
+		int err = dist.error( c1[0], c1[1], c1[2], c2[0], c2[1], c2[2] );
+		worst = std::max( worst, std::abs( err-ref ) );
+		if( std::abs( err-ref ) > tolerance( perceptual, ref ) ) {
+			if( fails++ < 5 )
+				out << "  error(" << c1[0] << "," << c1[1] << "," << c1[2] << " - "
+				    << c2[0] << "," << c2[1] << "," << c2[2] << ") is " << err
+				    << ", expected " << ref << "\n";
+		}
+	}
+
+	// nearest palette entries, a different entry is accepted if its
+	// exact error is within the tolerance of the best one
+	int nfails = 0, differ = 0;
+	for( int p = 0; p < PALETTES; p++ ) {
+		int size = p % 5 == 4 ? 255 : 16;
+		std::vector<int> pal( 3*size );
+		for( int i = 0; i < 3*size; i++ )
+			pal[i] = cd + rnd(cr+1);
+		dist.setPalette( &pal[0], size );
+		for( int i = 0; i < NEAREST_COLORS/PALETTES; i++ ) {
+			int c[3] = { cd + rnd(cr+1), cd + rnd(cr+1), cd + rnd(cr+1) };
+			int best = 0, bestErr = INT_MAX;
+			for( int j = 0; j < size; j++ ) {
+				int e = refError( perceptual, cd, cr, c, &pal[3*j] );
+				if( e < bestErr ) {
+					best = j;
+					bestErr = e;
+				}
+			}
+			int n = dist.nearest( c[0], c[1], c[2] );
+			if( n == best ) continue;
+			differ++;
+			int nErr = n >= 0 && n < size ? refError( perceptual, cd, cr, c, &pal[3*n] ) : INT_MAX;
+			if( nErr - bestErr > tolerance( perceptual, bestErr ) ) {
+				if( nfails++ < 5 )
+					out << "  nearest(" << c[0] << "," << c[1] << "," << c[2] << ") is " << n
+					    << " with error " << nErr << ", expected " << best << " with " << bestErr << "\n";
+			}
+		}
+	}
+
+	out << "color_distance/" << (perceptual ? "perceptual" : "rgb") << " " << cd << "+" << cr
+	    << ": largest error difference " << worst << ", " << differ << " near ties in nearest, "
+	    << (fails + nfails ? "FAILED" : "ok") << "\n";
+	return fails + nfails ? 1 : 0;
+}
+
+int runAccuracyChecks( std::ostream& out )
+{
+	int failed = 0;
+	for( int m = 0; m < 2; m++ ) {
+		bool perceptual = m == 1;
+		// full range and the octree ranges of every colour depth
+		failed += checkColorDistance( out, perceptual, 0, 255 );
+		for( int depth = 1; depth < 8; depth++ ) {
+			int cd = 128 >> depth;
+			failed += checkColorDistance( out, perceptual, cd, ((0xFF80 >> depth) & 255) - cd );
+		}
+	}
+	return failed;
+}
+
+} // namespace Polka
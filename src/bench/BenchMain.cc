@@ -0,0 +1,107 @@
+/*
+	Copyright (C) 2013 Edwin Velds
+
+    This file is part of Polka 2.
+
+    Polka 2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Polka 2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Polka 2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "Benchmark.h"
+#include "CoreBenchmarks.h"
+#include "AccuracyChecks.h"
+#include "Functions.h"
+#include <iostream>
+#include <fstream>
+#include <streambuf>
+
+// swallows the debug output of the core classes
+class NullBuffer : public std::streambuf
+{
+protected:
+	int overflow( int c ) { return c; }
+};
+
+static void printUsage()
+{
+	std::cerr << "Usage: polka2-bench [options]\n"
+	             "Runs the core benchmarks and writes the results as json.\n\n"
+	             "Options:\n"
+	             "  --filter <text>     only run benchmarks with text in their name\n"
+	             "  --min-time <s>      minimum measured time per benchmark (default 0.5)\n"
+	             "  --iterations <n>    minimum number of timed runs (default 5)\n"
+	             "  --output <file>     write json to file instead of stdout\n"
+	             "  --list              list the benchmarks\n"
+	             "  --check             compare fast code with its reference instead,\n"
+	             "                      fails if results are out of tolerance\n";
+}
+
+int main( int argc, char *argv[] )
+{
+	Polka::BenchmarkRunner runner;
+	std::string output;
+	bool list = false, check = false;
+	for( int i = 1; i < argc; i++ ) {
+		std::string arg = argv[i];
+		if( arg == "--list" ) {
+			list = true;
+		} else if( arg == "--check" ) {
+			check = true;
+		} else if( i+1 < argc && arg == "--filter" ) {
+			runner.setFilter( argv[++i] );
+		} else if( i+1 < argc && arg == "--min-time" ) {
+			runner.setMinimumTime( to_double( argv[++i] ) );
+		} else if( i+1 < argc && arg == "--iterations" ) {
+			runner.setIterations( to_int( argv[++i] ), 1000 );
+		} else if( i+1 < argc && arg == "--output" ) {
+			output = argv[++i];
+		} else {
+			printUsage();
+			return 1;
+		}
+	}
+
+	if( check ) {
+		int failed = Polka::runAccuracyChecks( std::cerr );
+		if( failed ) std::cerr << failed << " accuracy checks failed" << std::endl;
+		return failed ? 1 : 0;
+	}
+
+	Polka::registerCanvasBenchmarks( runner );
+	Polka::registerStorageBenchmarks( runner );
+	Polka::registerReducerBenchmarks( runner );
+	if( list ) {
+		runner.listBenchmarks( std::cout );
+		return 0;
+	}
+
+	// keep stdout for the results
+	NullBuffer null;
+	std::ostream out( std::cout.rdbuf( &null ) );
+	std::ofstream file;
+	if( !output.empty() ) {
+		file.open( output.c_str() );
+		if( !file.is_open() ) {
+			std::cerr << "Cannot write " << output << std::endl;
+			return 1;
+		}
+	}
+	int count = runner.run( output.empty() ? out : file );
+	std::cout.rdbuf( out.rdbuf() );
+	if( count == 0 ) {
+		std::cerr << "No benchmarks selected" << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,135 @@
+/*
+	Copyright (C) 2013 Edwin Velds
+
+    This file is part of Polka 2.
+
+    Polka 2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Polka 2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Polka 2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "Benchmark.h"
+#include "Parallel.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+
+namespace Polka {
+
+BenchmarkRunner::BenchmarkRunner()
+	: m_MinimumTime(0.5), m_MinIterations(5), m_MaxIterations(1000)
+{
+}
+
+BenchmarkRunner::~BenchmarkRunner()
+{
+}
+
+void BenchmarkRunner::add( const std::string& name, double items, const std::string& unit,
+                           const Function& run, const Function& setup )
+{
+	Case c;
+	c.Name = name;
+	c.Unit = unit;
+	c.Items = items;
+	c.Run = run;
+	c.Setup = setup;
+	m_Cases.push_back( c );
+}
+
+void BenchmarkRunner::setFilter( const std::string& filter )
+{
+	m_Filter = filter;
+}
+
+void BenchmarkRunner::setMinimumTime( double seconds )
+{
+	m_MinimumTime = seconds;
+}
+
+void BenchmarkRunner::setIterations( int min, int max )
+{
+	m_MinIterations = std::max( 1, min );
+	m_MaxIterations = std::max( m_MinIterations, max );
+}
+
+void BenchmarkRunner::listBenchmarks( std::ostream& out ) const
+{
+	for( unsigned int i = 0; i < m_Cases.size(); i++ )
+		out << m_Cases[i].Name << std::endl;
+}
+
+int BenchmarkRunner::run( std::ostream& json )
+{
+	typedef std::chrono::steady_clock Clock;
+
+	json << "{\n"
+	     << "  \"format\": 1,\n"
+	     << "  \"compiler\": " << jsonString( __VERSION__ ) << ",\n"
+	     << "  \"hardware_threads\": " << hardwareThreads() << ",\n"
+	     << "  \"benchmarks\": [";
+
+	int count = 0;
+	for( unsigned int i = 0; i < m_Cases.size(); i++ ) {
+		const Case& c = m_Cases[i];
+		if( c.Name.find( m_Filter ) == std::string::npos ) continue;
+
+		// untimed warm up run
+		if( c.Setup ) c.Setup();
+		c.Run();
+
+		// time single calls until enough time has passed
+		std::vector<double> times;
+		double total = 0.0;
+		while( int(times.size()) < m_MaxIterations &&
+		       ( int(times.size()) < m_MinIterations || total < m_MinimumTime ) ) {
+			if( c.Setup ) c.Setup();
+			Clock::time_point start = Clock::now();
+			c.Run();
+			double t = std::chrono::duration<double>( Clock::now() - start ).count();
+			times.push_back( t );
+			total += t;
+		}
+		std::sort( times.begin(), times.end() );
+		int n = times.size();
+		double median = n & 1 ? times[n/2] : 0.5 * (times[n/2-1] + times[n/2]);
+		std::cerr << c.Name << ": " << 1000.0 * median << " ms (" << n << " runs)" << std::endl;
+
+		char buf[512];
+		snprintf( buf, sizeof(buf),
+		          "\"iterations\": %d, \"min_ms\": %.6f, \"median_ms\": %.6f, "
+		          "\"mean_ms\": %.6f, \"max_ms\": %.6f, \"items\": %.0f, ",
+		          n, 1000.0 * times[0], 1000.0 * median, 1000.0 * total / n,
+		          1000.0 * times[n-1], c.Items );
+		json << (count++ ? "," : "") << "\n    { \"name\": " << jsonString( c.Name ) << ", "
+		     << buf << "\"unit\": " << jsonString( c.Unit ) << ", ";
+		snprintf( buf, sizeof(buf), "\"items_per_second\": %.1f }", median > 0.0 ? c.Items / median : 0.0 );
+		json << buf;
+	}
+	json << "\n  ]\n}" << std::endl;
+	return count;
+}
+
+std::string BenchmarkRunner::jsonString( const std::string& str )
+{
+	std::string result = "\"";
+	for( unsigned int i = 0; i < str.size(); i++ ) {
+		if( str[i] == '"' || str[i] == '\\' )
+			result += '\\';
+		result += str[i];
+	}
+	return result + "\"";
+}
+
+} // namespace Polka
@@ -0,0 +1,69 @@
+/*
+	Copyright (C) 2013 Edwin Velds
+
+    This file is part of Polka 2.
+
+    Polka 2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Polka 2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Polka 2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _POLKA_BENCHMARK_H_
+#define _POLKA_BENCHMARK_H_
+
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace Polka {
+
+class BenchmarkRunner
+{
+public:
+	BenchmarkRunner();
+	~BenchmarkRunner();
+
+	typedef std::function<void()> Function;
+
+	// add a benchmark, setup runs untimed before every timed call and
+	// items is the amount of work per call in the given unit
+	void add( const std::string& name, double items, const std::string& unit,
+	          const Function& run, const Function& setup = Function() );
+
+	// run settings
+	void setFilter( const std::string& filter );
+	void setMinimumTime( double seconds );
+	void setIterations( int min, int max );
+	void listBenchmarks( std::ostream& out ) const;
+
+	// run matching benchmarks and write the results as json
+	int run( std::ostream& json );
+
+private:
+	struct Case {
+		std::string Name, Unit;
+		double Items;
+		Function Run, Setup;
+	};
+	std::vector<Case> m_Cases;
+	std::string m_Filter;
+	double m_MinimumTime;
+	int m_MinIterations, m_MaxIterations;
+
+	static std::string jsonString( const std::string& str );
+};
+
+} // namespace Polka
+
+#endif // _POLKA_BENCHMARK_H_
@@ -0,0 +1,466 @@
+/*
+	Copyright (C) 2013 Edwin Velds
+
+    This file is part of Polka 2.
+
+    Polka 2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Polka 2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Polka 2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "CoreBenchmarks.h"
+#include "Benchmark.h"
+#include "CanvasData.h"
+#include "Canvas.h"
+#include "DirtyTiles.h"
+#include "Storage.h"
+#include "Pen.h"
+#include "Brush.h"
+#include "ColorReducer.h"
+#include <glibmm/miscutils.h>
+#include <cairomm/surface.h>
+#include <memory>
+#include <algorithm>
+#include <cstdio>
+#include <cmath>
+
+namespace Polka {
+
+// all workloads use fixed seeds and sizes so runs can be compared
+static const int CANVAS_WIDTH = 512;
+static const int CANVAS_HEIGHT = 424;
+static const int PROJECT_CANVASES = 24;
+// about 100MB of project text
+static const int LARGE_PROJECT_CANVASES = 342;
+static const int INDEX_ITEMS = 10000;
+static const int INDEX_OBJECT_TYPES = 8;
+static const int IMAGE_SIZE = 1024;
+static const int SMALL_IMAGE_SIZE = 256;
+// four megapixels
+static const int HUGE_IMAGE_SIZE = 2048;
+
+// msx2 default palette
+static const unsigned int DisplayColors[16] = {
+	0x000000, 0x000000, 0x24db24, 0x6dff6d, 0x2424ff, 0x496dff, 0xb62424, 0x49dbff,
+	0xff2424, 0xff6d6d, 0xdbdb24, 0xdbdb92, 0x249224, 0xdb49b6, 0xb6b6b6, 0xffffff
+};
+
+class Random
+{
+public:
+	Random( unsigned int seed ) : m_Seed(seed) {}
+	int operator()( int n )
+	{
+		m_Seed = m_Seed * 1103515245u + 12345u;
+		return int( (m_Seed >> 16) % n );
+	}
+private:
+	unsigned int m_Seed;
+};
+
+struct CanvasState
+{
+	CanvasState() : Data( CANVAS_WIDTH, CANVAS_HEIGHT, 4 ) {}
+	CanvasData Data;
+	// noise with enough open pixels for a fill to cover most of the image
+	std::vector<char> Maze;
+	int FillX, FillY;
+	Cairo::RefPtr<Cairo::ImageSurface> Image;
+};
+
+static void drawRandomLines( CanvasData& data, const Pen& pen, int count, unsigned int seed )
+{
+	Random rnd( seed );
+	std::vector<Gdk::Rectangle> changed;
+	for( int i = 0; i < count; i++ ) {
+		changed.clear();
+		data.drawLine( rnd(CANVAS_WIDTH), rnd(CANVAS_HEIGHT), rnd(CANVAS_WIDTH), rnd(CANVAS_HEIGHT),
+		               pen, changed );
+	}
+}
+
+void registerCanvasBenchmarks( BenchmarkRunner& runner )
+{
+	std::shared_ptr<CanvasState> cs = std::make_shared<CanvasState>();
+	cs->Data.setDisplayColors( DisplayColors, 16 );
+	cs->Image = Cairo::ImageSurface::create( Cairo::FORMAT_RGB24, CANVAS_WIDTH, CANVAS_HEIGHT );
+	Random rnd( 1 );
+	cs->Maze.resize( CANVAS_WIDTH * CANVAS_HEIGHT );
+	for( unsigned int i = 0; i < cs->Maze.size(); i++ )
+		cs->Maze[i] = rnd(4) == 0 ? 1 : 0;
+	cs->FillX = CANVAS_WIDTH/2;
+	cs->FillY = CANVAS_HEIGHT/2;
+	cs->Maze[cs->FillY * CANVAS_WIDTH + cs->FillX] = 0;
+	double pixels = CANVAS_WIDTH * CANVAS_HEIGHT;
+
+	BenchmarkRunner::Function resetMaze = [cs]() {
+		cs->Data.setData( 0, 0, &cs->Maze[0], CANVAS_WIDTH, CANVAS_HEIGHT );
+	};
+
+	runner.add( "canvas/fill_contiguous", pixels, "pixels", [cs]() {
+		Pen pen;
+		pen.setColor( 2 );
+		std::vector<Gdk::Rectangle> changed;
+		cs->Data.bucketFill( cs->FillX, cs->FillY, pen, Canvas::FILL_CONTIGUOUS, changed );
+	}, resetMaze );
+
+	runner.add( "canvas/fill_replace", pixels, "pixels", [cs]() {
+		Pen pen;
+		pen.setColor( 2 );
+		std::vector<Gdk::Rectangle> changed;
+		cs->Data.bucketFill( cs->FillX, cs->FillY, pen, Canvas::FILL_REPLACE, changed );
+	}, resetMaze );
+
+	runner.add( "canvas/line", 1000, "lines", [cs]() {
+		Pen pen;
+		pen.setColor( 7 );
+		drawRandomLines( cs->Data, pen, 1000, 2 );
+	} );
+
+	runner.add( "canvas/line_shape", 250, "lines", [cs]() {
+		// round 5x5 pen
+		static const int round[25] = { -1, 5, 5, 5, -1,  5, 5, 5, 5, 5,  5, 5, 5, 5, 5,
+		                               5, 5, 5, 5, 5,  -1, 5, 5, 5, -1 };
+		Shape shape( 5, 5 );
+		shape.setData( round );
+		drawRandomLines( cs->Data, shape, 250, 3 );
+	} );
+
+	runner.add( "canvas/rectangle", 250, "rectangles", [cs]() {
+		Pen line, fill;
+		line.setColor( 15 );
+		fill.setColor( 4 );
+		Random rnd( 4 );
+		std::vector<Gdk::Rectangle> changed;
+		for( int i = 0; i < 250; i++ ) {
+			changed.clear();
+			cs->Data.drawRect( rnd(CANVAS_WIDTH), rnd(CANVAS_HEIGHT), rnd(CANVAS_WIDTH), rnd(CANVAS_HEIGHT),
+			                   line, fill, changed );
+		}
+	} );
+
+	runner.add( "canvas/brush", 10000, "stamps", [cs]() {
+		Brush brush( 8, 8 );
+		std::vector<int> data( 64 );
+		for( int i = 0; i < 64; i++ ) data[i] = i % 9 == 0 ? -1 : i & 15;
+		brush.setData( &data[0] );
+		Random rnd( 5 );
+		for( int i = 0; i < 10000; i++ )
+			cs->Data.applyBrush( rnd(CANVAS_WIDTH+8)-4, rnd(CANVAS_HEIGHT+8)-4, brush );
+	} );
+
+	runner.add( "canvas/write_image", pixels, "pixels", [cs]() {
+		cs->Data.writeImage( cs->Image, Gdk::Rectangle( 0, 0, CANVAS_WIDTH, CANVAS_HEIGHT ) );
+	}, resetMaze );
+
+	runner.add( "canvas/flip", pixels, "pixels", [cs]() {
+		cs->Data.flip( 0, 0, CANVAS_WIDTH-1, CANVAS_HEIGHT-1 );
+		cs->Data.flip( 0, 0, CANVAS_WIDTH-1, CANVAS_HEIGHT-1, true );
+	} );
+
+	// action recording as done by the canvas object, the history itself
+	// needs a project
+	runner.add( "canvas/undo_record", 64, "lines", [cs]() {
+		DirtyTiles tiles;
+		tiles.setSize( CANVAS_WIDTH, CANVAS_HEIGHT );
+		cs->Data.backupState();
+		Pen pen;
+		pen.setColor( 9 );
+		Random rnd( 6 );
+		std::vector<Gdk::Rectangle> changed;
+		for( int i = 0; i < 64; i++ ) {
+			changed.clear();
+			cs->Data.drawLine( rnd(CANVAS_WIDTH), rnd(CANVAS_HEIGHT), rnd(CANVAS_WIDTH), rnd(CANVAS_HEIGHT),
+			                   pen, changed );
+			for( unsigned int j = 0; j < changed.size(); j++ )
+				tiles.mark( changed[j] );
+		}
+		std::vector<Gdk::Rectangle> rects;
+		tiles.getRectangles( rects );
+		Storage su, sr;
+		for( unsigned int i = 0; i < rects.size(); i++ ) {
+			cs->Data.storeBackupRect( su.createObject("RECT_DATA"), rects[i] );
+			cs->Data.storeRect( sr.createObject("RECT_DATA"), rects[i] );
+		}
+		cs->Data.releaseBackup();
+	}, resetMaze );
+}
+
+struct ProjectState
+{
+	ProjectState() : Data( CANVAS_WIDTH, CANVAS_HEIGHT, 4 ), Saved(false), BinarySaved(false), LargeSaved(false) {}
+	CanvasData Data;
+	std::string Filename, BinaryFilename, LargeFilename;
+	bool Saved, BinarySaved, LargeSaved;
+};
+
+static int saveProject( ProjectState& ps, bool binary = false, int canvases = PROJECT_CANVASES )
+{
+	Storage s( binary ? ps.BinaryFilename : canvases == PROJECT_CANVASES ? ps.Filename : ps.LargeFilename );
+	if( binary ) s.setFileFormat( Storage::FORMAT_BINARY );
+	s.setFileIdentification( "POLKA2_BENCHMARK", 1, 0 );
+	s.createItem("PROJECT_NAME", "S");
+	s.setField( 0, std::string("Benchmark") );
+	for( int i = 0; i < canvases; i++ ) {
+		Storage& os = s.createObject("CANVAS/16/BMP");
+		os.createItem("OBJECT_NAME", "S");
+		os.setField( 0, std::string("Canvas") );
+		ps.Data.save( os );
+	}
+	return s.save();
+}
+
+static void loadProject( ProjectState& ps, const std::string& filename )
+{
+	Storage s( filename );
+	if( s.load() ) return;
+	s.getFileIdentification( "POLKA2_BENCHMARK" );
+	bool found = s.findObject("CANVAS/16/BMP");
+	while( found ) {
+		ps.Data.load( s.object() );
+		found = s.findNextObject("CANVAS/16/BMP");
+	}
+}
+
+void registerStorageBenchmarks( BenchmarkRunner& runner )
+{
+	std::shared_ptr<ProjectState> ps = std::make_shared<ProjectState>();
+	ps->Filename = Glib::build_filename( Glib::get_tmp_dir(), "polka2-bench.p2" );
+	ps->BinaryFilename = Glib::build_filename( Glib::get_tmp_dir(), "polka2-bench.p2b" );
+	ps->LargeFilename = Glib::build_filename( Glib::get_tmp_dir(), "polka2-bench-large.p2" );
+	// canvas with some structure for the encoder
+	Random rnd( 7 );
+	Pen pen;
+	std::vector<Gdk::Rectangle> changed;
+	for( int i = 0; i < 200; i++ ) {
+		pen.setColor( rnd(16) );
+		changed.clear();
+		ps->Data.drawRect( rnd(CANVAS_WIDTH), rnd(CANVAS_HEIGHT), rnd(CANVAS_WIDTH), rnd(CANVAS_HEIGHT),
+		                   pen, pen, changed );
+	}
+	double pixels = double(PROJECT_CANVASES) * CANVAS_WIDTH * CANVAS_HEIGHT;
+
+	runner.add( "storage/project_save", pixels, "pixels", [ps]() {
+		saveProject( *ps );
+	} );
+
+	runner.add( "storage/project_load", pixels, "pixels", [ps]() {
+		loadProject( *ps, ps->Filename );
+	}, [ps]() {
+		// the file is written once
+		if( !ps->Saved ) ps->Saved = saveProject( *ps ) == 0;
+	} );
+
+	runner.add( "storage/text_load_100mb", pixels * LARGE_PROJECT_CANVASES / PROJECT_CANVASES, "pixels", [ps]() {
+		loadProject( *ps, ps->LargeFilename );
+	}, [ps]() {
+		if( !ps->LargeSaved ) ps->LargeSaved = saveProject( *ps, false, LARGE_PROJECT_CANVASES ) == 0;
+	} );
+
+	runner.add( "storage/binary_save", pixels, "pixels", [ps]() {
+		saveProject( *ps, true );
+	} );
+
+	runner.add( "storage/binary_load", pixels, "pixels", [ps]() {
+		loadProject( *ps, ps->BinaryFilename );
+	}, [ps]() {
+		if( !ps->BinarySaved ) ps->BinarySaved = saveProject( *ps, true ) == 0;
+	} );
+
+	// opening only reads names, pixels stay mapped until used
+	runner.add( "storage/binary_open", PROJECT_CANVASES, "objects", [ps]() {
+		Storage s( ps->BinaryFilename );
+		if( s.load() ) return;
+		bool found = s.findObject("CANVAS/16/BMP");
+		while( found ) {
+			s.object().findItem("OBJECT_NAME");
+			s.object().stringField(0);
+			found = s.findNextObject("CANVAS/16/BMP");
+		}
+	}, [ps]() {
+		if( !ps->BinarySaved ) ps->BinarySaved = saveProject( *ps, true ) == 0;
+	} );
+
+	// settings and projects look up items by name, every fourth is an object
+	std::shared_ptr<Storage> is = std::make_shared<Storage>();
+	std::shared_ptr< std::vector<std::string> > names = std::make_shared< std::vector<std::string> >();
+	for( int i = 0; i < INDEX_ITEMS; i++ ) {
+		char name[32];
+		if( i % 4 == 3 ) {
+			snprintf( name, sizeof(name), "OBJECT_%d", i % INDEX_OBJECT_TYPES );
+			is->createObject( name ).createItem( "ID", "I" );
+		} else {
+			snprintf( name, sizeof(name), "ITEM_%d", i );
+			is->createItem( name, "I" );
+			is->setField( 0, i );
+			names->push_back( name );
+		}
+	}
+	std::random_shuffle( names->begin(), names->end(), Random( 11 ) );
+
+	runner.add( "storage/find_10k", INDEX_ITEMS, "items", [is, names]() {
+		for( unsigned int i = 0; i < names->size(); i++ )
+			is->findItem( (*names)[i] );
+		for( int t = 0; t < INDEX_OBJECT_TYPES; t++ ) {
+			char type[32];
+			snprintf( type, sizeof(type), "OBJECT_%d", t );
+			bool found = is->findObject( type );
+			while( found )
+				found = is->findNextObject( type );
+		}
+	} );
+}
+
+struct ReducerState
+{
+	std::vector<unsigned char> Source, SmallSource, HugeSource;
+	std::vector<unsigned char> Dest;
+	// screen 2 pattern and colour tables
+	std::vector<unsigned char> Patterns, Colors;
+	ColorReducer Reducer;
+	bool Quantized;
+};
+
+// smooth gradients with noise, stored like a cairo argb32 surface
+static void createImage( std::vector<unsigned char>& image, int size, unsigned int seed )
+{
+	Random rnd( seed );
+	image.resize( 4 * size * size );
+	unsigned char *p = &image[0];
+	for( int y = 0; y < size; y++ )
+		for( int x = 0; x < size; x++, p += 4 ) {
+			double s = 0.5 + 0.5 * sin( 12.0 * x / size ) * cos( 9.0 * y / size );
+			int r = 255 * x / size + rnd(17) - 8;
+			int g = 255 * y / size + rnd(17) - 8;
+			int b = int( 255 * s ) + rnd(17) - 8;
+			p[0] = std::min( std::max( b, 0 ), 255 );
+			p[1] = std::min( std::max( g, 0 ), 255 );
+			p[2] = std::min( std::max( r, 0 ), 255 );
+			p[3] = 255;
+		}
+}
+
+void registerReducerBenchmarks( BenchmarkRunner& runner )
+{
+	std::shared_ptr<ReducerState> rs = std::make_shared<ReducerState>();
+	createImage( rs->Source, IMAGE_SIZE, 8 );
+	createImage( rs->SmallSource, SMALL_IMAGE_SIZE, 9 );
+	rs->Dest.resize( HUGE_IMAGE_SIZE * HUGE_IMAGE_SIZE );
+	rs->Patterns.resize( IMAGE_SIZE * IMAGE_SIZE / 8 );
+	rs->Colors.resize( IMAGE_SIZE * IMAGE_SIZE / 8 );
+	rs->Quantized = false;
+	double pixels = IMAGE_SIZE * IMAGE_SIZE;
+	double smallPixels = SMALL_IMAGE_SIZE * SMALL_IMAGE_SIZE;
+
+	// quantization of the large image
+	struct { const char *Name; ColorReducer::QuantizationMethod Method; } quants[] = {
+		{ "reducer/quantize_popularity", ColorReducer::QUANT_POPULARITY },
+		{ "reducer/quantize_octree", ColorReducer::QUANT_OCTREE }
+	};
+	for( unsigned int i = 0; i < sizeof(quants)/sizeof(quants[0]); i++ ) {
+		ColorReducer::QuantizationMethod method = quants[i].Method;
+		runner.add( quants[i].Name, pixels, "pixels", [rs]() {
+			rs->Reducer.quantizeColors();
+		}, [rs, method]() {
+			rs->Reducer.setRGBSource( &rs->Source[0], IMAGE_SIZE, IMAGE_SIZE );
+			rs->Reducer.setTarget( "PAL/16/MSX2", &rs->Dest[0] );
+			rs->Reducer.setQuantizationMethod( method, ColorReducer::COLORERROR_RGB );
+			rs->Quantized = false;
+		} );
+	}
+
+	// elimination on the small image to keep runs short
+	runner.add( "reducer/quantize_elimination_small", smallPixels, "pixels", [rs]() {
+		rs->Reducer.quantizeColors();
+	}, [rs]() {
+		rs->Reducer.setRGBSource( &rs->SmallSource[0], SMALL_IMAGE_SIZE, SMALL_IMAGE_SIZE );
+		rs->Reducer.setTarget( "PAL/16/MSX2", &rs->Dest[0] );
+		rs->Reducer.setQuantizationMethod( ColorReducer::QUANT_ELIMINATION, ColorReducer::COLORERROR_RGB );
+		rs->Quantized = false;
+	} );
+
+	// octree quantization of a photo sized image, created on first use
+	struct { const char *Name; ColorReducer::ColorErrorMethod Error; } octrees[] = {
+		{ "reducer/quantize_octree_4mp", ColorReducer::COLORERROR_RGB },
+		{ "reducer/quantize_octree_perceptual_4mp", ColorReducer::COLORERROR_PERCEPTUAL }
+	};
+	double hugePixels = double(HUGE_IMAGE_SIZE) * HUGE_IMAGE_SIZE;
+	for( unsigned int i = 0; i < sizeof(octrees)/sizeof(octrees[0]); i++ ) {
+		ColorReducer::ColorErrorMethod error = octrees[i].Error;
+		runner.add( octrees[i].Name, hugePixels, "pixels", [rs]() {
+			rs->Reducer.quantizeColors();
+		}, [rs, error]() {
+			if( rs->HugeSource.empty() )
+				createImage( rs->HugeSource, HUGE_IMAGE_SIZE, 10 );
+			rs->Reducer.setRGBSource( &rs->HugeSource[0], HUGE_IMAGE_SIZE, HUGE_IMAGE_SIZE );
+			rs->Reducer.setTarget( "PAL/16/MSX2", &rs->Dest[0] );
+			rs->Reducer.setQuantizationMethod( ColorReducer::QUANT_OCTREE, error );
+			rs->Quantized = false;
+		} );
+	}
+
+	// image generation of the large image with a shared octree palette
+	struct { const char *Name; ColorReducer::DitherType Type; bool Serpentine; } dithers[] = {
+		{ "reducer/dither_none", ColorReducer::DITHER_NONE, false },
+		{ "reducer/dither_ordered", ColorReducer::DITHER_ORDERED, false },
+		{ "reducer/dither_floyd_steinberg", ColorReducer::DITHER_FLOYDSTEINBERG, false },
+		{ "reducer/dither_floyd_steinberg_serpentine", ColorReducer::DITHER_FLOYDSTEINBERG, true },
+		{ "reducer/dither_stucki", ColorReducer::DITHER_STUCKI, false }
+	};
+	for( unsigned int i = 0; i < sizeof(dithers)/sizeof(dithers[0]); i++ ) {
+		ColorReducer::DitherType type = dithers[i].Type;
+		bool serpentine = dithers[i].Serpentine;
+		runner.add( dithers[i].Name, pixels, "pixels", [rs]() {
+			rs->Reducer.generateImage();
+		}, [rs, type, serpentine]() {
+			if( !rs->Quantized ) {
+				rs->Reducer.setRGBSource( &rs->Source[0], IMAGE_SIZE, IMAGE_SIZE );
+				rs->Reducer.setTarget( "PAL/16/MSX2", &rs->Dest[0] );
+				rs->Reducer.setQuantizationMethod( ColorReducer::QUANT_OCTREE, ColorReducer::COLORERROR_RGB );
+				rs->Reducer.quantizeColors();
+				rs->Quantized = true;
+			}
+			rs->Reducer.setDitherType( type );
+			rs->Reducer.setSerpentine( serpentine );
+		} );
+	}
+
+	// best colour pair per 8x1 block with the same palette
+	runner.add( "reducer/patterns", pixels, "pixels", [rs]() {
+		rs->Reducer.generatePatterns( &rs->Patterns[0], &rs->Colors[0] );
+	}, [rs]() {
+		if( !rs->Quantized ) {
+			rs->Reducer.setRGBSource( &rs->Source[0], IMAGE_SIZE, IMAGE_SIZE );
+			rs->Reducer.setTarget( "PAL/16/MSX2", &rs->Dest[0] );
+			rs->Reducer.setQuantizationMethod( ColorReducer::QUANT_OCTREE, ColorReducer::COLORERROR_RGB );
+			rs->Reducer.quantizeColors();
+			rs->Quantized = true;
+		}
+		rs->Reducer.setDitherType( ColorReducer::DITHER_NONE );
+	} );
+
+	// complete conversion with perceptual errors
+	runner.add( "reducer/convert_perceptual_small", smallPixels, "pixels", [rs]() {
+		rs->Reducer.quantizeColors();
+		rs->Reducer.generateImage();
+	}, [rs]() {
+		rs->Reducer.setRGBSource( &rs->SmallSource[0], SMALL_IMAGE_SIZE, SMALL_IMAGE_SIZE );
+		rs->Reducer.setTarget( "PAL/16/MSX2", &rs->Dest[0] );
+		rs->Reducer.setQuantizationMethod( ColorReducer::QUANT_OCTREE, ColorReducer::COLORERROR_PERCEPTUAL );
+		rs->Reducer.setDitherType( ColorReducer::DITHER_FLOYDSTEINBERG );
+		rs->Reducer.setSerpentine( false );
+		rs->Quantized = false;
+	} );
+}
+
+} // namespace Polka
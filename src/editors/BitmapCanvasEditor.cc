@@ -164,7 +164,7 @@ void BitmapCanvasEditor::createTools( ToolButtonWindow& tw )
 	tw.addTool( rm.getIcon("canvasedit_tool_drawrect"), &m_ToolRectPanel );
 
 	// TOOL_FILL: create fill tool
-	tw.addTool( rm.getIcon("canvasedit_tool_fill") );
+	tw.addTool( rm.getIcon("canvasedit_tool_fill"), &m_ToolFillPanel );
 
 	// TOOL_FILL: create fill tool
 	tw.addTool( rm.getIcon("canvasedit_tool_flip") );
@@ -1812,7 +1812,7 @@ bool BitmapCanvasEditor::fillActivate( guint button, guint key, guint mods )
 			else
 				m_Pen.setColor( m_FGColor );
 			createUndo( _("Bucket fill"), ResourceManager::get().getIcon("canvasedit_tool_fill") );
-			canvas().bucketFill( m_PixX, m_PixY, m_Pen );
+			canvas().bucketFill( m_PixX, m_PixY, m_Pen, Canvas::FillMode(m_ToolFillPanel.fillMode()) );
 			canvas().finishAction();
 		}
 		return true;
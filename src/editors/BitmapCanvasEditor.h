@@ -27,6 +27,7 @@
 //#include "ToolGridPanel.h"
 #include "ToolBrushPanel.h"
 #include "ToolRectPanel.h"
+#include "ToolFillPanel.h"
 #include "Brush.h"
 #include "Defs.h"
 #include <vector>
@@ -111,6 +112,7 @@ private:
 	//ToolGridPanel m_ToolGridPanel;
 	ToolBrushPanel m_ToolBrushPanel;
 	ToolRectPanel m_ToolRectPanel;
+	ToolFillPanel m_ToolFillPanel;
 
 	// tool variables
 	int m_ToolMode;
@@ -154,6 +154,12 @@ void CanvasView::canvasChanged( const Gdk::Rectangle& r )
 	                 r.get_width() * hscale()   , r.get_height() * vscale() );
 }
 
+void CanvasView::canvasChanged( const std::vector<Gdk::Rectangle>& rects )
+{
+	for( unsigned int i = 0; i < rects.size(); i++ )
+		canvasChanged( rects[i] );
+}
+
 void CanvasView::changeCursor( Glib::RefPtr<Gdk::Cursor> cursor )
 {
 	if( !cursor ) cursor = Gdk::Cursor::create(Gdk::FLEUR);
@@ -25,6 +25,7 @@
 #include "ShapeDrawingObjects.h"
 #include "GridSelector.h"
 #include "AccelBase.h"
+#include <vector>
 
 namespace Polka {
 
@@ -42,6 +43,7 @@ public:
 	
 	// notifies partial canvas changes
 	void canvasChanged( const Gdk::Rectangle& r );
+	void canvasChanged( const std::vector<Gdk::Rectangle>& rects );
 	
 	// display properties
 	int scale() const;
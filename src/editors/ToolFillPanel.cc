@@ -0,0 +1,55 @@
+/*
+	Copyright (C) 2013 Edwin Velds
+
+    This file is part of Polka 2.
+
+    Polka 2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Polka 2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Polka 2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ToolFillPanel.h"
+#include "Canvas.h"
+#include <glibmm/i18n.h>
+
+namespace Polka {
+
+ToolFillPanel::ToolFillPanel()
+	: m_Contiguous(_("Area")), m_Replace(_("Color")), m_Tile(_("Tile"))
+{
+	m_Contiguous.set_tooltip_text( _("Fill the connected area of the same color.") );
+	m_Replace.join_group( m_Contiguous );
+	m_Replace.set_tooltip_text( _("Replace every pixel of the same color.") );
+	m_Tile.join_group( m_Contiguous );
+	m_Tile.set_tooltip_text( _("Fill the connected area within the tile grid cell.") );
+
+	pack_start( m_Contiguous, Gtk::PACK_SHRINK );
+	pack_start( m_Replace, Gtk::PACK_SHRINK );
+	pack_start( m_Tile, Gtk::PACK_SHRINK );
+
+	show_all_children();
+}
+
+ToolFillPanel::~ToolFillPanel()
+{
+}
+
+int ToolFillPanel::fillMode() const
+{
+	if( m_Replace.get_active() )
+		return Canvas::FILL_REPLACE;
+	else if( m_Tile.get_active() )
+		return Canvas::FILL_TILE;
+	return Canvas::FILL_CONTIGUOUS;
+}
+
+} // namespace Polka
@@ -0,0 +1,43 @@
+/*
+	Copyright (C) 2013 Edwin Velds
+
+    This file is part of Polka 2.
+
+    Polka 2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Polka 2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Polka 2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _POLKA_TOOLFILLPANEL_H_
+#define _POLKA_TOOLFILLPANEL_H_
+
+#include <gtkmm/box.h>
+#include <gtkmm/radiobutton.h>
+
+namespace Polka {
+
+class ToolFillPanel: public Gtk::VBox
+{
+public:
+	ToolFillPanel();
+	~ToolFillPanel();
+
+	// one of the Canvas::FillMode values
+	int fillMode() const;
+
+private:
+	Gtk::RadioButton m_Contiguous, m_Replace, m_Tile;
+};
+
+} // namespace Polka
+
+#endif // _POLKA_TOOLFILLPANEL_H_
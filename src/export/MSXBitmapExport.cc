@@ -28,6 +28,8 @@
 #include <gtkmm/stock.h>
 #include <iostream>
 #include <fstream>
+#include <vector>
+#include <algorithm>
 #include <cassert>
 
 using namespace std;
@@ -169,11 +171,6 @@ bool MSXBitmapExporter::exportObject( const std::string& filename )
 	if( !m_pObject ) return false;
 	const Canvas& canvas = *dynamic_cast<const Canvas*>(m_pObject);
 
-	// open file
-	std::ofstream file;
-	file.open( filename, std::ofstream::binary );
-	if( !file.is_open() ) return false;
-	
 	// calc sizes
 	int w = canvas.pixelScaleVer() == 2 ? 512 : 256;
 	int h = 192 + m_Format*(m_Format==1?20:32);
@@ -182,8 +179,39 @@ bool MSXBitmapExporter::exportObject( const std::string& filename )
 	int ox = m_CropLeft - m_OffsetX;
 	int oy = m_CropTop - m_OffsetY;
 	
+	// collect data, canvas rows are already in vram layout
+	assert( canvas.pixelBits() == 4 );
+	std::vector<char> data( w/2*h, 0 );
+	int x1 = std::max( m_OffsetX, 0 ), x2 = std::min( m_OffsetX+ew, w );
+	for( int y = std::max( m_OffsetY, 0 ); y < std::min( m_OffsetY+eh, h ); y++ ) {
+		if( x1 < x2 )
+			canvas.getPackedRow( x1 + ox, y + oy, x2-x1, &data[w/2*y], x1 );
+	}
+
+	// palette if needed
+	double pal[48];
+	if( m_Format < 2 && m_IncludePalette ) {
+		const Palette& p = canvas.palette();
+		for( int c = 0; c < 16; c++ ) {
+			pal[3*c]   = p.r(c);
+			pal[3*c+1] = p.g(c);
+			pal[3*c+2] = p.b(c);
+		}
+	}
+
+	return writeBitmap( filename, &data[0], w, h, m_Format < 2 && m_IncludePalette ? pal : 0 );
+}
+
+bool MSXBitmapExporter::writeBitmap( const std::string& filename, const char *data, int w, int h,
+                                     const double *palette )
+{
+	// open file
+	std::ofstream file;
+	file.open( filename, std::ofstream::binary );
+	if( !file.is_open() ) return false;
+	
 	int size = w*h/2;
-	if( m_Format < 2 && m_IncludePalette ) size = w==256 ? 0x7680+32 : 0xFA80+32;
+	if( palette ) size = w==256 ? 0x7680+32 : 0xFA80+32;
 	
 	// write header
 	file.put(0xFE);
@@ -195,39 +223,62 @@ bool MSXBitmapExporter::exportObject( const std::string& filename )
 	file.put(0);
 	
 	// write data
-	char c1, c;
-	for( int y=0; y<h; y++ ) {
-		for( int x=0; x<w; x++ ) {
-			// get pixel color
-			c = 0;
-			if( y >= m_OffsetY && y < m_OffsetY+eh && 
-			    x >= m_OffsetX && x < m_OffsetX+ew )
-			{
-				c = canvas.data( x + ox, y + oy );
-			}
-			// write or store pixel
-			if( x&1 )
-				file.put( 16*c1 + c );
-			else
-				c1 = c;
-		}
-	}
+	file.write( data, w*h/2 );
 	
 	// output palette if needed
-	if( m_Format < 2 && m_IncludePalette ) {
+	if( palette ) {
 		// pad with zeros
 		for( int i = 0; i < size-32-w*h/2; i++ )
 			file.put(0);
 		// write palette
-		const Palette& pal = canvas.palette();
 		for( int c = 0; c < 16; c++ ) {
-			file.put( round(pal.r(c)*7)*16 + round(pal.b(c)*7) );
-			file.put( round(pal.g(c)*7) );
+			file.put( round(palette[3*c]*7)*16 + round(palette[3*c+2]*7) );
+			file.put( round(palette[3*c+1]*7) );
 		}
 	}
 	file.close();
 	
-	return true;
+	return !file.fail();
+}
+
+bool MSXBitmapExporter::writePatterns( const std::string& filename, const unsigned char *patterns,
+                                       const unsigned char *colors, const double *palette )
+{
+	// vram from the pattern table to the end of the colour table
+	std::vector<char> vram( 0x3800, 0 );
+	std::copy( patterns, patterns + 0x1800, vram.begin() );
+	std::copy( colors, colors + 0x1800, vram.begin() + 0x2000 );
+	// every third of the screen shows its own 256 characters
+	for( int i = 0; i < 768; i++ )
+		vram[0x1800+i] = i & 255;
+	// no sprites
+	vram[0x1B00] = char(0xD0);
+	if( palette ) {
+		for( int c = 0; c < 16; c++ ) {
+			vram[0x1B80+2*c]   = round(palette[3*c]*7)*16 + round(palette[3*c+2]*7);
+			vram[0x1B80+2*c+1] = round(palette[3*c+1]*7);
+		}
+	}
+
+	// open file
+	std::ofstream file;
+	file.open( filename, std::ofstream::binary );
+	if( !file.is_open() ) return false;
+
+	// write header
+	int size = vram.size();
+	file.put(0xFE);
+	file.put(0);
+	file.put(0);
+	file.put((size-1) & 255);
+	file.put((size-1) >> 8);
+	file.put(0);
+	file.put(0);
+
+	file.write( &vram[0], size );
+	file.close();
+	
+	return !file.fail();
 }
 
 
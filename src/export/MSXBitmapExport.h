@@ -39,6 +39,16 @@ public:
 
 	virtual bool exportObject( const std::string& filename );
 
+	// write a bitmap file of h lines of w pixels, data holds packed
+	// 4 bit rows. The palette is 16 rgb triplets (0.0-1.0) or null.
+	static bool writeBitmap( const std::string& filename, const char *data, int w, int h,
+	                         const double *palette = 0 );
+	// write a screen 2 or 4 file of 32x24 characters, patterns and
+	// colors hold 8 bytes per character. The palette is only stored for
+	// screen 4.
+	static bool writePatterns( const std::string& filename, const unsigned char *patterns,
+	                           const unsigned char *colors, const double *palette = 0 );
+
 protected:
 	virtual void initObject();
 
@@ -346,18 +346,12 @@ bool BitmapScreenImporter::importToProject( Project& project )
 				// size
 				canvas->resize( 256, vres, 1, 1, true );
 
-				// data
+				// data, vram is in the canvas layout
 				std::string data;
-				data.resize( 256*startline + startpix, 0 );
-
-				int addr = 0;
-				while( addr <= m_EndAddress ) {
-					data += char( (m_pData[addr] >> 4) & 15 );
-					data += char(  m_pData[addr++]     & 15 );
-				}
-				
-				data.resize( 256*vres, 0 );
-				canvas->setData( 0, 0, data.c_str(), 256, vres );
+				data.resize( (256*startline + startpix) / 2, 0 );
+				data.append( m_pData, m_EndAddress+1 );
+				data.resize( 128*vres, 0 );
+				canvas->setPackedData( 0, 0, data.c_str(), 256, vres );
 				
 				break;
 			}
@@ -379,18 +373,12 @@ bool BitmapScreenImporter::importToProject( Project& project )
 				// size
 				canvas->resize( 512, vres, 1, 2, true );
 				
-				// data
+				// data, vram is in the canvas layout
 				std::string data;
-				data.resize( 512*startline + startpix, 0 );
-
-				int addr = 0;
-				while( addr <= m_EndAddress ) {
-					data += char( (m_pData[addr] >> 4) & 15 );
-					data += char(  m_pData[addr++]     & 15 );
-				}
-				
-				data.resize( 512*vres, 0 );
-				canvas->setData( 0, 0, data.c_str(), 512, vres );
+				data.resize( (512*startline + startpix) / 2, 0 );
+				data.append( m_pData, m_EndAddress+1 );
+				data.resize( 256*vres, 0 );
+				canvas->setPackedData( 0, 0, data.c_str(), 512, vres );
 				
 				break;
 			}
@@ -0,0 +1,275 @@
+/*
+	Copyright (C) 2013 Edwin Velds
+
+    This file is part of Polka 2.
+
+    Polka 2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Polka 2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Polka 2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "ColorDistance.h"
+#include "Simd.h"
+#include <algorithm>
+#include <climits>
+#include <cmath>
+
+namespace Polka {
+
+// the Lab curve is interpolated from a table between 0 and 1
+static const int CURVE_STEPS = 4096;
+
+static float labCurveExact( float t )
+{
+	return t > 0.008856f ? cbrtf(t) : 7.787f*t + 16.0f/116.0f;
+}
+
+static const float *labCurveTable()
+{
+	static const std::vector<float> Table = []() {
+		std::vector<float> t( CURVE_STEPS+2 );
+		for( int i = 0; i <= CURVE_STEPS+1; i++ )
+			t[i] = labCurveExact( float(i) / CURVE_STEPS );
+		return t;
+	}();
+	return &Table[0];
+}
+
+static inline float labCurve( float t )
+{
+	if( t <= 0.008856f || t >= 1.0f ) return labCurveExact( t );
+	float f = t * CURVE_STEPS;
+	int i = int(f);
+	const float *table = labCurveTable();
+	float y = table[i] + (table[i+1] - table[i]) * (f - i);
+	// the interpolation alone is off too much for dark colours, one
+	// newton step for the cube root fixes that
+	return y - (y*y*y - t) / (3.0f*y*y);
+}
+
+static float srgbToLinear( double v )
+{
+	return v > 0.04045 ? pow( (v+0.055)/1.055, 2.4 ) : v/12.92;
+}
+
+
+ColorDistance::ColorDistance()
+	: m_PalSize(0)
+{
+	setMethod( METHOD_RGB );
+}
+
+ColorDistance::~ColorDistance()
+{
+}
+
+void ColorDistance::setMethod( Method method, int offset, int range )
+{
+	m_Method = method;
+	m_Offset = offset;
+	m_Range = range;
+	for( int v = 0; v < 256; v++ )
+		m_Linear[v] = srgbToLinear( double(v-m_Offset)/m_Range );
+	m_PalSize = 0;
+}
+
+ColorDistance::Method ColorDistance::method() const
+{
+	return m_Method;
+}
+
+float ColorDistance::linear( int v ) const
+{
+	if( v & ~255 ) return srgbToLinear( double(v-m_Offset)/m_Range );
+	return m_Linear[v];
+}
+
+void ColorDistance::toLab( int r, int g, int b, Lab& lab ) const
+{
+	float R = linear(r), G = linear(g), B = linear(b);
+	float x = labCurve( (R*41.24f + G*35.75f + B*18.05f) / 95.047f );
+	float y = labCurve( (R*21.26f + G*71.52f + B* 7.22f) / 100.0f );
+	float z = labCurve( (R* 1.93f + G*11.92f + B*95.05f) / 108.883f );
+	lab.L = 116.0f*y - 16.0f;
+	lab.a = 500.0f*(x-y);
+	lab.b = 200.0f*(y-z);
+	lab.C = sqrtf( lab.a*lab.a + lab.b*lab.b );
+}
+
+// squared dE1994 difference, the hue difference is used squared so no
+// root is needed besides the chroma
+float ColorDistance::labError( const Lab& c1, const Lab& c2 )
+{
+	float sC = 1.0f + 0.045f*c1.C, sH = 1.0f + 0.015f*c1.C;
+	float kC = 1.0f / (sC*sC), kH = 1.0f / (sH*sH);
+	float dL = c1.L-c2.L, da = c1.a-c2.a, db = c1.b-c2.b, dC = c1.C-c2.C;
+	float dH2 = std::max( da*da + db*db - dC*dC, 0.0f );
+	return dL*dL + dC*dC*kC + dH2*kH;
+}
+
+int ColorDistance::error( int r1, int g1, int b1, int r2, int g2, int b2 ) const
+{
+	if( m_Method == METHOD_RGB )
+		return (r2-r1)*(r2-r1) + (g2-g1)*(g2-g1) + (b2-b1)*(b2-b1);
+
+	Lab c1, c2;
+	toLab( r1, g1, b1, c1 );
+	toLab( r2, g2, b2, c2 );
+	return lrintf( labError( c1, c2 ) * 75.0f );
+}
+
+void ColorDistance::point( int r, int g, int b, Lab& p ) const
+{
+	if( m_Method == METHOD_RGB ) {
+		p.L = r; p.a = g; p.b = b; p.C = 0.0f;
+	} else
+		toLab( r, g, b, p );
+}
+
+int ColorDistance::error( const Lab& p1, const Lab& p2 ) const
+{
+	if( m_Method == METHOD_RGB ) {
+		// integer components, exact in single precision
+		float dr = p2.L-p1.L, dg = p2.a-p1.a, db = p2.b-p1.b;
+		return int( dr*dr + dg*dg + db*db );
+	}
+	return lrintf( labError( p1, p2 ) * 75.0f );
+}
+
+static inline float boxDistance( float v, float lo, float hi )
+{
+	return v < lo ? lo-v : (v > hi ? v-hi : 0.0f);
+}
+
+int ColorDistance::lowerBound( const Lab& p, const Lab& lo, const Lab& hi ) const
+{
+	float d0 = boxDistance( p.L, lo.L, hi.L );
+	float d1 = boxDistance( p.a, lo.a, hi.a ), d2 = boxDistance( p.b, lo.b, hi.b );
+	if( m_Method == METHOD_RGB )
+		return int( d0*d0 + d1*d1 + d2*d2 );
+	// chroma and hue terms add up to the ab distance with the hue weight
+	// above the chroma weight, which is lowest for the highest chroma of
+	// either colour. leave room for rounding.
+	float d3 = boxDistance( p.C, lo.C, hi.C );
+	float sC = 1.0f + 0.045f*std::max( p.C, hi.C );
+	float e = (d0*d0 + std::max( d1*d1 + d2*d2, d3*d3 ) / (sC*sC)) * 75.0f;
+	return std::max( int( e*0.999f ) - 1, 0 );
+}
+
+void ColorDistance::setPalette( const int *rgb, int count )
+{
+	m_PalSize = count;
+	int padded = (count+3) & ~3;
+	for( int i = 0; i < 4; i++ )
+		m_Pal[i].assign( padded, 0.0f );
+	for( int i = 0; i < count; i++ ) {
+		if( m_Method == METHOD_RGB ) {
+			m_Pal[0][i] = rgb[3*i];
+			m_Pal[1][i] = rgb[3*i+1];
+			m_Pal[2][i] = rgb[3*i+2];
+		} else {
+			Lab lab;
+			toLab( rgb[3*i], rgb[3*i+1], rgb[3*i+2], lab );
+			m_Pal[0][i] = lab.L;
+			m_Pal[1][i] = lab.a;
+			m_Pal[2][i] = lab.b;
+			m_Pal[3][i] = lab.C;
+		}
+	}
+}
+
+int ColorDistance::paletteSize() const
+{
+	return m_PalSize;
+}
+
+int ColorDistance::nearest( int r, int g, int b ) const
+{
+	if( m_PalSize == 0 ) return -1;
+
+	// query in palette components, perceptual weights depend on the
+	// source chroma only
+	Lab q;
+	float kC = 0.0f, kH = 0.0f;
+	bool rgb = m_Method == METHOD_RGB;
+	if( rgb ) {
+		q.L = r; q.a = g; q.b = b; q.C = 0.0f;
+	} else {
+		toLab( r, g, b, q );
+		float sC = 1.0f + 0.045f*q.C, sH = 1.0f + 0.015f*q.C;
+		kC = 1.0f / (sC*sC);
+		kH = 1.0f / (sH*sH);
+	}
+	const float *p0 = &m_Pal[0][0], *p1 = &m_Pal[1][0], *p2 = &m_Pal[2][0], *p3 = &m_Pal[3][0];
+
+#ifdef POLKA_SSE2
+	// four entries at a time, lanes keep the first lowest error
+	const __m128 v0 = _mm_set1_ps( q.L ), v1 = _mm_set1_ps( q.a ), v2 = _mm_set1_ps( q.b );
+	const __m128 v3 = _mm_set1_ps( q.C ), vkC = _mm_set1_ps( kC ), vkH = _mm_set1_ps( kH );
+	const __m128 scale = _mm_set1_ps( 75.0f ), zero = _mm_setzero_ps();
+	const __m128i size = _mm_set1_epi32( m_PalSize ), four = _mm_set1_epi32( 4 );
+	__m128i idx = _mm_setr_epi32( 0, 1, 2, 3 );
+	__m128i best = _mm_set1_epi32( INT_MAX ), bestIdx = _mm_setzero_si128();
+	for( int i = 0; i < m_PalSize; i += 4 ) {
+		__m128 d0 = _mm_sub_ps( v0, _mm_loadu_ps( p0+i ) );
+		__m128 d1 = _mm_sub_ps( v1, _mm_loadu_ps( p1+i ) );
+		__m128 d2 = _mm_sub_ps( v2, _mm_loadu_ps( p2+i ) );
+		__m128 e;
+		if( rgb ) {
+			e = _mm_add_ps( _mm_add_ps( _mm_mul_ps( d0, d0 ), _mm_mul_ps( d1, d1 ) ), _mm_mul_ps( d2, d2 ) );
+		} else {
+			__m128 dC = _mm_sub_ps( v3, _mm_loadu_ps( p3+i ) );
+			__m128 dC2 = _mm_mul_ps( dC, dC );
+			__m128 dH2 = _mm_max_ps( _mm_sub_ps( _mm_add_ps( _mm_mul_ps( d1, d1 ), _mm_mul_ps( d2, d2 ) ), dC2 ), zero );
+			e = _mm_add_ps( _mm_add_ps( _mm_mul_ps( d0, d0 ), _mm_mul_ps( dC2, vkC ) ), _mm_mul_ps( dH2, vkH ) );
+			e = _mm_mul_ps( e, scale );
+		}
+		__m128i ei = _mm_cvtps_epi32( e );
+		__m128i better = _mm_and_si128( _mm_cmplt_epi32( ei, best ), _mm_cmplt_epi32( idx, size ) );
+		best = _mm_or_si128( _mm_and_si128( better, ei ), _mm_andnot_si128( better, best ) );
+		bestIdx = _mm_or_si128( _mm_and_si128( better, idx ), _mm_andnot_si128( better, bestIdx ) );
+		idx = _mm_add_epi32( idx, four );
+	}
+	int errs[4], idxs[4];
+	_mm_storeu_si128( reinterpret_cast<__m128i*>(errs), best );
+	_mm_storeu_si128( reinterpret_cast<__m128i*>(idxs), bestIdx );
+	int c = idxs[0], cerr = errs[0];
+	for( int l = 1; l < 4; l++ )
+		if( errs[l] < cerr || (errs[l] == cerr && idxs[l] < c) ) {
+			c = idxs[l];
+			cerr = errs[l];
+		}
+	return c;
+#else
+	int c = -1, cerr = INT_MAX;
+	for( int i = 0; i < m_PalSize; i++ ) {
+		float d0 = q.L-p0[i], d1 = q.a-p1[i], d2 = q.b-p2[i];
+		float e;
+		if( rgb ) {
+			e = d0*d0 + d1*d1 + d2*d2;
+		} else {
+			float dC = q.C-p3[i], dC2 = dC*dC;
+			float dH2 = std::max( d1*d1 + d2*d2 - dC2, 0.0f );
+			e = (d0*d0 + dC2*kC + dH2*kH) * 75.0f;
+		}
+		int err = lrintf( e );
+		if( err < cerr ) {
+			c = i;
+			cerr = err;
+		}
+	}
+	return c;
+#endif
+}
+
+} // namespace Polka
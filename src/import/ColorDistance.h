@@ -0,0 +1,81 @@
+/*
+	Copyright (C) 2013 Edwin Velds
+
+    This file is part of Polka 2.
+
+    Polka 2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Polka 2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Polka 2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _POLKA_COLORDISTANCE_H_
+#define _POLKA_COLORDISTANCE_H_
+
+#include <vector>
+
+namespace Polka {
+
+// Colour error between rgb colours, either the squared rgb distance or
+// the squared dE1994 difference scaled by 75. Lab conversions use
+// precomputed tables and single precision.
+class ColorDistance
+{
+public:
+	ColorDistance();
+	~ColorDistance();
+
+	enum Method { METHOD_RGB, METHOD_PERCEPTUAL };
+
+	// perceptual errors map rgb values from offset to offset+range onto
+	// the full colour space
+	void setMethod( Method method, int offset = 0, int range = 255 );
+	Method method() const;
+
+	int error( int r1, int g1, int b1, int r2, int g2, int b2 ) const;
+
+	// colours converted to the space errors are measured in, rgb or Lab
+	// and chroma depending on the method, for repeated errors between
+	// the same colours
+	struct Lab {
+		float L, a, b, C;
+	};
+	void point( int r, int g, int b, Lab& p ) const;
+	int error( const Lab& p1, const Lab& p2 ) const;
+	// error between p and any point within the box lo..hi will not be
+	// lower than this
+	int lowerBound( const Lab& p, const Lab& lo, const Lab& hi ) const;
+
+	// palette for nearest colour searches, count rgb triplets
+	void setPalette( const int *rgb, int count );
+	int paletteSize() const;
+	// lowest error palette entry, the first one on equal errors
+	int nearest( int r, int g, int b ) const;
+
+private:
+	Method m_Method;
+	int m_Offset, m_Range;
+	// linear light for rgb values 0..255
+	float m_Linear[256];
+	// palette components padded to a multiple of four entries, rgb or
+	// Lab and chroma depending on the method
+	std::vector<float> m_Pal[4];
+	int m_PalSize;
+
+	float linear( int v ) const;
+	void toLab( int r, int g, int b, Lab& lab ) const;
+	static float labError( const Lab& c1, const Lab& c2 );
+};
+
+} // namespace Polka
+
+#endif // _POLKA_COLORDISTANCE_H_
@@ -20,11 +20,19 @@
 #include "ColorReducer.h"
 #include "Functions.h"
 #include "ObjectManager.h"
+#include "Parallel.h"
+#include "Simd.h"
 #include <iostream>
+#include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <cassert>
+#include <cfloat>
+#include <climits>
 #include <cstring>
 #include <list>
+#include <queue>
+#include <thread>
 
 using namespace std;
 
@@ -39,6 +47,248 @@ unsigned char cclip( int v )
 	return v;
 }
 		
+// minimum number of rows per thread
+static const int MIN_BAND_ROWS = 32;
+
+// pixels diffused between progress updates of parallel rows
+static const int DIFFUSION_CHUNK = 64;
+
+// pattern block error for colours missing from the palette, eight of
+// them still fit an int
+static const int MAX_BLOCK_ERROR = INT_MAX / 16;
+
+// empty nearest colour entry, stored indices are offset by one
+static const unsigned int NEAREST_EMPTY = 0;
+
+// colours of the elimination quantizers, bucketed on rgb for nearest
+// colour searches. elements are ordered like a count sorted multimap,
+// merged colours go in front of existing colours with the same count.
+class EliminationSet
+{
+public:
+	struct Element {
+		int Color, Count;
+		long long Seq;
+		ColorDistance::Lab Point;
+		int Cell, Slot;
+		bool Alive;
+		// closest element and weighted error
+		int Best;
+		long long BestError;
+	};
+
+	EliminationSet( const ColorDistance& dist )
+		: m_Distance(dist), m_Cells(BLOCK_COUNT*8), m_Blocks(BLOCK_COUNT), m_Size(0), m_Merges(0)
+	{
+	}
+
+	int size() const { return m_Size; }
+	const Element& operator[]( int e ) const { return m_Elements[e]; }
+
+	// add colours in multimap insertion order
+	int add( int color, int count )
+	{
+		return add( color, count, m_Elements.size() );
+	}
+
+	int merge( int e1, int e2, int color )
+	{
+		int count = m_Elements[e1].Count + m_Elements[e2].Count;
+		remove( e1 );
+		remove( e2 );
+		return add( color, count, -++m_Merges );
+	}
+
+	bool before( int e1, int e2 ) const
+	{
+		const Element& el1 = m_Elements[e1], &el2 = m_Elements[e2];
+		return el1.Count < el2.Count || (el1.Count == el2.Count && el1.Seq < el2.Seq);
+	}
+
+	int error( int e1, int e2 ) const
+	{
+		return m_Distance.error( m_Elements[e1].Point, m_Elements[e2].Point );
+	}
+
+	void setBest( int e, int best, long long error )
+	{
+		m_Elements[e].Best = best;
+		m_Elements[e].BestError = error;
+	}
+
+	// visit the other elements that may be within limit of element e,
+	// starting in its own block. the visitor gets the lowest error
+	// possible for the element and may lower the limit. errors are
+	// multiplied by the lowest pixel count when weighted.
+	template<typename Visitor>
+	void search( int e, bool weighted, const long long& limit, Visitor visit )
+	{
+		const Element& el = m_Elements[e];
+		int own = el.Cell/8;
+		searchBlock( e, own, weighted, limit, visit );
+		// other blocks in order of distance
+		m_Search.clear();
+		for( int block = 0; block < BLOCK_COUNT; block++ ) {
+			if( !m_Blocks[block].Size || block == own ) continue;
+			Bound bound = { m_Distance.lowerBound( el.Point, m_Blocks[block].Min, m_Blocks[block].Max ), block };
+			if( weighted )
+				bound.Error *= std::min( el.Count, blockMinCount( block ) );
+			if( bound.Error <= limit )
+				m_Search.push_back( bound );
+		}
+		// a heap as most blocks are never visited
+		std::make_heap( m_Search.begin(), m_Search.end() );
+		while( !m_Search.empty() && m_Search.front().Error <= limit ) {
+			std::pop_heap( m_Search.begin(), m_Search.end() );
+			searchBlock( e, m_Search.back().Block, weighted, limit, visit );
+			m_Search.pop_back();
+		}
+	}
+
+	// remaining colours in order
+	void colors( std::vector<int>& cols ) const
+	{
+		std::vector<int> order;
+		for( unsigned int e = 0; e < m_Elements.size(); e++ )
+			if( m_Elements[e].Alive )
+				order.push_back( e );
+		std::sort( order.begin(), order.end(), [this]( int e1, int e2 ) { return before( e1, e2 ); } );
+		cols.clear();
+		for( unsigned int i = 0; i < order.size(); i++ )
+			cols.push_back( m_Elements[order[i]].Color );
+	}
+
+private:
+	// rgb space is split into 8 blocks per axis of 2x2x2 cells, bounds
+	// of both only grow as merged colours are already inside
+	static const int BLOCK_SHIFT = 5;
+	static const int BLOCK_COUNT = 512;
+
+	struct Cell {
+		std::vector<int> Elements;
+		ColorDistance::Lab Min, Max;
+		int Size, MinCount;
+		bool Dirty;
+		Cell() : Size(0), MinCount(INT_MAX), Dirty(false)
+		{
+			Min.L = Min.a = Min.b = Min.C = FLT_MAX;
+			Max.L = Max.a = Max.b = Max.C = -FLT_MAX;
+		}
+	};
+
+	struct Bound {
+		long long Error;
+		int Block;
+		// closest on top of the heap
+		bool operator<( const Bound& b ) const { return Error > b.Error; }
+	};
+
+	const ColorDistance& m_Distance;
+	std::vector<Element> m_Elements;
+	std::vector<Cell> m_Cells, m_Blocks;
+	std::vector<Bound> m_Search;
+	int m_Size, m_Merges;
+
+	template<typename Visitor>
+	void searchBlock( int e, int b, bool weighted, const long long& limit, Visitor& visit )
+	{
+		const Element& el = m_Elements[e];
+		for( int c = 8*b; c < 8*b+8; c++ ) {
+			const Cell& cell = m_Cells[c];
+			if( cell.Elements.empty() ) continue;
+			int err = m_Distance.lowerBound( el.Point, cell.Min, cell.Max );
+			if( (weighted ? (long long)err * std::min( el.Count, cellMinCount( c ) ) : err) > limit ) continue;
+			for( unsigned int j = 0; j < cell.Elements.size(); j++ )
+				if( cell.Elements[j] != e )
+					visit( cell.Elements[j], err );
+		}
+	}
+
+	// lowest counts are recalculated after removals
+	int cellMinCount( int c )
+	{
+		Cell& cell = m_Cells[c];
+		if( cell.Dirty ) {
+			cell.MinCount = INT_MAX;
+			for( unsigned int i = 0; i < cell.Elements.size(); i++ )
+				cell.MinCount = std::min( cell.MinCount, m_Elements[cell.Elements[i]].Count );
+			cell.Dirty = false;
+		}
+		return cell.MinCount;
+	}
+
+	int blockMinCount( int b )
+	{
+		Cell& block = m_Blocks[b];
+		if( block.Dirty ) {
+			block.MinCount = INT_MAX;
+			for( int c = 8*b; c < 8*b+8; c++ )
+				block.MinCount = std::min( block.MinCount, cellMinCount( c ) );
+			block.Dirty = false;
+		}
+		return block.MinCount;
+	}
+
+	static void include( Cell& cell, const Element& el )
+	{
+		cell.Min.L = std::min( cell.Min.L, el.Point.L ); cell.Max.L = std::max( cell.Max.L, el.Point.L );
+		cell.Min.a = std::min( cell.Min.a, el.Point.a ); cell.Max.a = std::max( cell.Max.a, el.Point.a );
+		cell.Min.b = std::min( cell.Min.b, el.Point.b ); cell.Max.b = std::max( cell.Max.b, el.Point.b );
+		cell.Min.C = std::min( cell.Min.C, el.Point.C ); cell.Max.C = std::max( cell.Max.C, el.Point.C );
+		cell.MinCount = std::min( cell.MinCount, el.Count );
+		cell.Size++;
+	}
+
+	int add( int color, int count, long long seq )
+	{
+		Element el;
+		el.Color = color;
+		el.Count = count;
+		el.Seq = seq;
+		el.Alive = true;
+		el.Best = -1;
+		el.BestError = LLONG_MAX;
+		m_Distance.point( color>>16, (color>>8)&255, color&255, el.Point );
+		// block index and cell within the block
+		int r = color>>16, g = (color>>8)&255, b = color&255;
+		int block = ((r >> BLOCK_SHIFT) << 6) | ((g >> BLOCK_SHIFT) << 3) | (b >> BLOCK_SHIFT);
+		int sub = (r >> (BLOCK_SHIFT-1) & 1) << 2 | (g >> (BLOCK_SHIFT-1) & 1) << 1 | (b >> (BLOCK_SHIFT-1) & 1);
+		el.Cell = 8*block + sub;
+		Cell& cell = m_Cells[el.Cell];
+		include( cell, el );
+		include( m_Blocks[block], el );
+		el.Slot = cell.Elements.size();
+		cell.Elements.push_back( m_Elements.size() );
+		m_Elements.push_back( el );
+		m_Size++;
+		return m_Elements.size()-1;
+	}
+
+	void remove( int e )
+	{
+		Element& el = m_Elements[e];
+		Cell& cell = m_Cells[el.Cell];
+		int last = cell.Elements.back();
+		cell.Elements[el.Slot] = last;
+		m_Elements[last].Slot = el.Slot;
+		cell.Elements.pop_back();
+		cell.Size--;
+		cell.Dirty = true;
+		Cell& block = m_Blocks[el.Cell/8];
+		block.Size--;
+		block.Dirty = true;
+		el.Alive = false;
+		m_Size--;
+	}
+};
+
+// merge candidate of the error elimination, only valid while it is
+// still the best of its owner
+struct EliminationCandidate {
+	long long Error;
+	int E1, E2, Owner;
+};
+
 // error diffusion dither matrices
 
 struct ErrorDiffusionMatrix {
@@ -48,7 +298,7 @@ struct ErrorDiffusionMatrix {
 };
 
 const int NUM_ERROR_DIFFUSION = 1 + ColorReducer::DITHER_ATKINSON - ColorReducer::DITHER_FLOYDSTEINBERG;
-ErrorDiffusionMatrix ErrorDiffusionMatrices[NUM_ERROR_DIFFUSION] =
+static constexpr ErrorDiffusionMatrix ErrorDiffusionMatrices[NUM_ERROR_DIFFUSION] =
 {
 	//Floyd-Steinberg:
 	{ 3, 2, -1, 16, 
@@ -97,6 +347,43 @@ ErrorDiffusionMatrix ErrorDiffusionMatrices[NUM_ERROR_DIFFUSION] =
 	}
 };
 
+// number of elements after the current pixel
+constexpr int diffusionElements( int k )
+{
+	return ErrorDiffusionMatrices[k].width - 1 + ErrorDiffusionMatrices[k].offset +
+	       ErrorDiffusionMatrices[k].width * (ErrorDiffusionMatrices[k].height - 1);
+}
+
+// adds the error parts of matrix k from element EL on, unrolled at
+// compile time. DIR mirrors the matrix for right to left rows.
+template<int K, int DIR, int EL = 0, bool END = (EL == diffusionElements(K))>
+struct DiffuseError
+{
+	static void apply( int *const *rows, int x, int er, int eg, int eb )
+	{
+		// elements right of the pixel, then full rows below it
+		static constexpr int WIDTH = ErrorDiffusionMatrices[K].width;
+		static constexpr int FIRST = WIDTH - 1 + ErrorDiffusionMatrices[K].offset;
+		static constexpr int ROW = EL < FIRST ? 0 : 1 + (EL-FIRST)/WIDTH;
+		static constexpr int COL = EL < FIRST ? EL+1 : (EL-FIRST)%WIDTH + ErrorDiffusionMatrices[K].offset;
+		static constexpr int MUL = ErrorDiffusionMatrices[K].matrix[EL];
+		static constexpr int DIV = ErrorDiffusionMatrices[K].div;
+		if( MUL ) {
+			int *p = rows[ROW] + 3*(x + DIR*COL);
+			p[0] = cclip( p[0] + (er*MUL)/DIV );
+			p[1] = cclip( p[1] + (eg*MUL)/DIV );
+			p[2] = cclip( p[2] + (eb*MUL)/DIV );
+		}
+		DiffuseError<K, DIR, EL+1>::apply( rows, x, er, eg, eb );
+	}
+};
+
+template<int K, int DIR, int EL>
+struct DiffuseError<K, DIR, EL, true>
+{
+	static void apply( int *const *, int, int, int, int ) {}
+};
+
 
 /*
  **********************************************************************
@@ -113,21 +400,36 @@ struct Target
 	int Depth;
 	std::string Canvas;
 };
-static std::map<std::string, Target> Targets;
+typedef std::map<std::string, Target> TargetMap;
+
+// the table is built once, reducers may run on several threads
+static const TargetMap& targets()
+{
+	static const TargetMap Targets = [] {
+		TargetMap t;
+		// TEMP: Add targets
+		//t["PAL/16/MSX1"] = { 16, 3, "CANVAS/16/BMP"};
+		t["PAL/16/MSX2"] = { 16, 3, "CANVAS/16/BMP"};
+		t["PAL/16/G9K"] = { 16, 5, "CANVAS/16/BMP"};
+		return t;
+	}();
+	return Targets;
+}
 
 
 ColorReducer::ColorReducer()
 	: m_pSource(0), m_pDest(0),
+	  m_pRowSource(0), m_SourceFailed(false),
 	  m_DitherType(DITHER_NONE),
 	  m_QuantMethod(QUANT_OCTREE),
 	  m_ColorErrorMethod(COLORERROR_RGB),
 	  m_OrderX(2), m_OrderY(2),
-	  m_Root(this)
+	  m_Serpentine(false),
+	  m_NearestValid(false),
+	  m_Threads(hardwareThreads()),
+	  m_pCancel(0),
+	  m_Tree(this)
 {
-	// TEMP: Add targets
-	//Targets["PAL/16/MSX1"] = { 16, 3, "CANVAS/16/BMP"} );
-	Targets["PAL/16/MSX2"] = { 16, 3, "CANVAS/16/BMP"};
-	Targets["PAL/16/G9K"] = { 16, 5, "CANVAS/16/BMP"};
 }
 
 ColorReducer::~ColorReducer()
@@ -136,8 +438,8 @@ ColorReducer::~ColorReducer()
 
 void ColorReducer::getTargetPalettes( std::vector<std::string>& pal_vec )
 {
-	auto it = Targets.begin();
-	while( it != Targets.end() ) {
+	auto it = targets().begin();
+	while( it != targets().end() ) {
 		pal_vec.push_back( it->first );
 		++it;
 	}
@@ -145,16 +447,17 @@ void ColorReducer::getTargetPalettes( std::vector<std::string>& pal_vec )
 
 const std::string& ColorReducer::getTargetCanvas( const std::string& pal )
 {
-	auto it = Targets.find(pal);
-	if( it == Targets.end() ) return Targets[0].Canvas;
+	static const std::string none;
+	auto it = targets().find(pal);
+	if( it == targets().end() ) return none;
 	
 	return it->second.Canvas;
 }
 
 bool ColorReducer::needQuantization( const std::string& pal )
 {
-	auto it = Targets.find(pal);
-	if( it == Targets.end() ) return false;
+	auto it = targets().find(pal);
+	if( it == targets().end() ) return false;
 	
 	return it->second.Colors < 256;
 }
@@ -162,6 +465,7 @@ bool ColorReducer::needQuantization( const std::string& pal )
 void ColorReducer::setRGBSource( const unsigned char *src, int width, int height, int pixsize, int stride )
 {
 	m_pSource = src;
+	m_pRowSource = 0;
 	m_Width = width;
 	m_Height = height;
 	m_SrcPixSize = pixsize;
@@ -173,16 +477,64 @@ void ColorReducer::setRGBSource( const unsigned char *src, int width, int height
 
 void ColorReducer::setTarget( const std::string& palette, unsigned char *dest, int pixsize, int stride )
 {
-	auto it = Targets.find(palette);
+	auto it = targets().find(palette);
 
-	assert( it != Targets.end() );
+	assert( it != targets().end() );
 
 	m_pDest = dest;
+	m_RowTarget = nullptr;
 	m_DstPixSize = pixsize;
 	m_DstStride = stride;
 	
 	m_NumCols = it->second.Colors;
 	m_Depth = it->second.Depth;
+	invalidateNearest();
+}
+
+void ColorReducer::setRowSource( RowSource *source, int width, int height, int pixsize )
+{
+	m_pSource = 0;
+	m_pRowSource = source;
+	m_Width = width;
+	m_Height = height;
+	m_SrcPixSize = pixsize;
+	m_SrcStride = 0;
+}
+
+void ColorReducer::setRowTarget( const std::string& palette, const RowTarget& target )
+{
+	setTarget( palette, 0 );
+	m_RowTarget = target;
+}
+
+bool ColorReducer::rewindSource()
+{
+	m_SourceFailed = m_pRowSource && !m_pRowSource->rewind();
+	return !m_SourceFailed;
+}
+
+const unsigned char *ColorReducer::sourceRow( int y )
+{
+	if( !m_pRowSource )
+		return m_pSource + m_SrcStride*y;
+	const unsigned char *row = m_pRowSource->readRow();
+	if( !row ) m_SourceFailed = true;
+	return row;
+}
+
+void ColorReducer::setThreads( int threads )
+{
+	m_Threads = std::max( 1, threads );
+}
+
+void ColorReducer::setCancelFlag( const std::atomic<bool> *cancel )
+{
+	m_pCancel = cancel;
+}
+
+bool ColorReducer::cancelled() const
+{
+	return m_pCancel && m_pCancel->load( std::memory_order_relaxed );
 }
 
 void ColorReducer::setDitherType( DitherType type, int orderx, int ordery, int offsetx, int offsety )
@@ -194,415 +546,780 @@ void ColorReducer::setDitherType( DitherType type, int orderx, int ordery, int o
 	m_OffsetY = ( offsety >=0 && offsety < (1<<m_OrderY) ) ? offsety : 0;
 }
 
+void ColorReducer::setSerpentine( bool serpentine )
+{
+	m_Serpentine = serpentine;
+}
+
 void ColorReducer::setQuantizationMethod( QuantizationMethod method, ColorErrorMethod error )
 {
 	m_QuantMethod = method;
 	m_ColorErrorMethod = error;
+	updateDistance();
+}
+
+void ColorReducer::updateDistance()
+{
+	ColorDistance::Method method = m_ColorErrorMethod == COLORERROR_PERCEPTUAL ?
+	                               ColorDistance::METHOD_PERCEPTUAL : ColorDistance::METHOD_RGB;
+	// octree colours are shrunk to fit the root node
+	if( m_QuantMethod == QUANT_OCTREE )
+		m_Distance.setMethod( method, m_Tree.ColMin, m_Tree.ColRange );
+	else
+		m_Distance.setMethod( method );
+	invalidateNearest();
 }
 
 int ColorReducer::colorError( int R1, int G1, int B1, int R2, int G2, int B2 )
 {
-	switch( m_ColorErrorMethod ) {
-		case COLORERROR_RGB:
-			// return simple squared difference
-			return sqr(R2-R1)+sqr(G2-G1)+sqr(B2-B1);
-		case COLORERROR_PERCEPTUAL:
-			// calculate squared color error according to dE1994
-			// Information and reference implementation:
-			//    http://en.wikipedia.org/wiki/Color_difference
-			//    http://en.wikipedia.org/wiki/Lab_color_space
-			//    http://www.emanueleferonato.com/2009/09/08/color-difference-algorithm-part-2/
-
-			// convert to Lab-color
-			double L1, a1, b1, L2, a2, b2;
-			rgbToLab( R1, G1, B1, L1, a1, b1 );
-			rgbToLab( R2, G2, B2, L2, a2, b2 );
-			double C1 = sqrt(a1*a1+b1*b1), C2 = sqrt(a2*a2+b2*b2);
-			double deltaC = C1-C2;
-			double deltaL = L1-L2, deltaa = a1-a2, deltab = b1-b2;
-			double deltaH2 = deltaa*deltaa+deltab*deltab-deltaC*deltaC;
-			double deltaH = deltaH2>0.0 ? sqrt(deltaH2) : 0.0;
-			double deltaCK = deltaC/(1+0.045*C1), deltaHK = deltaH/(1+0.015*C1);
-			double deltaE2 = deltaL*deltaL + deltaCK*deltaCK + deltaHK*deltaHK;
-			// squared error samples:
-			// Black/White:        10000
-			// Black/Red:          13770
-			// Red/White:          2524.0
-			// Black/Green:        22051
-			// Green/White:        502.11
-			// Black/Blue:         18950
-			// Blue/White:         4946.5
-			// Black/010000:       0.080275
-			// White/FEFFFF:       0.12300
-			// Black/000100:       0.28100
-			// White/FFFEFF:       0.42541
-			// Black/000001:       0.16302
-			// White/FFFFFE:       0.24736
-			// Total error should represent all values comfortably.
-			return round(deltaE2*75);
-	}
-	// unreachable
-	return 0;
-}
-
-void ColorReducer::rgbToLab( int ri, int gi, int bi, double& L, double& a, double& b )
-{
-	// convert rgb range to 0.0 - 1.0
-	int cd = m_QuantMethod==QUANT_OCTREE ? m_Root.ColMin : 0;
-	int cr = m_QuantMethod==QUANT_OCTREE ? m_Root.ColRange : 255;
-	double R = double(ri-cd)/cr;
-	double G = double(gi-cd)/cr;
-	double B = double(bi-cd)/cr;
-	// first convert to XYZ
-	R = R>0.04045 ? pow((R+0.055)/1.055,2.4) : R/12.92;
-	G = G>0.04045 ? pow((G+0.055)/1.055,2.4) : G/12.92;
-	B = B>0.04045 ? pow((B+0.055)/1.055,2.4) : B/12.92;
-	double x = (R*41.24 + G*35.75 + B*18.05) / 95.047;
-	double y = (R*21.26 + G*71.52 + B* 7.22) / 100.0;
-	double z = (R* 1.93 + G*11.92 + B*95.05) / 108.883;
-	// now convert to Lab
-	x = x > 0.008856 ? pow(x, 1.0/3.0) : 7.787*x+16.0/116.0;
-	y = y > 0.008856 ? pow(y, 1.0/3.0) : 7.787*y+16.0/116.0;
-	z = z > 0.008856 ? pow(z, 1.0/3.0) : 7.787*z+16.0/116.0;
-	L = 116.0*y-16.0;
-	a = 500.0*(x-y);
-	b = 200.0*(y-z);
+	// squared rgb difference or squared dE1994 color error
+	// Information and reference implementation:
+	//    http://en.wikipedia.org/wiki/Color_difference
+	//    http://en.wikipedia.org/wiki/Lab_color_space
+	//    http://www.emanueleferonato.com/2009/09/08/color-difference-algorithm-part-2/
+	return m_Distance.error( R1, G1, B1, R2, G2, B2 );
 }
 
 void ColorReducer::countColors()
 {
-	// fill the color count map
-	m_ColorCounts.clear();
+	// channel values to target levels and levels back to 0..255
 	int n = (1<<m_Depth)-1;
-	for( int y = 0; y < m_Height; y++ ) {
-		const unsigned char *src = m_pSource + m_SrcStride*y;
-		for( int x = 0; x < m_Width; x++ ) {
-			// reduce to target depth
-			int r = round(round(double(src[2]*n)/255)*255/n);
-			int g = round(round(double(src[1]*n)/255)*255/n);
-			int b = round(round(double(src[0]*n)/255)*255/n);
-			int c = (r << 16) | (g << 8)  | b;
-			m_ColorCounts[c]++;
-			src += m_SrcPixSize;
+	unsigned char level[256], value[256];
+	for( int v = 0; v < 256; v++ )
+		level[v] = round(double(v*n)/255);
+	for( int l = 0; l <= n; l++ )
+		value[l] = round(double(l)*255/n);
+
+	// count per band of rows, each band has a green/blue plane per red
+	// level that is created on first use
+	typedef std::vector< std::vector<unsigned int> > Histogram;
+	int planeSize = 1 << (2*m_Depth);
+	// streamed sources are read in one band
+	int bands = 1;
+	if( !m_pRowSource )
+		bands = std::max( 1, std::min( m_Threads, m_Height / MIN_BAND_ROWS ) );
+	std::vector<Histogram> hist( bands, Histogram( n+1 ) );
+	parallelFor( bands, bands, [&]( int band ) {
+		Histogram& h = hist[band];
+		for( int y = m_Height*band/bands; y < m_Height*(band+1)/bands; y++ ) {
+			const unsigned char *src = sourceRow( y );
+			if( !src ) break;
+			for( int x = 0; x < m_Width; x++ ) {
+				std::vector<unsigned int>& plane = h[level[src[2]]];
+				if( plane.empty() ) plane.assign( planeSize, 0 );
+				plane[(level[src[1]] << m_Depth) | level[src[0]]]++;
+				src += m_SrcPixSize;
+			}
+		}
+	} );
+	// merge bands
+	Histogram& h = hist[0];
+	for( int band = 1; band < bands; band++ )
+		for( int r = 0; r <= n; r++ ) {
+			if( hist[band][r].empty() ) continue;
+			if( h[r].empty() ) {
+				h[r].swap( hist[band][r] );
+			} else {
+				for( int i = 0; i < planeSize; i++ )
+					h[r][i] += hist[band][r][i];
+			}
+		}
+
+	// compact list in color order
+	m_ColorCounts.clear();
+	for( int r = 0; r <= n; r++ ) {
+		if( h[r].empty() ) continue;
+		for( int i = 0; i < planeSize; i++ ) {
+			if( !h[r][i] ) continue;
+			ColorCount cc;
+			cc.Color = (value[r] << 16) | (value[i >> m_Depth] << 8) | value[i & n];
+			cc.Count = h[r][i];
+			m_ColorCounts.push_back( cc );
+		}
+	}
+}
+
+void ColorReducer::eliminateColors()
+{
+	// multimap order, lowest count on top
+	EliminationSet set( m_Distance );
+	auto later = [&set]( int e1, int e2 ) { return set.before( e2, e1 ); };
+	std::priority_queue<int, std::vector<int>, decltype(later)> queue( later );
+	for( unsigned int i = 0; i < m_ColorCounts.size(); i++ )
+		queue.push( set.add( m_ColorCounts[i].Color, m_ColorCounts[i].Count ) );
+	m_ColorCounts.clear();
+
+	// merge the lowest count color into its closest neighbour
+	while( set.size() > 1 && (unsigned int)set.size() > m_NumCols && !cancelled() ) {
+		int e = queue.top();
+		queue.pop();
+		if( !set[e].Alive ) continue;
+		// first in order on equal errors
+		int near = -1;
+		long long minerr = LLONG_MAX;
+		set.search( e, false, minerr, [&]( int e2, int ) {
+			int err = set.error( e, e2 );
+			if( err < minerr || (err == minerr && set.before( e2, near )) ) {
+				near = e2;
+				minerr = err;
+			}
+		} );
+		queue.push( set.merge( e, near, set[near].Color ) );
+	}
+	set.colors( m_Palette );
+}
+
+void ColorReducer::eliminateColorsByError()
+{
+	EliminationSet set( m_Distance );
+	for( unsigned int i = 0; i < m_ColorCounts.size(); i++ )
+		set.add( m_ColorCounts[i].Color, m_ColorCounts[i].Count );
+	m_ColorCounts.clear();
+
+	// pairs are ordered on weighted error, then in multimap order
+	auto pairBefore = [&set]( long long err1, int e11, int e12, long long err2, int e21, int e22 ) {
+		if( err1 != err2 ) return err1 < err2;
+		if( e11 != e21 ) return set.before( e11, e21 );
+		return set.before( e12, e22 );
+	};
+	// lowest pair on top
+	auto worse = [&]( const EliminationCandidate& c1, const EliminationCandidate& c2 ) {
+		return pairBefore( c2.Error, c2.E1, c2.E2, c1.Error, c1.E1, c1.E2 );
+	};
+	std::priority_queue<EliminationCandidate, std::vector<EliminationCandidate>, decltype(worse)> queue( worse );
+	// elements using an element as best, may hold outdated entries
+	std::vector< std::vector<int> > users( set.size() );
+
+	// closest element, weighted by the lowest pixel count. the lowest
+	// pair is always found from the element searched last, so bests do
+	// not need to be updated for new elements.
+	auto updateBest = [&]( int e ) {
+		int best = -1, e1 = -1, e2 = -1;
+		long long minerr = LLONG_MAX;
+		set.search( e, true, minerr, [&]( int other, int bound ) {
+			int weight = std::min( set[e].Count, set[other].Count );
+			if( (long long)bound * weight > minerr ) return;
+			// error from the first color in order
+			int p1 = e, p2 = other;
+			if( set.before( p2, p1 ) ) std::swap( p1, p2 );
+			long long err = (long long)set.error( p1, p2 ) * weight;
+			if( best < 0 || pairBefore( err, p1, p2, minerr, e1, e2 ) ) {
+				best = other;
+				minerr = err;
+				e1 = p1;
+				e2 = p2;
+			}
+		} );
+		set.setBest( e, best, minerr );
+		if( best < 0 ) return;
+		EliminationCandidate cand = { minerr, e1, e2, e };
+		queue.push( cand );
+		users[best].push_back( e );
+	};
+
+	for( int e = 0; e < set.size(); e++ )
+		updateBest( e );
+
+	while( set.size() > 1 && (unsigned int)set.size() > m_NumCols && !cancelled() ) {
+		EliminationCandidate cand = queue.top();
+		queue.pop();
+		const EliminationSet::Element& el = set[cand.Owner];
+		int other = cand.Owner == cand.E1 ? cand.E2 : cand.E1;
+		if( !el.Alive || el.Best != other || el.BestError != cand.Error ) continue;
+
+		// combined color of the most occurring one
+		int e1 = cand.E1, e2 = cand.E2;
+		int color = set[e2].Count > set[e1].Count ? set[e2].Color : set[e1].Color;
+		int m = set.merge( e1, e2, color );
+		users.resize( m+1 );
+
+		// elements that lost their best
+		for( int k = 0; k < 2; k++ ) {
+			std::vector<int> lost;
+			lost.swap( users[k ? e2 : e1] );
+			for( unsigned int i = 0; i < lost.size(); i++ ) {
+				int e = lost[i];
+				if( set[e].Alive && (set[e].Best == e1 || set[e].Best == e2) )
+					updateBest( e );
+			}
 		}
+		updateBest( m );
 	}
+	set.colors( m_Palette );
 }
 
 bool ColorReducer::quantizeColors()
 {
 	// must have source
-	if( !m_pSource ) return false;
+	if( !m_pSource && !m_pRowSource ) return false;
 	// must be palette target
 	if( m_NumCols >= 256 ) return false;
+	if( !rewindSource() ) return false;
 
 	// init palette
 	m_Palette.clear();
+	updateDistance();
 
 	switch( m_QuantMethod )
 	{
 		case QUANT_POPULARITY:
 		{
-			std::cout << "POP\n";
-			countColors();
-			// pick the most occurring
-			auto it = m_ColorCounts.begin();
-			while( it != m_ColorCounts.end() ) {
-				auto pit = m_Palette.begin();
-				while( pit != m_Palette.end() ) {
-					if( it->second > m_ColorCounts[*pit] ) {
-						// higher color
-						m_Palette.insert( pit, it->first );
-						// remove end if needed
-						if( m_Palette.size() > m_NumCols )
-							m_Palette.pop_back();
-						break;
-					}
-					++pit;
-				}
-				// only end on small list
-				if( m_Palette.size() < m_NumCols )
-					m_Palette.push_back( it->first );
-				++it;
-			}
-			m_ColorCounts.clear();
-			break;
-		}
-		case QUANT_ELIMINATION:
-		{
-			std::cout << "ELIM\n";
 			countColors();
-			// sort by pixel count
-			std::multimap<int,int> count_map;
-			auto it = m_ColorCounts.begin();
-			while( it != m_ColorCounts.end() ) {
-				count_map.insert( std::pair<int,int>(it->second, it->first) );
-				++it;
-			}
-			m_ColorCounts.clear();
-			// remove colors from the top until the number is low enough
+			// pick the most occurring, lowest color first on equal counts
+			std::stable_sort( m_ColorCounts.begin(), m_ColorCounts.end(),
+			                  []( const ColorCount& c1, const ColorCount& c2 ) { return c1.Count > c2.Count; } );
 			int n = (1<<m_Depth)-1;
-			while( count_map.size() > m_NumCols ) {
-				int v = count_map.begin()->second;
-				int r = v>>16, g = (v&0xFF00)>>8,  b = v&255;
-				// find color with smallest error
-				int minerr = 0x7FFFFFFF;
-				auto it = count_map.begin(), minit = it;
-				while( ++it != count_map.end() ) {
-					int v2 = it->second;
-					int r2 = v2>>16, g2 = (v2&0xFF00)>>8,  b2 = v2&255;
-					int err = colorError(r, g, b, r2, g2, b2);
-					if( err < minerr ) {
-						minit = it;
-						minerr = err;
-					}
-				};
-				// add new combined row
-				int n = count_map.begin()->first + minit->first;
-				v = minit->second;
-				count_map.insert( minit, std::pair<int,int>(n, v) );
-				// erase old rows
-				count_map.erase(minit);
-				count_map.erase(count_map.begin());
-			}
-			// add remaining colors to palette
-			auto cit = count_map.begin();
-			while( cit != count_map.end() ) {
-				int v = cit->second;
+			for( unsigned int i = 0; i < m_ColorCounts.size() && i < m_NumCols; i++ ) {
+				int v = m_ColorCounts[i].Color;
 				int r = round(double(v>>16)        *n/255);
 				int g = round(double((v&0xFF00)>>8)*n/255);
 				int b = round(double(v&255)        *n/255);
 				m_Palette.push_back( (r<<16) | (g<<8) | b );
-				++cit;
 			}
+			m_ColorCounts.clear();
 			break;
 		}
+		case QUANT_ELIMINATION:
 		case QUANT_ERRORELIMINATION:
 		{
-			std::cout << "ERRELIM\n";
 			countColors();
-			// sort by pixel count
-			std::multimap<int,int> count_map;
-			auto it = m_ColorCounts.begin();
-			while( it != m_ColorCounts.end() ) {
-				count_map.insert( std::pair<int,int>(it->second, it->first) );
-				++it;
-			}
-			m_ColorCounts.clear();
-			// remove colors from the top until the number is low enough
+			if( m_QuantMethod == QUANT_ELIMINATION )
+				eliminateColors();
+			else
+				eliminateColorsByError();
+			// convert remaining colors to target depth
 			int n = (1<<m_Depth)-1;
-			while( count_map.size() > m_NumCols ) {
-				int minerr = 0x7FFFFFFF;
-				// loop color one
-				auto cit1 = count_map.begin(), minit1 = cit1, minit2 = cit1;
-				while( cit1 != count_map.end() ) {
-					// get color one
-					int v = cit1->second;
-					int r1 = v>>16, g1 = (v&0xFF00)>>8, b1 = v&255;
-					// loop color two
-					auto cit2 = cit1;
-					++cit2;
-					while( cit2 != count_map.end() ) {
-						// calculate difference
-						v = cit2->second;
-						int r2 = v>>16, g2 = (v&0xFF00)>>8, b2 = v&255;
-						int err = colorError(r1, g1, b1,  r2, g2, b2) * min(cit1->first, cit2->first);
-						if( err < minerr ) {
-							minit1 = cit1;
-							minit2 = cit2;
-							minerr = err;
-						}
-						++cit2;
-					}
-					++cit1;
-				}
-				// add new combined row
-				int n = minit1->first + minit2->first;
-				if( minit2->first > minit1->first )
-					count_map.insert( minit2, std::pair<int,int>(n, minit2->second) );
-				else
-					count_map.insert( minit1, std::pair<int,int>(n, minit1->second) );
-				// erase old rows
-				count_map.erase(minit1);
-				count_map.erase(minit2);
-				count_map.erase(count_map.begin());
-			}
-			// add remaining colors to palette
-			auto cit = count_map.begin();
-			while( cit != count_map.end() ) {
-				int v = cit->second;
+			for( unsigned int i = 0; i < m_Palette.size(); i++ ) {
+				int v = m_Palette[i];
 				int r = round(double(v>>16)        *n/255);
 				int g = round(double((v&0xFF00)>>8)*n/255);
 				int b = round(double(v&255)        *n/255);
-				m_Palette.push_back( (r<<16) | (g<<8) | b );
-				++cit;
+				m_Palette[i] = (r<<16) | (g<<8) | b;
 			}
 			break;
 		}
 		case QUANT_OCTREE:
 		{
-			std::cout << "OCTREE" << int( m_ColorErrorMethod) << "\n";
 			// init tree for current depth
-			m_Root.reset(m_Depth);
+			m_Tree.reset(m_Depth);
+			updateDistance();
 			// build color tree
 			for( int y = 0; y < m_Height; y++ ) {
-				const unsigned char *src = m_pSource + m_SrcStride*y;
+				if( cancelled() ) return false;
+				const unsigned char *src = sourceRow( y );
+				if( !src ) return false;
 				for( int x = 0; x < m_Width; x++ ) {
 					// convert rgb values to target depth
-					m_Root.addPixel( src[2], src[1], src[0] );
+					m_Tree.addPixel( src[2], src[1], src[0] );
 					src += m_SrcPixSize;
 				}
 			}
 			// reduce color tree
-			while( m_Root.ColorCount > m_NumCols ) {
-				//debug();
-				ColorNode& low = m_Root.findMinError();
-				low.remove();
-			}
+			m_Tree.reduce( m_NumCols );
 			// compile palette
-			m_Root.createPalette(m_Palette);
+			m_Tree.createPalette(m_Palette);
 			break;
 		}
 		default:
 			assert(false);
 	}
 
-	// debug output
-	for( unsigned int i = 0; i < m_Palette.size(); i++ ) std::cout << i << ": " << std::hex << m_Palette[i] << std::dec << std::endl;
-	return true;
+	return !cancelled() && !m_SourceFailed;
+}
+
+void ColorReducer::setPalette( const unsigned char *rgb, int count )
+{
+	int n = (1<<m_Depth)-1;
+	m_Palette.clear();
+	for( int c = 0; c < count; c++ ) {
+		int r = round(double(rgb[3*c])  *n/255);
+		int g = round(double(rgb[3*c+1])*n/255);
+		int b = round(double(rgb[3*c+2])*n/255);
+		m_Palette.push_back( (r << 16) | (g << 8) | b );
+	}
+	invalidateNearest();
 }
 
 bool ColorReducer::generateImage()
 {
 	// must have all data
-	if( !m_pSource || !m_pDest ) return false;
+	if( !m_pSource && !m_pRowSource ) return false;
+	if( !m_pDest && !m_RowTarget ) return false;
 	// quantization must be finished
 	if( m_NumCols < 256 && m_Palette.size() == 0 ) return false;
+	if( !rewindSource() ) return false;
 	
 	// generate data
 	if( m_DstStride <= 0 )
 		m_DstStride = m_DstPixSize*m_Width;
-
-	
-	unsigned char *srcdat = const_cast<unsigned char*>(m_pSource);
-	unsigned char *ordered_dither_mat = 0, cthreshR = 0, cthreshG = 0, cthreshB = 0;
-	int matw = 1, math = 1, matf = 1;
-	if( m_DitherType >= DITHER_FLOYDSTEINBERG ) {
-		// error diffusion dithering changes source, use copy
-		srcdat = new unsigned char[m_Height*m_SrcStride];
-		memcpy( srcdat, m_pSource, m_Height*m_SrcStride );
-	} else if( m_DitherType == DITHER_ORDERED ) {
-		// flip for calculation
-		bool flip = false;
-		if( m_OrderY > m_OrderX ) {
-			flip = true;
-			std::swap(m_OrderX, m_OrderY);
+	if( !m_NearestValid ) prepareNearest();
+
+	if( m_DitherType >= DITHER_FLOYDSTEINBERG && m_DitherType <= DITHER_ATKINSON && !m_Palette.empty() ) {
+		// palette colours for the errors
+		int n = (1<<m_Depth)-1;
+		std::vector<int> pal( 3*m_Palette.size() );
+		for( unsigned int i = 0; i < m_Palette.size(); i++ ) {
+			pal[3*i]   = round(double(m_Palette[i] >> 16)/n*255);
+			pal[3*i+1] = round(double((m_Palette[i] & 0xFF00) >> 8)/n*255);
+			pal[3*i+2] = round(double(m_Palette[i] & 255)/n*255);
 		}
-		// ordered dithering, pre-generate matrix
-		matw = 1<<m_OrderX, math = 1<<m_OrderY;
-		ordered_dither_mat = new unsigned char[matw*math];
-
-		for( int y = 0; y < math; y++ ) {
-			for( int x = 0; x < matw; x++ ) {
-				int v = 0, offset = 0, maskx = m_OrderX, masky = m_OrderY;
-				int xc = x ^ (y << (m_OrderX-m_OrderY)), yc = y, b = 0;
-				while( b < m_OrderX+m_OrderY ) {
-					v |= ((yc >> --masky)&1) << b++;
-					for( offset += m_OrderX; offset >= m_OrderY; offset -= m_OrderY)
-						v |= ((xc >> --maskx)&1) << b++;
-				}
-				if( flip )
-					ordered_dither_mat[x*math+y] = v+1;
-				else
-					ordered_dither_mat[y*matw+x] = v+1;
-            }
-        }
-        // flip back
-        if( flip ) {
-			std::swap(m_OrderX, m_OrderY);
-			std::swap(matw, math);
+		switch( m_DitherType ) {
+			case DITHER_FLOYDSTEINBERG:   diffuseImage<DITHER_FLOYDSTEINBERG>( &pal[0] ); break;
+			case DITHER_JARVISJUDICENINKE: diffuseImage<DITHER_JARVISJUDICENINKE>( &pal[0] ); break;
+			case DITHER_STUCKI:           diffuseImage<DITHER_STUCKI>( &pal[0] ); break;
+			case DITHER_BURKES:           diffuseImage<DITHER_BURKES>( &pal[0] ); break;
+			case DITHER_SIERRA3:          diffuseImage<DITHER_SIERRA3>( &pal[0] ); break;
+			case DITHER_SIERRA2:          diffuseImage<DITHER_SIERRA2>( &pal[0] ); break;
+			case DITHER_SIERRA2_4A:       diffuseImage<DITHER_SIERRA2_4A>( &pal[0] ); break;
+			case DITHER_STEVENSONARCE:    diffuseImage<DITHER_STEVENSONARCE>( &pal[0] ); break;
+			default:                      diffuseImage<DITHER_ATKINSON>( &pal[0] ); break;
 		}
+		return !cancelled() && !m_SourceFailed;
+	}
+
+	// offsets added to every source byte per ordered dither matrix row
+	std::vector<unsigned char> offsets;
+	int math = 0;
+	if( m_DitherType == DITHER_ORDERED ) {
+		// ordered dithering, pre-generate matrix
+		int matw;
+		std::vector<unsigned char> ordered_dither_mat;
+		orderedMatrix( ordered_dither_mat, matw, math );
 		// division constant
-		matf = matw*math+1;
+		int matf = matw*math+1;
 		// calculate component threshholds TODO: uneven RGB
-		cthreshR = 256 / (1<<m_Depth);
-		cthreshG = cthreshB = cthreshR;
-    }
-	
-	for( int y = 0; y < m_Height; y++ ) {
-		unsigned char *src = srcdat + m_SrcStride*y;
-		unsigned char *dst = m_pDest + m_DstStride*y;
+		int cthreshR = 256 / (1<<m_Depth);
+		int cthreshG = cthreshR, cthreshB = cthreshR;
+
+		// the matrix starts at the dither offset
+		int bytes = m_Width*m_SrcPixSize;
+		offsets.assign( math*bytes, 0 );
+		for( int y = 0; y < math; y++ )
+			for( int x = 0; x < m_Width; x++ ) {
+				int matval = ordered_dither_mat[ (x-m_OffsetX+matw)%matw + matw*y ];
+				unsigned char *o = &offsets[y*bytes + x*m_SrcPixSize];
+				o[2] = matval * cthreshR / matf;
+				o[1] = matval * cthreshG / matf;
+				o[0] = matval * cthreshB / matf;
+			}
+	}
+
+	const unsigned char *ofs = offsets.empty() ? 0 : &offsets[0];
+	if( m_pRowSource || m_RowTarget ) {
+		// rows in order through a single row
+		std::vector<unsigned char> scratch( ofs ? m_Width*m_SrcPixSize : 0 );
+		std::vector<unsigned char> row( m_pDest ? 0 : m_Width*m_DstPixSize );
+		for( int y = 0; y < m_Height && !cancelled(); y++ ) {
+			const unsigned char *src = sourceRow( y );
+			if( !src ) break;
+			unsigned char *dst = m_pDest ? m_pDest + m_DstStride*y : &row[0];
+			mapRow( y, src, dst, ofs, math, scratch.data(), m_Nearest );
+			if( m_RowTarget ) m_RowTarget( y, dst );
+		}
+		return !cancelled() && !m_SourceFailed;
+	}
+
+	// pixels only depend on their source, convert bands of rows in
+	// parallel with their own nearest colour tables
+	int bands = std::max( 1, std::min( m_Threads, m_Height / MIN_BAND_ROWS ) );
+	if( bands == 1 ) {
+		mapRows( 0, m_Height, ofs, math, m_Nearest );
+	} else {
+		parallelFor( bands, bands, [&]( int band ) {
+			NearestTable table = m_Nearest;
+			mapRows( m_Height*band/bands, m_Height*(band+1)/bands, ofs, math, table );
+		} );
+	}
+
+	return !cancelled();
+}
+
+void ColorReducer::orderedMatrix( std::vector<unsigned char>& mat, int& matw, int& math ) const
+{
+	// flip for calculation
+	int orderx = m_OrderX, ordery = m_OrderY;
+	bool flip = false;
+	if( ordery > orderx ) {
+		flip = true;
+		std::swap(orderx, ordery);
+	}
+	int w = 1<<orderx, h = 1<<ordery;
+	mat.resize( w*h );
+
+	for( int y = 0; y < h; y++ ) {
+		for( int x = 0; x < w; x++ ) {
+			int v = 0, offset = 0, maskx = orderx, masky = ordery;
+			int xc = x ^ (y << (orderx-ordery)), yc = y, b = 0;
+			while( b < orderx+ordery ) {
+				v |= ((yc >> --masky)&1) << b++;
+				for( offset += orderx; offset >= ordery; offset -= ordery)
+					v |= ((xc >> --maskx)&1) << b++;
+			}
+			if( flip )
+				mat[x*h+y] = v+1;
+			else
+				mat[y*w+x] = v+1;
+		}
+	}
+	// flip back
+	if( flip ) std::swap(w, h);
+	matw = w;
+	math = h;
+}
+
+template<ColorReducer::DitherType TYPE>
+void ColorReducer::diffuseImage( const int *pal )
+{
+	const int k = TYPE - DITHER_FLOYDSTEINBERG;
+	const ErrorDiffusionMatrix& mat = ErrorDiffusionMatrices[k];
+	// pixels the matrix reaches left or right, rows get room for it on
+	// both sides so edges need no checks
+	int reach = std::max( -mat.offset, mat.width - 1 + mat.offset );
+	int rowSize = 3*(m_Width + 2*reach);
+
+	// rows run in parallel with each row staying far enough behind the
+	// one above it to receive all of its error in the same order. right
+	// to left rows need the row above finished, so serpentine is serial.
+	int threads = 1;
+	if( !m_Serpentine && !m_pRowSource && !m_RowTarget )
+		threads = std::max( 1, std::min( m_Threads, m_Height / MIN_BAND_ROWS ) );
+	int lag = 2*reach + 1;
+
+	// rolling buffer of diffused source values, rows are loaded when the
+	// row above the matrix starts
+	int ringRows = threads + mat.height;
+	std::vector<int> ring( ringRows*rowSize );
+	auto row = [&]( int y ) {
+		return &ring[(y % ringRows)*rowSize + 3*reach];
+	};
+	auto loadRow = [&]( int y ) {
+		if( y >= m_Height ) return;
+		const unsigned char *src = sourceRow( y );
+		if( !src ) return;
+		int *r = row( y );
 		for( int x = 0; x < m_Width; x++ ) {
+			r[0] = src[2];
+			r[1] = src[1];
+			r[2] = src[0];
+			src += m_SrcPixSize;
+			r += 3;
+		}
+	};
+	for( int y = 0; y < mat.height-1; y++ )
+		loadRow( y );
+
+	if( threads == 1 ) {
+		// matrices have at most four rows
+		int *rows[4];
+		std::vector<unsigned char> out( m_pDest ? 0 : m_Width*m_DstPixSize );
+		for( int y = 0; y < m_Height && !cancelled() && !m_SourceFailed; y++ ) {
+			loadRow( y + mat.height-1 );
+			for( int oy = 0; oy < mat.height; oy++ )
+				rows[oy] = row( y+oy );
+			unsigned char *dst = m_pDest ? m_pDest + m_DstStride*y : &out[0];
+			if( m_Serpentine && (y & 1) )
+				diffuseRow<TYPE, -1>( dst, 0, m_Width, rows, pal, m_Nearest );
+			else
+				diffuseRow<TYPE, 1>( dst, 0, m_Width, rows, pal, m_Nearest );
+			if( m_RowTarget ) m_RowTarget( y, dst );
+		}
+		return;
+	}
 
-			if( m_DitherType >= DITHER_FLOYDSTEINBERG && m_DitherType <= DITHER_ATKINSON ) {
-				// convert rgb values to target depth
-				*dst = getColor( src[2], src[1], src[0] );
-
-				// -- calc error
-				int eR = src[2] - round(palRed(*dst)*255);
-				int eG = src[1] - round(palGreen(*dst)*255);
-				int eB = src[0] - round(palBlue(*dst)*255);
-				// get matrix
-				ErrorDiffusionMatrix& mat = ErrorDiffusionMatrices[m_DitherType-DITHER_FLOYDSTEINBERG];
-				unsigned char *fsd = src + m_SrcPixSize;
-				int ox = 1 - mat.offset, oy = 0, el = 0;
-				while( oy < mat.height ) {
-					// skip if outside image
-					int tx = x+ox-mat.offset;
-					if( tx >= 0 && tx < m_Width && y+oy < m_Height ) {
-						// apply element
-						fsd[2] = cclip( fsd[2] + ((eR*mat.matrix[el])/mat.div) );
-						fsd[1] = cclip( fsd[1] + ((eG*mat.matrix[el])/mat.div) );
-						fsd[0] = cclip( fsd[0] + ((eB*mat.matrix[el])/mat.div) );
-					}
-					// increase element
-					el++;
-					ox++;
-					fsd += m_SrcPixSize;
-					if( ox == mat.width ) {
-						ox = 0;
-						oy++;
-						fsd += m_SrcStride - mat.width*m_SrcPixSize;
+	// diffused pixels per row
+	std::vector< std::atomic<int> > done( m_Height );
+	for( int y = 0; y < m_Height; y++ )
+		done[y].store( 0, std::memory_order_relaxed );
+
+	parallelFor( threads, threads, [&]( int t ) {
+		NearestTable table = m_Nearest;
+		int *rows[4];
+		for( int y = t; y < m_Height; y += threads ) {
+			loadRow( y + mat.height-1 );
+			for( int oy = 0; oy < mat.height; oy++ )
+				rows[oy] = row( y+oy );
+			for( int x = 0; x < m_Width; x += DIFFUSION_CHUNK ) {
+				int x2 = std::min( x + DIFFUSION_CHUNK, m_Width );
+				// rows stop together, the row above may not finish
+				if( cancelled() ) return;
+				if( y > 0 ) {
+					int need = std::min( x2 + lag, m_Width );
+					while( done[y-1].load( std::memory_order_acquire ) < need ) {
+						if( cancelled() ) return;
+						std::this_thread::yield();
 					}
 				}
-			} else if( m_DitherType == DITHER_ORDERED ) {
-				// get matrix value
-				unsigned char matval = ordered_dither_mat[ (x-m_OffsetX)%matw + matw*((y-m_OffsetY)%math) ];
-				unsigned char r = cclip( src[2] + matval * cthreshR / matf );
-				unsigned char g = cclip( src[1] + matval * cthreshG / matf );
-				unsigned char b = cclip( src[0] + matval * cthreshB / matf );
-				*dst = getColor( r, g, b );
-			} else  {
-				// undithered
-				*dst = getColor( src[2], src[1], src[0] );
+				diffuseRow<TYPE, 1>( m_pDest + m_DstStride*y, x, x2, rows, pal, table );
+				done[y].store( x2, std::memory_order_release );
 			}
-			// next pixel
-			src += m_SrcPixSize;
-			dst += m_DstPixSize;
 		}
+	} );
+}
+
+template<ColorReducer::DitherType TYPE, int DIR>
+void ColorReducer::diffuseRow( unsigned char *dst, int x1, int x2, int *const *rows, const int *pal, NearestTable& table ) const
+{
+	int x = DIR > 0 ? x1 : x2-1;
+	for( int i = x1; i < x2; i++ ) {
+		const int *p = rows[0] + 3*x;
+		int c = nearestColor( p[0], p[1], p[2], table );
+		dst[m_DstPixSize*x] = c;
+		// spread difference with the palette colour
+		const int *rgb = pal + 3*c;
+		DiffuseError<TYPE - DITHER_FLOYDSTEINBERG, DIR>::apply( rows, x, p[0]-rgb[0], p[1]-rgb[1], p[2]-rgb[2] );
+		x += DIR;
 	}
-	// clean up
-	if( m_DitherType >= DITHER_FLOYDSTEINBERG ) {
-		delete [] srcdat;
-	} else if( m_DitherType == DITHER_ORDERED ) {
-		delete [] ordered_dither_mat;
+}
+
+// add with clipping at 255
+static void addSaturated( const unsigned char *src, const unsigned char *add, unsigned char *dest, int count )
+{
+	int i = 0;
+#ifdef POLKA_SSE2
+	for( ; i+16 <= count; i += 16 ) {
+		__m128i s = _mm_loadu_si128( reinterpret_cast<const __m128i*>(src+i) );
+		__m128i a = _mm_loadu_si128( reinterpret_cast<const __m128i*>(add+i) );
+		_mm_storeu_si128( reinterpret_cast<__m128i*>(dest+i), _mm_adds_epu8( s, a ) );
 	}
+#endif
+	for( ; i < count; i++ )
+		dest[i] = std::min( src[i] + add[i], 255 );
+}
 
-	return true;
+void ColorReducer::mapRows( int y1, int y2, const unsigned char *offsets, int offsetRows, NearestTable& table ) const
+{
+	std::vector<unsigned char> scratch( offsets ? m_Width*m_SrcPixSize : 0 );
+	for( int y = y1; y < y2 && !cancelled(); y++ )
+		mapRow( y, m_pSource + m_SrcStride*y, m_pDest + m_DstStride*y, offsets, offsetRows, scratch.data(), table );
 }
 
-int ColorReducer::getColor( int r, int g, int b )
+void ColorReducer::mapRow( int y, const unsigned char *src, unsigned char *dst, const unsigned char *offsets,
+                           int offsetRows, unsigned char *scratch, NearestTable& table ) const
+{
+	if( offsets ) {
+		// apply dither matrix row
+		int bytes = m_Width*m_SrcPixSize;
+		addSaturated( src, offsets + bytes*((y-m_OffsetY+offsetRows)%offsetRows), scratch, bytes );
+		src = scratch;
+	}
+	for( int x = 0; x < m_Width; x++ ) {
+		*dst = nearestColor( src[2], src[1], src[0], table );
+		// next pixel
+		src += m_SrcPixSize;
+		dst += m_DstPixSize;
+	}
+}
+
+#ifdef POLKA_SSE2
+// signed minimum of four ints, sse2 only compares
+static inline __m128i min4( __m128i a, __m128i b )
 {
-	int c = -1, cerr = 0x7FFFFFFF;
-	// convert to 0..255
+	__m128i lt = _mm_cmplt_epi32( a, b );
+	return _mm_or_si128( _mm_and_si128( lt, a ), _mm_andnot_si128( lt, b ) );
+}
+#endif
+
+// lowest block error of all colour pairs when every pixel takes the
+// closer colour of the pair, the first pair wins on equal errors
+static void bestPair( const int (*errors)[16], int count, int& first, int& second )
+{
+	int best = INT_MAX;
+	for( int a = 0; a < count; a++ ) {
+		// errors with a and every other colour
+		int sum[16];
+#ifdef POLKA_SSE2
+		__m128i s0 = _mm_setzero_si128(), s1 = s0, s2 = s0, s3 = s0;
+		for( int i = 0; i < 8; i++ ) {
+			const __m128i *e = reinterpret_cast<const __m128i*>(errors[i]);
+			__m128i ea = _mm_set1_epi32( errors[i][a] );
+			s0 = _mm_add_epi32( s0, min4( ea, _mm_loadu_si128( e ) ) );
+			s1 = _mm_add_epi32( s1, min4( ea, _mm_loadu_si128( e+1 ) ) );
+			s2 = _mm_add_epi32( s2, min4( ea, _mm_loadu_si128( e+2 ) ) );
+			s3 = _mm_add_epi32( s3, min4( ea, _mm_loadu_si128( e+3 ) ) );
+		}
+		_mm_storeu_si128( reinterpret_cast<__m128i*>(sum), s0 );
+		_mm_storeu_si128( reinterpret_cast<__m128i*>(sum+4), s1 );
+		_mm_storeu_si128( reinterpret_cast<__m128i*>(sum+8), s2 );
+		_mm_storeu_si128( reinterpret_cast<__m128i*>(sum+12), s3 );
+#else
+		for( int b = 0; b < 16; b++ )
+			sum[b] = 0;
+		for( int i = 0; i < 8; i++ )
+			for( int b = 0; b < 16; b++ )
+				sum[b] += std::min( errors[i][a], errors[i][b] );
+#endif
+		for( int b = a; b < count; b++ )
+			if( sum[b] < best ) {
+				best = sum[b];
+				first = a;
+				second = b;
+			}
+	}
+}
+
+bool ColorReducer::generatePatterns( unsigned char *patterns, unsigned char *colors, int columns )
+{
+	// must have all data
+	if( !m_pSource && !m_pRowSource ) return false;
+	if( !patterns || !colors ) return false;
+	// pairs come from a palette of up to 16 colours
+	if( m_Palette.empty() || m_Palette.size() > 16 ) return false;
+	if( !rewindSource() ) return false;
+	if( columns <= 0 ) columns = (m_Width+7)/8;
+
+	// palette at 8 bits and in the error space
+	int n = (1<<m_Depth)-1;
+	int pal[3*16];
+	ColorDistance::Lab points[16];
+	for( unsigned int i = 0; i < m_Palette.size(); i++ ) {
+		pal[3*i]   =  (m_Palette[i] >> 16         )*255/n;
+		pal[3*i+1] = ((m_Palette[i] & 0xFF00) >> 8)*255/n;
+		pal[3*i+2] =  (m_Palette[i] & 255         )*255/n;
+		m_Distance.point( pal[3*i], pal[3*i+1], pal[3*i+2], points[i] );
+	}
+	std::vector<unsigned char> ordered;
+	int matw = 0, math = 0;
+	if( m_DitherType == DITHER_ORDERED )
+		orderedMatrix( ordered, matw, math );
+	const unsigned char *ord = ordered.empty() ? 0 : &ordered[0];
+
+	if( m_pRowSource ) {
+		// rows in order
+		for( int y = 0; y < m_Height && !cancelled(); y++ ) {
+			const unsigned char *src = sourceRow( y );
+			if( !src ) break;
+			patternRow( y, src, patterns, colors, columns, pal, points, ord, matw, math );
+		}
+		return !cancelled() && !m_SourceFailed;
+	}
+
+	// blocks only depend on their own pixels, convert bands of rows in
+	// parallel
+	int bands = std::max( 1, std::min( m_Threads, m_Height / MIN_BAND_ROWS ) );
+	parallelFor( bands, bands, [&]( int band ) {
+		for( int y = m_Height*band/bands; y < m_Height*(band+1)/bands && !cancelled(); y++ )
+			patternRow( y, m_pSource + m_SrcStride*y, patterns, colors, columns, pal, points, ord, matw, math );
+	} );
+	return !cancelled();
+}
+
+void ColorReducer::patternRow( int y, const unsigned char *src, unsigned char *patterns, unsigned char *colors,
+                               int columns, const int *pal, const ColorDistance::Lab *points,
+                               const unsigned char *ordered, int matw, int math ) const
+{
+	int count = m_Palette.size();
+	int row = (y >> 3)*columns*8 + (y & 7);
+	for( int x = 0; x < m_Width; x += 8 ) {
+		const unsigned char *block = src + x*m_SrcPixSize;
+		int pixels = std::min( 8, m_Width - x );
+
+		// error of every pixel with every colour, missing pixels add
+		// nothing
+		int errors[8][16];
+		for( int i = 0; i < 8; i++ ) {
+			if( i >= pixels ) {
+				memset( errors[i], 0, sizeof(errors[i]) );
+				continue;
+			}
+			const unsigned char *p = block + i*m_SrcPixSize;
+			ColorDistance::Lab point;
+			m_Distance.point( p[2], p[1], p[0], point );
+			for( int c = 0; c < 16; c++ )
+				errors[i][c] = c < count ? m_Distance.error( point, points[c] ) : MAX_BLOCK_ERROR;
+		}
+		int back = 0, fore = 0;
+		bestPair( errors, count, back, fore );
+
+		// pick the foreground pixels
+		unsigned char bits = 0;
+		const int *pb = pal + 3*back, *pf = pal + 3*fore;
+		int dr = pf[0]-pb[0], dg = pf[1]-pb[1], db = pf[2]-pb[2];
+		int len = dr*dr + dg*dg + db*db;
+		int er = 0, eg = 0, eb = 0;
+		for( int i = 0; i < pixels && back != fore; i++ ) {
+			const unsigned char *p = block + i*m_SrcPixSize;
+			bool set;
+			if( ordered && len ) {
+				// position between the colours against the matrix
+				int pos = (p[2]-pb[0])*dr + (p[1]-pb[1])*dg + (p[0]-pb[2])*db;
+				int v = ordered[ (x+i-m_OffsetX+matw)%matw + matw*((y-m_OffsetY+math)%math) ];
+				set = pos*(matw*math+1) > v*len;
+			} else if( m_DitherType >= DITHER_FLOYDSTEINBERG ) {
+				// carry the error to the next pixel of the block
+				int r = p[2]+er, g = p[1]+eg, b = p[0]+eb;
+				ColorDistance::Lab point;
+				m_Distance.point( cclip(r), cclip(g), cclip(b), point );
+				set = m_Distance.error( point, points[fore] ) < m_Distance.error( point, points[back] );
+				const int *c = set ? pf : pb;
+				er = r-c[0];
+				eg = g-c[1];
+				eb = b-c[2];
+			} else {
+				set = errors[i][fore] < errors[i][back];
+			}
+			if( set ) bits |= 0x80 >> i;
+		}
+		patterns[row + x] = bits;
+		colors[row + x] = (fore << 4) | back;
+	}
+}
+
+void ColorReducer::invalidateNearest()
+{
+	m_NearestValid = false;
+}
+
+void ColorReducer::prepareNearest()
+{
+	// convert palette to 0..255
 	int n = (1<<m_Depth)-1;
+	std::vector<int> rgb( 3*m_Palette.size() );
 	for( unsigned int i = 0; i < m_Palette.size(); i++ ) {
-		int err = colorError( r, g, b,
-							  (m_Palette[i] >> 16         )*255/n, 
-							 ((m_Palette[i] & 0xFF00) >> 8)*255/n, 
-							  (m_Palette[i] & 255         )*255/n );
-		if( err < cerr ) {
-			c = i;
-			cerr = err;
+		rgb[3*i]   =  (m_Palette[i] >> 16         )*255/n;
+		rgb[3*i+1] = ((m_Palette[i] & 0xFF00) >> 8)*255/n;
+		rgb[3*i+2] =  (m_Palette[i] & 255         )*255/n;
+	}
+	m_Distance.setPalette( rgb.data(), m_Palette.size() );
+	// start with an empty table
+	m_Nearest.Shift = 20;
+	m_Nearest.Entries.assign( 1 << (32-m_Nearest.Shift), NEAREST_EMPTY );
+	m_Nearest.Used = 0;
+	m_NearestValid = true;
+}
+
+int ColorReducer::getColor( int r, int g, int b )
+{
+	if( !m_NearestValid ) prepareNearest();
+	return nearestColor( r, g, b, m_Nearest );
+}
+
+int ColorReducer::nearestColor( int r, int g, int b, NearestTable& table ) const
+{
+	if( m_Palette.empty() ) return -1;
+	// values outside the colour cube are not cached
+	if( (r | g | b) & ~255 ) return m_Distance.nearest( r, g, b );
+
+	unsigned int key = (r << 16) | (g << 8) | b;
+	unsigned int mask = table.Entries.size()-1;
+	unsigned int i = (key * 0x9E3779B1u) >> table.Shift;
+	while( table.Entries[i] != NEAREST_EMPTY ) {
+		if( (table.Entries[i] >> 8) == key )
+			return int(table.Entries[i] & 255) - 1;
+		i = (i+1) & mask;
+	}
+	int c = m_Distance.nearest( r, g, b );
+	table.Entries[i] = (key << 8) | (c+1);
+	// keep the table at most half full
+	if( ++table.Used > table.Entries.size()/2 ) {
+		std::vector<unsigned int> old( 2*table.Entries.size(), NEAREST_EMPTY );
+		old.swap( table.Entries );
+		table.Shift--;
+		mask = table.Entries.size()-1;
+		for( unsigned int j = 0; j < old.size(); j++ ) {
+			if( old[j] == NEAREST_EMPTY ) continue;
+			unsigned int n = ((old[j] >> 8) * 0x9E3779B1u) >> table.Shift;
+			while( table.Entries[n] != NEAREST_EMPTY ) n = (n+1) & mask;
+			table.Entries[n] = old[j];
 		}
 	}
 	return c;
@@ -644,65 +1361,80 @@ void ColorReducer::debug()
 	std::cout << "Image: (" << m_Width << ", " << m_Height << "), stride: " << m_SrcStride << std::endl;
 	std::cout << "Target: " << m_NumCols << " colors/" << m_Depth << " bit\n";
 	std::cout << "Color tree:\n";
-	m_Root.debug(" ");
-	std::cout << "\nColor count:" << m_Root.ColorCount << std::endl;
+	m_Tree.debug();
+	std::cout << "\nColor count:" << m_Tree.ColorCount << std::endl;
 }
 
 
 /*
- * ColorNode class
+ * ColorTree class
  * 
- * This class represents a node in the rgb color tree.
+ * This class represents the rgb color tree. Nodes are stored in a pool
+ * with the root node first.
  */
 
-ColorReducer::ColorNode::ColorNode( ColorReducer *cr )
-	: NR(0), NG(0), NB(0)
-{
-	m_pRootNode = this;
-	m_pOwner = cr;
-	m_pParent = 0;
-	ColorCount = 0;
-}
+// leaf error cache size
+static const int TREE_ERROR_CACHE = 4096;
 
-ColorReducer::ColorNode::~ColorNode()
+// node that holds all of its pixels and can be merged into its parent
+struct TreeCandidate {
+	long long Error;
+	int Key, Node;
+	unsigned int Stamp;
+	// lowest error on top, first in tree order on equal errors
+	bool operator<( const TreeCandidate& c ) const
+	{
+		return Error > c.Error || (Error == c.Error && Key > c.Key);
+	}
+};
+
+ColorReducer::ColorTree::ColorTree( ColorReducer *cr )
+	: ColMin(0), ColRange(255), ColorCount(0), m_pOwner(cr), m_Level(0)
 {
 }
 
-void ColorReducer::ColorNode::reset( int depth )
+ColorReducer::ColorTree::~ColorTree()
 {
-	// only root node
-	assert( this == m_pRootNode );
-	// clear children
-	clear();
-	Level = depth;
-	// determine color correction values
-	ColMin = 128 >> Level;
-	ColRange = ((0xFF80 >> Level) & 255) - ColMin;
-	ColFact = double(ColRange)/255;
 }
 
-void ColorReducer::ColorNode::clear()
+void ColorReducer::ColorTree::reset( int depth )
 {
-	// clear all children
-	for( unsigned int i = 0; i < m_Nodes.size(); i++ )
-		m_Nodes[i].clear();
-	// empty values
-	NumPix = NumLPix = 0;;
-	RSum = GSum = BSum = 0;
-	Error = 0;
+	m_Nodes.clear();
+	ColorCount = 0;
+	m_Level = depth;
+	// determine color correction values
+	ColMin = 128 >> m_Level;
+	ColRange = ((0xFF80 >> m_Level) & 255) - ColMin;
+	double fact = double(ColRange)/255;
+	for( int v = 0; v < 256; v++ )
+		m_ColTable[v] = ColMin+round(fact*v);
+	m_ErrorKeys.assign( TREE_ERROR_CACHE, 0 );
+	m_Errors.resize( TREE_ERROR_CACHE );
+	// root node
+	addNode( -1, 0, 0, 0 );
 }
 
-void ColorReducer::ColorNode::setNode( ColorNode *root, ColorNode *parent, int r, int g, int b )
+int ColorReducer::ColorTree::addNode( int parent, int r, int g, int b )
 {
-	clear();
-	m_pRootNode = root;
-	m_pParent = parent;
-	m_pOwner = root->m_pOwner;
-	Level = m_pParent->Level-1;
-	NR = r; NG = g; NB = b;
+	Node n;
+	n.NR = r; n.NG = g; n.NB = b;
+	n.Level = parent < 0 ? m_Level : m_Nodes[parent].Level-1;
+	n.Parent = parent;
+	for( int i = 0; i < 8; i++ )
+		n.Children[i] = -1;
+	n.NumPix = n.NumLPix = 0;
+	n.RSum = n.GSum = n.BSum = 0;
+	n.Error = 0;
+	// interleaved rgb bits order nodes like a depth first walk
+	n.Key = 0;
+	for( int bit = 128; bit; bit >>= 1 )
+		n.Key = (n.Key << 3) | (r & bit?4:0) | (g & bit?2:0) | (b & bit?1:0);
+	n.Stamp = 0;
+	m_Nodes.push_back( n );
+	return m_Nodes.size()-1;
 }
 
-int ColorReducer::ColorNode::colorError( int R1, int G1, int B1, int R2, int G2, int B2 )
+int ColorReducer::ColorTree::colorError( int R1, int G1, int B1, int R2, int G2, int B2 ) const
 {
 	return m_pOwner->colorError( R1, G1, B1, R2, G2, B2 );
 }
@@ -710,9 +1442,9 @@ int ColorReducer::ColorNode::colorError( int R1, int G1, int B1, int R2, int G2,
 /*
  * Add a pixel to the octree.
  * 
- * When the level is greater than zero, the node is split into eight
- * children (three bit number), which represents whether the R, G or B
- * bit for this level was set or not.
+ * When the level is greater than zero, the pixel is added to one of
+ * eight children (three bit number), which represents whether the R, G
+ * or B bit for this level was set or not.
  * 
  * At zero level, the RGB values are added to the total and leaf pixel
  * count is increased. Also, the error with respect to the centre of
@@ -722,134 +1454,168 @@ int ColorReducer::ColorNode::colorError( int R1, int G1, int B1, int R2, int G2,
  * noticeable on lower palette depths. This is that the octree divides
  * the color space in 2^depth blocks per component. However, values
  * range between minimum and maximum allowing only 2^depth-1 blocks.
- * To compensate for this, the colorspace is shrunk in the root node,
+ * To compensate for this, the colorspace is shrunk at the root node,
  * resulting in efficively only half a block at either end of the 
  * spectrum.
  * 
  * r, g, b: color components ranging from 0 to 255.
  */ 
-void ColorReducer::ColorNode::addPixel( int r, int g, int b )
-{
-	if( this == m_pRootNode ) {
-		r = ColMin+round(ColFact*r);
-		g = ColMin+round(ColFact*g);
-		b = ColMin+round(ColFact*b);
-	}
-	// add pixel count
-	NumPix++;
-	if( Level >  0 ) {
-		// handle child nodes
-		int lvl = Level-1, bit = 256>>(m_pRootNode->Level-lvl);
-		if( !m_Nodes.size() ) {
-			// create child nodes
-			m_Nodes.resize(8);
-			for( int i = 0; i < 8; i++ ) {
-				m_Nodes[i].setNode( m_pRootNode, this, NR + (i&4?bit:0), NG + (i&2?bit:0), NB + (i&1?bit:0) );
-			}
-		}
-		// add to subnode
+void ColorReducer::ColorTree::addPixel( int r, int g, int b )
+{
+	r = m_ColTable[r];
+	g = m_ColTable[g];
+	b = m_ColTable[b];
+	// walk down to the leaf node
+	int node = 0;
+	while( m_Nodes[node].Level > 0 ) {
+		Node& n = m_Nodes[node];
+		n.NumPix++;
+		int bit = 256 >> (m_Level-n.Level+1);
 		int v = (r & bit?4:0) + (g & bit?2:0) + (b & bit?1:0);
-		m_Nodes[v].addPixel(r, g, b);
-	} else {
-		// leaf node
-		if( NumLPix == 0 ) m_pRootNode->ColorCount++;
-		NumLPix++;
-		// add color sum
-		RSum += r;
-		GSum += g;
-		BSum += b;
-		// calculate error
-		int bit = 128 >> m_pRootNode->Level;
-		Error += colorError( r, g, b,  NR|bit, NG|bit, NB|bit );
+		int child = n.Children[v];
+		if( child < 0 ) {
+			child = addNode( node, n.NR + (v&4?bit:0), n.NG + (v&2?bit:0), n.NB + (v&1?bit:0) );
+			m_Nodes[node].Children[v] = child;
+		}
+		node = child;
 	}
+	// leaf node
+	Node& n = m_Nodes[node];
+	n.NumPix++;
+	if( n.NumLPix == 0 ) ColorCount++;
+	n.NumLPix++;
+	// add color sum
+	n.RSum += r;
+	n.GSum += g;
+	n.BSum += b;
+	// the error only depends on the color
+	unsigned int key = 0x1000000 | (r << 16) | (g << 8) | b;
+	int slot = (key * 0x9E3779B1u) >> 20;
+	if( m_ErrorKeys[slot] != key ) {
+		int bit = 128 >> m_Level;
+		m_ErrorKeys[slot] = key;
+		m_Errors[slot] = colorError( r, g, b,  n.NR|bit, n.NG|bit, n.NB|bit );
+	}
+	n.Error += m_Errors[slot];
 }
 
-long long ColorReducer::ColorNode::error()
+long long ColorReducer::ColorTree::error( int node ) const
 {
-	if( m_pParent ) {
-		if( m_pParent->NumLPix ) {
+	const Node& n = m_Nodes[node];
+	if( n.Parent >= 0 ) {
+		const Node& p = m_Nodes[n.Parent];
+		if( p.NumLPix ) {
 			// parent has leaf nodes, use error between averages instead
-			return NumLPix * colorError( double(RSum)/NumLPix, double(GSum)/NumLPix, double(BSum)/NumLPix,
-			                             double(m_pParent->RSum)/m_pParent->NumLPix, double(m_pParent->GSum)/m_pParent->NumLPix, double(m_pParent->BSum)/m_pParent->NumLPix );
+			return n.NumLPix * (long long)colorError( double(n.RSum)/n.NumLPix, double(n.GSum)/n.NumLPix, double(n.BSum)/n.NumLPix,
+			                                          double(p.RSum)/p.NumLPix, double(p.GSum)/p.NumLPix, double(p.BSum)/p.NumLPix );
 		}
 	}
-	return Error;
+	return n.Error;
 }
 
 /*
- * Find the node with the lowest error
+ * Merge the nodes with the lowest error into their parents. Nodes that
+ * hold all of their pixels are queued with their error, which is
+ * updated when a sibling is merged into the parent.
  */
-ColorReducer::ColorNode& ColorReducer::ColorNode::findMinError()
+void ColorReducer::ColorTree::reduce( unsigned int colors )
 {
-	if( NumPix - NumLPix > 0 ) {
-		// nodes contained in children
-		// this must have lower error
-		ColorNode *low = 0;
-		for( int i = 0; i < 8; i++ )
-			if( m_Nodes[i].NumPix > 0 ) {
-				if( low ) {
-					ColorNode& child = m_Nodes[i].findMinError();
-					if( child.error() < low->error() )
-						low = &child;
-				} else
-					low = &m_Nodes[i].findMinError();
-			}
-		return *low;					
-	} else 
-		return *this;
+	std::priority_queue<TreeCandidate> queue;
+	auto push = [&]( int node ) {
+		Node& n = m_Nodes[node];
+		TreeCandidate cand = { error( node ), n.Key, node, ++n.Stamp };
+		queue.push( cand );
+	};
+	for( unsigned int i = 0; i < m_Nodes.size(); i++ )
+		if( m_Nodes[i].Level == 0 )
+			push( i );
+
+	while( ColorCount > colors && !queue.empty() ) {
+		TreeCandidate cand = queue.top();
+		queue.pop();
+		const Node& n = m_Nodes[cand.Node];
+		if( n.NumPix == 0 || n.Stamp != cand.Stamp ) continue;
+		remove( cand.Node );
+		// siblings change error, the parent may have become mergeable
+		const Node& p = m_Nodes[n.Parent];
+		bool children = false;
+		for( int i = 0; i < 8; i++ ) {
+			int c = p.Children[i];
+			if( c < 0 || m_Nodes[c].NumPix == 0 ) continue;
+			children = true;
+			if( m_Nodes[c].NumLPix == m_Nodes[c].NumPix )
+				push( c );
+		}
+		if( !children && p.Parent >= 0 )
+			push( n.Parent );
+	}
 }
 
-void ColorReducer::ColorNode::remove()
+void ColorReducer::ColorTree::remove( int node )
 {
-	assert( NumPix > 0 );
-	assert( NumLPix == NumPix );
-	assert( m_pParent );
+	Node& n = m_Nodes[node];
+	Node& p = m_Nodes[n.Parent];
+	assert( n.NumPix > 0 );
+	assert( n.NumLPix == n.NumPix );
 	// global colorcount reduces if parent already has nodes
-	if( m_pParent->NumLPix != 0 )
-		m_pRootNode->ColorCount--;
+	if( p.NumLPix != 0 )
+		ColorCount--;
 	// move pixels to parent
-	m_pParent->RSum += RSum;
-	m_pParent->GSum += GSum;
-	m_pParent->BSum += BSum;
-	RSum = GSum = BSum = 0;
+	p.RSum += n.RSum;
+	p.GSum += n.GSum;
+	p.BSum += n.BSum;
+	n.RSum = n.GSum = n.BSum = 0;
 	// The error with respect to the parent node is the error of this
 	// node plus the distance between nodes cube centres
-	int bit1 = 128>>(m_pParent->Level - Level), bit2 = bit1 << 1;
-	m_pParent->Error += Error + NumLPix * colorError(            NR|bit1,            NG|bit1,            NB|bit1,
-	                                                  m_pParent->NR|bit2, m_pParent->NG|bit2, m_pParent->NB|bit2 );
+	int bit1 = 128>>(p.Level - n.Level), bit2 = bit1 << 1;
+	p.Error += n.Error + n.NumLPix * (long long)colorError(      n.NR|bit1,      n.NG|bit1,      n.NB|bit1,
+	                                                             p.NR|bit2,      p.NG|bit2,      p.NB|bit2 );
 	// move nodes
-	m_pParent->NumLPix += NumLPix;
-	NumPix = NumLPix = 0;
+	p.NumLPix += n.NumLPix;
+	n.NumPix = n.NumLPix = 0;
+}
+
+void ColorReducer::ColorTree::createPalette( std::vector<int>& pal )
+{
+	if( !m_Nodes.empty() )
+		createPalette( 0, pal );
 }
 
-void ColorReducer::ColorNode::createPalette( std::vector<int>& pal )
+void ColorReducer::ColorTree::createPalette( int node, std::vector<int>& pal )
 {
-	if( NumLPix > 0 ) {
+	const Node& nd = m_Nodes[node];
+	if( nd.NumLPix > 0 ) {
 		// calc RGB color
-		int n = (1<<m_pRootNode->Level)-1;
-		int avgR = round(n*(double(RSum)/NumLPix - m_pRootNode->ColMin) / m_pRootNode->ColRange);
-		int avgG = round(n*(double(GSum)/NumLPix - m_pRootNode->ColMin) / m_pRootNode->ColRange);
-		int avgB = round(n*(double(BSum)/NumLPix - m_pRootNode->ColMin) / m_pRootNode->ColRange);
+		int n = (1<<m_Level)-1;
+		int avgR = round(n*(double(nd.RSum)/nd.NumLPix - ColMin) / ColRange);
+		int avgG = round(n*(double(nd.GSum)/nd.NumLPix - ColMin) / ColRange);
+		int avgB = round(n*(double(nd.BSum)/nd.NumLPix - ColMin) / ColRange);
 		pal.push_back( (avgR << 16) | (avgG << 8) | avgB );
 	}
 	
-	if( Level > 0 )
-		for( unsigned int i = 0; i <	m_Nodes.size(); i++ )
-			if( m_Nodes[i].NumPix > 0 )
-				m_Nodes[i].createPalette(pal);
+	for( int i = 0; i < 8; i++ )
+		if( nd.Children[i] >= 0 && m_Nodes[nd.Children[i]].NumPix > 0 )
+			createPalette( nd.Children[i], pal );
+}
 
+void ColorReducer::ColorTree::debug()
+{
+	if( !m_Nodes.empty() )
+		debug( 0, " " );
 }
 
-void ColorReducer::ColorNode::debug( std::string indent )
+void ColorReducer::ColorTree::debug( int node, std::string indent )
 {
-	if( NumPix > 0 ) {
-		std::cout << indent << "Node: " << NR << ", " << NG << ", " << NB << std::endl;
-		std::cout << indent << "Pixels: " << NumLPix << "/"<< NumPix << std::endl;
-		std::cout << indent << "Sums: " << RSum << ", " << GSum << ", " << BSum << std::endl;
-		std::cout << indent << "Error: " << Error << std::endl;
+	const Node& n = m_Nodes[node];
+	if( n.NumPix > 0 ) {
+		std::cout << indent << "Node: " << n.NR << ", " << n.NG << ", " << n.NB << std::endl;
+		std::cout << indent << "Pixels: " << n.NumLPix << "/"<< n.NumPix << std::endl;
+		std::cout << indent << "Sums: " << n.RSum << ", " << n.GSum << ", " << n.BSum << std::endl;
+		std::cout << indent << "Error: " << n.Error << std::endl;
 
-		for( unsigned int i = 0; i < m_Nodes.size(); i++ )
-			m_Nodes[i].debug( indent + "  " );
+		for( int i = 0; i < 8; i++ )
+			if( n.Children[i] >= 0 )
+				debug( n.Children[i], indent + "  " );
 	}
 }
 
@@ -23,7 +23,10 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <atomic>
+#include <functional>
 #include <glibmm/ustring.h>
+#include "ColorDistance.h"
 
 namespace Polka {
 
@@ -52,13 +55,48 @@ public:
 	void setRGBSource( const unsigned char *src, int width, int height, int pixsize = 4, int stride = -1 );
 	void setTarget( const std::string& palette, unsigned char *dest, int pixsize = 1, int stride = -1 );
 
+	// sources too large to keep in memory deliver their rows in order,
+	// once for quantization and once for image generation
+	class RowSource
+	{
+	public:
+		virtual ~RowSource() {}
+		// restart at the first row
+		virtual bool rewind() = 0;
+		// next row, 0 on errors
+		virtual const unsigned char *readRow() = 0;
+	};
+	typedef std::function<void(int, const unsigned char*)> RowTarget;
+
+	void setRowSource( RowSource *source, int width, int height, int pixsize = 4 );
+	// generated rows are passed on in order instead of stored
+	void setRowTarget( const std::string& palette, const RowTarget& target );
+
+	// number of threads used for large images
+	void setThreads( int threads );
+	// quantization and image generation stop and fail when set
+	void setCancelFlag( const std::atomic<bool> *cancel );
+
 	// select technique for color reduction
 	void setQuantizationMethod( QuantizationMethod method, ColorErrorMethod error );
 	void setDitherType( DitherType type, int orderx = 2, int ordery = 2, int offsetx = 0, int offsety = 0 );
+	// error diffusion alternates the scan direction every row
+	void setSerpentine( bool serpentine );
 
 	// apply color reduction
 	bool quantizeColors();
 	bool generateImage();
+	// use count fixed 8 bit rgb colours instead of quantizing, after
+	// setting the target
+	void setPalette( const unsigned char *rgb, int count );
+
+	// screen 2 and 4 tiles with two colours per 8x1 block instead of an
+	// image. bits set in a pattern byte select the foreground colour from
+	// the left at bit 7, colour bytes hold the foreground in the high and
+	// the background in the low nibble. both tables have 8 bytes per
+	// 8x8 character in rows of columns characters, the image width
+	// rounded up by default. dithering only works within a block.
+	bool generatePatterns( unsigned char *patterns, unsigned char *colors, int columns = -1 );
 	
 	// retrieve palette colors
 	int palSize() const;
@@ -74,6 +112,9 @@ protected:
 private:
 	const unsigned char *m_pSource;
 	unsigned char *m_pDest;
+	RowSource *m_pRowSource;
+	RowTarget m_RowTarget;
+	bool m_SourceFailed;
 	int m_Width, m_Height;
 	int m_SrcPixSize, m_SrcStride;
 	int m_DstPixSize, m_DstStride;
@@ -83,60 +124,125 @@ private:
 	QuantizationMethod m_QuantMethod;
 	ColorErrorMethod m_ColorErrorMethod;
 	int m_OrderX, m_OrderY, m_OffsetX, m_OffsetY;
+	bool m_Serpentine;
 
 	// color error calculation
-	void rgbToLab( int ri, int gi, int bi, double& L, double& a, double& b );
+	ColorDistance m_Distance;
+	void updateDistance();
 	int colorError( int R1, int G1, int B1, int R2, int G2, int B2 );
 
 	// palette storage after quantization
 	std::vector<int> m_Palette;
 
-	// Color list for quantization
-	std::map<int,int> m_ColorCounts;
+	// nearest palette index per source colour, entries hold the packed
+	// rgb value above the index and are filled on first use
+	struct NearestTable {
+		NearestTable() : Used(0), Shift(0) {}
+		std::vector<unsigned int> Entries;
+		unsigned int Used;
+		int Shift;
+	};
+	NearestTable m_Nearest;
+	bool m_NearestValid;
+
+	void invalidateNearest();
+	void prepareNearest();
+	int nearestColor( int r, int g, int b, NearestTable& table ) const;
+
+	// source rows in order, 0 when a streamed source fails
+	bool rewindSource();
+	const unsigned char *sourceRow( int y );
+
+	// palette indices for rows without error diffusion, ordered dither
+	// offsets per matrix row when given
+	void mapRows( int y1, int y2, const unsigned char *offsets, int offsetStride, NearestTable& table ) const;
+	void mapRow( int y, const unsigned char *src, unsigned char *dst, const unsigned char *offsets,
+	             int offsetRows, unsigned char *scratch, NearestTable& table ) const;
+
+	// ordered dither matrix of matw by math values 1..matw*math
+	void orderedMatrix( std::vector<unsigned char>& mat, int& matw, int& math ) const;
+
+	// best colour pair and pattern for each block of a row, pal holds
+	// the palette rgb values at 8 bits and points their distance space
+	// positions
+	void patternRow( int y, const unsigned char *src, unsigned char *patterns, unsigned char *colors,
+	                 int columns, const int *pal, const ColorDistance::Lab *points,
+	                 const unsigned char *ordered, int matw, int math ) const;
+
+	// error diffusion with the matrix and scan direction known at compile
+	// time. rows point at the diffused source values of the current row
+	// and the rows below it, pal holds the palette rgb values at 8 bits.
+	template<DitherType TYPE> void diffuseImage( const int *pal );
+	template<DitherType TYPE, int DIR>
+	void diffuseRow( unsigned char *dst, int x1, int x2, int *const *rows, const int *pal, NearestTable& table ) const;
+
+	int m_Threads;
+	const std::atomic<bool> *m_pCancel;
+
+	bool cancelled() const;
+
+	// color list for quantization, sorted on color value
+	struct ColorCount {
+		int Color, Count;
+	};
+	std::vector<ColorCount> m_ColorCounts;
 
 	void countColors();
 
-	// octree quantization node
-	class ColorNode
+	// elimination quantizers, merge colors until the palette fits and
+	// leave the remaining colors in the palette
+	void eliminateColors();
+	void eliminateColorsByError();
+
+	// octree quantization tree, nodes are kept in a flat pool and refer
+	// to each other by index
+	class ColorTree
 	{
 	public:
-		ColorNode( ColorReducer *cr = 0 );
-		~ColorNode();
+		ColorTree( ColorReducer *cr = 0 );
+		~ColorTree();
 	
 		void reset( int depth );
-		void clear();
 		void addPixel( int r, int g, int b );
-
-		long long error();
-		ColorNode& findMinError();
-		void remove();
+		// merge nodes until no more than the given colors are left
+		void reduce( unsigned int colors );
 		
 		void createPalette( std::vector<int>& pal );
 		
-		void debug( std::string indent );
+		void debug();
 
-		// private class, use public member vars for convenience
 		// color correction values
 		int ColMin, ColRange;
-		double ColFact;
-		int NumPix, NumLPix;
-		int RSum, GSum, BSum;
-		int Level, NR, NG, NB;
-		long long Error;
-
 		unsigned int ColorCount;
 
 	private:
-		std::vector<ColorNode> m_Nodes;
-		
-		ColorNode *m_pRootNode, *m_pParent;
-		ColorReducer  *m_pOwner;
-
-		void setNode( ColorNode *root, ColorNode *parent, int r, int g, int b );
-		int colorError( int R1, int G1, int B1, int R2, int G2, int B2 );
+		struct Node {
+			int NR, NG, NB, Level;
+			int Parent, Children[8];
+			int NumPix, NumLPix;
+			long long RSum, GSum, BSum;
+			long long Error;
+			// order of the node in the tree and version of its queued error
+			int Key;
+			unsigned int Stamp;
+		};
+		std::vector<Node> m_Nodes;
+		ColorReducer *m_pOwner;
+		int m_Level;
+		// shrunk rgb values
+		unsigned char m_ColTable[256];
+		// leaf errors per shrunk rgb value, filled on first use
+		std::vector<unsigned int> m_ErrorKeys;
+		std::vector<int> m_Errors;
+
+		int addNode( int parent, int r, int g, int b );
+		long long error( int node ) const;
+		void remove( int node );
+		void createPalette( int node, std::vector<int>& pal );
+		void debug( int node, std::string indent );
+		int colorError( int R1, int G1, int B1, int R2, int G2, int B2 ) const;
 	};
-	// root node
-	ColorNode m_Root;
+	ColorTree m_Tree;
 
 };
 
@@ -18,6 +18,7 @@
 */
 
 #include "ImageImport.h"
+#include "PngReader.h"
 #include "Palette.h"
 #include "Bmp16Canvas.h"
 #include "Project.h"
@@ -27,7 +28,11 @@
 #include <gtkmm/table.h>
 #include <cairomm/surface.h>
 #include <iostream>
+#include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <cstring>
+#include <tuple>
 
 using namespace std;
 
@@ -35,13 +40,101 @@ namespace Polka {
 
 const char PNG_HEADER[8] = { 137-256, 80, 78, 71, 13, 10, 26, 10 };
 
+// largest preview dimension, larger sources are first shown from a
+// reduced copy
+static const int PREVIEW_SIZE = 256;
+// converted images kept per importer
+static const unsigned int PREVIEW_CACHE_SIZE = 16;
+// images with more pixels are decoded from the file when needed
+// instead of being loaded
+static const double STREAM_PIXELS = 4096.0*4096.0;
+// rows collected before canvases are written
+static const int IMPORT_BAND_ROWS = 64;
+
+class ImageImporter::SurfaceRows : public ColorReducer::RowSource
+{
+public:
+	SurfaceRows( const unsigned char *data, int stride, int height )
+		: m_pData(data), m_Stride(stride), m_Height(height), m_Row(0) {}
+
+	virtual bool rewind()
+	{
+		m_Row = 0;
+		return true;
+	}
+
+	virtual const unsigned char *readRow()
+	{
+		if( m_Row >= m_Height ) return 0;
+		return m_pData + m_Stride*m_Row++;
+	}
+
+private:
+	const unsigned char *m_pData;
+	int m_Stride, m_Height, m_Row;
+};
+
+class ImageImporter::SliceWriter
+{
+public:
+	SliceWriter( const std::vector<Canvas*>& canvases, int width, int height,
+	             int slicew, int sliceh, int bandrows )
+		: m_Canvases(canvases), m_Width(width), m_Height(height),
+		  m_SliceWidth(slicew), m_SliceHeight(sliceh), m_BandRows(bandrows),
+		  m_BandY(0), m_Rows(0), m_Band(width*bandrows), m_Slice(slicew*bandrows) {}
+
+	// rows must come in order
+	void writeRow( int y, const unsigned char *row )
+	{
+		if( !m_Rows ) m_BandY = y;
+		memcpy( &m_Band[m_Rows*m_Width], row, m_Width );
+		m_Rows++;
+		// bands do not cross slices
+		if( m_Rows == m_BandRows || (y+1) % m_SliceHeight == 0 || y+1 == m_Height )
+			flush();
+	}
+
+private:
+	const std::vector<Canvas*>& m_Canvases;
+	int m_Width, m_Height, m_SliceWidth, m_SliceHeight, m_BandRows;
+	int m_BandY, m_Rows;
+	std::vector<char> m_Band, m_Slice;
+
+	void flush()
+	{
+		int cols = (m_Width + m_SliceWidth-1) / m_SliceWidth;
+		int first = m_BandY / m_SliceHeight * cols;
+		for( int sx = 0; sx < cols; sx++ ) {
+			int x = sx*m_SliceWidth, w = std::min( m_SliceWidth, m_Width - x );
+			const char *data = &m_Band[0];
+			if( cols > 1 ) {
+				// copy the part of the slice
+				for( int r = 0; r < m_Rows; r++ )
+					memcpy( &m_Slice[r*w], &m_Band[r*m_Width + x], w );
+				data = &m_Slice[0];
+			}
+			m_Canvases[first+sx]->setData( 0, m_BandY % m_SliceHeight, data, w, m_Rows );
+		}
+		m_Rows = 0;
+	}
+};
+
 ImageImporter::ImageImporter()
-	: Importer("PNGIMP"), m_Preview(*this)
+	: Importer("PNGIMP"),
+	  m_Streamed(false), m_Width(0), m_Height(0),
+	  m_ProxyWidth(0), m_ProxyHeight(0), m_CacheCounter(0),
+	  m_PreviewCancel(false),
+	  m_PreviewQuit(false), m_PreviewPending(false), m_PreviewBusy(false),
+	  m_RequestProxy(false),
+	  m_Preview(*this)
 {
+	m_PreviewDone.connect( sigc::mem_fun(*this, &ImageImporter::previewDone) );
+	m_Preview.signalSettingsChanged().connect( sigc::mem_fun(*this, &ImageImporter::requestPreview) );
 }
 
 ImageImporter::~ImageImporter()
 {
+	stopPreview();
 }
 
 Gtk::Widget& ImageImporter::getPreviewWidget()
@@ -81,11 +174,34 @@ void ImageImporter::cancelImport()
 
 void ImageImporter::cleanUp()
 {
+	stopPreview();
+	m_refImage.clear();
+	m_Streamed = false;
+	m_Width = m_Height = 0;
+	m_Finished.clear();
+	m_ProxyCache.clear();
+	m_FullCache.clear();
+	m_Proxy.clear();
+	m_ProxyWidth = m_ProxyHeight = 0;
 	m_Preview.reset();
 }
 
 bool ImageImporter::tryLoadPNG()
 {
+	// very large images are never loaded as a whole, their rows are
+	// decoded from the file for every pass
+	PngReader png;
+	if( png.open( m_FileName ) && png.width()*double(png.height()) > STREAM_PIXELS ) {
+		m_Width = png.width();
+		m_Height = png.height();
+		if( !createProxy( png ) ) return false;
+		m_Streamed = true;
+		m_Preview.setImage( _("PNG"), m_Width, m_Height, _("true color") );
+		requestPreview();
+		return true;
+	}
+	png.close();
+
 	// open file with cairo
 	m_refImage = Cairo::ImageSurface::create_from_png(m_FileName);
 	// check validity
@@ -106,37 +222,44 @@ bool ImageImporter::tryLoadPNG()
 			return false;
 	}
 	// image ok, init preview
-	m_Preview.setImage( _("PNG"), m_refImage->get_width(), m_refImage->get_height(), coltext );
+	m_Width = m_refImage->get_width();
+	m_Height = m_refImage->get_height();
+	m_Preview.setImage( _("PNG"), m_Width, m_Height, coltext );
+	SurfaceRows rows( m_refImage->get_data(), m_refImage->get_stride(), m_Height );
+	createProxy( rows );
+	requestPreview();
 	return true;
 }
 
 bool ImageImporter::importToProject( Project& project )
 {
 	// convenience vars
-	int w = m_refImage->get_width(), h = m_refImage->get_height();
+	int w = m_Width, h = m_Height;
 
-	// Create color reducer
+	Settings settings = currentSettings();
+	stopPreview();
+	previewDone();
+	const std::string& palid = settings.Palette;
+	Conversion conv;
 	ColorReducer cr;
-	cr.setRGBSource( m_refImage->get_data(), w, h, 4, m_refImage->get_stride() );
-
-	// fetch settings from widget and init color reducer
-	std::string palid = m_Preview.getPaletteType();
-	unsigned char *data = new unsigned char[w*h];
-	cr.setTarget( palid, data );
-	// quantization
-	if( cr.needQuantization(palid) ) {
-		cr.setQuantizationMethod( m_Preview.getQuantMethod(), m_Preview.getErrorColorSpace() );
+	PngReader png;
+	if( m_Streamed ) {
+		// colors from a first pass over the file, the image follows in
+		// a second pass once the canvases exist
+		if( !png.open( m_FileName ) ) return false;
+		cr.setRowSource( &png, w, h );
+		cr.setTarget( palid, 0 );
+		setupReducer( cr, settings );
+		if( !cr.quantizeColors() ) return false;
+		getPalette( cr, conv );
+	} else {
+		// use the preview conversion if it was finished
+		std::map<Settings, Conversion>::const_iterator it = m_FullCache.find( settings );
+		if( it != m_FullCache.end() )
+			conv = it->second;
+		else if( !convert( settings, m_refImage->get_data(), w, h, m_refImage->get_stride(), conv ) )
+			return false;
 	}
-	// dither
-	cr.setDitherType( m_Preview.getDitherType(),
-	                  m_Preview.getOrderedDitherWidth(),
-	                  m_Preview.getOrderedDitherHeight(),
-	                  m_Preview.getOrderedDitherOffsetX(),
-	                  m_Preview.getOrderedDitherOffsetY() );
-
-	// perform quantization and dither
-	cr.quantizeColors();
-	cr.generateImage();
 
 	// create import storage for objects
 	Glib::ustring palname, name = getNameFromFilename(m_FileName);
@@ -149,42 +272,323 @@ bool ImageImporter::importToProject( Project& project )
 	palname = project.createUniqueName( name + _(" Palette") );
 	project.setObjectName( *pal, palname );
 	// assign colors
-	double *r, *g, *b;
-	r = new double[ cr.palSize() ];
-	g = new double[ cr.palSize() ];
-	b = new double[ cr.palSize() ];
-	for( int c = 0; c < cr.palSize(); c++ ) {
-		r[c] = cr.palRed(c);
-		g[c] = cr.palGreen(c);
-		b[c] = cr.palBlue(c);
-	}
-	pal->setColors( 0, cr.palSize(), r, g, b );
-	delete [] r;
-	delete [] g;
-	delete [] b;
+	if( !conv.Red.empty() )
+		pal->setColors( 0, conv.Red.size(), &conv.Red[0], &conv.Green[0], &conv.Blue[0] );
 	
-	// create canvas
-	// calculate the number of lines
-	Canvas *canvas = dynamic_cast<Canvas*>( project.createNewObject( cr.getTargetCanvas(palid) ) );
-	std::string scname = project.createUniqueName( name + _(" Canvas") );
-	project.setObjectName( *canvas, scname );
-
-	// set palette
-	canvas->setPalette( *pal );
-
-	// size
-	canvas->resize( w, h, 1, 1, true );
-
-	// data
-	std::string cdata;
-	cdata.assign( (char*)data, w*h );
-	canvas->setData( 0, 0, cdata.c_str(), w, h );
-	
-	delete [] data;
+	// create a canvas per slice, left to right and top to bottom
+	int sw = m_Preview.getSplitWidth(), sh = m_Preview.getSplitHeight();
+	if( sw <= 0 || sw > w ) sw = w;
+	if( sh <= 0 || sh > h ) sh = h;
+	int cols = (w + sw-1) / sw, rows = (h + sh-1) / sh;
+	std::vector<Canvas*> canvases;
+	for( int sy = 0; sy < rows; sy++ )
+		for( int sx = 0; sx < cols; sx++ ) {
+			Canvas *canvas = dynamic_cast<Canvas*>( project.createNewObject( ColorReducer::getTargetCanvas(palid) ) );
+			if( !canvas ) return false;
+			Glib::ustring cname = name + _(" Canvas");
+			if( cols*rows > 1 )
+				cname = Glib::ustring::compose( _("%1 Canvas %2,%3"), name, sx, sy );
+			project.setObjectName( *canvas, project.createUniqueName( cname ) );
+
+			// set palette
+			canvas->setPalette( *pal );
+
+			// size
+			canvas->resize( std::min( sw, w - sx*sw ), std::min( sh, h - sy*sh ), 1, 1, true );
+			canvases.push_back( canvas );
+		}
+
+	// data, streamed images only hold a band of rows
+	if( m_Streamed ) {
+		SliceWriter writer( canvases, w, h, sw, sh, std::min( sh, IMPORT_BAND_ROWS ) );
+		cr.setRowTarget( palid, [&writer]( int y, const unsigned char *row ) { writer.writeRow( y, row ); } );
+		if( !cr.generateImage() ) return false;
+	} else {
+		SliceWriter writer( canvases, w, h, sw, sh, sh );
+		for( int y = 0; y < h; y++ )
+			writer.writeRow( y, &conv.Data[y*w] );
+	}
 	
 	return true;
 }
 
+ImageImporter::Settings ImageImporter::currentSettings() const
+{
+	Settings s;
+	s.Palette = m_Preview.getPaletteType();
+	s.Quant = m_Preview.getQuantMethod();
+	s.Error = m_Preview.getErrorColorSpace();
+	s.Dither = m_Preview.getDitherType();
+	s.OrderX = m_Preview.getOrderedDitherWidth();
+	s.OrderY = m_Preview.getOrderedDitherHeight();
+	s.OffsetX = m_Preview.getOrderedDitherOffsetX();
+	s.OffsetY = m_Preview.getOrderedDitherOffsetY();
+	// unused settings do not make a different image
+	if( !ColorReducer::needQuantization( s.Palette ) ) {
+		s.Quant = ColorReducer::QUANT_OCTREE;
+		s.Error = ColorReducer::COLORERROR_RGB;
+	}
+	if( s.Dither != ColorReducer::DITHER_ORDERED )
+		s.OrderX = s.OrderY = s.OffsetX = s.OffsetY = 0;
+	return s;
+}
+
+bool ImageImporter::Settings::operator<( const Settings& s ) const
+{
+	return std::tie( Palette, Quant, Error, Dither, OrderX, OrderY, OffsetX, OffsetY ) <
+	       std::tie( s.Palette, s.Quant, s.Error, s.Dither, s.OrderX, s.OrderY, s.OffsetX, s.OffsetY );
+}
+
+bool ImageImporter::Settings::operator==( const Settings& s ) const
+{
+	return !(*this < s) && !(s < *this);
+}
+
+void ImageImporter::setupReducer( ColorReducer& cr, const Settings& settings ) const
+{
+	// quantization
+	if( cr.needQuantization(settings.Palette) ) {
+		cr.setQuantizationMethod( settings.Quant, settings.Error );
+	}
+	// dither
+	cr.setDitherType( settings.Dither, settings.OrderX, settings.OrderY,
+	                  settings.OffsetX, settings.OffsetY );
+}
+
+bool ImageImporter::convert( const Settings& settings, const unsigned char *src, int w, int h, int stride,
+                             Conversion& result, const std::atomic<bool> *cancel ) const
+{
+	// Create color reducer
+	ColorReducer cr;
+	cr.setCancelFlag( cancel );
+	cr.setRGBSource( src, w, h, 4, stride );
+	result.Width = w;
+	result.Height = h;
+	result.Data.resize( w*h );
+	cr.setTarget( settings.Palette, &result.Data[0] );
+	setupReducer( cr, settings );
+
+	// perform quantization and dither
+	cr.quantizeColors();
+	if( (cancel && *cancel) || !cr.generateImage() ) return false;
+
+	getPalette( cr, result );
+	return true;
+}
+
+void ImageImporter::getPalette( const ColorReducer& cr, Conversion& result ) const
+{
+	// palette colors
+	result.Red.resize( cr.palSize() );
+	result.Green.resize( cr.palSize() );
+	result.Blue.resize( cr.palSize() );
+	for( int c = 0; c < cr.palSize(); c++ ) {
+		result.Red[c] = cr.palRed(c);
+		result.Green[c] = cr.palGreen(c);
+		result.Blue[c] = cr.palBlue(c);
+	}
+}
+
+bool ImageImporter::createProxy( ColorReducer::RowSource& source )
+{
+	int w = m_Width, h = m_Height;
+	int f = (std::max( w, h ) + PREVIEW_SIZE-1) / PREVIEW_SIZE;
+	m_Proxy.clear();
+	m_ProxyWidth = m_ProxyHeight = 0;
+	// small sources are converted at once
+	if( f < 2 ) return true;
+	if( !source.rewind() ) return false;
+
+	// average blocks of f by f pixels, summed over f source rows
+	m_ProxyWidth = std::max( 1, w/f );
+	m_ProxyHeight = std::max( 1, h/f );
+	m_Proxy.resize( 4*m_ProxyWidth*m_ProxyHeight );
+	std::vector<int> sum( 4*m_ProxyWidth );
+	unsigned char *dst = &m_Proxy[0];
+	for( int y = 0; y < m_ProxyHeight; y++ ) {
+		int rows = std::min( y*f + f, h ) - y*f;
+		std::fill( sum.begin(), sum.end(), 0 );
+		for( int sy = 0; sy < rows; sy++ ) {
+			const unsigned char *src = source.readRow();
+			if( !src ) {
+				m_Proxy.clear();
+				m_ProxyWidth = m_ProxyHeight = 0;
+				return false;
+			}
+			for( int x = 0; x < m_ProxyWidth; x++ ) {
+				int x2 = std::min( x*f + f, w );
+				for( int sx = x*f; sx < x2; sx++ ) {
+					for( int c = 0; c < 4; c++ )
+						sum[4*x+c] += src[c];
+					src += 4;
+				}
+			}
+		}
+		for( int x = 0; x < m_ProxyWidth; x++ ) {
+			int n = rows * (std::min( x*f + f, w ) - x*f);
+			for( int c = 0; c < 4; c++ )
+				dst[c] = (sum[4*x+c] + n/2) / n;
+			dst += 4;
+		}
+	}
+	return true;
+}
+
+void ImageImporter::requestPreview()
+{
+	if( !m_Width ) return;
+	Settings settings = currentSettings();
+	showPreview( settings );
+
+	std::lock_guard<std::mutex> lock( m_PreviewMutex );
+	// already being converted
+	if( m_PreviewBusy && !m_PreviewPending && !m_PreviewCancel && m_PreviewJob == settings ) return;
+	// stop the running conversion, cached ones need no new one
+	m_PreviewCancel = true;
+	if( m_Streamed )
+		m_PreviewPending = m_ProxyCache.find( settings ) == m_ProxyCache.end();
+	else
+		m_PreviewPending = m_FullCache.find( settings ) == m_FullCache.end();
+	if( !m_PreviewPending ) return;
+	m_PreviewRequest = settings;
+	m_RequestProxy = !m_Proxy.empty() && m_ProxyCache.find( settings ) == m_ProxyCache.end();
+	if( !m_PreviewThread.joinable() )
+		m_PreviewThread = std::thread( &ImageImporter::previewThread, this );
+	m_PreviewWake.notify_one();
+}
+
+void ImageImporter::stopPreview()
+{
+	if( !m_PreviewThread.joinable() ) return;
+	{
+		std::lock_guard<std::mutex> lock( m_PreviewMutex );
+		m_PreviewQuit = true;
+		m_PreviewCancel = true;
+	}
+	m_PreviewWake.notify_one();
+	m_PreviewThread.join();
+	m_PreviewQuit = false;
+	m_PreviewPending = false;
+}
+
+void ImageImporter::previewThread()
+{
+	std::unique_lock<std::mutex> lock( m_PreviewMutex );
+	while( true ) {
+		m_PreviewWake.wait( lock, [this]() { return m_PreviewQuit || m_PreviewPending; } );
+		if( m_PreviewQuit ) break;
+		Finished job;
+		job.Request = m_PreviewJob = m_PreviewRequest;
+		bool proxy = m_RequestProxy;
+		m_PreviewPending = false;
+		m_PreviewBusy = true;
+		m_PreviewCancel = false;
+		lock.unlock();
+
+		// proxy conversion first, source data does not change while
+		// the thread runs
+		bool ok = true;
+		job.Full = false;
+		if( proxy ) {
+			ok = convert( job.Request, &m_Proxy[0], m_ProxyWidth, m_ProxyHeight, 4*m_ProxyWidth,
+			              job.Result, &m_PreviewCancel );
+			if( ok ) {
+				lock.lock();
+				m_Finished.push_back( job );
+				lock.unlock();
+				m_PreviewDone.emit();
+			}
+		}
+		// streamed images are not converted at full size
+		if( ok && !m_Streamed ) {
+			job.Full = true;
+			ok = convert( job.Request, m_refImage->get_data(), m_Width, m_Height,
+			              m_refImage->get_stride(), job.Result, &m_PreviewCancel );
+		}
+
+		lock.lock();
+		if( ok && job.Full ) {
+			m_Finished.push_back( job );
+			m_PreviewDone.emit();
+		}
+		m_PreviewBusy = false;
+	}
+}
+
+void ImageImporter::previewDone()
+{
+	std::vector<Finished> finished;
+	{
+		std::lock_guard<std::mutex> lock( m_PreviewMutex );
+		finished.swap( m_Finished );
+	}
+	if( finished.empty() ) return;
+	for( unsigned int i = 0; i < finished.size(); i++ )
+		storeResult( finished[i].Full ? m_FullCache : m_ProxyCache, finished[i].Request, finished[i].Result );
+	showPreview( currentSettings() );
+}
+
+void ImageImporter::storeResult( std::map<Settings, Conversion>& cache, const Settings& settings, Conversion& result )
+{
+	// drop the least recently shown
+	if( cache.size() >= PREVIEW_CACHE_SIZE && cache.find( settings ) == cache.end() ) {
+		std::map<Settings, Conversion>::iterator old = cache.begin();
+		for( std::map<Settings, Conversion>::iterator it = cache.begin(); it != cache.end(); ++it )
+			if( it->second.Used < old->second.Used ) old = it;
+		cache.erase( old );
+	}
+	result.Used = ++m_CacheCounter;
+	cache[settings] = std::move( result );
+}
+
+void ImageImporter::showPreview( const Settings& settings )
+{
+	// best available conversion
+	std::map<Settings, Conversion>::iterator it = m_FullCache.find( settings );
+	bool busy = it == m_FullCache.end();
+	if( busy ) {
+		it = m_ProxyCache.find( settings );
+		if( it == m_ProxyCache.end() ) {
+			m_Preview.setPreview( Glib::RefPtr<Gdk::Pixbuf>(), true );
+			return;
+		}
+		// no better conversion comes for streamed images
+		busy = !m_Streamed;
+	}
+	Conversion& conv = it->second;
+	conv.Used = ++m_CacheCounter;
+
+	// palette colors in 8 bits
+	std::vector<guint8> rgb( 3*conv.Red.size() );
+	for( unsigned int c = 0; c < conv.Red.size(); c++ ) {
+		rgb[3*c]   = round( conv.Red[c]*255 );
+		rgb[3*c+1] = round( conv.Green[c]*255 );
+		rgb[3*c+2] = round( conv.Blue[c]*255 );
+	}
+	Glib::RefPtr<Gdk::Pixbuf> image = Gdk::Pixbuf::create( Gdk::COLORSPACE_RGB, false, 8, conv.Width, conv.Height );
+	for( int y = 0; y < conv.Height; y++ ) {
+		const unsigned char *src = &conv.Data[y*conv.Width];
+		guint8 *dst = image->get_pixels() + y*image->get_rowstride();
+		for( int x = 0; x < conv.Width; x++ ) {
+			unsigned int c = std::min<unsigned int>( src[x], conv.Red.size()-1 );
+			dst[0] = rgb[3*c];
+			dst[1] = rgb[3*c+1];
+			dst[2] = rgb[3*c+2];
+			dst += 3;
+		}
+	}
+
+	// fit the source size in the preview, proxies are shown at the
+	// same size
+	int w = m_Width, h = m_Height;
+	double scale = std::min( 1.0, double(PREVIEW_SIZE) / std::max( w, h ) );
+	w = std::max( 1, int(round(w*scale)) );
+	h = std::max( 1, int(round(h*scale)) );
+	if( w != conv.Width || h != conv.Height )
+		image = image->scale_simple( w, h, busy ? Gdk::INTERP_NEAREST : Gdk::INTERP_BILINEAR );
+	m_Preview.setPreview( image, busy );
+}
+
 
 /*************************
  * Import Preview Widget *
@@ -200,7 +604,10 @@ ImageImporter::ImagePreviewWidget::ImagePreviewWidget( ImageImporter& importer )
 	  m_DitherOrderedLabel( _("Width and height:"), 0.5, 0.5 ),
 	  m_DitherOrderedOffsetLabel( _("Offset:"), 0.5, 0.5 ),
 	  m_ColorSpaceLabel( _("Calculate errors in:"), 0.0, 0.5 ),
+	  m_PreviewLabel( "", 0.0, 0.5 ),
+	  m_SplitLabel( _("Canvas size (0 for the whole image):"), 0.0, 0.5 ),
 	  m_OptionsFrame( _("Conversion options") ),
+	  m_PreviewFrame( _("Preview") ),
 	  m_RGBRadio( _("RGB colorspace") ),
 	  m_PerceptualRadio( _("Perceptual colorspace") )
 {
@@ -210,6 +617,11 @@ ImageImporter::ImagePreviewWidget::ImagePreviewWidget( ImageImporter& importer )
 	pack_start( m_ImportLabel, Gtk::PACK_SHRINK );
 	pack_start( m_ImageLabel, Gtk::PACK_SHRINK );
 	pack_start( m_OptionsFrame, Gtk::PACK_SHRINK );
+	pack_start( m_PreviewFrame, Gtk::PACK_SHRINK );
+
+	m_PreviewFrame.add( m_PreviewBox );
+	m_PreviewBox.pack_start( m_PreviewImage, Gtk::PACK_SHRINK );
+	m_PreviewBox.pack_start( m_PreviewLabel, Gtk::PACK_SHRINK );
 	
 	m_OptionsFrame.add( m_OptionsGrid );
 	m_OptionsGrid.attach( m_PaletteLabel, 0, 0, 1, 1 );
@@ -222,6 +634,8 @@ ImageImporter::ImagePreviewWidget::ImagePreviewWidget( ImageImporter& importer )
 	m_OptionsGrid.attach( m_DitherLabel, 0, 7, 1, 1 );
 	m_OptionsGrid.attach( m_DitherCombo, 0, 8, 1, 1 );
 	m_OptionsGrid.attach( m_DitherMethodSelect, 0, 9, 1, 1 );
+	m_OptionsGrid.attach( m_SplitLabel, 0, 10, 1, 1 );
+	m_OptionsGrid.attach( m_SplitOptions, 0, 11, 1, 1 );
 
 	m_ErrorDiffOptions.attach( m_DitherErrorLabel, 0, 0, 1, 1 );
 	m_ErrorDiffOptions.attach( m_DitherErrorCombo, 0, 1, 1, 1 );
@@ -231,6 +645,8 @@ ImageImporter::ImagePreviewWidget::ImagePreviewWidget( ImageImporter& importer )
 	m_OrderedOptions.attach( m_DitherOrderedOffsetLabel, 0, 2, 2, 1 );
 	m_OrderedOptions.attach( m_OrderedOffsetXSpin, 0, 3, 1, 1 );
 	m_OrderedOptions.attach( m_OrderedOffsetYSpin, 1, 3, 1, 1 );
+	m_SplitOptions.attach( m_SplitWidthSpin, 0, 0, 1, 1 );
+	m_SplitOptions.attach( m_SplitHeightSpin, 1, 0, 1, 1 );
 
 	m_DitherMethodSelect.append_page( *manage( new Gtk::VBox ) );
 	m_DitherMethodSelect.append_page( m_ErrorDiffOptions );
@@ -257,6 +673,14 @@ ImageImporter::ImagePreviewWidget::ImagePreviewWidget( ImageImporter& importer )
 	m_OrderedOffsetYSpin.set_editable(false);
 	m_OrderedOffsetYSpin.set_increments( 1, 1 );
 
+	m_SplitWidthSpin.set_numeric();
+	m_SplitWidthSpin.set_range( 0, 65535 );
+	m_SplitWidthSpin.set_increments( 8, 64 );
+
+	m_SplitHeightSpin.set_numeric();
+	m_SplitHeightSpin.set_range( 0, 65535 );
+	m_SplitHeightSpin.set_increments( 8, 64 );
+
 	// add some spacing
 	m_PaletteLabel.set_margin_top(4);
 	m_QuantLabel.set_margin_top(4);
@@ -267,6 +691,8 @@ ImageImporter::ImagePreviewWidget::ImagePreviewWidget( ImageImporter& importer )
 	m_DitherLabel.set_margin_top(4);
 	m_DitherMethodSelect.set_border_width(8);
 	m_OrderedOptions.set_column_spacing(4);
+	m_SplitLabel.set_margin_top(4);
+	m_SplitOptions.set_column_spacing(4);
 	
 	// init combos
 	std::vector<std::string> vec;
@@ -307,6 +733,16 @@ ImageImporter::ImagePreviewWidget::ImagePreviewWidget( ImageImporter& importer )
 	m_DitherCombo.signal_changed().connect( sigc::mem_fun(*this, &ImageImporter::ImagePreviewWidget::ditherGroupChanged) );
 	m_OrderedWidthSpin.signal_output().connect( sigc::bind<Gtk::SpinButton&>( sigc::mem_fun(*this, &ImageImporter::ImagePreviewWidget::orderedSizeChanged), m_OrderedWidthSpin ) );
 	m_OrderedHeightSpin.signal_output().connect( sigc::bind<Gtk::SpinButton&>( sigc::mem_fun(*this, &ImageImporter::ImagePreviewWidget::orderedSizeChanged), m_OrderedHeightSpin ) );
+	// any change updates the conversion preview
+	m_PaletteCombo.signal_changed().connect( sigc::mem_fun(*this, &ImageImporter::ImagePreviewWidget::settingsChanged) );
+	m_QuantCombo.signal_changed().connect( sigc::mem_fun(*this, &ImageImporter::ImagePreviewWidget::settingsChanged) );
+	m_RGBRadio.signal_toggled().connect( sigc::mem_fun(*this, &ImageImporter::ImagePreviewWidget::settingsChanged) );
+	m_DitherCombo.signal_changed().connect( sigc::mem_fun(*this, &ImageImporter::ImagePreviewWidget::settingsChanged) );
+	m_DitherErrorCombo.signal_changed().connect( sigc::mem_fun(*this, &ImageImporter::ImagePreviewWidget::settingsChanged) );
+	m_OrderedWidthSpin.signal_value_changed().connect( sigc::mem_fun(*this, &ImageImporter::ImagePreviewWidget::settingsChanged) );
+	m_OrderedHeightSpin.signal_value_changed().connect( sigc::mem_fun(*this, &ImageImporter::ImagePreviewWidget::settingsChanged) );
+	m_OrderedOffsetXSpin.signal_value_changed().connect( sigc::mem_fun(*this, &ImageImporter::ImagePreviewWidget::settingsChanged) );
+	m_OrderedOffsetYSpin.signal_value_changed().connect( sigc::mem_fun(*this, &ImageImporter::ImagePreviewWidget::settingsChanged) );
 
 	// update status (with signal)
 	m_DitherCombo.set_active(0);
@@ -329,6 +765,25 @@ void ImageImporter::ImagePreviewWidget::setImage( const Glib::ustring& type, int
 	m_ImportLabel.set_use_markup();
 }
 
+void ImageImporter::ImagePreviewWidget::setPreview( const Glib::RefPtr<Gdk::Pixbuf>& image, bool busy )
+{
+	if( image )
+		m_PreviewImage.set( image );
+	else
+		m_PreviewImage.clear();
+	m_PreviewLabel.set_text( busy ? _("Updating preview...") : "" );
+}
+
+sigc::signal<void>& ImageImporter::ImagePreviewWidget::signalSettingsChanged()
+{
+	return m_SignalSettingsChanged;
+}
+
+void ImageImporter::ImagePreviewWidget::settingsChanged()
+{
+	m_SignalSettingsChanged.emit();
+}
+
 void ImageImporter::ImagePreviewWidget::paletteChanged()
 {
 	// quantization needed
@@ -422,5 +877,15 @@ int ImageImporter::ImagePreviewWidget::getOrderedDitherOffsetY() const
 	return m_OrderedOffsetYSpin.get_value_as_int();
 }
 
+int ImageImporter::ImagePreviewWidget::getSplitWidth() const
+{
+	return m_SplitWidthSpin.get_value_as_int();
+}
+
+int ImageImporter::ImagePreviewWidget::getSplitHeight() const
+{
+	return m_SplitHeightSpin.get_value_as_int();
+}
+
 
 } // namespace Polka 
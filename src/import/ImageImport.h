@@ -24,7 +24,10 @@
 #include "ImportManager.h"
 #include "HIGFrame.h"
 #include "ColorReducer.h"
+#include <glibmm/dispatcher.h>
+#include <gdkmm/pixbuf.h>
 #include <gtkmm/box.h>
+#include <gtkmm/image.h>
 #include <gtkmm/label.h>
 #include <gtkmm/comboboxtext.h>
 #include <gtkmm/grid.h>
@@ -32,6 +35,11 @@
 #include <gtkmm/radiobutton.h>
 #include <gtkmm/spinbutton.h>
 #include <fstream>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
 
 namespace Polka {
 
@@ -57,11 +65,78 @@ private:
 	std::string m_FileName;
 	int m_FileSize;
 
-	// image surface
+	// image surface, not loaded for images streamed from the file
 	Cairo::RefPtr<Cairo::ImageSurface> m_refImage;
+	bool m_Streamed;
+	int m_Width, m_Height;
 	
 	// image formats
 	bool tryLoadPNG();
+	// rows of a loaded image for the proxy
+	class SurfaceRows;
+	// converted rows to canvases covering slices of the image
+	class SliceWriter;
+
+	// conversion settings of the preview widget
+	struct Settings {
+		std::string Palette;
+		ColorReducer::QuantizationMethod Quant;
+		ColorReducer::ColorErrorMethod Error;
+		ColorReducer::DitherType Dither;
+		int OrderX, OrderY, OffsetX, OffsetY;
+
+		bool operator<( const Settings& s ) const;
+		bool operator==( const Settings& s ) const;
+	};
+
+	// converted image with its palette
+	struct Conversion {
+		int Width, Height;
+		std::vector<unsigned char> Data;
+		std::vector<double> Red, Green, Blue;
+		// age in the cache
+		unsigned int Used;
+	};
+
+	Settings currentSettings() const;
+	void setupReducer( ColorReducer& cr, const Settings& settings ) const;
+	void getPalette( const ColorReducer& cr, Conversion& result ) const;
+	bool convert( const Settings& settings, const unsigned char *src, int w, int h, int stride,
+	              Conversion& result, const std::atomic<bool> *cancel = 0 ) const;
+
+	// background conversion of the current settings, first on a reduced
+	// copy of the source and then at full size. streamed images are only
+	// previewed from the reduced copy. converted images are kept per
+	// settings and a new request cancels the running one.
+	std::vector<unsigned char> m_Proxy;
+	int m_ProxyWidth, m_ProxyHeight;
+	std::map<Settings, Conversion> m_ProxyCache, m_FullCache;
+	unsigned int m_CacheCounter;
+
+	std::thread m_PreviewThread;
+	std::mutex m_PreviewMutex;
+	std::condition_variable m_PreviewWake;
+	std::atomic<bool> m_PreviewCancel;
+	bool m_PreviewQuit, m_PreviewPending, m_PreviewBusy;
+	// requested and running conversion, proxy when not cached
+	Settings m_PreviewRequest, m_PreviewJob;
+	bool m_RequestProxy;
+	// results for the gui thread
+	struct Finished {
+		Settings Request;
+		bool Full;
+		Conversion Result;
+	};
+	std::vector<Finished> m_Finished;
+	Glib::Dispatcher m_PreviewDone;
+
+	bool createProxy( ColorReducer::RowSource& source );
+	void requestPreview();
+	void stopPreview();
+	void previewThread();
+	void previewDone();
+	void showPreview( const Settings& settings );
+	void storeResult( std::map<Settings, Conversion>& cache, const Settings& settings, Conversion& result );
 	
 	class ImagePreviewWidget : public Gtk::VBox
 	{
@@ -71,6 +146,10 @@ private:
 		void reset();
 
 		void setImage( const Glib::ustring& type, int hres, int vres, const Glib::ustring& colors );
+		// show conversion, busy while a better one is being made
+		void setPreview( const Glib::RefPtr<Gdk::Pixbuf>& image, bool busy );
+
+		sigc::signal<void>& signalSettingsChanged();
 
 		std::string getPaletteType() const;
 		ColorReducer::QuantizationMethod getQuantMethod() const;
@@ -80,25 +159,36 @@ private:
 		int getOrderedDitherHeight() const;
 		int getOrderedDitherOffsetX() const;
 		int getOrderedDitherOffsetY() const;
+		// canvas size to split the image in, 0 for the whole image
+		int getSplitWidth() const;
+		int getSplitHeight() const;
 
 	private:
 		ImageImporter& m_Importer;
 		Gtk::Label m_ImportLabel, m_ImageLabel, 
 		           m_PaletteLabel, m_QuantLabel, m_DitherLabel,
 		           m_DitherErrorLabel, m_DitherOrderedLabel,
-		           m_DitherOrderedOffsetLabel, m_ColorSpaceLabel;
-		HIGFrame m_OptionsFrame;
+		           m_DitherOrderedOffsetLabel, m_ColorSpaceLabel,
+		           m_PreviewLabel, m_SplitLabel;
+		HIGFrame m_OptionsFrame, m_PreviewFrame;
+		Gtk::VBox m_PreviewBox;
+		Gtk::Image m_PreviewImage;
 		Gtk::ComboBoxText m_PaletteCombo, m_QuantCombo, m_DitherCombo,
 		                  m_DitherErrorCombo;
 		Gtk::RadioButton m_RGBRadio, m_PerceptualRadio;
 		Gtk::Notebook m_DitherMethodSelect;
-		Gtk::Grid m_OptionsGrid, m_ErrorDiffOptions, m_OrderedOptions;
+		Gtk::Grid m_OptionsGrid, m_ErrorDiffOptions, m_OrderedOptions,
+		          m_SplitOptions;
 		Gtk::SpinButton m_OrderedWidthSpin, m_OrderedHeightSpin,
-		                m_OrderedOffsetXSpin, m_OrderedOffsetYSpin;
+		                m_OrderedOffsetXSpin, m_OrderedOffsetYSpin,
+		                m_SplitWidthSpin, m_SplitHeightSpin;
+
+		sigc::signal<void> m_SignalSettingsChanged;
 
 		void paletteChanged();
 		void ditherGroupChanged();
 		bool orderedSizeChanged( Gtk::SpinButton& sb );
+		void settingsChanged();
 	};
 	
 	ImagePreviewWidget m_Preview;
@@ -0,0 +1,157 @@
+/*
+	Copyright (C) 2013 Edwin Velds
+
+    This file is part of Polka 2.
+
+    Polka 2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Polka 2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Polka 2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "PngReader.h"
+#include <png.h>
+
+namespace Polka {
+
+PngReader::PngReader()
+	: m_pFile(0), m_pPng(0), m_pInfo(0),
+	  m_Width(0), m_Height(0), m_Row(0), m_Alpha(false)
+{
+}
+
+PngReader::~PngReader()
+{
+	close();
+}
+
+bool PngReader::open( const std::string& filename )
+{
+	close();
+	m_FileName = filename;
+	if( !start() ) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+void PngReader::close()
+{
+	finish();
+	m_FileName.clear();
+	m_Width = m_Height = 0;
+}
+
+int PngReader::width() const
+{
+	return m_Width;
+}
+
+int PngReader::height() const
+{
+	return m_Height;
+}
+
+bool PngReader::hasAlpha() const
+{
+	return m_Alpha;
+}
+
+bool PngReader::rewind()
+{
+	if( m_FileName.empty() ) return false;
+	return start();
+}
+
+const unsigned char *PngReader::readRow()
+{
+	if( !m_pPng || m_Row >= m_Height ) return 0;
+	// decoding errors return here
+	if( setjmp( png_jmpbuf(m_pPng) ) ) {
+		finish();
+		return 0;
+	}
+	png_read_row( m_pPng, &m_RowData[0], 0 );
+	m_Row++;
+
+	if( m_Alpha ) {
+		// premultiply like cairo does
+		unsigned char *p = &m_RowData[0];
+		for( int x = 0; x < m_Width; x++ ) {
+			for( int c = 0; c < 3; c++ ) {
+				unsigned int t = p[c]*p[3] + 0x80;
+				p[c] = ((t >> 8) + t) >> 8;
+			}
+			p += 4;
+		}
+	}
+	return &m_RowData[0];
+}
+
+bool PngReader::start()
+{
+	finish();
+	m_pFile = fopen( m_FileName.c_str(), "rb" );
+	if( m_pFile )
+		m_pPng = png_create_read_struct( PNG_LIBPNG_VER_STRING, 0, 0, 0 );
+	if( m_pPng )
+		m_pInfo = png_create_info_struct( m_pPng );
+	if( !m_pInfo ) {
+		finish();
+		return false;
+	}
+	// header errors return here
+	if( setjmp( png_jmpbuf(m_pPng) ) ) {
+		finish();
+		return false;
+	}
+	png_init_io( m_pPng, m_pFile );
+	png_read_info( m_pPng, m_pInfo );
+	// interlaced images are only complete after the last pass
+	if( png_get_interlace_type( m_pPng, m_pInfo ) != PNG_INTERLACE_NONE ) {
+		finish();
+		return false;
+	}
+
+	// any format to 8 bit blue, green, red and alpha
+	png_set_expand( m_pPng );
+	png_set_strip_16( m_pPng );
+	png_set_gray_to_rgb( m_pPng );
+	png_set_bgr( m_pPng );
+	png_set_filler( m_pPng, 0xff, PNG_FILLER_AFTER );
+	png_read_update_info( m_pPng, m_pInfo );
+
+	m_Width = png_get_image_width( m_pPng, m_pInfo );
+	m_Height = png_get_image_height( m_pPng, m_pInfo );
+	m_Alpha = (png_get_color_type( m_pPng, m_pInfo ) & PNG_COLOR_MASK_ALPHA) != 0;
+	if( m_Width <= 0 || m_Height <= 0 || png_get_rowbytes( m_pPng, m_pInfo ) != 4*png_size_t(m_Width) ) {
+		finish();
+		return false;
+	}
+	m_RowData.resize( 4*m_Width );
+	m_Row = 0;
+	return true;
+}
+
+void PngReader::finish()
+{
+	if( m_pPng )
+		png_destroy_read_struct( &m_pPng, m_pInfo ? &m_pInfo : 0, 0 );
+	m_pPng = 0;
+	m_pInfo = 0;
+	if( m_pFile )
+		fclose( m_pFile );
+	m_pFile = 0;
+}
+
+} // namespace Polka
@@ -0,0 +1,70 @@
+/*
+	Copyright (C) 2013 Edwin Velds
+
+    This file is part of Polka 2.
+
+    Polka 2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Polka 2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Polka 2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _POLKA_PNGREADER_H_
+#define _POLKA_PNGREADER_H_
+
+#include "ColorReducer.h"
+#include <cstdio>
+#include <string>
+#include <vector>
+
+struct png_struct_def;
+struct png_info_def;
+
+namespace Polka {
+
+/*
+ * Decodes a PNG file one row at a time. Rows have four bytes per pixel
+ * in the premultiplied order of cairo surfaces.
+ */
+
+class PngReader : public ColorReducer::RowSource
+{
+public:
+	PngReader();
+	virtual ~PngReader();
+
+	// read the header, fails for files that can not be read row by row
+	bool open( const std::string& filename );
+	void close();
+
+	int width() const;
+	int height() const;
+	bool hasAlpha() const;
+
+	virtual bool rewind();
+	virtual const unsigned char *readRow();
+
+private:
+	std::string m_FileName;
+	FILE *m_pFile;
+	png_struct_def *m_pPng;
+	png_info_def *m_pInfo;
+	int m_Width, m_Height, m_Row;
+	bool m_Alpha;
+	std::vector<unsigned char> m_RowData;
+
+	bool start();
+	void finish();
+};
+
+} // namespace Polka
+
+#endif // _POLKA_PNGREADER_H_
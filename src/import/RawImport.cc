@@ -113,7 +113,7 @@ bool RawImporter::importToProject( Project& project )
 	// create canvas
 
 	// calculate the number of lines
-	int size = m_Preview.width()/2 * m_Preview.height();
+	int size = (m_Preview.width() * m_Preview.height() + 1) / 2;
 	char *data = new char[size];
 	memset( data, 0, size );
 	file.read( data, size );
@@ -129,16 +129,22 @@ bool RawImporter::importToProject( Project& project )
 	canvas->setPalette( *pal );
 	
 	// data
-	std::string cdata;
-	cdata.reserve( 2*size );
-
-	int addr = 0;
-	while( addr < size ) {
-		cdata += char( (data[addr] >> 4) & 15 );
-		cdata += char(  data[addr++]     & 15 );
+	if( m_Preview.width() & 1 ) {
+		// odd rows start halfway a byte
+		std::string cdata;
+		cdata.reserve( 2*size );
+
+		int addr = 0;
+		while( addr < size ) {
+			cdata += char( (data[addr] >> 4) & 15 );
+			cdata += char(  data[addr++]     & 15 );
+		}
+
+		canvas->setData( 0, 0, cdata.c_str(), m_Preview.width(), m_Preview.height() );
+	} else {
+		// packed canvas layout
+		canvas->setPackedData( 0, 0, data, m_Preview.width(), m_Preview.height() );
 	}
-
-	canvas->setData( 0, 0, cdata.c_str(), m_Preview.width(), m_Preview.height() );
 	
 	delete [] data;
 	
@@ -1,8 +1,20 @@
 #include <gtkmm/main.h>
+#include <cstring>
 #include "MainWindow.h"
+#include "BatchConverter.h"
 
 int main(int argc, char *argv[])
 {
+  // batch conversion runs without any windows
+  if( argc > 1 && strcmp( argv[1], "--convert" ) == 0 ) {
+    Polka::BatchConverter converter;
+    if( !converter.parseArguments( argc-2, argv+2 ) ) {
+      Polka::BatchConverter::printUsage();
+      return 2;
+    }
+    return converter.run();
+  }
+
   Gtk::Main kit(argc, argv);
 
   Polka::MainWindow window;
@@ -25,7 +25,9 @@
 #include "UndoAction.h"
 #include "Project.h"
 #include <cstring>
+#include <cstdlib>
 #include <cassert>
+#include <algorithm>
 #include <iostream>
 
 namespace Polka {
@@ -34,10 +36,11 @@ const char *PIXEL_ASPECT_ID = "PIXEL_ASPECT_RATIO";
 const char *RESIZE_ID = "RESIZE";
 const char *RESIZE_DATA_ITEM = "RESTORE_DATA";
 const char *GRID_ID = "GRID_SIZE";
+const char *RECT_DATA_ITEM = "RECT_DATA";
 
 
 Canvas::Canvas( Project& _prj, const std::string& _id )
-	: Object(_prj, _id, true), m_pData(0), m_PixelHScale(1), m_PixelVScale(1)
+	: Object(_prj, _id, true), m_pData(0), m_pPendingData(0), m_PendingError(0), m_PixelHScale(1), m_PixelVScale(1)
 {
 	// create default grids
 	m_TileGridWidth = 16;
@@ -57,6 +60,7 @@ Canvas::~Canvas()
 	if( m_pData ) {
 		delete m_pData;
 	}		
+	delete m_pPendingData;
 }
 
 int Canvas::width() const
@@ -222,6 +226,7 @@ bool Canvas::getClipped() const
 
 void Canvas::resize( int w, int h, int horscale, int verscale, bool store_undo )
 {
+	loadPendingData();
 	ObjectManager& om = ObjectManager::get();
 	bool mod = false;
 	if( m_pData->width() != w || m_pData->height() != h ) {
@@ -300,6 +305,7 @@ void Canvas::setPalette( Palette& pal )
 
 Cairo::RefPtr<Cairo::ImageSurface> Canvas::getImage()
 {
+	loadPendingData();
 	if( !m_Image ) {
 		assert( m_pData );
 		m_Image = Cairo::ImageSurface::create( Cairo::FORMAT_RGB24, m_pData->width(), m_pData->height() );
@@ -310,21 +316,34 @@ Cairo::RefPtr<Cairo::ImageSurface> Canvas::getImage()
 
 int Canvas::data( int x, int y ) const
 {
+	loadPendingData();
 	return m_pData->data( x, y );
 }
 
+int Canvas::pixelBits() const
+{
+	return m_pData->pixelBits();
+}
+
+void Canvas::getPackedRow( int x, int y, int w, char *dest, int dx ) const
+{
+	loadPendingData();
+	m_pData->getPackedRow( x, y, w, dest, dx );
+}
+
 const Palette& Canvas::palette() const
 {
 	return *dynamic_cast<const Palette*>(dependency(DEP_PAL));
 }
 
-const Gdk::Rectangle& Canvas::lastUpdate() const
+const std::vector<Gdk::Rectangle>& Canvas::lastUpdate() const
 {
-	return m_LastUpdateRect;
+	return m_LastUpdateRects;
 }
 
 void Canvas::onUpdate( bool full )
 {
+	loadPendingData();
 	// ensure image object exists
 	if( !m_Image ) {
 		assert( m_pData );
@@ -333,26 +352,22 @@ void Canvas::onUpdate( bool full )
 	}
 	
 	if( full ) {
+		// full updates include palette changes
+		m_pData->updatePaletteTable();
 		// update entire buffer
-		m_pData->writeImage( m_Image, Gdk::Rectangle( 0, 0, m_pData->width(), m_pData->height() ) );
+		m_LastUpdateRects.assign( 1, Gdk::Rectangle( 0, 0, m_pData->width(), m_pData->height() ) );
 	} else {
-		// only within data range
-		bool intersects;
-		m_UpdateRect.intersect( Gdk::Rectangle( 0, 0, m_pData->width(), m_pData->height() ), intersects );
-		
-		if( intersects ) {
-			// update changed area
-			m_pData->writeImage( m_Image, m_UpdateRect );
-			m_LastUpdateRect = m_UpdateRect;
-		} else {
-			m_LastUpdateRect = Gdk::Rectangle(0, 0, 0, 0);
-		}
+		// update changed tiles only
+		m_UpdateTiles.getRectangles( m_LastUpdateRects );
 	}
-	m_UpdateRect = Gdk::Rectangle(0, 0, 0, 0);	
+	for( unsigned int i = 0; i < m_LastUpdateRects.size(); i++ )
+		m_pData->writeImage( m_Image, m_LastUpdateRects[i] );
+	m_UpdateTiles.clear();
 }
 
 void Canvas::draw( int x, int y, const Pen& pen )
 {
+	loadPendingData();
 	// TODO: draw on each data layer
 	m_pData->draw( x, y, pen );
 
@@ -365,6 +380,7 @@ void Canvas::draw( int x, int y, const Pen& pen )
 
 void Canvas::changeColorDraw( int x, int y, const Pen& pen, int current )
 {
+	loadPendingData();
 	// TODO: draw on each data layer
 	if( !m_pData->changeColorDraw( x, y, pen, current ) ) return;
 
@@ -377,49 +393,56 @@ void Canvas::changeColorDraw( int x, int y, const Pen& pen, int current )
 
 void Canvas::drawLine( int x1, int y1, int x2, int y2, const Pen& pen )
 {
+	loadPendingData();
 	// TODO: draw on each data layer
-	m_pData->drawLine( x1, y1, x2, y2, pen );
-	// swap rect points
-	if( x2 < x1 ) std::swap(x1, x2);
-	if( y2 < y1 ) std::swap(y1, y2);
-	
-	// update area
-	if( addChangedRect( Gdk::Rectangle( x1 - pen.offsetX(), y1 - pen.offsetY(), x2-x1 + pen.width(), y2-y1 + pen.height() ) ) ) {
-		// partial update self and dependencies
-		update(false);
-	}
+	std::vector<Gdk::Rectangle> spans;
+	m_pData->drawLine( x1, y1, x2, y2, pen, spans );
+	if( spans.empty() ) return;
+
+	// update area of the drawn spans only
+	for( unsigned int i = 0; i < spans.size(); i++ )
+		addChangedRect( spans[i] );
+	// partial update self and dependencies
+	update(false);
 }
 
 void Canvas::drawRect( int x1, int y1, int x2, int y2, const Pen& lpen, const Pen& fpen )
 {
+	loadPendingData();
 	if( x2 < x1 ) std::swap(x1, x2);
 	if( y2 < y1 ) std::swap(y1, y2);
 
 	if( x1 >= width() || y1 >= height() || x2 < 0 || y2 < 0 ) return;
 
-	m_pData->drawRect( x1, y1, x2, y2, lpen, fpen );
+	std::vector<Gdk::Rectangle> spans;
+	m_pData->drawRect( x1, y1, x2, y2, lpen, fpen, spans );
+	if( spans.empty() ) return;
 
-	// update area
-	if( addChangedRect(Gdk::Rectangle( x1, y1, 1+x2-x1, 1+y2-y1 )) ) {
-		// partial update self and dependencies
-		update(false);
-	}
+	// update area of the drawn spans only
+	for( unsigned int i = 0; i < spans.size(); i++ )
+		addChangedRect( spans[i] );
+	// partial update self and dependencies
+	update(false);
 }
 
-void Canvas::bucketFill( int x, int y, const Pen& pen )
+void Canvas::bucketFill( int x, int y, const Pen& pen, FillMode mode )
 {
+	loadPendingData();
 	// TODO: draw on each data layer
-	Gdk::Rectangle curDrw = m_pData->bucketFill( x, y, pen );
-
-	// update area
-	if( addChangedRect(curDrw) ) {
-		// partial update self and dependencies
-		update(false);
-	}
+	std::vector<Gdk::Rectangle> spans;
+	m_pData->bucketFill( x, y, pen, mode, spans );
+	if( spans.empty() ) return;
+
+	// update area of the filled spans only
+	for( unsigned int i = 0; i < spans.size(); i++ )
+		addChangedRect( spans[i] );
+	// partial update self and dependencies
+	update(false);
 }
 
 void Canvas::flip( int x, int y, int w, int h, bool vertical )
 {
+	loadPendingData();
 	int x2 = x + w -1, y2 = y + h -1;
 	clipRectangle( x, y, x2, y2 );
 	m_pData->flip( x, y, x2, y2, vertical );
@@ -430,6 +453,7 @@ void Canvas::flip( int x, int y, int w, int h, bool vertical )
 
 void Canvas::rotate( int x, int y, int sz, bool ccw )
 {
+	loadPendingData();
 	if( x < m_ClipX1 || y < m_ClipY1 || x+sz-1 > m_ClipX2 || y+sz-1 > m_ClipY2 ) return;
 	
 	m_pData->rotate( x, y, sz, ccw );
@@ -440,11 +464,13 @@ void Canvas::rotate( int x, int y, int sz, bool ccw )
 
 Brush *Canvas::createBrushFromRect( int x, int y, int w, int h, int bg )
 {
+	loadPendingData();
 	return m_pData->createBrushFromRect( x, y, w, h, bg );
 }
 
 void Canvas::setData( int x, int y, const char *data, int w, int h )
 {
+	loadPendingData();
 	startAction( _("Change canvas data"), ObjectManager::get().iconFromId(id()) );
 	m_pData->setData( x, y, data, w, h );
 	addChangedRect( Gdk::Rectangle(x, y, w, h) );
@@ -452,9 +478,22 @@ void Canvas::setData( int x, int y, const char *data, int w, int h )
 	update(false);
 }
 
+void Canvas::setPackedData( int x, int y, const char *data, int w, int h )
+{
+	loadPendingData();
+	startAction( _("Change canvas data"), ObjectManager::get().iconFromId(id()) );
+	m_pData->setPackedData( x, y, data, w, h );
+	addChangedRect( Gdk::Rectangle(x, y, w, h) );
+	finishAction();
+	update(false);
+}
+
 // storage
 int Canvas::store( Storage& s )
 {
+	loadPendingData();
+	// don't replace pixels that failed to load with a blank canvas
+	if( m_pPendingData ) return m_PendingError;
 	// save pixel grid
 	//s.createItem("PIXEL_GRID", "II");
 	//s.setField( 0, m_PixelGridVisible );
@@ -512,34 +551,65 @@ int Canvas::restore( Storage& s )
 
 	if( s.findObject("DATA_MAIN") ) {
 		// read data
-		int err = m_pData->load( s.object() );
+		Storage& dataS = s.object();
+		int err = m_pData->loadHeader( dataS );
+		if( err == 0 ) {
+			if( m_pData->pixelsMapped( dataS ) ) {
+				// keep pixels in the file until they are used
+				delete m_pPendingData;
+				m_pPendingData = s.detachObject();
+				m_PendingError = 0;
+			} else
+				err = m_pData->loadPixels( dataS );
+		}
 		update();
 		return err;
 	} else
 		return Storage::EMISSINGDATANONFATAL;
 }
 
+void Canvas::loadPendingData() const
+{
+	if( !m_pPendingData || m_PendingError ) return;
+	m_PendingError = m_pData->loadPixels( *m_pPendingData );
+	if( m_PendingError ) {
+		// keep the file data, the canvas stays blank and can't be stored
+		std::cerr << "Error " << m_PendingError << " loading pixels of " << name() << std::endl;
+		return;
+	}
+	delete m_pPendingData;
+	m_pPendingData = 0;
+}
+
 // display and undo area functions
 
 bool Canvas::addChangedRect( const Gdk::Rectangle& rect )
 {
 	// create clip rectangle
-	m_UpdateRect = Gdk::Rectangle( m_ClipX1, m_ClipY1, 1+m_ClipX2-m_ClipX1, 1+m_ClipY2-m_ClipY1 );
+	Gdk::Rectangle r( m_ClipX1, m_ClipY1, 1+m_ClipX2-m_ClipX1, 1+m_ClipY2-m_ClipY1 );
 	bool has_int;
-	m_UpdateRect.intersect( rect, has_int );
+	r.intersect( rect, has_int );
 
 	// return if no change
 	if( !has_int ) return false;
 	
-	// update undo rectangle
-	if( m_ActionRect.has_zero_area() )
-		m_ActionRect = m_UpdateRect;
-	else
-		m_ActionRect.join( m_UpdateRect );
+	// mark display and undo tiles
+	markUpdateRect( r );
+	if( m_ActionTiles.width() != m_pData->width() || m_ActionTiles.height() != m_pData->height() )
+		m_ActionTiles.setSize( m_pData->width(), m_pData->height() );
+	m_ActionTiles.mark( r );
 	
 	return true;
 }
 
+void Canvas::markUpdateRect( const Gdk::Rectangle& rect )
+{
+	// follow data size changes
+	if( m_UpdateTiles.width() != m_pData->width() || m_UpdateTiles.height() != m_pData->height() )
+		m_UpdateTiles.setSize( m_pData->width(), m_pData->height() );
+	m_UpdateTiles.mark( rect );
+}
+
 // data transfer and undo
 
 void Canvas::undo( const std::string& id, Storage& s )
@@ -554,8 +624,12 @@ void Canvas::redo( const std::string& id, Storage& s )
 
 void Canvas::undoAction( const std::string& id, Storage& s )
 {
+	loadPendingData();
 	if( id == "RECT" )  {
-		m_UpdateRect = m_pData->restoreRect( s );
+		if( s.findObject(RECT_DATA_ITEM) )
+			do {
+				markUpdateRect( m_pData->restoreRect( s.object() ) );
+			} while( s.findNextObject(RECT_DATA_ITEM) );
 		update(false);
 	} else if( id == RESIZE_ID ) {
 		if( s.findItem( RESIZE_ID ) ) {
@@ -586,33 +660,40 @@ void Canvas::undoAction( const std::string& id, Storage& s )
 
 void Canvas::startAction( const Glib::ustring& text, const Glib::RefPtr<Gdk::Pixbuf>& icon )
 {
-	m_ActionRect = Gdk::Rectangle( 0, 0, 0, 0 );	
+	loadPendingData();
+	m_ActionTiles.setSize( m_pData->width(), m_pData->height() );
 	m_ActionText = text;
 	m_rpActionIcon = icon;
-	// signal data layers to backup
+	// signal data layers to start a backup
 	m_pData->backupState();
 }
 
 void Canvas::finishAction()
 {
-	if( !m_ActionRect.has_zero_area() ) {
-		// clip rect to data area
-		m_ActionRect.intersect( Gdk::Rectangle( 0, 0, m_pData->width(), m_pData->height() ) );
-		// create undo action for rect
-	std::cout << "UNDO  (" << m_ActionRect.get_x() << ", " << m_ActionRect.get_y() << ")-(" << m_ActionRect.get_width() << ", " << m_ActionRect.get_height() << ")\n";
+	if( !m_ActionTiles.isEmpty() ) {
+		// store the changed tiles only
+		std::vector<Gdk::Rectangle> rects;
+		m_ActionTiles.getRectangles( rects );
+		m_ActionTiles.clear();
+		// create undo action for rects
 		UndoAction& action = project().undoHistory().createAction( *this );
 		action.setName( m_ActionText );
 		action.setIcon( m_rpActionIcon );
-		// create undo data block
 		Storage& su = action.setUndoData("RECT");
-		m_pData->storeBackupRect( su, m_ActionRect );
-		// set redo action
 		Storage& sr = action.setRedoData("RECT");
-		m_pData->storeRect( sr, m_ActionRect );
+		for( unsigned int i = 0; i < rects.size(); i++ ) {
+			// create undo data block
+			m_pData->storeBackupRect( su.createObject(RECT_DATA_ITEM), rects[i] );
+			// set redo action
+			m_pData->storeRect( sr.createObject(RECT_DATA_ITEM), rects[i] );
+		}
 	
 		m_ActionText.clear();
 		m_rpActionIcon.reset();
+		// pixel data makes up most of the history
+		project().undoHistory().updateMemoryUsage();
 	}
+	m_pData->releaseBackup();
 }
 
 } // namespace Polka
@@ -23,9 +23,11 @@
 #include "Object.h"
 #include "ObjectManager.h"
 #include "Pen.h"
+#include "DirtyTiles.h"
 #include <glibmm/i18n.h>
 #include <cairomm/surface.h>
 #include <gdkmm/rectangle.h>
+#include <vector>
 
 namespace Polka {
 
@@ -73,11 +75,13 @@ public:
 	virtual void changeColorDraw( int x, int y, const Pen& pen, int current );
 	virtual void drawLine( int x1, int y1, int x2, int y2, const Pen& pen );
 	virtual void drawRect( int x1, int y1, int x2, int y2, const Pen& lpen, const Pen& fpen );
-	virtual void bucketFill( int x, int y, const Pen& pen );
+	enum FillMode { FILL_CONTIGUOUS, FILL_REPLACE, FILL_TILE };
+	virtual void bucketFill( int x, int y, const Pen& pen, FillMode mode = FILL_CONTIGUOUS );
 	virtual void flip( int x, int y, int w, int h, bool vertical = false );
 	virtual void rotate( int x, int y, int sz, bool ccw = false );
 
 	virtual void setData( int x, int y, const char *data, int w, int h );
+	virtual void setPackedData( int x, int y, const char *data, int w, int h );
 
 	// clipping
 	void setClipRectangle( int x = -1, int y = -1, int w = -1, int h = -1 );
@@ -90,6 +94,8 @@ public:
 	
 	// data access
 	virtual int data( int x, int y ) const;
+	int pixelBits() const;
+	void getPackedRow( int x, int y, int w, char *dest, int dx = 0 ) const;
 	virtual const Palette& palette() const;
 
 	virtual Brush *createBrushFromRect( int x, int y, int w, int h, int bg );
@@ -98,7 +104,7 @@ public:
 	virtual void undo( const std::string& id, Storage& s );
 	virtual void redo( const std::string& id, Storage& s );
 
-	const Gdk::Rectangle& lastUpdate() const;
+	const std::vector<Gdk::Rectangle>& lastUpdate() const;
 	virtual void startAction( const Glib::ustring& text, const Glib::RefPtr<Gdk::Pixbuf>& icon );
 	virtual void finishAction();
 
@@ -106,6 +112,10 @@ protected:
 	virtual void onUpdate( bool full );
 
 	CanvasData *m_pData;
+	// pixel data of a loaded project, decoded on first use
+	mutable Storage *m_pPendingData;
+	mutable int m_PendingError;
+	void loadPendingData() const;
 	
 	// storage
 	virtual int store( Storage& s );
@@ -114,8 +124,8 @@ protected:
 private:
 	Cairo::RefPtr<Cairo::ImageSurface> m_Image;
 	int m_PixelHScale, m_PixelVScale;
-	Gdk::Rectangle m_UpdateRect, m_LastUpdateRect;
-	Gdk::Rectangle m_ActionRect;
+	DirtyTiles m_UpdateTiles, m_ActionTiles;
+	std::vector<Gdk::Rectangle> m_LastUpdateRects;
 	Glib::ustring m_ActionText;
 	Glib::RefPtr<Gdk::Pixbuf> m_rpActionIcon;
 
@@ -128,6 +138,7 @@ private:
 	
 	void undoAction( const std::string& id, Storage& s );
 	bool addChangedRect( const Gdk::Rectangle& rect );
+	void markUpdateRect( const Gdk::Rectangle& rect );
 };
 
 
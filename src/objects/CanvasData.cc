@@ -24,18 +24,67 @@
 #include "Storage.h"
 #include "StorageHelpers.h"
 #include "Brush.h"
+#include "PixelKernels.h"
+#include "DirtyTiles.h"
 #include <cstdlib>
 #include <cstring>
+#include <cstdint>
+#include <climits>
 #include <cassert>
-#include <iostream>
+#include <algorithm>
 
 namespace Polka {
 
+// rows are aligned to cache lines
+static const int ROW_ALIGNMENT = 64;
+
+// allocate a cache line aligned block, the pointer returned by
+// malloc is stored just in front of the aligned block
+static char *allocAligned( size_t size )
+{
+	char *block = static_cast<char*>(malloc( size + ROW_ALIGNMENT + sizeof(void*) ));
+	if( !block ) return 0;
+	uintptr_t addr = reinterpret_cast<uintptr_t>(block) + sizeof(void*);
+	addr = (addr + ROW_ALIGNMENT-1) & ~uintptr_t(ROW_ALIGNMENT-1);
+	reinterpret_cast<void**>(addr)[-1] = block;
+	return reinterpret_cast<char*>(addr);
+}
+
+static void freeAligned( char *data )
+{
+	if( data ) free( reinterpret_cast<void**>(data)[-1] );
+}
+
 CanvasData::CanvasData( Canvas& canvas, int w, int h, int depth )
-	: m_Canvas( canvas ), m_Depth( depth ), m_Width(0), m_Height(0), m_pDataStore(0)
+	: m_pPixels(0), m_Stride(0), m_pCanvas( &canvas ), m_Depth( depth ),
+	  m_Width(0), m_Height(0), m_AllocRows(0), m_pDataStore(0),
+	  m_BackupGeneration(0), m_BackupCols(0), m_BackupActive(false),
+	  m_SmallDisplayTable(false)
 {
+	init( w, h );
+}
+
+CanvasData::CanvasData( int w, int h, int depth )
+	: m_pPixels(0), m_Stride(0), m_pCanvas(0), m_Depth( depth ),
+	  m_Width(0), m_Height(0), m_AllocRows(0), m_pDataStore(0),
+	  m_BackupGeneration(0), m_BackupCols(0), m_BackupActive(false),
+	  m_SmallDisplayTable(false)
+{
+	init( w, h );
+}
+
+void CanvasData::init( int w, int h )
+{
+	memset( m_DisplayTable, 0, sizeof(m_DisplayTable) );
 	// number of bytes per pixel
 	m_PixSize = (m_Depth+7) / 8;
+	// low depths are packed into 2 or 4 bits
+	if( m_Depth <= 2 )
+		m_PixBits = 2;
+	else if( m_Depth <= 4 )
+		m_PixBits = 4;
+	else
+		m_PixBits = 8 * m_PixSize;
 	// init data
 	setSize( w, h );
 }
@@ -47,45 +96,66 @@ CanvasData::~CanvasData()
 
 void CanvasData::setSize( int w, int h )
 {
-	// first adjust number of rows
-	if( h < m_Height ) {
-		while( m_Height > h ) {
-			free( m_Data.back() );
-			m_Data.pop_back();
-			m_Height--;
-		}
-	}
-	// adjust line sizes
-	if( w != m_Width ) {
-		std::vector<char*>::iterator it = m_Data.begin();
-		while( it != m_Data.end() ) {
-			*it = static_cast<char*>(realloc( *it, w * m_PixSize ));
-			if( w > m_Width ) memset( *it + m_Width*m_PixSize, 0, (w-m_Width)*m_PixSize );
-			++it;
-		}
+	// release everything for empty data
+	if( w == 0 || h == 0 ) {
+		freeAligned( m_pPixels );
+		freeAligned( m_pDataStore );
+		m_pPixels = m_pDataStore = 0;
 		m_Width = w;
+		m_Height = h;
+		m_Stride = m_AllocRows = 0;
+		m_BackupTiles.clear();
+		m_BackupCols = 0;
+		m_BackupActive = false;
+		return;
 	}
-	// add more data
-	for( int i = m_Height; i < h; i++ ) {
-		m_Data.push_back( static_cast<char*>(malloc( w*m_PixSize )) );
-		memset( m_Data.back(), 0, w*m_PixSize );
-	}
-		
-	m_Height = h;
+
+	int lineSize = rowBytes( w );
+	int stride = (lineSize + ROW_ALIGNMENT-1) & ~(ROW_ALIGNMENT-1);
+	int keepRows = std::min( h, m_Height );
 	
-	// create backup space
-	if( w && h ) {
-		if( m_pDataStore )
-			m_pDataStore = static_cast<char*>(realloc( m_pDataStore, w*h* m_PixSize ));
-		else
-			m_pDataStore = static_cast<char*>(malloc( w*h*m_PixSize ));
+	if( stride == m_Stride && h <= m_AllocRows ) {
+		// fits in current block, clear uncovered columns
+		if( w > m_Width )
+			for( int y = 0; y < keepRows; y++ )
+				clearColumns( row(y), m_Width, stride );
 	} else {
-		if( m_pDataStore ) {
-			free( m_pDataStore );
-			m_pDataStore = 0;
+		// move data into a new block
+		char *pixels = allocAligned( size_t(stride) * h );
+		if( stride == m_Stride ) {
+			if( keepRows ) memmove( pixels, m_pPixels, size_t(stride) * keepRows );
+			if( w > m_Width )
+				for( int y = 0; y < keepRows; y++ )
+					clearColumns( pixels + size_t(stride) * y, m_Width, stride );
+		} else {
+			int keepCols = std::min( w, m_Width );
+			for( int y = 0; y < keepRows; y++ ) {
+				char *dest = pixels + size_t(stride) * y;
+				memmove( dest, row(y), rowBytes( keepCols ) );
+				clearColumns( dest, keepCols, stride );
+			}
 		}
+		freeAligned( m_pPixels );
+		m_pPixels = pixels;
+		m_Stride = stride;
+		m_AllocRows = h;
+		
+		// backup space of the same shape
+		freeAligned( m_pDataStore );
+		m_pDataStore = allocAligned( size_t(stride) * h );
 	}
+	// clear new rows
+	if( h > keepRows )
+		memset( m_pPixels + size_t(stride) * keepRows, 0, size_t(stride) * (h-keepRows) );
 	
+	m_Width = w;
+	m_Height = h;
+
+	// the backup does not survive a resize
+	m_BackupCols = (w + DirtyTiles::TILE_SIZE-1) >> DirtyTiles::TILE_SHIFT;
+	m_BackupTiles.assign( m_BackupCols * ((h + DirtyTiles::TILE_SIZE-1) >> DirtyTiles::TILE_SHIFT), 0 );
+	m_BackupGeneration = 0;
+	m_BackupActive = false;
 }
 
 
@@ -106,41 +176,148 @@ int CanvasData::height() const
 
 const Palette& CanvasData::palette() const
 {
-	return m_Canvas.palette();
+	assert( m_pCanvas );
+	return m_pCanvas->palette();
 }
 
 int CanvasData::data( int x, int y ) const
 {
+	return pixel( row(y), x );
+}
+
+int CanvasData::stride() const
+{
+	return m_Stride;
+}
+
+char *CanvasData::row( int y )
+{
+	return m_pPixels + size_t(m_Stride) * y;
+}
+
+const char *CanvasData::row( int y ) const
+{
+	return m_pPixels + size_t(m_Stride) * y;
+}
+
+int CanvasData::pixelBits() const
+{
+	return m_PixBits;
+}
+
+void CanvasData::getPackedRow( int x, int y, int w, char *dest, int dx ) const
+{
+	copyPixels( dest, dx, row(y), x, w );
+}
+
+int CanvasData::rowBytes( int w ) const
+{
+	return (w * m_PixBits + 7) >> 3;
+}
+
+int CanvasData::pixel( const char *line, int x ) const
+{
+	if( m_PixBits < 8 )
+		return packedPixel( reinterpret_cast<const unsigned char*>(line), x, m_PixBits );
+	const char *pixel = line + x*m_PixSize;
 	int result = 0;
-	for( int a = x*m_PixSize; a < x*m_PixSize+m_PixSize; a++ )
-		result = (result << 8 ) | m_Data[y][a];
+	for( int a = 0; a < m_PixSize; a++ )
+		result = (result << 8 ) | pixel[a];
 	return result;
 }
 
+void CanvasData::setPixel( char *line, int x, int value )
+{
+	if( m_PixBits < 8 ) {
+		setPackedPixel( reinterpret_cast<unsigned char*>(line), x, value, m_PixBits );
+		return;
+	}
+	char *pixel = line + x*m_PixSize;
+	for( int i = 0; i < m_PixSize; i++ )
+		pixel[i] = (value >> (i*8)) & 255;
+}
+
+void CanvasData::copyPixels( char *dest, int dx, const char *src, int sx, int n ) const
+{
+	if( m_PixBits < 8 )
+		copyPackedPixels( reinterpret_cast<const unsigned char*>(src), sx,
+		                  reinterpret_cast<unsigned char*>(dest), dx, n, m_PixBits );
+	else
+		memcpy( dest + dx*m_PixSize, src + sx*m_PixSize, n*m_PixSize );
+}
+
+// zero all pixels from x up to the end of a row of size bytes
+void CanvasData::clearColumns( char *line, int x, int size ) const
+{
+	int offset = (x * m_PixBits) >> 3;
+	if( (x * m_PixBits) & 7 ) {
+		// rest of a partly used byte
+		int n = (8 - ((x * m_PixBits) & 7)) / m_PixBits;
+		fillPackedPixels( reinterpret_cast<unsigned char*>(line), x, n, 0, m_PixBits );
+		offset++;
+	}
+	memset( line + offset, 0, size - offset );
+}
+
+void CanvasData::makeColor( int value, char color[4] ) const
+{
+	if( m_PixBits < 8 ) {
+		color[0] = value & ((1 << m_PixBits)-1);
+		return;
+	}
+	for( int i = 0; i < m_PixSize; i++ )
+		color[i] = (value >> (i*8)) & 255;
+}
+
+bool CanvasData::isColor( const char *line, int x, const char *color ) const
+{
+	if( m_PixBits < 8 )
+		return packedPixel( reinterpret_cast<const unsigned char*>(line), x, m_PixBits ) == color[0];
+	return memcmp( line + x*m_PixSize, color, m_PixSize ) == 0;
+}
+
+void CanvasData::updatePaletteTable()
+{
+	const Palette& pal = palette();
+	std::vector<unsigned int> colors( pal.size() );
+	for( int c = 0; c < pal.size(); c++ )
+		colors[c] = (int(255 * pal.r(c)) << 16) |
+		            (int(255 * pal.g(c)) << 8) |
+		             int(255 * pal.b(c));
+	setDisplayColors( &colors[0], colors.size() );
+}
+
+void CanvasData::setDisplayColors( const unsigned int *colors, int size )
+{
+	for( int i = 0; i < 256; i++ )
+		m_DisplayTable[i] = colors[i % size];
+	// check if the first 16 entries repeat over the table
+	m_SmallDisplayTable = true;
+	for( int i = 16; i < 256; i++ )
+		if( m_DisplayTable[i] != m_DisplayTable[i & 15] ) {
+			m_SmallDisplayTable = false;
+			break;
+		}
+}
+
 void CanvasData::writeImage( Cairo::RefPtr<Cairo::ImageSurface> image, const Gdk::Rectangle& rect )
 {
-	std::cout << "draw(" << rect.get_x() << ", " << rect.get_y() << ")-(" << rect.get_width() << ", " << rect.get_height() << ")\n";
-	// rewrite all image data
-	int addr;
 	unsigned char *imgData = image->get_data();
-	// loop over all pixels
 	for( int y = rect.get_y(); y < rect.get_y()+rect.get_height(); y++ ) {
-		// start line
-		addr = image->get_stride() * y + 4*rect.get_x();
-		char *line = m_Data[y] + rect.get_x()*m_PixSize;
-		
-		// write line
-		for( int x = 0; x < rect.get_width()*m_PixSize; x+=m_PixSize ) {
-			// skip alpha
-				
-			// process data
+		const unsigned char *line = reinterpret_cast<const unsigned char*>(row(y));
+		unsigned int *dest = reinterpret_cast<unsigned int*>(imgData + image->get_stride() * y) + rect.get_x();
+		if( m_PixBits < 8 ) {
+			expandPackedRow( line, rect.get_x(), dest, rect.get_width(), m_DisplayTable,
+			                 m_SmallDisplayTable, m_PixBits );
+			continue;
+		}
+		line += rect.get_x()*m_PixSize;
+		if( m_PixSize == 1 ) {
+			expandIndexedRow( line, dest, rect.get_width(), m_DisplayTable, m_SmallDisplayTable );
+		} else {
 			// basic palette data (never more than 1 byte)
-			int pixel = line[x] % palette().size();
-	//std::cout << pixel << std::endl;
-			imgData[addr++] = int(255 * palette().b( pixel ));
-			imgData[addr++] = int(255 * palette().g( pixel ));
-			imgData[addr++] = int(255 * palette().r( pixel ));
-			imgData[addr++] = 0;
+			for( int x = 0; x < rect.get_width(); x++ )
+				dest[x] = m_DisplayTable[line[x*m_PixSize]];
 		}
 	}
 }
@@ -150,85 +327,217 @@ void CanvasData::draw( int x, int y, const Pen& pen )
 	applyBrush(x, y, pen);
 }
 
-void CanvasData::drawLine( int x1, int y1, int x2, int y2, const Pen& pen )
+void CanvasData::drawLine( int x1, int y1, int x2, int y2, const Pen& pen, std::vector<Gdk::Rectangle>& changed )
 {
-	// handle single point
-	if( x1 == x2 && y1 == y2 ) {
-		draw(x1, x2, pen);
-		return;
-	}
+	changed.clear();
+	std::vector<int> points;
+	linePoints( x1, y1, x2, y2, points );
+
+	// pixels covered by the pen along the line
+	std::vector<Span> spans;
+	sweepSpans( points, pen, spans );
+	mergeSpans( spans );
 
-	// calc line stuff
-	bool vert = false;
-	if( abs(y2-y1) > abs(x2-x1) ) {
-		// flip
-		vert = true;
-		int t = x1;	x1 = y1; y1 = t;
-		t = x2;	x2 = y2; y2 = t;
+	char color[4];
+	if( penColor( pen, color ) ) {
+		// single colour, write every pixel once
+		writeSpans( spans, color, changed );
+	} else {
+		// multi coloured pens are stamped in line order
+		for( unsigned int i = 0; i < points.size(); i += 2 )
+			applyBrush( points[i], points[i+1], pen );
+		for( unsigned int i = 0; i < spans.size(); i++ )
+			changed.push_back( Gdk::Rectangle( spans[i].x1, spans[i].y, 1+spans[i].x2-spans[i].x1, 1 ) );
 	}
-	
-	// calc stepping
-	int dx = x1<=x2?1:-1;
-	double dy = double(y2-y1)/abs(x2-x1), yerr = 0.0;
-	
-	// draw line
-	int y = y1;
-	for( int x = x1; x != x2+dx; x += dx ) {
-		if( vert )
-			applyBrush(y, x, pen);
-		else
-			applyBrush(x, y, pen);
-
-		yerr += dy;
-		if( dy > 0.0 && yerr > 0.5 ) {
-			yerr -= 1.0;
-			y++;
-		} else if( dy < 0.0 && yerr < -0.5 ) {
-			yerr += 1.0;
-			y--;
+}
+
+void CanvasData::drawRect( int x1, int y1, int x2, int y2, const Pen& lpen, const Pen& fpen,
+                           std::vector<Gdk::Rectangle>& changed )
+{
+	changed.clear();
+	std::vector<Span> spans;
+
+	// fill
+	if( fpen.data()[0] != -1 ) {
+		for( int y = y1+1; y < y2; y++ ) {
+			Span s = { y, x1+1, x2-1 };
+			if( s.x1 <= s.x2 ) spans.push_back( s );
 		}
+		mergeSpans( spans );
+		char fc[4];
+		makeColor( fpen.data()[0], fc );
+		writeSpans( spans, fc, changed );
+		spans.clear();
 	}
 
+	// outline, the pen is swept along each side separately
+	int sides[4][4] = { { x1, y1, x2, y1 }, { x2, y2, x1, y2 },
+	                    { x2, y1+1, x2, y2-1 }, { x1, y2-1, x1, y1+1 } };
+	int nsides = y2-y1 > 1 ? 4 : (y2 > y1 ? 2 : 1);
+	std::vector<int> points, side;
+	for( int i = 0; i < nsides; i++ ) {
+		side.clear();
+		linePoints( sides[i][0], sides[i][1], sides[i][2], sides[i][3], side );
+		sweepSpans( side, lpen, spans );
+		points.insert( points.end(), side.begin(), side.end() );
+	}
+	mergeSpans( spans );
+
+	char lc[4];
+	if( penColor( lpen, lc ) ) {
+		writeSpans( spans, lc, changed );
+	} else {
+		for( unsigned int i = 0; i < points.size(); i += 2 )
+			applyBrush( points[i], points[i+1], lpen );
+		for( unsigned int i = 0; i < spans.size(); i++ )
+			changed.push_back( Gdk::Rectangle( spans[i].x1, spans[i].y, 1+spans[i].x2-spans[i].x1, 1 ) );
+	}
 }
 
-void CanvasData::drawRect( int x1, int y1, int x2, int y2, const Pen& lpen, const Pen& fpen )
+bool CanvasData::penColor( const Pen& pen, char color[4] ) const
 {
-	// private class, so expect san input. Which is:
-	// x1 < m_Width, y1 < m_Height, x2 >= 0, y2 >= 0, x2 > x1, y2 > y1
-	char *dat1 = 0, *dat2 = 0;
-	if( y1 >= 0 ) dat1 = m_Data[y1];
-	if( y2 < m_Height ) dat2 = m_Data[y2];
-	char lc[4], fc[4];
-	for( int i = 0; i < m_PixSize; i++ ) {
-		lc[i] = (lpen.data()[0] >> (i*8)) & 255;
-		fc[i] = (fpen.data()[0] >> (i*8)) & 255;
+	// find the colour if the pen has only one
+	const int *d = pen.data();
+	int c = -1;
+	for( int i = 0; i < pen.width()*pen.height(); i++ ) {
+		if( d[i] == -1 ) continue;
+		if( c == -1 )
+			c = d[i];
+		else if( d[i] != c )
+			return false;
 	}
-	// horizontal lines
-	int sx = x1<0 ? 0 : x1*m_PixSize;
-	int dx = x2>=m_Width ? (m_Width-1)*m_PixSize : x2*m_PixSize;
-	for( int x = sx; x <= dx; x+=m_PixSize )
-		for( int i = 0; i < m_PixSize; i++ ) {
-			if( dat1 ) dat1[x+i] = lc[i];
-			if( dat2 ) dat2[x+i] = lc[i];
+	makeColor( c, color );
+	return true;
+}
+
+void CanvasData::linePoints( int x1, int y1, int x2, int y2, std::vector<int>& points ) const
+{
+	// step along the major axis, the minor axis steps when the
+	// error passes half a pixel
+	int dx = abs(x2-x1), dy = abs(y2-y1);
+	int sx = x1<=x2?1:-1, sy = y1<=y2?1:-1;
+	int x = x1, y = y1, err = 0;
+	if( dy > dx ) {
+		for( int i = 0; i <= dy; i++ ) {
+			points.push_back(x);
+			points.push_back(y);
+			y += sy;
+			err += 2*dx;
+			if( err > dy ) {
+				err -= 2*dy;
+				x += sx;
+			}
 		}
-	// correct horizontal boundaries to inside rectangle
-	if( x1 >= 0 ) sx += m_PixSize;
-	if( x2 < m_Width ) dx -= m_PixSize;
-	// vertical lines
-	for( int y = y1+1; y < y2; y++ ) {
-		if( y < 0 ) continue;
-		if( y >= m_Height ) break;
-		dat1 = m_Data[y];
-		for( int i = 0; i < m_PixSize; i++ ) {
-			if( x1 >= 0 ) dat1[x1*m_PixSize] = lc[i];
-			if( x2 < m_Width ) dat1[x2*m_PixSize] = lc[i];
+	} else {
+		for( int i = 0; i <= dx; i++ ) {
+			points.push_back(x);
+			points.push_back(y);
+			x += sx;
+			err += 2*dy;
+			if( err > dx ) {
+				err -= 2*dx;
+				y += sy;
+			}
+		}
+	}
+}
+
+void CanvasData::sweepSpans( const std::vector<int>& points, const Pen& pen, std::vector<Span>& spans ) const
+{
+	if( points.empty() ) return;
+
+	// horizontal extent of the points on each row
+	int ymin = points[1], ymax = points[1];
+	for( unsigned int i = 3; i < points.size(); i += 2 ) {
+		ymin = std::min( ymin, points[i] );
+		ymax = std::max( ymax, points[i] );
+	}
+	std::vector<int> rx1( ymax-ymin+1, INT_MAX ), rx2( ymax-ymin+1, INT_MIN );
+	for( unsigned int i = 0; i < points.size(); i += 2 ) {
+		int r = points[i+1]-ymin;
+		rx1[r] = std::min( rx1[r], points[i] );
+		rx2[r] = std::max( rx2[r], points[i] );
+	}
+
+	// runs of set pixels in the pen
+	std::vector<Span> pspans;
+	const int *d = pen.data();
+	for( int py = 0; py < pen.height(); py++ ) {
+		int px = 0;
+		while( px < pen.width() ) {
+			if( d[py*pen.width()+px] == -1 ) {
+				px++;
+				continue;
+			}
+			Span s = { py - pen.offsetY(), px - pen.offsetX(), 0 };
+			while( px < pen.width() && d[py*pen.width()+px] != -1 ) px++;
+			s.x2 = px-1 - pen.offsetX();
+			pspans.push_back( s );
+		}
+	}
+
+	// points of a line are contiguous on a row, so every pen run
+	// sweeps into a single span
+	for( int r = 0; r <= ymax-ymin; r++ ) {
+		if( rx1[r] > rx2[r] ) continue;
+		for( unsigned int i = 0; i < pspans.size(); i++ ) {
+			Span s = { ymin + r + pspans[i].y, rx1[r] + pspans[i].x1, rx2[r] + pspans[i].x2 };
+			spans.push_back( s );
 		}
-		// fill
-		if( fpen.data()[0] != -1 ) {
-			for( int x = sx; x <= dx; x+=m_PixSize ) 
-				for( int i = 0; i < m_PixSize; i++ )
-					dat1[x+i] = fc[i];
-		}		
+	}
+}
+
+void CanvasData::clipBounds( int& x1, int& y1, int& x2, int& y2 ) const
+{
+	if( m_pCanvas ) {
+		x1 = m_pCanvas->clipLeft(); x2 = m_pCanvas->clipRight();
+		y1 = m_pCanvas->clipTop(); y2 = m_pCanvas->clipBottom();
+	} else {
+		// standalone data clips to the image
+		x1 = y1 = 0;
+		x2 = m_Width-1; y2 = m_Height-1;
+	}
+}
+
+void CanvasData::clipRectangle( int& x1, int& y1, int& x2, int& y2 ) const
+{
+	// right orientation
+	if( x2 < x1 ) std::swap(x1, x2);
+	if( y2 < y1 ) std::swap(y1, y2);
+
+	int cx1, cy1, cx2, cy2;
+	clipBounds( cx1, cy1, cx2, cy2 );
+	x1 = std::max( x1, cx1 ); y1 = std::max( y1, cy1 );
+	x2 = std::min( x2, cx2 ); y2 = std::min( y2, cy2 );
+}
+
+void CanvasData::mergeSpans( std::vector<Span>& spans ) const
+{
+	int cx1, cy1, cx2, cy2;
+	clipBounds( cx1, cy1, cx2, cy2 );
+
+	// clip, sort and join overlapping or touching spans
+	std::sort( spans.begin(), spans.end() );
+	unsigned int n = 0;
+	for( unsigned int i = 0; i < spans.size(); i++ ) {
+		Span s = spans[i];
+		if( s.y < cy1 || s.y > cy2 ) continue;
+		s.x1 = std::max( s.x1, cx1 );
+		s.x2 = std::min( s.x2, cx2 );
+		if( s.x1 > s.x2 ) continue;
+		if( n > 0 && spans[n-1].y == s.y && s.x1 <= spans[n-1].x2+1 )
+			spans[n-1].x2 = std::max( spans[n-1].x2, s.x2 );
+		else
+			spans[n++] = s;
+	}
+	spans.resize(n);
+}
+
+void CanvasData::writeSpans( const std::vector<Span>& spans, const char *color, std::vector<Gdk::Rectangle>& changed )
+{
+	for( unsigned int i = 0; i < spans.size(); i++ ) {
+		fillSpan( spans[i].y, spans[i].x1, spans[i].x2, color );
+		changed.push_back( Gdk::Rectangle( spans[i].x1, spans[i].y, 1+spans[i].x2-spans[i].x1, 1 ) );
 	}
 }
 
@@ -238,27 +547,23 @@ void CanvasData::applyBrush( int x, int y, const Pen& pen )
 	int cole = cols + pen.width()-1;
 	int rows = y - pen.offsetY();
 	int rowe = rows + pen.height()-1;
-	m_Canvas.clipRectangle( cols, rows, cole, rowe );
+	clipRectangle( cols, rows, cole, rowe );
 	int dx = cols - ( x-pen.offsetX() );
 	int dy = rows - ( y-pen.offsetY() );
 
 	// exit if nothing left
 	if( dx >= pen.width() || dy >= pen.height() ) return;
+	prepareWrite( cols, rows, cole, rowe );
 
 	// loop pen
-	for( int row = rows; row <= rowe; row++ ) {
+	for( int r = rows; r <= rowe; r++ ) {
 		// data pointers
-		const int *penData = pen.data() + (dy+row-rows)*pen.width() + dx;
-		char *data = m_Data[row] + cols*m_PixSize;
+		const int *penData = pen.data() + (dy+r-rows)*pen.width() + dx;
+		char *line = row(r);
 		// copy data
-		for( int col = cols; col <= cole; col++ ) {
+		for( int col = cols; col <= cole; col++, penData++ )
 			if( penData[0] != -1 )
-				for( int i = 0; i < m_PixSize; i++ ) {
-					data[i] = (penData[0] >> (i*8)) & 255;
-				}
-			data += m_PixSize;
-			penData++;
-		}
+				setPixel( line, col, penData[0] );
 	}
 
 }
@@ -269,146 +574,192 @@ bool CanvasData::changeColorDraw( int x, int y, const Pen& pen, int current )
 	int cole = cols + pen.width()-1;
 	int rows = y - pen.offsetY();
 	int rowe = rows + pen.height()-1;
-	m_Canvas.clipRectangle( cols, rows, cole, rowe );
+	clipRectangle( cols, rows, cole, rowe );
 	int dx = cols - ( x-pen.offsetX() );
 	int dy = rows - ( y-pen.offsetY() );
 
 	bool changed = false;
+	char cur[4];
+	makeColor( current, cur );
 
 	// exit if nothing left
 	if( dx >= pen.width() || dy >= pen.height() ) return false;
+	prepareWrite( cols, rows, cole, rowe );
 
 	// loop pen
-	for( int row = rows; row <= rowe; row++ ) {
+	for( int r = rows; r <= rowe; r++ ) {
 		// data pointers
-		const int *penData = pen.data() + (dy+row-rows)*pen.width() + dx;
-		char *data = m_Data[row] + cols*m_PixSize;
-		// copy data
-		for( int col = cols; col <= cole; col++ ) {
-			if( penData[0] != -1 ) {
-				// check current
-				bool is_current = true;
-				for( int i = 0; i < m_PixSize; i++ ) {
-					if( data[i] != ((current >> (i*8)) & 255) ) {
-						is_current = false;
-						break;
-					}
-				}
-				if( is_current )
-					for( int i = 0; i < m_PixSize; i++ ) {
-						data[i] = (penData[0] >> (i*8)) & 255;
-						changed = true;
-					}
+		const int *penData = pen.data() + (dy+r-rows)*pen.width() + dx;
+		char *line = row(r);
+		// copy data over the current colour only
+		for( int col = cols; col <= cole; col++, penData++ ) {
+			if( penData[0] != -1 && isColor( line, col, cur ) ) {
+				setPixel( line, col, penData[0] );
+				changed = true;
 			}
-			data += m_PixSize;
-			penData++;
 		}
 	}
 	return changed;
 }
 
-Gdk::Rectangle CanvasData::bucketFill( int x, int y, const Pen& pen )
+void CanvasData::bucketFill( int x, int y, const Pen& pen, int mode, std::vector<Gdk::Rectangle>& changed )
 {
-	Gdk::Rectangle r;
+	changed.clear();
+	// fill bounds
+	int x1, y1, x2, y2;
+	clipBounds( x1, y1, x2, y2 );
+	if( mode == Canvas::FILL_TILE && m_pCanvas ) {
+		// limit to the grid cell under the start position
+		int gw = m_pCanvas->tileGridWidth(), gh = m_pCanvas->tileGridHeight();
+		if( gw > 0 ) {
+			int cx = x - ((x - m_pCanvas->tileGridHorOffset()) % gw + gw) % gw;
+			x1 = std::max( x1, cx );
+			x2 = std::min( x2, cx+gw-1 );
+		}
+		if( gh > 0 ) {
+			int cy = y - ((y - m_pCanvas->tileGridVerOffset()) % gh + gh) % gh;
+			y1 = std::max( y1, cy );
+			y2 = std::min( y2, cy+gh-1 );
+		}
+	}
+	if( x < x1 || x > x2 || y < y1 || y > y2 ) return;
+
 	char fg[4], bg[4];
-	// start address
-	char *data = m_Data[y] + x*m_PixSize;
 	// calc background colour
-	bool same = true;
-	for( int i = 0; i < m_PixSize; i++ ) {
-		fg[i] = (pen.data()[0] >> (i*8)) & 255;
-		bg[i] = data[i];
-		same &= fg[i] == bg[i];
-	}
-	// fill line
-	if( !same ) fillLine( x, y, fg, bg, r );
-	return r;	
-}
-
-bool CanvasData::fillLine( int x, int y, char fg[4], char bg[4], Gdk::Rectangle& r )
-{
-	int xb = x;
-	char *dat = m_Data[y] + x*m_PixSize;
-	// fill left
-	while( xb >= m_Canvas.clipLeft() ) {
-		bool same = true;
-		for( int i = 0; i < m_PixSize; i++ )
-			same &= bg[i] == dat[i];
-		// break from loop if not same
-		if( !same ) break;
-		
-		// fill pixel
-		for( int i = 0; i < m_PixSize; i++ )
-			dat[i] = fg[i];
-		
-		dat -= m_PixSize;
-		xb--;
-	}
-	
-	// return if no fill
-	if( xb == x ) return false;
-	
-	// line start
-	char *sdat = dat + m_PixSize;
-	
-	// fill right
-	int xe = x+1;
-	dat = m_Data[y] + (x+1)*m_PixSize;
-	while( xe <= m_Canvas.clipRight() ) {
-		bool same = true;
-		for( int i = 0; i < m_PixSize; i++ )
-			same &= bg[i] == dat[i];
-		// break from loop if not same
-		if( !same ) break;
-		
-		// fill pixel
-		for( int i = 0; i < m_PixSize; i++ )
-			dat[i] = fg[i];
-		
-		dat += m_PixSize;
-		xe++;
+	makeColor( pen.data()[0], fg );
+	if( m_PixBits < 8 )
+		bg[0] = pixel( row(y), x );
+	else
+		memcpy( bg, row(y) + x*m_PixSize, m_PixSize );
+	if( isColor( row(y), x, fg ) ) return;
+
+	if( mode == Canvas::FILL_REPLACE ) {
+		// replace every matching run in the bounds
+		for( int fy = y1; fy <= y2; fy++ ) {
+			const char *line = row(fy);
+			int fx = nextMatch( line, x1, x2, bg );
+			while( fx <= x2 ) {
+				int fe = matchRight( line, fx, x2, bg );
+				fillSpan( fy, fx, fe, fg );
+				changed.push_back( Gdk::Rectangle( fx, fy, 1+fe-fx, 1 ) );
+				fx = nextMatch( line, fe+1, x2, bg );
+			}
+		}
+		return;
 	}
 
-	// update rect
-	if( r.get_x() > xb+1 ) r.set_x( xb+1 );
-	if( r.get_x()+r.get_width() < xe ) r.set_width( xe - r.get_x() );
-	if( r.get_y() > y ) 
-		r.set_y(y);
-	else if( y >= r.get_y()+r.get_height() )
-		r.set_height( 1+y-r.get_y() );
+	// scanline fill, seeds are kept on a stack instead of recursing
+	std::vector< std::pair<int,int> > seeds;
+	seeds.push_back( std::make_pair( x, y ) );
+	while( !seeds.empty() ) {
+		int sx = seeds.back().first, sy = seeds.back().second;
+		seeds.pop_back();
+		const char *line = row(sy);
+		// skip seeds already filled from another span
+		if( !isColor( line, sx, bg ) ) continue;
 
-	// bluntly loop over all positions above and below the fill
-	for( int i = xb+1; i < xe; i++ ) {
-		// fill above
-		if( y>m_Canvas.clipTop() ) fillLine( i, y-1, fg, bg, r );
-		// fill below
-		if( y<m_Canvas.clipBottom() ) fillLine( i, y+1, fg, bg, r );
+		int xl = matchLeft( line, sx, x1, bg );
+		int xr = matchRight( line, sx, x2, bg );
+		fillSpan( sy, xl, xr, fg );
+		changed.push_back( Gdk::Rectangle( xl, sy, 1+xr-xl, 1 ) );
 
-		sdat += m_PixSize;
+		// seed every matching run above and below the span
+		for( int ny = sy-1; ny <= sy+1; ny += 2 ) {
+			if( ny < y1 || ny > y2 ) continue;
+			const char *nline = row(ny);
+			int nx = nextMatch( nline, xl, xr, bg );
+			while( nx <= xr ) {
+				seeds.push_back( std::make_pair( nx, ny ) );
+				nx = nextMatch( nline, matchRight( nline, nx, xr, bg ) + 1, xr, bg );
+			}
+		}
 	}
-	return true;
+}
+
+int CanvasData::matchLeft( const char *line, int x, int xmin, const char *bg ) const
+{
+	// x is known to match
+	if( m_PixBits < 8 )
+		return x + 1 - matchingPixelsReverse( reinterpret_cast<const unsigned char*>(line), xmin,
+		                                      1+x-xmin, bg[0], m_PixBits );
+	if( m_PixSize == 1 )
+		return x + 1 - matchingBytesReverse( reinterpret_cast<const unsigned char*>(line) + xmin,
+		                                     1+x-xmin, bg[0] );
+	while( x > xmin && memcmp( line + (x-1)*m_PixSize, bg, m_PixSize ) == 0 ) x--;
+	return x;
+}
 
+int CanvasData::matchRight( const char *line, int x, int xmax, const char *bg ) const
+{
+	// x is known to match
+	if( m_PixBits < 8 )
+		return x - 1 + matchingPixels( reinterpret_cast<const unsigned char*>(line), x,
+		                               1+xmax-x, bg[0], m_PixBits );
+	if( m_PixSize == 1 )
+		return x - 1 + matchingBytes( reinterpret_cast<const unsigned char*>(line) + x,
+		                              1+xmax-x, bg[0] );
+	while( x < xmax && memcmp( line + (x+1)*m_PixSize, bg, m_PixSize ) == 0 ) x++;
+	return x;
+}
+
+int CanvasData::nextMatch( const char *line, int x, int xmax, const char *bg ) const
+{
+	if( x > xmax ) return x;
+	if( m_PixBits < 8 )
+		return x + differingPixels( reinterpret_cast<const unsigned char*>(line), x,
+		                            1+xmax-x, bg[0], m_PixBits );
+	if( m_PixSize == 1 )
+		return x + differingBytes( reinterpret_cast<const unsigned char*>(line) + x,
+		                           1+xmax-x, bg[0] );
+	while( x <= xmax && memcmp( line + x*m_PixSize, bg, m_PixSize ) != 0 ) x++;
+	return x;
+}
+
+void CanvasData::fillSpan( int y, int x1, int x2, const char *fg )
+{
+	prepareWrite( x1, y, x2, y );
+	char *line = row(y);
+	if( m_PixBits < 8 ) {
+		fillPackedPixels( reinterpret_cast<unsigned char*>(line), x1, 1+x2-x1, fg[0], m_PixBits );
+	} else if( m_PixSize == 1 ) {
+		memset( line + x1, fg[0], 1+x2-x1 );
+	} else {
+		for( char *p = line + x1*m_PixSize; x1 <= x2; x1++, p += m_PixSize )
+			memcpy( p, fg, m_PixSize );
+	}
 }
 
 void CanvasData::flip( int x1, int y1, int x2, int y2, bool vertical )
 {
+	prepareWrite( x1, y1, x2, y2 );
 	if( vertical ) {
 		int ym = (y2-y1+1)/2;
-		int n = m_PixSize*(x2-x1+1);
-		char *tempdat = new char[n];
+		int n = x2-x1+1;
+		char *tempdat = new char[rowBytes(n)];
 		for( int y = 0; y < ym; y++ ) {
-			char *l1 = m_Data[y1+y] + m_PixSize*x1;
-			char *l2 = m_Data[y2-y] + m_PixSize*x1;
-			memcpy(tempdat, l1, n);
-			memcpy(l1, l2, n);
-			memcpy(l2, tempdat, n);
+			char *l1 = row(y1+y);
+			char *l2 = row(y2-y);
+			copyPixels( tempdat, 0, l1, x1, n );
+			copyPixels( l1, x1, l2, x1, n );
+			copyPixels( l2, x1, tempdat, 0, n );
+		}
+		delete [] tempdat;
+	} else if( m_PixBits < 8 ) {
+		// reverse unpacked pixels
+		int n = x2-x1+1;
+		unsigned char *tempdat = new unsigned char[n];
+		for( int y = y1; y <= y2; y++ ) {
+			unsigned char *line = reinterpret_cast<unsigned char*>(row(y));
+			unpackPixels( line, x1, tempdat, n, m_PixBits );
+			std::reverse( tempdat, tempdat + n );
+			packPixels( tempdat, line, x1, n, m_PixBits );
 		}
 		delete [] tempdat;
 	} else {
 		int xm = (x2-x1+1)/2;
-		for( int y = 0; y < m_Height; y++ ) {
-			char *p1 = m_Data[y] + x1*m_PixSize;
-			char *p2 = m_Data[y] + x2*m_PixSize;
+		for( int y = y1; y <= y2; y++ ) {
+			char *p1 = row(y) + x1*m_PixSize;
+			char *p2 = row(y) + x2*m_PixSize;
 			for( int x = 0; x < xm; x++ ) {
 				for( int i = 0; i < m_PixSize; i++ ) {
 					char t = *p1;
@@ -428,14 +779,34 @@ void CanvasData::rotate( int x, int y, int sz, bool ccw )
 	int xs = x, xe = x+sz-1;
 	int yc = sz/2;
 	char t;
+	prepareWrite( x, y, x+sz-1, y+sz-1 );
 	
 	for( int yr = 0; yr < yc; yr++ ) {
 		for( int xr = xs; xr < xe; xr++ ) {
+			if( m_PixBits < 8 ) {
+				// corner rows and columns
+				char *lul = row(y+yr), *lur = row(y+yr+xr-xs);
+				char *ldr = row(y+yr+xe-xs), *ldl = row(y+yr+xe-xr);
+				int cul = pixel( lul, xr ), cur = pixel( lur, xe );
+				int cdr = pixel( ldr, xe-xr+xs ), cdl = pixel( ldl, xs );
+				if( ccw ) {
+					setPixel( lul, xr, cur );
+					setPixel( lur, xe, cdr );
+					setPixel( ldr, xe-xr+xs, cdl );
+					setPixel( ldl, xs, cul );
+				} else {
+					setPixel( lul, xr, cdl );
+					setPixel( ldl, xs, cdr );
+					setPixel( ldr, xe-xr+xs, cur );
+					setPixel( lur, xe, cul );
+				}
+				continue;
+			}
 			// calc corner addresses
-			char *ul = m_Data[y+yr] + xr*m_PixSize;
-			char *ur = m_Data[y+yr+xr-xs] + xe*m_PixSize;
-			char *dr = m_Data[y+yr+xe-xs] + (xe-xr+xs)*m_PixSize;
-			char *dl = m_Data[y+yr+xe-xr] + xs*m_PixSize;
+			char *ul = row(y+yr) + xr*m_PixSize;
+			char *ur = row(y+yr+xr-xs) + xe*m_PixSize;
+			char *dr = row(y+yr+xe-xs) + (xe-xr+xs)*m_PixSize;
+			char *dl = row(y+yr+xe-xr) + xs*m_PixSize;
 			if( ccw ) {
 				for( int i = 0; i<m_PixSize; i++ ) {
 					t = ul[i];
@@ -467,14 +838,39 @@ void CanvasData::setData( int x, int y, const char *data, int w, int h )
 		delta = -x;
 		x = 0;
 	}
+	int size = std::min( w-delta, m_Width-x );
+	if( size <= 0 ) return;
+	prepareWrite( x, y, x+size-1, y+h-1 );
 
 	// apply raw data to image
-	for( int yr = y; yr < y+h; yr++ ) {
+	for( int yr = y; yr < y+h; yr++, data += w*m_PixSize ) {
+		// clip
+		if( yr < 0 || yr >= m_Height ) continue;
+		if( m_PixBits < 8 )
+			packPixels( reinterpret_cast<const unsigned char*>(data) + delta,
+			            reinterpret_cast<unsigned char*>(row(yr)), x, size, m_PixBits );
+		else
+			memcpy( row(yr) + x*m_PixSize, data + delta*m_PixSize, size*m_PixSize );
+	}
+}
+
+void CanvasData::setPackedData( int x, int y, const char *data, int w, int h )
+{
+	// clip
+	int delta = 0;
+	if( x < 0 ) {
+		delta = -x;
+		x = 0;
+	}
+	int size = std::min( w-delta, m_Width-x );
+	if( size <= 0 ) return;
+	prepareWrite( x, y, x+size-1, y+h-1 );
+
+	// rows are copied as a block when the bytes line up
+	for( int yr = y; yr < y+h; yr++, data += rowBytes(w) ) {
 		// clip
 		if( yr < 0 || yr >= m_Height ) continue;
-		char *dest = m_Data[yr] + (x+delta)*m_PixSize;
-		memcpy(dest, data, (w-delta)*m_PixSize);
-		data += w*m_PixSize;
+		copyPixels( row(yr), x, data, delta, size );
 	}
 }
 
@@ -485,11 +881,12 @@ Brush *CanvasData::createBrushFromRect( int x, int y, int w, int h, int bg )
 	int c2 = -1;
 	Brush *b = 0;
 	for( int sy = y; sy < y+h; sy++ ) {
-		char *data = m_Data[sy];
+		const char *data = row(sy);
 		for( int sx = x; sx < x+w; sx++ ) {
-			if( data[sx] != -1 ) {
+			int c = pixel( data, sx );
+			if( c != -1 ) {
 				if( c2 == -1 )
-					c2 = data[sx];
+					c2 = c;
 				else {
 					// two colours other than bg
 					b = new Brush(w, h);
@@ -505,12 +902,13 @@ Brush *CanvasData::createBrushFromRect( int x, int y, int w, int h, int bg )
 	// copy brush data
 	int *bdat = b->data();
 	for( int sy = y; sy < y+h; sy++ ) {
-		char *data = m_Data[sy];
+		const char *data = row(sy);
 		for( int sx = x; sx < x+w; sx++ ) {
-			if( data[sx] == bg )
+			int c = pixel( data, sx );
+			if( c == bg )
 				*bdat = -1;
 			else
-				*bdat = data[sx];
+				*bdat = c;
 			bdat++;
 		}
 	}
@@ -526,20 +924,35 @@ int CanvasData::save( Storage& s )
 	s.setField( 0, m_Width );
 	s.setField( 1, m_Height );
 	
+	// standalone data has no palette
 	s.createItem("PALETTE", "S");
-	s.setField( 0, palette().name() );
+	s.setField( 0, m_pCanvas ? palette().name() : Glib::ustring() );
 		
 	s.createItem("DATA", "S");
 	std::string& dat = s.setDataField(0);
+	// always one byte per pixel for low depths
 	int lineSize = m_Width * m_PixSize;
-	dat.reserve( lineSize * m_Height );
-	for( unsigned int i = 0; i < m_Data.size(); i++ )
-		dat.append( m_Data[i], lineSize );
+	dat.resize( size_t(lineSize) * m_Height );
+	for( int i = 0; i < m_Height; i++ ) {
+		char *dest = &dat[size_t(lineSize) * i];
+		if( m_PixBits < 8 )
+			unpackPixels( reinterpret_cast<const unsigned char*>(row(i)), 0,
+			              reinterpret_cast<unsigned char*>(dest), m_Width, m_PixBits );
+		else
+			memcpy( dest, row(i), lineSize );
+	}
 
 	return 0;
 }
 	
 int CanvasData::load( Storage& s )
+{
+	int err = loadHeader( s );
+	if( err ) return err;
+	return loadPixels( s );
+}
+
+int CanvasData::loadHeader( Storage& s )
 {
 	// get image size
 	if( !s.findItem("DATA_SIZE") ) return Storage::EMISSINGDATAFATAL;
@@ -552,11 +965,17 @@ int CanvasData::load( Storage& s )
 	if( !s.findItem("PALETTE") ) return Storage::EMISSINGDATAFATAL;
 	if( !s.checkFormat("S") ) return Storage::EINCORRECTDATATYPE;
 
-	Glib::ustring palName( s.stringField(0) );
-	Object *pal = m_Canvas.project().findObject( palName );
-	if( !pal ) return Storage::EMISSINGDATAFATAL;
-	m_Canvas.setPalette( *dynamic_cast<Palette*>(pal) );
+	if( m_pCanvas ) {
+		Glib::ustring palName( s.stringField(0) );
+		Object *pal = m_pCanvas->project().findObject( palName );
+		if( !pal ) return Storage::EMISSINGDATAFATAL;
+		m_pCanvas->setPalette( *dynamic_cast<Palette*>(pal) );
+	}
+	return 0;
+}
 
+int CanvasData::loadPixels( Storage& s )
+{
 	// read data
 	if( !s.findItem("DATA") ) return Storage::EMISSINGDATAFATAL;
 	if( !s.checkFormat("S") ) return Storage::EINCORRECTDATATYPE;
@@ -568,69 +987,125 @@ int CanvasData::load( Storage& s )
 	
 	const char *cdat = dat.c_str();
 	for( int i = 0; i < m_Height; i++ ) {
-		memcpy( m_Data[i], cdat, m_Width*m_PixSize );
+		if( m_PixBits < 8 )
+			packPixels( reinterpret_cast<const unsigned char*>(cdat),
+			            reinterpret_cast<unsigned char*>(row(i)), 0, m_Width, m_PixBits );
+		else
+			memcpy( row(i), cdat, m_Width*m_PixSize );
 		cdat += m_Width*m_PixSize;
 	}
 
 	return 0;
 }
 
-// create a backup of the image data
+bool CanvasData::pixelsMapped( Storage& s ) const
+{
+	// data too short for the image is loaded now to report the error
+	return s.findItem("DATA") && s.checkFormat("S") && s.hasMappedData() &&
+	       s.dataSize(0) >= size_t(m_Width)*m_Height*m_PixSize;
+}
+
+// start a backup of the image data, tiles are copied on first write
 void CanvasData::backupState()
 {
 	assert( m_pDataStore );
-	// store image data
-	int lineSize = m_Width * m_PixSize;
-	char *dat = m_pDataStore;
-	for( unsigned int i = 0; i < m_Data.size(); i++ ) {
-		memcpy( dat, m_Data[i], lineSize );
-		dat += lineSize;
+	if( ++m_BackupGeneration == 0 ) {
+		// wrapped around, old marks could match again
+		std::fill( m_BackupTiles.begin(), m_BackupTiles.end(), 0 );
+		m_BackupGeneration = 1;
+	}
+	m_BackupActive = true;
+}
+
+void CanvasData::releaseBackup()
+{
+	m_BackupActive = false;
+}
+
+bool CanvasData::tileBackedUp( int tx, int ty ) const
+{
+	return m_BackupActive && m_BackupTiles[ty*m_BackupCols + tx] == m_BackupGeneration;
+}
+
+void CanvasData::prepareWrite( int x1, int y1, int x2, int y2 )
+{
+	if( !m_BackupActive ) return;
+	// clip to image
+	x1 = std::max( x1, 0 );
+	y1 = std::max( y1, 0 );
+	x2 = std::min( x2, m_Width-1 );
+	y2 = std::min( y2, m_Height-1 );
+	if( x2 < x1 || y2 < y1 ) return;
+
+	// copy tiles not yet in the backup
+	for( int ty = y1 >> DirtyTiles::TILE_SHIFT; ty <= y2 >> DirtyTiles::TILE_SHIFT; ty++ ) {
+		for( int tx = x1 >> DirtyTiles::TILE_SHIFT; tx <= x2 >> DirtyTiles::TILE_SHIFT; tx++ ) {
+			unsigned int& gen = m_BackupTiles[ty*m_BackupCols + tx];
+			if( gen == m_BackupGeneration ) continue;
+			gen = m_BackupGeneration;
+			// tiles always start on a byte
+			int px = ((tx << DirtyTiles::TILE_SHIFT) * m_PixBits) >> 3;
+			int n = rowBytes( std::min( DirtyTiles::TILE_SIZE, m_Width - (tx << DirtyTiles::TILE_SHIFT) ) );
+			int py = ty << DirtyTiles::TILE_SHIFT;
+			int pe = std::min( py + DirtyTiles::TILE_SIZE, m_Height );
+			for( ; py < pe; py++ ) {
+				size_t offset = size_t(m_Stride) * py + px;
+				memcpy( m_pDataStore + offset, m_pPixels + offset, n );
+			}
+		}
 	}
 }
 
-// save a data rect to storage from the backup
 void CanvasData::storeBackupRect( Storage& s, const Gdk::Rectangle& rect )
 {
 	storageSetRect( s, "DATA_RECT", rect );
-	s.createItem("DATA", "S");
-	std::string& dat = s.setDataField(0);
-	int lineSize = m_Width*m_PixSize;
-	dat.reserve( rect.get_y()*rect.get_x()*m_PixSize );
-	// copy data
-	char *src = m_pDataStore + rect.get_y()*lineSize + rect.get_x()*m_PixSize;
-	for( int i = 0; i < rect.get_height(); i++ ) {
-		dat.append( src, rect.get_width()*m_PixSize );
-		src += lineSize;
+	// rows are stored in the packed layout
+	int lineSize = rowBytes( rect.get_width() );
+	std::string dat( size_t(lineSize) * rect.get_height(), 0 );
+	char *dest = &dat[0];
+	// copy data, tiles without backup have not changed
+	int xe = rect.get_x() + rect.get_width();
+	for( int y = rect.get_y(); y < rect.get_y()+rect.get_height(); y++, dest += lineSize ) {
+		size_t offset = size_t(m_Stride) * y;
+		int x = rect.get_x();
+		while( x < xe ) {
+			int tx = x >> DirtyTiles::TILE_SHIFT;
+			int n = std::min( xe, (tx+1) << DirtyTiles::TILE_SHIFT ) - x;
+			const char *src = tileBackedUp( tx, y >> DirtyTiles::TILE_SHIFT ) ? m_pDataStore : m_pPixels;
+			copyPixels( dest, x - rect.get_x(), src + offset, x, n );
+			x += n;
+		}
 	}
+	storageSetPackedData( s, "PACKED_DATA", dat.data(), dat.size() );
 }
 
-// save a data rect to storage
 void CanvasData::storeRect( Storage& s, const Gdk::Rectangle& rect )
 {
 	storageSetRect( s, "DATA_RECT", rect );
-	s.createItem("DATA", "S");
-	std::string& dat = s.setDataField(0);
-	dat.reserve( rect.get_y()*rect.get_x()*m_PixSize );
+	int lineSize = rowBytes( rect.get_width() );
+	std::string dat( size_t(lineSize) * rect.get_height(), 0 );
 	// copy data
-	for( int i = rect.get_y(); i < rect.get_y()+rect.get_height(); i++ ) {
-		dat.append( m_Data[i] + rect.get_x()*m_PixSize, rect.get_width()*m_PixSize );
-	}
+	for( int i = 0; i < rect.get_height(); i++ )
+		copyPixels( &dat[size_t(lineSize) * i], 0, row(rect.get_y()+i), rect.get_x(), rect.get_width() );
+	storageSetPackedData( s, "PACKED_DATA", dat.data(), dat.size() );
 }
 
 const Gdk::Rectangle CanvasData::restoreRect( Storage& s )
 {
 	Gdk::Rectangle r;
 	if( storageGetRect( s, "DATA_RECT", r ) ) {
-		if( s.findItem("DATA") ) {
-			const std::string& dat = s.dataField(0);
+		std::string dat;
+		if( storageGetPackedData( s, "PACKED_DATA", dat ) &&
+		    dat.size() >= size_t(rowBytes(r.get_width())) * r.get_height() ) {
 			const char *src = dat.c_str();
 			// make sure to fit size
 			int size = r.get_width();
 			if( r.get_x()+size > m_Width ) size = m_Width-r.get_x();
+			prepareWrite( r.get_x(), r.get_y(), r.get_x()+size-1, r.get_y()+r.get_height()-1 );
 			for( int i = r.get_y(); i < r.get_y()+r.get_height(); i++ ) {
-				if( i >= int(m_Data.size()) ) break;
-				memcpy( m_Data[i] + r.get_x()*m_PixSize, src, size*m_PixSize );
-				src += r.get_width()*m_PixSize;
+				if( i >= m_Height ) break;
+				copyPixels( row(i), r.get_x(), src, 0, size );
+				src += rowBytes( r.get_width() );
 			}
 		}
 	}
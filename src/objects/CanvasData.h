@@ -22,6 +22,7 @@
 
 #include <cairomm/surface.h>
 #include <gdkmm/rectangle.h>
+#include <vector>
 
 namespace Polka {
 
@@ -35,6 +36,8 @@ class CanvasData
 {
 public:
 	CanvasData( Canvas& canvas, int w, int h, int depth );
+	// standalone data without canvas, draws unclipped and stores no palette
+	CanvasData( int w, int h, int depth );
 	virtual ~CanvasData();
 
 	// dimensions
@@ -45,9 +48,20 @@ public:
 
 	// palette data
 	const Palette &palette() const;
+	void updatePaletteTable();
+	// display colours (0xRRGGBB) for size indices, repeated over all values
+	void setDisplayColors( const unsigned int *colors, int size );
 
 	// data access
 	int data( int x, int y ) const;
+	int stride() const;
+	char *row( int y );
+	const char *row( int y ) const;
+
+	// storage bits per pixel, depths up to 4 bits are packed with the
+	// leftmost pixel in the highest bits (MSX VRAM order)
+	int pixelBits() const;
+	void getPackedRow( int x, int y, int w, char *dest, int dx = 0 ) const;
 
 	// output
 	virtual void writeImage( Cairo::RefPtr<Cairo::ImageSurface> image, const Gdk::Rectangle& rect );
@@ -55,13 +69,15 @@ public:
 	// modification
 	virtual void draw( int x, int y, const Pen& pen );
 	virtual bool changeColorDraw( int x, int y, const Pen& pen, int current );
-	virtual void drawLine( int x1, int y1, int x2, int y2, const Pen& pen );
-	virtual void drawRect( int x1, int y1, int x2, int y2, const Pen& lpen, const Pen& fpen );
-	virtual Gdk::Rectangle bucketFill( int x, int y, const Pen& pen );
+	virtual void drawLine( int x1, int y1, int x2, int y2, const Pen& pen, std::vector<Gdk::Rectangle>& changed );
+	virtual void drawRect( int x1, int y1, int x2, int y2, const Pen& lpen, const Pen& fpen,
+	                       std::vector<Gdk::Rectangle>& changed );
+	virtual void bucketFill( int x, int y, const Pen& pen, int mode, std::vector<Gdk::Rectangle>& changed );
 	virtual void flip( int x1, int y1, int x2, int y2, bool vertical = false );
 	virtual void rotate( int x, int y, int sz, bool ccw = false );
 
 	virtual void setData( int x, int y, const char *data, int w, int h );
+	virtual void setPackedData( int x, int y, const char *data, int w, int h );
 
 	virtual void applyBrush( int x, int y, const Pen& pen );
 
@@ -70,23 +86,76 @@ public:
 	// storage
 	virtual int save( Storage& s );
 	virtual int load( Storage& s );
+	// load split in size and palette first and pixels later, pixels
+	// can stay in the file while they are mapped
+	int loadHeader( Storage& s );
+	int loadPixels( Storage& s );
+	bool pixelsMapped( Storage& s ) const;
 
 	void backupState();
+	void releaseBackup();
 	void storeBackupRect( Storage& s, const Gdk::Rectangle& rect );
 	void storeRect( Storage& s, const Gdk::Rectangle& rect );
 	const Gdk::Rectangle restoreRect( Storage& s );
 
 
 protected:
-	std::vector<char*> m_Data;
+	// contiguous pixel rows, each row starts at a multiple of stride
+	char *m_pPixels;
+	int m_Stride;
 	
 private:
-	Canvas& m_Canvas;
-	int m_Depth, m_PixSize;
+	Canvas *m_pCanvas;
+	int m_Depth, m_PixSize, m_PixBits;
 	int m_Width, m_Height;
+	int m_AllocRows;
 	char *m_pDataStore;
+	// copy on write backup, a tile is copied to the data store on the
+	// first write after backupState
+	std::vector<unsigned int> m_BackupTiles;
+	unsigned int m_BackupGeneration;
+	int m_BackupCols;
+	bool m_BackupActive;
+	// display pixels for every index value
+	unsigned int m_DisplayTable[256];
+	bool m_SmallDisplayTable;
 	
-	bool fillLine( int x, int y, char fg[4], char bg[4], Gdk::Rectangle& r );
+	void init( int w, int h );
+
+	// clip area of the canvas or the whole image
+	void clipBounds( int& x1, int& y1, int& x2, int& y2 ) const;
+	void clipRectangle( int& x1, int& y1, int& x2, int& y2 ) const;
+
+	// pixel access for all storage layouts
+	int rowBytes( int w ) const;
+	int pixel( const char *line, int x ) const;
+	void setPixel( char *line, int x, int value );
+	void copyPixels( char *dest, int dx, const char *src, int sx, int n ) const;
+	void clearColumns( char *line, int x, int size ) const;
+	void makeColor( int value, char color[4] ) const;
+	bool isColor( const char *line, int x, const char *color ) const;
+
+	void prepareWrite( int x1, int y1, int x2, int y2 );
+	bool tileBackedUp( int tx, int ty ) const;
+
+	// horizontal run of pixels
+	struct Span {
+		int y, x1, x2;
+		bool operator<( const Span& s ) const { return y < s.y || (y == s.y && x1 < s.x1); }
+	};
+
+	// span drawing
+	bool penColor( const Pen& pen, char color[4] ) const;
+	void linePoints( int x1, int y1, int x2, int y2, std::vector<int>& points ) const;
+	void sweepSpans( const std::vector<int>& points, const Pen& pen, std::vector<Span>& spans ) const;
+	void mergeSpans( std::vector<Span>& spans ) const;
+	void writeSpans( const std::vector<Span>& spans, const char *color, std::vector<Gdk::Rectangle>& changed );
+
+	// fill helpers, scanning stops at the given column
+	int matchLeft( const char *line, int x, int xmin, const char *bg ) const;
+	int matchRight( const char *line, int x, int xmax, const char *bg ) const;
+	int nextMatch( const char *line, int x, int xmax, const char *bg ) const;
+	void fillSpan( int y, int x1, int x2, const char *fg );
 };
 
 
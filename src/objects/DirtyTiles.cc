@@ -0,0 +1,163 @@
+/*
+	Copyright (C) 2013 Edwin Velds
+
+    This file is part of Polka 2.
+
+    Polka 2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Polka 2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Polka 2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "DirtyTiles.h"
+#include <algorithm>
+#include <cstring>
+
+namespace Polka {
+
+// std::min takes these by reference
+const int DirtyTiles::TILE_SHIFT;
+const int DirtyTiles::TILE_SIZE;
+
+DirtyTiles::DirtyTiles()
+	: m_Width(0), m_Height(0), m_Cols(0), m_Rows(0),
+	  m_MarkX1(0), m_MarkY1(0), m_MarkX2(-1), m_MarkY2(-1)
+{
+}
+
+DirtyTiles::~DirtyTiles()
+{
+}
+
+void DirtyTiles::setSize( int w, int h )
+{
+	m_Width = w;
+	m_Height = h;
+	m_Cols = (w + TILE_SIZE-1) >> TILE_SHIFT;
+	m_Rows = (h + TILE_SIZE-1) >> TILE_SHIFT;
+	m_Tiles.assign( m_Cols*m_Rows, 0 );
+	m_MarkX1 = m_MarkY1 = 0;
+	m_MarkX2 = m_MarkY2 = -1;
+}
+
+int DirtyTiles::width() const
+{
+	return m_Width;
+}
+
+int DirtyTiles::height() const
+{
+	return m_Height;
+}
+
+void DirtyTiles::mark( const Gdk::Rectangle& rect )
+{
+	// clip to pixel area
+	int x1 = std::max( rect.get_x(), 0 );
+	int y1 = std::max( rect.get_y(), 0 );
+	int x2 = std::min( rect.get_x() + rect.get_width(), m_Width ) - 1;
+	int y2 = std::min( rect.get_y() + rect.get_height(), m_Height ) - 1;
+	if( x2 < x1 || y2 < y1 ) return;
+
+	// convert to tiles
+	x1 >>= TILE_SHIFT; x2 >>= TILE_SHIFT;
+	y1 >>= TILE_SHIFT; y2 >>= TILE_SHIFT;
+	for( int ty = y1; ty <= y2; ty++ )
+		memset( &m_Tiles[ty*m_Cols + x1], 1, x2-x1+1 );
+
+	// extend marked bounds
+	if( isEmpty() ) {
+		m_MarkX1 = x1; m_MarkY1 = y1;
+		m_MarkX2 = x2; m_MarkY2 = y2;
+	} else {
+		m_MarkX1 = std::min( m_MarkX1, x1 );
+		m_MarkY1 = std::min( m_MarkY1, y1 );
+		m_MarkX2 = std::max( m_MarkX2, x2 );
+		m_MarkY2 = std::max( m_MarkY2, y2 );
+	}
+}
+
+void DirtyTiles::clear()
+{
+	// only clear the marked area
+	for( int ty = m_MarkY1; ty <= m_MarkY2; ty++ )
+		memset( &m_Tiles[ty*m_Cols + m_MarkX1], 0, m_MarkX2-m_MarkX1+1 );
+	m_MarkX1 = m_MarkY1 = 0;
+	m_MarkX2 = m_MarkY2 = -1;
+}
+
+bool DirtyTiles::isEmpty() const
+{
+	return m_MarkX2 < m_MarkX1;
+}
+
+bool DirtyTiles::isDirty( int tx, int ty ) const
+{
+	if( tx < 0 || ty < 0 || tx >= m_Cols || ty >= m_Rows ) return false;
+	return m_Tiles[ty*m_Cols + tx] != 0;
+}
+
+void DirtyTiles::getRectangles( std::vector<Gdk::Rectangle>& rects ) const
+{
+	rects.clear();
+	if( isEmpty() ) return;
+
+	// rectangles reaching the current tile row in x order
+	std::vector<Gdk::Rectangle> open, next;
+	for( int ty = m_MarkY1; ty <= m_MarkY2; ty++ ) {
+		const unsigned char *tiles = &m_Tiles[ty*m_Cols];
+		int y = ty << TILE_SHIFT;
+		int h = std::min( y + TILE_SIZE, m_Height ) - y;
+		unsigned int prev = 0;
+
+		next.clear();
+		int tx = m_MarkX1;
+		while( tx <= m_MarkX2 ) {
+			// find run of marked tiles
+			if( !tiles[tx] ) {
+				tx++;
+				continue;
+			}
+			int txe = tx;
+			while( txe < m_MarkX2 && tiles[txe+1] ) txe++;
+			int x = tx << TILE_SHIFT;
+			int w = std::min( (txe+1) << TILE_SHIFT, m_Width ) - x;
+
+			// close open rectangles left of the run
+			while( prev < open.size() && open[prev].get_x() < x )
+				rects.push_back( open[prev++] );
+			// extend an open rectangle with the same span
+			if( prev < open.size() && open[prev].get_x() == x && open[prev].get_width() == w ) {
+				open[prev].set_height( open[prev].get_height() + h );
+				next.push_back( open[prev++] );
+			} else {
+				next.push_back( Gdk::Rectangle( x, y, w, h ) );
+			}
+			tx = txe+1;
+		}
+		// close the remaining ones
+		while( prev < open.size() )
+			rects.push_back( open[prev++] );
+		open.swap( next );
+	}
+	rects.insert( rects.end(), open.begin(), open.end() );
+}
+
+Gdk::Rectangle DirtyTiles::bounds() const
+{
+	if( isEmpty() ) return Gdk::Rectangle( 0, 0, 0, 0 );
+	int x = m_MarkX1 << TILE_SHIFT;
+	int y = m_MarkY1 << TILE_SHIFT;
+	return Gdk::Rectangle( x, y, std::min( (m_MarkX2+1) << TILE_SHIFT, m_Width ) - x,
+	                             std::min( (m_MarkY2+1) << TILE_SHIFT, m_Height ) - y );
+}
+
+} // namespace Polka
@@ -0,0 +1,63 @@
+/*
+	Copyright (C) 2013 Edwin Velds
+
+    This file is part of Polka 2.
+
+    Polka 2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Polka 2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Polka 2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _POLKA_DIRTYTILES_H_
+#define _POLKA_DIRTYTILES_H_
+
+#include <gdkmm/rectangle.h>
+#include <vector>
+
+namespace Polka {
+
+// tile granular change tracking for pixel data
+class DirtyTiles
+{
+public:
+	static const int TILE_SHIFT = 4;
+	static const int TILE_SIZE = 1 << TILE_SHIFT;
+
+	DirtyTiles();
+	~DirtyTiles();
+
+	// size in pixels, resizing clears all marks
+	void setSize( int w, int h );
+	int width() const;
+	int height() const;
+
+	// marking
+	void mark( const Gdk::Rectangle& rect );
+	void clear();
+	bool isEmpty() const;
+	bool isDirty( int tx, int ty ) const;
+
+	// marked area as rectangles clipped to the pixel size
+	void getRectangles( std::vector<Gdk::Rectangle>& rects ) const;
+	Gdk::Rectangle bounds() const;
+
+private:
+	int m_Width, m_Height;
+	int m_Cols, m_Rows;
+	std::vector<unsigned char> m_Tiles;
+	// bounding box of marked tiles, empty if x1 > x2
+	int m_MarkX1, m_MarkY1, m_MarkX2, m_MarkY2;
+};
+
+} // namespace Polka
+
+#endif // _POLKA_DIRTYTILES_H_
@@ -22,6 +22,7 @@
 
 #include "ObjectManager.h"
 #include "Palette.h"
+#include "Types.h"
 #include <glibmm/i18n.h>
 
 
@@ -29,6 +30,9 @@ namespace Polka {
 
 static const char *MSX1PAL_ID = "PAL/16/MSX1";
 
+// fixed colours of the TMS99x8A
+extern const Byte TMS99X8A_PALETTE[16][3];
+
 class MSX1Palette : public Palette 
 {
 public:
@@ -0,0 +1,413 @@
+/*
+	Copyright (C) 2013 Edwin Velds
+
+    This file is part of Polka 2.
+
+    Polka 2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Polka 2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Polka 2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "PixelKernels.h"
+#include "Simd.h"
+#include <algorithm>
+#include <cstring>
+
+namespace Polka {
+
+static void expandIndexedRowScalar( const unsigned char *src, unsigned int *dest, int count,
+                                    const unsigned int *table )
+{
+	for( int x = 0; x < count; x++ )
+		dest[x] = table[src[x]];
+}
+
+#ifdef POLKA_X86_SIMD
+
+// 16 colour tables fit in three byte shuffles, one per channel
+struct ShuffleTables
+{
+	__m128i blue, green, red;
+};
+
+__attribute__((target("ssse3")))
+static inline void loadShuffleTables( const unsigned int *table, ShuffleTables& t )
+{
+	unsigned char blue[16], green[16], red[16];
+	for( int i = 0; i < 16; i++ ) {
+		blue[i]  = table[i] & 255;
+		green[i] = (table[i] >> 8) & 255;
+		red[i]   = (table[i] >> 16) & 255;
+	}
+	t.blue = _mm_loadu_si128( reinterpret_cast<const __m128i*>(blue) );
+	t.green = _mm_loadu_si128( reinterpret_cast<const __m128i*>(green) );
+	t.red = _mm_loadu_si128( reinterpret_cast<const __m128i*>(red) );
+}
+
+// expand 16 indices of 4 bits
+__attribute__((target("ssse3")))
+static inline void expandShuffled( __m128i idx, const ShuffleTables& t, unsigned int *dest )
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i b = _mm_shuffle_epi8( t.blue, idx );
+	__m128i g = _mm_shuffle_epi8( t.green, idx );
+	__m128i r = _mm_shuffle_epi8( t.red, idx );
+	// interleave to b,g,r,0 byte order
+	__m128i bglo = _mm_unpacklo_epi8( b, g );
+	__m128i bghi = _mm_unpackhi_epi8( b, g );
+	__m128i rlo = _mm_unpacklo_epi8( r, zero );
+	__m128i rhi = _mm_unpackhi_epi8( r, zero );
+	__m128i *d = reinterpret_cast<__m128i*>(dest);
+	_mm_storeu_si128( d,   _mm_unpacklo_epi16( bglo, rlo ) );
+	_mm_storeu_si128( d+1, _mm_unpackhi_epi16( bglo, rlo ) );
+	_mm_storeu_si128( d+2, _mm_unpacklo_epi16( bghi, rhi ) );
+	_mm_storeu_si128( d+3, _mm_unpackhi_epi16( bghi, rhi ) );
+}
+
+__attribute__((target("ssse3")))
+static void expandIndexedRowSSSE3( const unsigned char *src, unsigned int *dest, int count,
+                                   const unsigned int *table )
+{
+	ShuffleTables t;
+	loadShuffleTables( table, t );
+	const __m128i mask = _mm_set1_epi8( 15 );
+
+	int x = 0;
+	for( ; x+16 <= count; x += 16 )
+		expandShuffled( _mm_and_si128( _mm_loadu_si128( reinterpret_cast<const __m128i*>(src+x) ), mask ),
+		                t, dest+x );
+	for( ; x < count; x++ )
+		dest[x] = table[src[x] & 15];
+}
+
+// nibble packed rows are split into high and low nibbles and
+// interleaved, the high nibble is the left pixel
+__attribute__((target("ssse3")))
+static void expandPacked4SSSE3( const unsigned char *src, int x, unsigned int *dest, int count,
+                                const unsigned int *table )
+{
+	ShuffleTables t;
+	loadShuffleTables( table, t );
+	const __m128i mask = _mm_set1_epi8( 15 );
+
+	int i = 0;
+	if( (x & 1) && count > 0 ) {
+		dest[0] = table[src[x >> 1] & 15];
+		i = 1;
+	}
+	const unsigned char *s = src + ((x+i) >> 1);
+	for( ; i+16 <= count; i += 16, s += 8 ) {
+		__m128i b = _mm_loadl_epi64( reinterpret_cast<const __m128i*>(s) );
+		__m128i hi = _mm_and_si128( _mm_srli_epi16( b, 4 ), mask );
+		__m128i lo = _mm_and_si128( b, mask );
+		expandShuffled( _mm_unpacklo_epi8( hi, lo ), t, dest+i );
+	}
+	for( ; i < count; i++ )
+		dest[i] = table[packedPixel( src, x+i, 4 ) & 15];
+}
+
+// full tables are looked up with a gather, eight pixels at a time
+__attribute__((target("avx2")))
+static void expandIndexedRowAVX2( const unsigned char *src, unsigned int *dest, int count,
+                                  const unsigned int *table )
+{
+	const int *itable = reinterpret_cast<const int*>(table);
+	int x = 0;
+	for( ; x+8 <= count; x += 8 ) {
+		__m256i idx = _mm256_cvtepu8_epi32( _mm_loadl_epi64( reinterpret_cast<const __m128i*>(src+x) ) );
+		__m256i pix = _mm256_i32gather_epi32( itable, idx, 4 );
+		_mm256_storeu_si256( reinterpret_cast<__m256i*>(dest+x), pix );
+	}
+	for( ; x < count; x++ )
+		dest[x] = table[src[x]];
+}
+
+#endif // POLKA_X86_SIMD
+
+void expandIndexedRow( const unsigned char *src, unsigned int *dest, int count,
+                       const unsigned int *table, bool small_table )
+{
+#ifdef POLKA_X86_SIMD
+	if( small_table && hasSSSE3() ) {
+		expandIndexedRowSSSE3( src, dest, count, table );
+		return;
+	}
+	if( hasAVX2() ) {
+		expandIndexedRowAVX2( src, dest, count, table );
+		return;
+	}
+#endif
+	expandIndexedRowScalar( src, dest, count, table );
+}
+
+#ifdef POLKA_SSE2
+
+// bit n is set if byte n of the block equals value
+static inline int equalMask( const unsigned char *src, __m128i value )
+{
+	__m128i b = _mm_loadu_si128( reinterpret_cast<const __m128i*>(src) );
+	return _mm_movemask_epi8( _mm_cmpeq_epi8( b, value ) );
+}
+
+int matchingBytes( const unsigned char *src, int count, unsigned char value )
+{
+	const __m128i v = _mm_set1_epi8( value );
+	int x = 0;
+	for( ; x+16 <= count; x += 16 ) {
+		int m = ~equalMask( src+x, v ) & 0xffff;
+		if( m ) return x + __builtin_ctz(m);
+	}
+	while( x < count && src[x] == value ) x++;
+	return x;
+}
+
+int differingBytes( const unsigned char *src, int count, unsigned char value )
+{
+	const __m128i v = _mm_set1_epi8( value );
+	int x = 0;
+	for( ; x+16 <= count; x += 16 ) {
+		int m = equalMask( src+x, v );
+		if( m ) return x + __builtin_ctz(m);
+	}
+	while( x < count && src[x] != value ) x++;
+	return x;
+}
+
+int matchingBytesReverse( const unsigned char *src, int count, unsigned char value )
+{
+	const __m128i v = _mm_set1_epi8( value );
+	int n = 0;
+	for( ; n+16 <= count; n += 16 ) {
+		int m = ~equalMask( src+count-n-16, v ) & 0xffff;
+		// highest differing byte ends the run
+		if( m ) return n + __builtin_clz(m) - 16;
+	}
+	while( n < count && src[count-n-1] == value ) n++;
+	return n;
+}
+
+#else
+
+int matchingBytes( const unsigned char *src, int count, unsigned char value )
+{
+	int x = 0;
+	while( x < count && src[x] == value ) x++;
+	return x;
+}
+
+int differingBytes( const unsigned char *src, int count, unsigned char value )
+{
+	int x = 0;
+	while( x < count && src[x] != value ) x++;
+	return x;
+}
+
+int matchingBytesReverse( const unsigned char *src, int count, unsigned char value )
+{
+	int n = 0;
+	while( n < count && src[count-n-1] == value ) n++;
+	return n;
+}
+
+#endif
+
+// packed layouts are specialised on the number of bits per pixel
+template<int BITS>
+struct PackedRow
+{
+	static const int PER_BYTE = 8 / BITS;
+	static const int MASK = (1 << BITS)-1;
+
+	static int get( const unsigned char *src, int x ) { return packedPixel( src, x, BITS ); }
+	static void set( unsigned char *dest, int x, int value ) { setPackedPixel( dest, x, value, BITS ); }
+	static bool aligned( int x ) { return x % PER_BYTE == 0; }
+	// value repeated over all pixels of a byte
+	static unsigned char pattern( int value ) { return (value & MASK) * (255 / MASK); }
+};
+
+template<int BITS>
+static void unpackPixelsT( const unsigned char *src, int x, unsigned char *dest, int count )
+{
+	typedef PackedRow<BITS> P;
+	int i = 0;
+	for( ; i < count && !P::aligned(x+i); i++ )
+		dest[i] = P::get( src, x+i );
+	const unsigned char *s = src + (x+i) / P::PER_BYTE;
+	for( ; i+P::PER_BYTE <= count; i += P::PER_BYTE, s++ )
+		for( int p = 0; p < P::PER_BYTE; p++ )
+			dest[i+p] = (*s >> (8 - BITS*(p+1))) & P::MASK;
+	for( ; i < count; i++ )
+		dest[i] = P::get( src, x+i );
+}
+
+template<int BITS>
+static void packPixelsT( const unsigned char *src, unsigned char *dest, int x, int count )
+{
+	typedef PackedRow<BITS> P;
+	int i = 0;
+	for( ; i < count && !P::aligned(x+i); i++ )
+		P::set( dest, x+i, src[i] );
+	unsigned char *d = dest + (x+i) / P::PER_BYTE;
+	for( ; i+P::PER_BYTE <= count; i += P::PER_BYTE, d++ ) {
+		unsigned char b = 0;
+		for( int p = 0; p < P::PER_BYTE; p++ )
+			b = (b << BITS) | (src[i+p] & P::MASK);
+		*d = b;
+	}
+	for( ; i < count; i++ )
+		P::set( dest, x+i, src[i] );
+}
+
+template<int BITS>
+static void copyPackedPixelsT( const unsigned char *src, int sx, unsigned char *dest, int dx, int count )
+{
+	typedef PackedRow<BITS> P;
+	if( sx % P::PER_BYTE != dx % P::PER_BYTE ) {
+		// pixels move within the bytes
+		for( int i = 0; i < count; i++ )
+			P::set( dest, dx+i, P::get( src, sx+i ) );
+		return;
+	}
+	int i = 0;
+	for( ; i < count && !P::aligned(sx+i); i++ )
+		P::set( dest, dx+i, P::get( src, sx+i ) );
+	int bytes = (count-i) / P::PER_BYTE;
+	memcpy( dest + (dx+i) / P::PER_BYTE, src + (sx+i) / P::PER_BYTE, bytes );
+	for( i += bytes * P::PER_BYTE; i < count; i++ )
+		P::set( dest, dx+i, P::get( src, sx+i ) );
+}
+
+template<int BITS>
+static void fillPackedPixelsT( unsigned char *dest, int x, int count, int value )
+{
+	typedef PackedRow<BITS> P;
+	int i = 0;
+	for( ; i < count && !P::aligned(x+i); i++ )
+		P::set( dest, x+i, value );
+	int bytes = (count-i) / P::PER_BYTE;
+	memset( dest + (x+i) / P::PER_BYTE, P::pattern(value), bytes );
+	for( i += bytes * P::PER_BYTE; i < count; i++ )
+		P::set( dest, x+i, value );
+}
+
+// whole bytes are scanned with the byte kernels
+template<int BITS>
+static int matchingPixelsT( const unsigned char *src, int x, int count, int value )
+{
+	typedef PackedRow<BITS> P;
+	value &= P::MASK;
+	int n = 0;
+	for( ; n < count && !P::aligned(x+n); n++ )
+		if( P::get( src, x+n ) != value ) return n;
+	int bytes = (count-n) / P::PER_BYTE;
+	n += P::PER_BYTE * matchingBytes( src + (x+n) / P::PER_BYTE, bytes, P::pattern(value) );
+	while( n < count && P::get( src, x+n ) == value ) n++;
+	return n;
+}
+
+template<int BITS>
+static int matchingPixelsReverseT( const unsigned char *src, int x, int count, int value )
+{
+	typedef PackedRow<BITS> P;
+	value &= P::MASK;
+	int e = x + count, n = 0;
+	for( ; n < count && !P::aligned(e-n); n++ )
+		if( P::get( src, e-n-1 ) != value ) return n;
+	int bytes = (count-n) / P::PER_BYTE;
+	n += P::PER_BYTE * matchingBytesReverse( src + (e-n) / P::PER_BYTE - bytes, bytes, P::pattern(value) );
+	while( n < count && P::get( src, e-n-1 ) == value ) n++;
+	return n;
+}
+
+template<int BITS>
+static int differingPixelsT( const unsigned char *src, int x, int count, int value )
+{
+	typedef PackedRow<BITS> P;
+	value &= P::MASK;
+	int n = 0;
+	while( n < count && P::get( src, x+n ) != value ) n++;
+	return n;
+}
+
+void unpackPixels( const unsigned char *src, int x, unsigned char *dest, int count, int bits )
+{
+	if( bits == 2 )
+		unpackPixelsT<2>( src, x, dest, count );
+	else
+		unpackPixelsT<4>( src, x, dest, count );
+}
+
+void packPixels( const unsigned char *src, unsigned char *dest, int x, int count, int bits )
+{
+	if( bits == 2 )
+		packPixelsT<2>( src, dest, x, count );
+	else
+		packPixelsT<4>( src, dest, x, count );
+}
+
+void copyPackedPixels( const unsigned char *src, int sx, unsigned char *dest, int dx,
+                       int count, int bits )
+{
+	if( bits == 2 )
+		copyPackedPixelsT<2>( src, sx, dest, dx, count );
+	else
+		copyPackedPixelsT<4>( src, sx, dest, dx, count );
+}
+
+void fillPackedPixels( unsigned char *dest, int x, int count, int value, int bits )
+{
+	if( bits == 2 )
+		fillPackedPixelsT<2>( dest, x, count, value );
+	else
+		fillPackedPixelsT<4>( dest, x, count, value );
+}
+
+void expandPackedRow( const unsigned char *src, int x, unsigned int *dest, int count,
+                      const unsigned int *table, bool small_table, int bits )
+{
+#ifdef POLKA_X86_SIMD
+	if( bits == 4 && small_table && hasSSSE3() ) {
+		expandPacked4SSSE3( src, x, dest, count, table );
+		return;
+	}
+#endif
+	// unpack blocks and expand those
+	unsigned char block[256];
+	for( int i = 0; i < count; i += 256 ) {
+		int n = std::min( 256, count-i );
+		unpackPixels( src, x+i, block, n, bits );
+		expandIndexedRow( block, dest+i, n, table, small_table );
+	}
+}
+
+int matchingPixels( const unsigned char *src, int x, int count, int value, int bits )
+{
+	if( bits == 2 )
+		return matchingPixelsT<2>( src, x, count, value );
+	return matchingPixelsT<4>( src, x, count, value );
+}
+
+int differingPixels( const unsigned char *src, int x, int count, int value, int bits )
+{
+	if( bits == 2 )
+		return differingPixelsT<2>( src, x, count, value );
+	return differingPixelsT<4>( src, x, count, value );
+}
+
+int matchingPixelsReverse( const unsigned char *src, int x, int count, int value, int bits )
+{
+	if( bits == 2 )
+		return matchingPixelsReverseT<2>( src, x, count, value );
+	return matchingPixelsReverseT<4>( src, x, count, value );
+}
+
+} // namespace Polka
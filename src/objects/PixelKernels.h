@@ -0,0 +1,76 @@
+/*
+	Copyright (C) 2013 Edwin Velds
+
+    This file is part of Polka 2.
+
+    Polka 2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Polka 2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Polka 2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _POLKA_PIXELKERNELS_H_
+#define _POLKA_PIXELKERNELS_H_
+
+namespace Polka {
+
+// expand a row of palette indices to 32 bit display pixels using a 256
+// entry table. If the table repeats every 16 entries, small_table may be
+// set to allow the faster shuffle based expansion.
+void expandIndexedRow( const unsigned char *src, unsigned int *dest, int count,
+                       const unsigned int *table, bool small_table = false );
+
+// byte run scanning, all return a number of bytes
+// leading bytes equal to value
+int matchingBytes( const unsigned char *src, int count, unsigned char value );
+// leading bytes not equal to value
+int differingBytes( const unsigned char *src, int count, unsigned char value );
+// trailing bytes equal to value
+int matchingBytesReverse( const unsigned char *src, int count, unsigned char value );
+
+// packed pixel rows store 2 or 4 bits per pixel with the leftmost pixel
+// in the highest bits of a byte, matching MSX VRAM. Positions and counts
+// are in pixels.
+inline int packedPixel( const unsigned char *src, int x, int bits )
+{
+	int pos = x * bits;
+	return (src[pos >> 3] >> (8 - bits - (pos & 7))) & ((1 << bits)-1);
+}
+
+inline void setPackedPixel( unsigned char *dest, int x, int value, int bits )
+{
+	int pos = x * bits;
+	int shift = 8 - bits - (pos & 7);
+	int mask = ((1 << bits)-1) << shift;
+	dest[pos >> 3] = (dest[pos >> 3] & ~mask) | ((value << shift) & mask);
+}
+
+// conversion from and to one byte per pixel
+void unpackPixels( const unsigned char *src, int x, unsigned char *dest, int count, int bits );
+void packPixels( const unsigned char *src, unsigned char *dest, int x, int count, int bits );
+// copy between packed rows, whole bytes are copied if both positions
+// share the same bit offset
+void copyPackedPixels( const unsigned char *src, int sx, unsigned char *dest, int dx,
+                       int count, int bits );
+void fillPackedPixels( unsigned char *dest, int x, int count, int value, int bits );
+// display expansion of a packed row
+void expandPackedRow( const unsigned char *src, int x, unsigned int *dest, int count,
+                      const unsigned int *table, bool small_table, int bits );
+
+// pixel run scanning, all return a number of pixels
+int matchingPixels( const unsigned char *src, int x, int count, int value, int bits );
+int differingPixels( const unsigned char *src, int x, int count, int value, int bits );
+// trailing pixels of the range [x, x+count) equal to value
+int matchingPixelsReverse( const unsigned char *src, int x, int count, int value, int bits );
+
+} // namespace Polka
+
+#endif // _POLKA_PIXELKERNELS_H_